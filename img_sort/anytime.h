@@ -0,0 +1,153 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <execution>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+namespace img_sort {
+
+    // Position along a Hilbert curve through a D dimensional grid of 2^bits cells per axis, after Skilling,
+    // "Programming the Hilbert curve" (2004). Points close on the curve are close in space.
+    template <std::size_t D>
+    std::uint64_t hilbert_index(std::array<std::uint32_t, D> x, std::uint32_t bits) noexcept {
+        static_assert(D > 0);
+        const std::uint32_t m = 1u << (bits - 1);
+
+        // Inverse undo
+        for (std::uint32_t q = m; q > 1; q >>= 1) {
+            const std::uint32_t p = q - 1;
+            for (std::size_t i = 0; i < D; ++i) {
+                if (x[i] & q) {
+                    x[0] ^= p;
+                }
+                else {
+                    const std::uint32_t t = (x[0] ^ x[i]) & p;
+                    x[0] ^= t;
+                    x[i] ^= t;
+                }
+            }
+        }
+
+        // Gray encode
+        for (std::size_t i = 1; i < D; ++i) {
+            x[i] ^= x[i - 1];
+        }
+        std::uint32_t t = 0;
+        for (std::uint32_t q = m; q > 1; q >>= 1) {
+            if (x[D - 1] & q) t ^= q - 1;
+        }
+        for (auto &v : x) {
+            v ^= t;
+        }
+
+        // Interleave the transposed bits, most significant first
+        std::uint64_t res = 0;
+        for (std::uint32_t bit = bits; bit-- > 0;) {
+            for (std::size_t i = 0; i < D; ++i) {
+                res = (res << 1) | ((x[i] >> bit) & 1u);
+            }
+        }
+        return res;
+    }
+
+    // Orders size points of D coordinates each (row-major) along a Hilbert curve over their bounding box
+    template <std::size_t D>
+    std::vector<std::size_t> hilbert_order(const std::vector<float> &points, std::size_t size) {
+        static_assert(D * 16 <= 64);
+        constexpr std::uint32_t bits = 16;
+        RUNTIME_ASSERT(points.size() == size * D);
+
+        std::array<float, D> lo, hi;
+        lo.fill(std::numeric_limits<float>::max());
+        hi.fill(std::numeric_limits<float>::lowest());
+        for (std::size_t i = 0; i < size; ++i) {
+            for (std::size_t d = 0; d < D; ++d) {
+                lo[d] = std::min(lo[d], points[i * D + d]);
+                hi[d] = std::max(hi[d], points[i * D + d]);
+            }
+        }
+
+        std::vector<std::pair<std::uint64_t, std::size_t>> keys(size);
+        const auto range = boost::irange<std::size_t>(0, size);
+        std::transform(std::execution::par, range.begin(), range.end(), keys.begin(), [&](std::size_t i) {
+            std::array<std::uint32_t, D> cell;
+            for (std::size_t d = 0; d < D; ++d) {
+                const float extent = hi[d] - lo[d];
+                const float unit = extent > 0.0f ? (points[i * D + d] - lo[d]) / extent : 0.0f;
+                cell[d] = std::min<std::uint32_t>(static_cast<std::uint32_t>(unit * (1u << bits)), (1u << bits) - 1);
+            }
+            return std::pair{ hilbert_index(cell, bits), i };
+        });
+
+        std::sort(std::execution::par, keys.begin(), keys.end());
+
+        std::vector<std::size_t> res;
+        for (const auto &k : keys) {
+            res.push_back(k.second);
+        }
+        return res;
+    }
+
+    // Sum of the distances between consecutive images of an order, the quality measure of anytime mode
+    template <typename Distance>
+    double path_cost(const std::vector<std::size_t> &order, const Distance &dist) {
+        if (order.size() < 2) return 0.0;
+
+        const auto range = boost::irange<std::size_t>(1, order.size());
+        return std::transform_reduce(std::execution::par, range.begin(), range.end(), 0.0, std::plus<>{},
+            [&](std::size_t i) { return static_cast<double>(dist(order[i - 1], order[i])); });
+    }
+
+    // 2-opt on an open path, restricted to reversals of at most window images. Runs passes until one finds no
+    // improvement, the deadline passes or the run is cancelled, checking once per position. Returns the
+    // reduction in cost.
+    template <typename Distance>
+    double two_opt(std::vector<std::size_t> &order, const Distance &dist, std::size_t window, std::chrono::steady_clock::time_point deadline) {
+        const auto size = order.size();
+        if (size < 3) return 0.0;
+
+        // edge[i] is the cost between order[i] and order[i + 1]
+        std::vector<double> edge(size - 1);
+        for (std::size_t i = 0; i + 1 < size; ++i) {
+            edge[i] = dist(order[i], order[i + 1]);
+        }
+
+        double res = 0.0;
+        for (bool improved = true; improved;) {
+            improved = false;
+
+            for (std::size_t i = 0; i + 2 < size; ++i) {
+                if (std::chrono::steady_clock::now() >= deadline || cancellation::requested()) return res;
+
+                for (std::size_t j = i + 2; j < std::min(size, i + 2 + window); ++j) {
+                    // Reversing order[i + 1 .. j] replaces edges (i, i + 1) and (j, j + 1) with (i, j) and (i + 1, j + 1)
+                    const bool last = j + 1 == size;
+                    const double new_left = dist(order[i], order[j]);
+                    const double new_right = last ? 0.0 : dist(order[i + 1], order[j + 1]);
+                    const double delta = new_left + new_right - edge[i] - (last ? 0.0 : edge[j]);
+
+                    if (delta < -1e-12) {
+                        std::reverse(order.begin() + i + 1, order.begin() + j + 1);
+                        std::reverse(edge.begin() + i + 1, edge.begin() + j);
+                        edge[i] = new_left;
+                        if (!last) edge[j] = new_right;
+
+                        res -= delta;
+                        improved = true;
+                    }
+                }
+            }
+        }
+
+        return res;
+    }
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <istream>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace img_sort {
+
+    // One sort of a batch: a source directory and the output directory it is sorted into
+    struct batch_job {
+        std::filesystem::path source;
+        std::filesystem::path output;
+    };
+
+    // A batch list: one "<source directory>\t<output directory>" per line. Blank lines and lines starting with
+    // '#' are skipped. Paths may contain spaces but not tabs.
+    inline std::optional<std::vector<batch_job>> parse_batch_list(std::istream &in) {
+        std::vector<batch_job> res;
+        std::string line;
+        for (std::size_t number = 1; std::getline(in, line); ++number) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line.front() == '#') continue;
+
+            const auto tab = line.find('\t');
+            if (tab == std::string::npos || tab == 0 || tab + 1 == line.size() || line.find('\t', tab + 1) != std::string::npos) {
+                logger::post<logger::error>("Line ", number, " of the batch list is not \"<source>\\t<output>\"");
+                return std::nullopt;
+            }
+            res.push_back({ line.substr(0, tab), line.substr(tab + 1) });
+        }
+        return res;
+    }
+
+    // Order jobs are started in: largest first, so that the long jobs are under way early and the short ones
+    // fill in around them at the end (longest processing time first). Equal sizes keep their listed order.
+    inline std::vector<std::size_t> batch_schedule(const std::vector<std::size_t> &sizes) {
+        std::vector<std::size_t> res(sizes.size());
+        std::iota(res.begin(), res.end(), std::size_t{ 0 });
+        std::stable_sort(res.begin(), res.end(), [&](std::size_t a, std::size_t b) { return sizes[a] > sizes[b]; });
+        return res;
+    }
+
+}
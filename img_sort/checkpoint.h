@@ -0,0 +1,301 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+
+namespace img_sort {
+
+    // Progress of the dense stage in a memory-mapped file: the descriptors of every image, then the distance
+    // table itself, so that the table is filled in place. A row block counts as complete only once its flag
+    // is set, and flags are set only after the block's pages have been flushed, so a crash at any point
+    // leaves a file whose flagged blocks can be trusted.
+    //
+    // Layout: header, per-image valid flags, per-block complete flags, descriptors, table. The table region
+    // is sized for every image up front; the file is sparse, so the unused tail costs nothing.
+    class checkpoint {
+        static constexpr char magic[8] = { 'I', 'M', 'G', 'S', 'O', 'R', 'T', 'K' };
+        static constexpr std::uint32_t version = 1;
+        static constexpr std::size_t page_alignment = 4096;
+
+    public:
+        static constexpr std::size_t max_blocks = 4096;
+
+    private:
+        struct header {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t descriptors_done;  // 0 while written, 1 once complete, 2 if a cancelled run left some
+            std::uint64_t fingerprint;
+            std::uint64_t num_files;
+            std::uint64_t descriptor_size;
+            std::uint64_t entry_size;
+            std::uint64_t table_width;  // 0 until the table is started
+            std::uint64_t num_blocks;
+            std::uint64_t valid_offset;
+            std::uint64_t blocks_offset;
+            std::uint64_t descriptor_offset;
+            std::uint64_t table_offset;
+        };
+
+        std::filesystem::path m_path;
+        bool m_resumed = false;  // Ahead of m_file, whose initialisation sets it
+        boost::interprocess::file_mapping m_file;
+        boost::interprocess::mapped_region m_region;
+
+        static std::size_t align_up(std::size_t n, std::size_t alignment) noexcept {
+            return (n + alignment - 1) / alignment * alignment;
+        }
+
+        header &get_header() const noexcept {
+            return *static_cast<header *>(m_region.get_address());
+        }
+
+        char *at(std::uint64_t offset) const noexcept {
+            return static_cast<char *>(m_region.get_address()) + offset;
+        }
+
+        static bool matches(const std::filesystem::path &path, std::uint64_t fingerprint, std::size_t num_files, std::size_t descriptor_size, std::size_t entry_size) {
+            header h{};
+            std::ifstream file{ path, std::ios::binary };
+            if (!file.read(reinterpret_cast<char *>(&h), sizeof(h))) {
+                return false;
+            }
+
+            return std::memcmp(h.magic, magic, sizeof(magic)) == 0 &&
+                   h.version == version &&
+                   h.fingerprint == fingerprint &&
+                   h.num_files == num_files &&
+                   h.descriptor_size == descriptor_size &&
+                   h.entry_size == entry_size;
+        }
+
+        static boost::interprocess::file_mapping open(const std::filesystem::path &path,
+                                                      std::uint64_t fingerprint,
+                                                      std::size_t num_files,
+                                                      std::size_t descriptor_size,
+                                                      std::size_t entry_size,
+                                                      bool resume,
+                                                      bool &resumed) {
+            resumed = false;
+            std::error_code ec;
+            if (resume && std::filesystem::is_regular_file(path, ec)) {
+                if (matches(path, fingerprint, num_files, descriptor_size, entry_size)) {
+                    resumed = true;
+                    return { path.string().c_str(), boost::interprocess::read_write };
+                }
+                logger::post<logger::warning>("Checkpoint ", path, " was written for different inputs or settings, starting over");
+            }
+
+            const std::size_t valid_offset = align_up(sizeof(header), 8);
+            const std::size_t blocks_offset = valid_offset + align_up(num_files, 8);
+            const std::size_t descriptor_offset = align_up(blocks_offset + max_blocks, page_alignment);
+            const std::size_t table_offset = align_up(descriptor_offset + num_files * descriptor_size * sizeof(float), page_alignment);
+            const std::size_t file_size = table_offset + num_files * (num_files - std::min<std::size_t>(num_files, 1)) / 2 * entry_size;
+
+            std::ofstream{ path, std::ios::binary | std::ios::trunc };
+            std::filesystem::resize_file(path, std::max(file_size, table_offset + 1));
+
+            header h{};
+            std::memcpy(h.magic, magic, sizeof(magic));
+            h.version = version;
+            h.fingerprint = fingerprint;
+            h.num_files = num_files;
+            h.descriptor_size = descriptor_size;
+            h.entry_size = entry_size;
+            h.valid_offset = valid_offset;
+            h.blocks_offset = blocks_offset;
+            h.descriptor_offset = descriptor_offset;
+            h.table_offset = table_offset;
+            {
+                std::fstream file{ path, std::ios::binary | std::ios::in | std::ios::out };
+                file.write(reinterpret_cast<const char *>(&h), sizeof(h));
+            }
+
+            return { path.string().c_str(), boost::interprocess::read_write };
+        }
+
+    public:
+        // Opens a matching checkpoint when resuming, otherwise starts a fresh one at path
+        checkpoint(const std::filesystem::path &path,
+                   std::uint64_t fingerprint,
+                   std::size_t num_files,
+                   std::size_t descriptor_size,
+                   std::size_t entry_size,
+                   bool resume)
+            :m_path{ path },
+             m_file{ open(path, fingerprint, num_files, descriptor_size, entry_size, resume, m_resumed) },
+             m_region{ m_file, boost::interprocess::read_write }
+        {}
+
+        checkpoint(const checkpoint &) = delete;
+        checkpoint &operator=(const checkpoint &) = delete;
+
+        const std::filesystem::path &path() const noexcept {
+            return m_path;
+        }
+
+        // Whether the descriptors of a previous run can be used as they are
+        bool has_descriptors() const noexcept {
+            return m_resumed && get_header().descriptors_done == 1;
+        }
+
+        // Whether a cancelled run left the descriptors it got to, marked by their valid flags
+        bool has_partial_descriptors() const noexcept {
+            return m_resumed && get_header().descriptors_done == 2;
+        }
+
+        float *descriptor(std::size_t i) const noexcept {
+            return reinterpret_cast<float *>(at(get_header().descriptor_offset)) + i * get_header().descriptor_size;
+        }
+
+        bool is_valid(std::size_t i) const noexcept {
+            return at(get_header().valid_offset)[i] != 0;
+        }
+
+        void set_valid(std::size_t i) noexcept {
+            at(get_header().valid_offset)[i] = 1;
+        }
+
+        // Unmarks the descriptors before more are written, so that a crash meanwhile cannot leave a valid flag
+        // whose descriptor never reached the disk
+        void start_descriptors() {
+            auto &h = get_header();
+            if (h.descriptors_done == 0) return;
+            h.descriptors_done = 0;
+            m_region.flush(0, sizeof(header), false);
+        }
+
+        // Flushes descriptors and valid flags, then marks them complete, or partial for a cancelled run
+        void finish_descriptors(bool partial = false) {
+            auto &h = get_header();
+            m_region.flush(static_cast<std::size_t>(h.valid_offset), static_cast<std::size_t>(h.table_offset - h.valid_offset), false);
+            h.descriptors_done = partial ? 2 : 1;
+            m_region.flush(0, sizeof(header), false);
+        }
+
+        // Table storage for width images. Keeps completed blocks if a table of the same width was started,
+        // in which case num_blocks is replaced by the block count of that table.
+        template <typename T>
+        T *table(std::size_t width, std::size_t &num_blocks) {
+            auto &h = get_header();
+            RUNTIME_ASSERT(sizeof(T) == h.entry_size && width <= h.num_files);
+
+            if (!m_resumed || h.table_width != width || h.num_blocks == 0) {
+                h.table_width = width;
+                h.num_blocks = std::min(num_blocks, max_blocks);
+                std::memset(at(h.blocks_offset), 0, max_blocks);
+                m_region.flush(0, static_cast<std::size_t>(h.descriptor_offset), false);
+            }
+
+            num_blocks = static_cast<std::size_t>(h.num_blocks);
+            return reinterpret_cast<T *>(at(h.table_offset));
+        }
+
+        bool is_complete(std::size_t block) const noexcept {
+            return at(get_header().blocks_offset)[block] != 0;
+        }
+
+        std::size_t num_complete() const noexcept {
+            const char *flags = at(get_header().blocks_offset);
+            return std::count(flags, flags + max_blocks, 1);
+        }
+
+        // Flushes the given row blocks of the table, then flags them complete
+        void complete(const std::vector<std::size_t> &blocks, const row_blocks &partition) {
+            if (blocks.empty()) return;
+
+            const auto &h = get_header();
+            for (auto block : blocks) {
+                const auto [first, last] = partition.rows(block);
+                const auto begin = first * (first - std::min<std::size_t>(first, 1)) / 2 * h.entry_size;
+                const auto end = last * (last - 1) / 2 * h.entry_size;
+                if (end > begin) {
+                    m_region.flush(static_cast<std::size_t>(h.table_offset + begin), static_cast<std::size_t>(end - begin), false);
+                }
+            }
+
+            for (auto block : blocks) {
+                at(h.blocks_offset)[block] = 1;
+            }
+            m_region.flush(static_cast<std::size_t>(h.blocks_offset), max_blocks, false);
+        }
+
+        // Unmaps and deletes the file, once the stage it protects has finished
+        void remove() {
+            m_region = {};
+            m_file = {};
+            std::error_code ec;
+            std::filesystem::remove(m_path, ec);
+        }
+    };
+
+    // Flushes completed row blocks from a background thread, at most once per interval, so that compute
+    // workers only ever append a block number to a list. Whatever is pending is flushed on destruction.
+    class checkpoint_writer {
+        checkpoint &m_checkpoint;
+        const row_blocks &m_partition;
+        std::chrono::steady_clock::duration m_interval;
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::vector<std::size_t> m_pending;
+        bool m_stop = false;
+        std::thread m_thread;
+
+        void run() {
+            std::unique_lock lock{ m_mutex };
+            while (true) {
+                m_cv.wait_for(lock, m_interval, [this]() { return m_stop; });
+                const bool stop = m_stop;
+
+                auto blocks = std::move(m_pending);
+                m_pending.clear();
+                lock.unlock();
+
+                m_checkpoint.complete(blocks, m_partition);
+
+                lock.lock();
+                if (stop) break;
+            }
+        }
+
+    public:
+        checkpoint_writer(checkpoint &cp, const row_blocks &partition, std::chrono::steady_clock::duration interval)
+            :m_checkpoint{ cp },
+             m_partition{ partition },
+             m_interval{ interval },
+             m_thread{ [this]() { run(); } }
+        {}
+
+        checkpoint_writer(const checkpoint_writer &) = delete;
+        checkpoint_writer &operator=(const checkpoint_writer &) = delete;
+
+        ~checkpoint_writer() {
+            {
+                std::lock_guard lock{ m_mutex };
+                m_stop = true;
+            }
+            m_cv.notify_one();
+            m_thread.join();
+        }
+
+        void block_done(std::size_t block) {
+            std::lock_guard lock{ m_mutex };
+            m_pending.push_back(block);
+        }
+    };
+
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace img_sort {
+
+    // Colour space that images are histogrammed in
+    enum class colour_space {
+        bgr,
+        ycbcr  // JFIF YCbCr, which is also OpenCV's YCrCb
+    };
+
+    // Bin of a BGR pixel in a bins^3 histogram laid out as cv::calcHist lays out channels { 0, 1, 2 } of
+    // a BGR image over [0, 256): blue major, red minor
+    inline std::size_t bgr_bin(int b, int g, int r, std::size_t bins) noexcept {
+        const auto bin = [bins](int v) { return static_cast<std::size_t>(v) * bins / 256; };
+        return (bin(b) * bins + bin(g)) * bins + bin(r);
+    }
+
+    // Bin of a YCbCr pixel in a bins^3 histogram laid out as cv::calcHist lays out an image converted with
+    // cv::COLOR_BGR2YCrCb: luma major, Cb minor
+    inline std::size_t ycbcr_bin(int y, int cb, int cr, std::size_t bins) noexcept {
+        const auto bin = [bins](int v) { return static_cast<std::size_t>(v) * bins / 256; };
+        return (bin(y) * bins + bin(cr)) * bins + bin(cb);
+    }
+
+    // JFIF YCbCr to RGB, as libjpeg converts it, clamped to [0, 255]
+    inline void ycbcr_to_rgb(double y, double cb, double cr, int &r, int &g, int &b) noexcept {
+        const auto clamp = [](double v) { return static_cast<int>(std::clamp(std::lround(v), 0l, 255l)); };
+        r = clamp(y + 1.402 * (cr - 128.0));
+        g = clamp(y - 0.344136 * (cb - 128.0) - 0.714136 * (cr - 128.0));
+        b = clamp(y + 1.772 * (cb - 128.0));
+    }
+
+    // RGB to JFIF YCbCr, as cv::COLOR_BGR2YCrCb converts it, rounded and clamped to [0, 255]
+    inline void rgb_to_ycbcr(int r, int g, int b, int &y, int &cb, int &cr) noexcept {
+        const auto clamp = [](double v) { return static_cast<int>(std::clamp(std::lround(v), 0l, 255l)); };
+        const double luma = 0.299 * r + 0.587 * g + 0.114 * b;
+        y = clamp(luma);
+        cb = clamp((b - luma) * 0.564 + 128.0);
+        cr = clamp((r - luma) * 0.713 + 128.0);
+    }
+
+    // An image decoded whole into 8 bit BGR rows, as cv::imread decodes it
+    struct bgr_image {
+        std::vector<std::uint8_t> pixels;
+        std::size_t width = 0;
+        std::size_t height = 0;
+    };
+
+    // Bin of an 8 bit RGB pixel in a histogram of the given colour space
+    inline std::size_t colour_bin(int r, int g, int b, std::size_t bins, colour_space space) noexcept {
+        if (space == colour_space::bgr) return bgr_bin(b, g, r, bins);
+
+        int y, cb, cr;
+        rgb_to_ycbcr(r, g, b, y, cb, cr);
+        return ycbcr_bin(y, cb, cr, bins);
+    }
+
+}
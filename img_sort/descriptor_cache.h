@@ -0,0 +1,331 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "boost/interprocess/file_mapping.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+
+namespace img_sort {
+
+    // Memory-mapped file of per-image descriptors, keyed by path, size and modification time.
+    //
+    // Layout: header, index of entries, product quantiser codebook and codes (optional), then the
+    // descriptor arena at a page boundary. Every run writes a fresh file next to the old one, copies
+    // the entries that are still valid across, and renames it over the old file on commit().
+    class descriptor_cache {
+        static constexpr char magic[8] = { 'I', 'M', 'G', 'S', 'O', 'R', 'T', 'C' };
+        static constexpr std::uint32_t version = 1;
+        static constexpr std::size_t arena_alignment = 4096;
+
+        struct header {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t pq_trained;
+            std::uint64_t count;
+            std::uint64_t descriptor_size;
+            std::uint64_t pq_subspaces;  // 0 when the file carries no product quantiser
+            std::uint64_t index_offset;
+            std::uint64_t pq_offset;
+            std::uint64_t arena_offset;
+            char metric[32];
+        };
+
+        // Followed by path_length bytes of path, padded to 8 bytes
+        struct index_entry {
+            std::uint64_t file_size;
+            std::int64_t mtime;
+            std::uint32_t valid;
+            std::uint32_t path_length;
+        };
+
+        struct mapping {
+            boost::interprocess::file_mapping file;
+            boost::interprocess::mapped_region region;
+
+            mapping(const std::filesystem::path &path, boost::interprocess::mode_t mode)
+                :file{ path.string().c_str(), mode },
+                 region{ file, mode }
+            {}
+
+            char *data() const noexcept { return static_cast<char *>(region.get_address()); }
+            std::size_t size() const noexcept { return region.get_size(); }
+            header &get_header() const noexcept { return *reinterpret_cast<header *>(data()); }
+        };
+
+        struct key {
+            std::uint64_t file_size = 0;
+            std::int64_t mtime = 0;
+        };
+
+        std::filesystem::path m_path;
+        std::filesystem::path m_temp_path;
+        std::optional<mapping> m_previous;
+        std::optional<mapping> m_current;
+
+        std::vector<index_entry *> m_entries;
+        std::vector<std::optional<std::size_t>> m_previous_slot;  // Slot of a still valid entry in the previous file
+        std::vector<std::uint8_t> m_restored;  // Not vector<bool>, restore() runs concurrently
+        std::vector<const index_entry *> m_previous_entries;
+        std::size_t m_descriptor_size = 0;
+        std::size_t m_code_size = 0;
+        bool m_codebook_restored = false;
+
+        static std::size_t align_up(std::size_t n, std::size_t alignment) noexcept {
+            return (n + alignment - 1) / alignment * alignment;
+        }
+
+        static key file_key(const std::filesystem::path &filename) {
+            std::error_code ec;
+            key res;
+            res.file_size = std::filesystem::file_size(filename, ec);
+            if (ec) return {};
+            res.mtime = std::filesystem::last_write_time(filename, ec).time_since_epoch().count();
+            if (ec) return {};
+            return res;
+        }
+
+        // Walks the variable length index, calling func(slot, entry, path)
+        template <typename Func>
+        static void for_each_entry(const mapping &m, Func &&func) {
+            const auto &h = m.get_header();
+            std::size_t offset = static_cast<std::size_t>(h.index_offset);
+            for (std::size_t slot = 0; slot < h.count; ++slot) {
+                RUNTIME_ASSERT(offset + sizeof(index_entry) <= m.size());
+                auto *entry = reinterpret_cast<index_entry *>(m.data() + offset);
+                RUNTIME_ASSERT(offset + sizeof(index_entry) + entry->path_length <= m.size());
+
+                const std::string_view path{ m.data() + offset + sizeof(index_entry), entry->path_length };
+                func(slot, entry, path);
+                offset += align_up(sizeof(index_entry) + entry->path_length, 8);
+            }
+        }
+
+        bool is_compatible(const header &h, std::string_view metric, std::size_t descriptor_size) const noexcept {
+            return std::memcmp(h.magic, magic, sizeof(magic)) == 0 &&
+                   h.version == version &&
+                   h.descriptor_size == descriptor_size &&
+                   std::string_view{ h.metric, static_cast<std::size_t>(std::find(h.metric, h.metric + sizeof(h.metric), '\0') - h.metric) } == metric;
+        }
+
+        void open_previous(std::string_view metric, const std::vector<std::filesystem::path> &filenames) {
+            std::error_code ec;
+            if (!std::filesystem::is_regular_file(m_path, ec) || std::filesystem::file_size(m_path, ec) < sizeof(header)) {
+                return;
+            }
+
+            try {
+                m_previous.emplace(m_path, boost::interprocess::read_only);
+            }
+            catch (const boost::interprocess::interprocess_exception &) {
+                logger::post<logger::warning>("Failed to open descriptor cache ", m_path);
+                return;
+            }
+
+            if (!is_compatible(m_previous->get_header(), metric, m_descriptor_size)) {
+                logger::post<logger::info>("Descriptor cache ", m_path, " was built with different settings, ignoring it");
+                m_previous.reset();
+                return;
+            }
+
+            std::unordered_map<std::string_view, std::size_t> slots;
+            for_each_entry(*m_previous, [&](std::size_t slot, const index_entry *entry, std::string_view path) {
+                m_previous_entries.push_back(entry);
+                if (entry->valid) slots.emplace(path, slot);
+            });
+
+            for (std::size_t i = 0; i < filenames.size(); ++i) {
+                const auto path = filenames[i].generic_string();
+                auto it = slots.find(path);
+                if (it == slots.end()) continue;
+
+                const auto k = file_key(filenames[i]);
+                const auto *entry = m_previous_entries[it->second];
+                if (entry->file_size == k.file_size && entry->mtime == k.mtime) {
+                    m_previous_slot[i] = it->second;
+                }
+            }
+        }
+
+    public:
+        descriptor_cache(const std::filesystem::path &path,
+                         std::string_view metric,
+                         std::size_t descriptor_size,
+                         std::size_t pq_subspaces,
+                         const std::vector<std::filesystem::path> &filenames)
+            :m_path{ path },
+             m_temp_path{ path.string() + ".tmp" },
+             m_previous_slot(filenames.size()),
+             m_restored(filenames.size(), 0),
+             m_descriptor_size{ descriptor_size },
+             m_code_size{ pq_subspaces / 2 }
+        {
+            RUNTIME_ASSERT(metric.size() < sizeof(header::metric));
+            open_previous(metric, filenames);
+
+            // Lay out the new file
+            std::vector<std::string> paths;
+            std::size_t index_size = 0;
+            for (const auto &f : filenames) {
+                paths.push_back(f.generic_string());
+                index_size += align_up(sizeof(index_entry) + paths.back().size(), 8);
+            }
+
+            const std::size_t index_offset = align_up(sizeof(header), 8);
+            const std::size_t pq_offset = index_offset + index_size;
+            const std::size_t pq_size = pq_subspaces > 0 ? descriptor_size * 16 * sizeof(float) + filenames.size() * m_code_size : 0;
+            const std::size_t arena_offset = align_up(pq_offset + pq_size, arena_alignment);
+            const std::size_t file_size = arena_offset + filenames.size() * descriptor_size * sizeof(float);
+
+            std::ofstream{ m_temp_path, std::ios::binary | std::ios::trunc };
+            std::filesystem::resize_file(m_temp_path, file_size);
+            m_current.emplace(m_temp_path, boost::interprocess::read_write);
+
+            auto &h = m_current->get_header();
+            std::memcpy(h.magic, magic, sizeof(magic));
+            h.version = version;
+            h.pq_trained = 0;
+            h.count = filenames.size();
+            h.descriptor_size = descriptor_size;
+            h.pq_subspaces = pq_subspaces;
+            h.index_offset = index_offset;
+            h.pq_offset = pq_offset;
+            h.arena_offset = arena_offset;
+            std::memset(h.metric, 0, sizeof(h.metric));
+            std::memcpy(h.metric, metric.data(), metric.size());
+
+            std::size_t offset = index_offset;
+            for (std::size_t i = 0; i < filenames.size(); ++i) {
+                const auto k = file_key(filenames[i]);
+                auto *entry = reinterpret_cast<index_entry *>(m_current->data() + offset);
+                entry->file_size = k.file_size;
+                entry->mtime = k.mtime;
+                entry->valid = 0;
+                entry->path_length = static_cast<std::uint32_t>(paths[i].size());
+                std::memcpy(m_current->data() + offset + sizeof(index_entry), paths[i].data(), paths[i].size());
+
+                m_entries.push_back(entry);
+                offset += align_up(sizeof(index_entry) + paths[i].size(), 8);
+            }
+
+            // Keep the codebook, and with it the codes of unchanged images, if it was trained with the same settings
+            if (m_previous && pq_subspaces > 0) {
+                const auto &previous = m_previous->get_header();
+                if (previous.pq_subspaces == pq_subspaces && previous.pq_trained) {
+                    std::memcpy(codebook(), m_previous->data() + previous.pq_offset, descriptor_size * 16 * sizeof(float));
+                    h.pq_trained = 1;
+                    m_codebook_restored = true;
+                }
+            }
+        }
+
+        descriptor_cache(const descriptor_cache &) = delete;
+        descriptor_cache &operator=(const descriptor_cache &) = delete;
+
+        ~descriptor_cache() {
+            if (m_current) {
+                m_current.reset();
+                std::error_code ec;
+                std::filesystem::remove(m_temp_path, ec);
+            }
+        }
+
+        std::size_t size() const noexcept {
+            return m_entries.size();
+        }
+
+        std::size_t descriptor_size() const noexcept {
+            return m_descriptor_size;
+        }
+
+        float *descriptor(std::size_t i) const noexcept {
+            return reinterpret_cast<float *>(m_current->data() + m_current->get_header().arena_offset) + i * m_descriptor_size;
+        }
+
+        bool is_valid(std::size_t i) const noexcept {
+            return m_entries[i]->valid != 0;
+        }
+
+        void set_valid(std::size_t i) noexcept {
+            m_entries[i]->valid = 1;
+        }
+
+        // Whether restore(i) will find the image in the previous file
+        bool is_cached(std::size_t i) const noexcept {
+            return m_previous_slot[i].has_value();
+        }
+
+        // Copies the descriptor (and code, if the codebook was kept) of an unchanged image from the previous file
+        bool restore(std::size_t i) noexcept {
+            if (!m_previous_slot[i]) {
+                return false;
+            }
+
+            const auto slot = *m_previous_slot[i];
+            const auto &previous = m_previous->get_header();
+            const char *src = m_previous->data() + previous.arena_offset + slot * m_descriptor_size * sizeof(float);
+            std::memcpy(descriptor(i), src, m_descriptor_size * sizeof(float));
+
+            if (m_codebook_restored) {
+                const char *code_src = m_previous->data() + previous.pq_offset + m_descriptor_size * 16 * sizeof(float) + slot * m_code_size;
+                std::memcpy(code(i), code_src, m_code_size);
+            }
+
+            set_valid(i);
+            m_restored[i] = 1;
+            return true;
+        }
+
+        std::size_t num_restored() const noexcept {
+            return std::count(m_restored.begin(), m_restored.end(), std::uint8_t{ 1 });
+        }
+
+        bool has_codebook() const noexcept {
+            return m_current->get_header().pq_trained != 0;
+        }
+
+        // Codes carry over only for restored entries, and only while the codebook is the one from the previous run
+        bool has_code(std::size_t i) const noexcept {
+            return m_codebook_restored && m_restored[i] != 0;
+        }
+
+        float *codebook() const {
+            RUNTIME_ASSERT(m_code_size > 0);
+            return reinterpret_cast<float *>(m_current->data() + m_current->get_header().pq_offset);
+        }
+
+        void set_codebook_trained() noexcept {
+            m_current->get_header().pq_trained = 1;
+        }
+
+        std::uint8_t *code(std::size_t i) const noexcept {
+            return reinterpret_cast<std::uint8_t *>(m_current->data() + m_current->get_header().pq_offset + m_descriptor_size * 16 * sizeof(float)) + i * m_code_size;
+        }
+
+        const std::uint8_t *codes() const noexcept {
+            return code(0);
+        }
+
+        // Flushes the new file and replaces the previous one with it. Descriptors are invalid afterwards.
+        void commit() {
+            RUNTIME_ASSERT(m_current);
+            m_current->region.flush();
+            m_current.reset();
+            m_previous.reset();
+            m_previous_entries.clear();
+
+            std::filesystem::rename(m_temp_path, m_path);
+        }
+    };
+
+}
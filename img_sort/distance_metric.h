@@ -0,0 +1,248 @@
+#pragma once
+
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+
+namespace img_sort {
+
+    // Distance metric policies.
+    //
+    // prepare() turns a raw bins^3 colour histogram into the descriptor the metric operates on and
+    // distance() compares two such descriptors. Every distance lies in [0, 1]; is_metric is true
+    // when the distance satisfies the triangle inequality, and is_euclidean when it is
+    // sqrt(|a - b|^2 / 2) of the descriptors, so that L2-preserving reductions apply.
+    namespace metric {
+
+        inline void normalise(const float *hist, std::size_t n, float *out) noexcept {
+            const double total = kernel::sum(hist, n);
+            kernel::scale(hist, n, total > 0.0 ? 1.0 / total : 0.0, out);
+        }
+
+        struct probability_descriptor {
+            static constexpr std::size_t descriptor_size(std::size_t bins) noexcept {
+                return bins * bins * bins;
+            }
+
+            static void prepare(const float *hist, std::size_t bins, float *out) noexcept {
+                normalise(hist, descriptor_size(bins), out);
+            }
+        };
+
+        // Stored as sqrt(p), so that 1 - BC(p, q) == |sqrt(p) - sqrt(q)|^2 / 2. Computing it from the
+        // difference rather than the Bhattacharyya coefficient avoids cancellation for near duplicates.
+        // Same value as cv::HISTCMP_BHATTACHARYYA (which OpenCV also calls HISTCMP_HELLINGER).
+        struct bhattacharyya {
+            static constexpr std::string_view name = "bhattacharyya";
+            static constexpr bool is_metric = true;
+            static constexpr bool is_euclidean = true;
+
+            static constexpr std::size_t descriptor_size(std::size_t bins) noexcept {
+                return bins * bins * bins;
+            }
+
+            static void prepare(const float *hist, std::size_t bins, float *out) noexcept {
+                const auto n = descriptor_size(bins);
+                normalise(hist, n, out);
+                kernel::sqrt(out, n);
+            }
+
+            static double distance(const float *a, const float *b, std::size_t n) noexcept {
+                return std::min(std::sqrt(0.5 * kernel::l2_squared(a, b, n)), 1.0);
+            }
+        };
+
+        // Symmetric chi-square, halved so that it lies in [0, 1]
+        struct chi_square : probability_descriptor {
+            static constexpr std::string_view name = "chi-square";
+            static constexpr bool is_metric = false;
+            static constexpr bool is_euclidean = false;
+
+            static double distance(const float *a, const float *b, std::size_t n) noexcept {
+                return std::min(0.5 * kernel::chi_square(a, b, n), 1.0);
+            }
+        };
+
+        // Total variation distance
+        struct l1 : probability_descriptor {
+            static constexpr std::string_view name = "l1";
+            static constexpr bool is_metric = true;
+            static constexpr bool is_euclidean = false;
+
+            static double distance(const float *a, const float *b, std::size_t n) noexcept {
+                return std::min(0.5 * kernel::l1(a, b, n), 1.0);
+            }
+        };
+
+        struct l2 : probability_descriptor {
+            static constexpr std::string_view name = "l2";
+            static constexpr bool is_metric = true;
+            static constexpr bool is_euclidean = true;
+
+            static double distance(const float *a, const float *b, std::size_t n) noexcept {
+                return std::min(std::sqrt(0.5 * kernel::l2_squared(a, b, n)), 1.0);
+            }
+        };
+
+        // 1 - sum(min(p, q)). Equal to the total variation distance on normalised histograms,
+        // but kept as its own kernel since min is cheaper than abs-diff on some targets.
+        struct intersection : probability_descriptor {
+            static constexpr std::string_view name = "intersection";
+            static constexpr bool is_metric = true;
+            static constexpr bool is_euclidean = false;
+
+            static double distance(const float *a, const float *b, std::size_t n) noexcept {
+                return std::clamp(1.0 - kernel::min_sum(a, b, n), 0.0, 1.0);
+            }
+        };
+
+        // Square root of the base-2 Jensen-Shannon divergence. Bound by log(), which has no cheap
+        // vector form; the histograms are sparse, so empty bins are skipped instead.
+        struct jensen_shannon : probability_descriptor {
+            static constexpr std::string_view name = "jensen-shannon";
+            static constexpr bool is_metric = true;
+            static constexpr bool is_euclidean = false;
+
+            static double distance(const float *a, const float *b, std::size_t n) noexcept {
+                double res = 0.0;
+                for (std::size_t i = 0; i < n; ++i) {
+                    const double x = a[i];
+                    const double y = b[i];
+                    if (x + y <= 0.0) continue;
+
+                    const double m = 0.5 * (x + y);
+                    if (x > 0.0) res += x * std::log2(x / m);
+                    if (y > 0.0) res += y * std::log2(y / m);
+                }
+
+                return std::sqrt(std::clamp(0.5 * res, 0.0, 1.0));
+            }
+        };
+
+        // Approximates the earth mover's distance by the mean 1D EMD of the three per-channel
+        // marginals. The descriptor is the three marginal CDFs, so the distance is a short L1.
+        struct emd {
+            static constexpr std::string_view name = "emd";
+            static constexpr bool is_metric = true;
+            static constexpr bool is_euclidean = false;
+
+            static constexpr std::size_t descriptor_size(std::size_t bins) noexcept {
+                return 3 * bins;
+            }
+
+            static void prepare(const float *hist, std::size_t bins, float *out) noexcept {
+                std::fill(out, out + descriptor_size(bins), 0.0f);
+
+                double total = 0.0;
+                for (std::size_t c0 = 0; c0 < bins; ++c0) {
+                    for (std::size_t c1 = 0; c1 < bins; ++c1) {
+                        for (std::size_t c2 = 0; c2 < bins; ++c2) {
+                            const float v = hist[(c0 * bins + c1) * bins + c2];
+                            out[c0] += v;
+                            out[bins + c1] += v;
+                            out[2 * bins + c2] += v;
+                            total += v;
+                        }
+                    }
+                }
+
+                const double scale = total > 0.0 ? 1.0 / total : 0.0;
+                for (std::size_t channel = 0; channel < 3; ++channel) {
+                    double cdf = 0.0;
+                    for (std::size_t i = 0; i < bins; ++i) {
+                        cdf += out[channel * bins + i];
+                        out[channel * bins + i] = static_cast<float>(cdf * scale);
+                    }
+                }
+            }
+
+            static double distance(const float *a, const float *b, std::size_t n) noexcept {
+                const auto bins = n / 3;
+                return bins > 1 ? std::min(kernel::l1(a, b, n) / static_cast<double>(n - 3), 1.0) : 0.0;
+            }
+        };
+
+    }
+
+    enum class metric_type {
+        bhattacharyya,
+        chi_square,
+        l1,
+        l2,
+        intersection,
+        jensen_shannon,
+        emd
+    };
+
+    constexpr metric_type all_metric_types[] = {
+        metric_type::bhattacharyya,
+        metric_type::chi_square,
+        metric_type::l1,
+        metric_type::l2,
+        metric_type::intersection,
+        metric_type::jensen_shannon,
+        metric_type::emd
+    };
+
+    template <typename Func>
+    decltype(auto) visit_metric(metric_type type, Func &&func) {
+        switch (type) {
+        case metric_type::bhattacharyya:  return std::forward<Func>(func)(metric::bhattacharyya{});
+        case metric_type::chi_square:     return std::forward<Func>(func)(metric::chi_square{});
+        case metric_type::l1:             return std::forward<Func>(func)(metric::l1{});
+        case metric_type::l2:             return std::forward<Func>(func)(metric::l2{});
+        case metric_type::intersection:   return std::forward<Func>(func)(metric::intersection{});
+        case metric_type::jensen_shannon: return std::forward<Func>(func)(metric::jensen_shannon{});
+        case metric_type::emd:            return std::forward<Func>(func)(metric::emd{});
+        }
+
+        throw std::runtime_error("Unrecognised metric enum!");
+    }
+
+    inline std::optional<metric_type> parse_metric(std::string_view name) {
+        if (name == "hellinger") {
+            return metric_type::bhattacharyya;
+        }
+
+        for (auto type : all_metric_types) {
+            if (visit_metric(type, [](auto m) { return decltype(m)::name; }) == name) {
+                return type;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    // Type-erased view of a metric policy, so that the pipeline can pick one at runtime
+    // without instantiating every stage per metric.
+    struct metric_functions {
+        std::string_view name;
+        bool is_metric;
+        bool is_euclidean;
+        std::size_t (*descriptor_size)(std::size_t bins);
+        void (*prepare)(const float *hist, std::size_t bins, float *out);
+        double (*distance)(const float *a, const float *b, std::size_t n);
+    };
+
+    template <typename Metric>
+    constexpr metric_functions make_metric_functions() noexcept {
+        return {
+            Metric::name,
+            Metric::is_metric,
+            Metric::is_euclidean,
+            [](std::size_t bins) { return Metric::descriptor_size(bins); },
+            [](const float *hist, std::size_t bins, float *out) { Metric::prepare(hist, bins, out); },
+            [](const float *a, const float *b, std::size_t n) { return Metric::distance(a, b, n); }
+        };
+    }
+
+    inline metric_functions get_metric_functions(metric_type type) {
+        return visit_metric(type, [](auto m) { return make_metric_functions<decltype(m)>(); });
+    }
+
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace img_sort {
+
+    namespace detail {
+        // Reads unsigned integers of either TIFF byte order, bounds checked against a buffer
+        class tiff_reader {
+            const unsigned char *m_data;
+            std::size_t m_size;
+            bool m_big_endian;
+
+        public:
+            tiff_reader(const unsigned char *data, std::size_t size, bool big_endian)
+                :m_data{ data },
+                 m_size{ size },
+                 m_big_endian{ big_endian }
+            {}
+
+            std::optional<std::uint32_t> read(std::size_t offset, std::size_t bytes) const {
+                if (offset > m_size || bytes > m_size - offset) return std::nullopt;
+
+                std::uint32_t res = 0;
+                for (std::size_t i = 0; i < bytes; ++i) {
+                    const std::uint32_t b = m_data[offset + (m_big_endian ? i : bytes - 1 - i)];
+                    res = (res << 8) | b;
+                }
+                return res;
+            }
+        };
+    }
+
+    // Width and height from the first start-of-frame marker of a JPEG
+    inline std::optional<std::pair<std::size_t, std::size_t>> jpeg_dimensions(const unsigned char *data, std::size_t size) {
+        if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return std::nullopt;
+
+        const detail::tiff_reader reader{ data, size, true };
+        std::size_t pos = 2;
+        while (pos + 4 <= size) {
+            if (data[pos] != 0xFF) return std::nullopt;
+            const unsigned char marker = data[pos + 1];
+            if (marker == 0xFF) {
+                ++pos;
+                continue;
+            }
+
+            const auto length = reader.read(pos + 2, 2);
+            if (!length || *length < 2) return std::nullopt;
+
+            // SOF0 to SOF15, less DHT, JPG and DAC which share the range
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                const auto height = reader.read(pos + 5, 2);
+                const auto width = reader.read(pos + 7, 2);
+                if (!height || !width) return std::nullopt;
+                return std::pair<std::size_t, std::size_t>{ *width, *height };
+            }
+            if (marker == 0xDA) return std::nullopt;
+
+            pos += 2 + *length;
+        }
+        return std::nullopt;
+    }
+
+    // Byte range of the JPEG thumbnail in an EXIF APP1 payload ("Exif\0\0" and a TIFF structure): the
+    // JPEGInterchangeFormat and JPEGInterchangeFormatLength tags of IFD1, the IFD that follows IFD0
+    inline std::optional<std::pair<std::size_t, std::size_t>> exif_thumbnail_range(const unsigned char *payload, std::size_t size) {
+        constexpr unsigned char exif_header[] = { 'E', 'x', 'i', 'f', 0, 0 };
+        constexpr std::size_t header_size = sizeof(exif_header);
+        if (size < header_size + 8 || !std::equal(exif_header, exif_header + header_size, payload)) return std::nullopt;
+
+        const unsigned char *tiff = payload + header_size;
+        const std::size_t tiff_size = size - header_size;
+        if (!((tiff[0] == 'I' && tiff[1] == 'I') || (tiff[0] == 'M' && tiff[1] == 'M'))) return std::nullopt;
+
+        const detail::tiff_reader reader{ tiff, tiff_size, tiff[0] == 'M' };
+        if (reader.read(2, 2) != 42u) return std::nullopt;
+
+        auto next_ifd = [&](std::size_t ifd) -> std::optional<std::uint32_t> {
+            const auto count = reader.read(ifd, 2);
+            if (!count) return std::nullopt;
+            return reader.read(ifd + 2 + *count * 12, 4);
+        };
+
+        const auto ifd0 = reader.read(4, 4);
+        const auto ifd1 = ifd0 ? next_ifd(*ifd0) : std::nullopt;
+        if (!ifd1 || *ifd1 == 0) return std::nullopt;
+
+        const auto count = reader.read(*ifd1, 2);
+        if (!count) return std::nullopt;
+
+        std::optional<std::uint32_t> offset, length;
+        for (std::size_t i = 0; i < *count; ++i) {
+            const std::size_t entry = *ifd1 + 2 + i * 12;
+            const auto tag = reader.read(entry, 2);
+            const auto type = reader.read(entry + 2, 2);
+            if (!tag || !type) return std::nullopt;
+
+            // LONG as the standard says, or SHORT as some writers store it, left aligned in the value field
+            const auto value = reader.read(entry + 8, *type == 3 ? 2 : 4);
+            if (*tag == 0x0201) offset = value;
+            else if (*tag == 0x0202) length = value;
+        }
+
+        if (!offset || !length || *length == 0 || *offset > tiff_size || *length > tiff_size - *offset) return std::nullopt;
+        return std::pair<std::size_t, std::size_t>{ header_size + *offset, *length };
+    }
+
+    // The EXIF thumbnail of a JPEG file, or nothing. Only the segments ahead of the APP1 segment are read.
+    inline std::vector<unsigned char> read_exif_thumbnail(const std::filesystem::path &path) {
+        std::ifstream file{ path, std::ios::binary };
+        unsigned char marker[4];
+        if (!file.read(reinterpret_cast<char *>(marker), 2) || marker[0] != 0xFF || marker[1] != 0xD8) return {};
+
+        // EXIF comes first or after JFIF's APP0, but some writers add more application segments ahead of it
+        constexpr int max_segments = 8;
+        for (int i = 0; i < max_segments; ++i) {
+            if (!file.read(reinterpret_cast<char *>(marker), 4) || marker[0] != 0xFF) return {};
+
+            const std::size_t length = (std::size_t{ marker[2] } << 8) | marker[3];
+            if (length < 2 || marker[1] < 0xE0 || marker[1] > 0xEF) return {};
+
+            if (marker[1] != 0xE1) {
+                file.seekg(length - 2, std::ios::cur);
+                continue;
+            }
+
+            std::vector<unsigned char> payload(length - 2);
+            if (!file.read(reinterpret_cast<char *>(payload.data()), payload.size())) return {};
+
+            const auto range = exif_thumbnail_range(payload.data(), payload.size());
+            if (!range) {
+                // XMP also lives in APP1
+                continue;
+            }
+            return std::vector<unsigned char>(payload.begin() + range->first, payload.begin() + range->first + range->second);
+        }
+        return {};
+    }
+
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <cstddef>
+#include <new>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+namespace img_sort {
+
+    // Table storage on huge pages where the OS provides them, to cut TLB misses on multi-GB tables. Memory
+    // comes back untouched, so that triangular_table can place each page by writing it from the worker
+    // that later fills it (first touch), rather than having one thread zero everything onto one NUMA node.
+    //
+    // Linux: explicit hugetlb pages if any are reserved, otherwise transparent huge pages via madvise.
+    // Windows: large pages if the process holds SeLockMemoryPrivilege, otherwise regular pages.
+    template <typename T>
+    class huge_page_storage {
+        static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>);
+
+        static constexpr std::size_t huge_page_size = 2 * 1024 * 1024;
+
+        T *m_data = nullptr;
+        std::size_t m_bytes = 0;
+        std::string_view m_kind = "none";
+
+        static std::size_t align_up(std::size_t n, std::size_t alignment) noexcept {
+            return (n + alignment - 1) / alignment * alignment;
+        }
+
+        void allocate(std::size_t bytes) {
+#if defined(__linux__)
+            // Tables smaller than a huge page are not worth one
+            const bool huge = bytes >= huge_page_size;
+            m_bytes = huge ? align_up(bytes, huge_page_size) : bytes;
+            void *p = MAP_FAILED;
+
+#if defined(MAP_HUGETLB)
+            // Without MAP_NORESERVE this fails up front, rather than faulting later, when too few pages are reserved
+            if (huge) {
+                p = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            }
+            if (p != MAP_FAILED) {
+                m_data = static_cast<T *>(p);
+                m_kind = "hugetlb pages";
+                return;
+            }
+#endif
+
+            p = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) throw std::bad_alloc{};
+            m_data = static_cast<T *>(p);
+            m_kind = "regular pages";
+
+#if defined(MADV_HUGEPAGE)
+            if (huge && madvise(p, m_bytes, MADV_HUGEPAGE) == 0) {
+                m_kind = "transparent huge pages";
+            }
+#endif
+#elif defined(_WIN32)
+            const SIZE_T large_page = GetLargePageMinimum();
+            if (large_page > 0) {
+                m_bytes = align_up(bytes, large_page);
+                if (void *p = VirtualAlloc(nullptr, m_bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE)) {
+                    m_data = static_cast<T *>(p);
+                    m_kind = "large pages";
+                    return;
+                }
+            }
+
+            m_bytes = bytes;
+            void *p = VirtualAlloc(nullptr, m_bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+            if (p == nullptr) throw std::bad_alloc{};
+            m_data = static_cast<T *>(p);
+            m_kind = "regular pages";
+#else
+            m_bytes = bytes;
+            m_data = static_cast<T *>(::operator new(m_bytes, std::align_val_t{ alignof(std::max_align_t) }));
+            m_kind = "regular pages";
+#endif
+        }
+
+    public:
+        static constexpr bool parallel_first_touch = true;
+
+        explicit huge_page_storage(std::size_t size) {
+            allocate(std::max<std::size_t>(size, 1) * sizeof(T));
+        }
+
+        huge_page_storage(huge_page_storage &&other) noexcept
+            :m_data{ std::exchange(other.m_data, nullptr) },
+             m_bytes{ std::exchange(other.m_bytes, 0) },
+             m_kind{ other.m_kind }
+        {}
+
+        huge_page_storage &operator=(huge_page_storage &&other) noexcept {
+            if (this != &other) {
+                clear();
+                m_data = std::exchange(other.m_data, nullptr);
+                m_bytes = std::exchange(other.m_bytes, 0);
+                m_kind = other.m_kind;
+            }
+            return *this;
+        }
+
+        ~huge_page_storage() {
+            clear();
+        }
+
+        T *data() noexcept { return m_data; }
+        const T *data() const noexcept { return m_data; }
+
+        // Which kind of pages backs the storage, for logging
+        std::string_view kind() const noexcept { return m_kind; }
+
+        void clear() noexcept {
+            if (m_data == nullptr) return;
+
+#if defined(__linux__)
+            munmap(m_data, m_bytes);
+#elif defined(_WIN32)
+            VirtualFree(m_data, 0, MEM_RELEASE);
+#else
+            ::operator delete(m_data, std::align_val_t{ alignof(std::max_align_t) });
+#endif
+            m_data = nullptr;
+            m_bytes = 0;
+        }
+    };
+
+    // Huge page storage that is kept between tables and only ever grown, so that a later table of at most the
+    // same size reuses pages that are already mapped and placed instead of faulting in new ones
+    class table_arena {
+        std::optional<huge_page_storage<std::byte>> m_storage;
+        std::size_t m_capacity = 0;  // Bytes
+
+    public:
+        // Room for count entries of T, contents unspecified
+        template <typename T>
+        T *reserve(std::size_t count) {
+            static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>);
+
+            const auto bytes = std::max<std::size_t>(count, 1) * sizeof(T);
+            if (bytes > m_capacity) {
+                // The old block goes first, so that growing never holds both
+                m_storage.reset();
+                m_storage.emplace(bytes);
+                m_capacity = bytes;
+            }
+            return reinterpret_cast<T *>(m_storage->data());
+        }
+
+        std::size_t capacity() const noexcept { return m_capacity; }
+        std::string_view kind() const noexcept { return m_storage ? m_storage->kind() : "none"; }
+
+        void release() noexcept {
+            m_storage.reset();
+            m_capacity = 0;
+        }
+    };
+
+}
@@ -3,331 +3,570 @@
 // 2. Perform template matching between each pair of resized images
 
 
-#include "img_sort.h"
-
-#include <algorithm>
-#include <execution>
+#include "pipeline.h"
+#include "metrics.h"
+#include "progress.h"
+
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
 #include <filesystem>
+#include <fstream>
+#include <optional>
 #include <string>
 #include <string_view>
-#include <optional>
-#include <stack>
-#include <queue>
+#include <thread>
+#include <vector>
 
-#include "boost/container/small_vector.hpp"
-#include "boost/format.hpp"
-#include "boost/range/adaptor/reversed.hpp"
-
-#include "opencv2/core.hpp"
-#include "opencv2/imgcodecs.hpp"
-#include "opencv2/highgui.hpp"
-#include "opencv2/imgproc.hpp"
+#if !defined(_WIN32)
+#include <cerrno>
+#include <unistd.h>
+#endif
 
 namespace img_sort {
 
-    static constexpr auto execution_policy = std::execution::par;
+    template <typename T>
+    std::optional<T> parse_number(std::string_view str) {
+        T res{};
+        const auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), res);
+        if (ec != std::errc{} || ptr != str.data() + str.size()) {
+            return std::nullopt;
+        }
+        return res;
+    }
 
-    struct histogram {
-        cv::Mat mat;
-        std::filesystem::path filename;
+    // Returns the value of "--name=value", or nullopt if arg is a different flag
+    std::optional<std::string_view> flag_value(std::string_view arg, std::string_view name) {
+        if (arg.size() > name.size() && arg.substr(0, name.size()) == name && arg[name.size()] == '=') {
+            return arg.substr(name.size() + 1);
+        }
+        return std::nullopt;
+    }
 
-        histogram() {}
+    void print_usage() {
+        std::string metric_names;
+        for (auto type : all_metric_types) {
+            if (!metric_names.empty()) metric_names += '|';
+            metric_names += get_metric_functions(type).name;
+        }
 
-        histogram(cv::Mat &&m, const std::filesystem::path &f)
-        :mat{ std::move(m) },
-         filename{ f }
-        {}
+        logger::post<logger::error>("Usage: img_sort [options] <source directory> <output directory>\n",
+                                    "       img_sort [--benchmark-metrics | --benchmark-decode] <source directory>\n",
+                                    "       img_sort [options] --shard=<i>/<n> <source directory> <shard file>\n",
+                                    "       img_sort [options] --merge <source directory> <output directory> <shard files>...\n",
+                                    "       img_sort [options] --batch=<file>\n",
+                                    "Options:\n",
+                                    "  --metric=<", metric_names, ">  histogram distance (default bhattacharyya)\n",
+                                    "  --mst=<dense|pivot>  dense Prim over a full distance table, or Prim with pivot lower bounds\n",
+                                    "                       that evaluates distances on demand (default: chosen by --plan,\n",
+                                    "                       otherwise dense)\n",
+                                    "  --mst=pq             MST of a k nearest neighbour graph found with product quantised descriptors\n",
+                                    "  --table-precision=<double|float|uint16|uint8>  distance table entries for --mst=dense\n",
+                                    "                       (default: chosen by --plan, otherwise double)\n",
+                                    "  --pivots=<n>         number of pivots for --mst=pivot (default 16)\n",
+                                    "  --knn=<k>            neighbours per image for --mst=pq (default 8)\n",
+                                    "  --pq-subspaces=<m>   product quantiser subspaces, m / 2 bytes per image (default 64)\n",
+                                    "  --pq-refine=<n>      candidates per image refined with exact distances (default 32)\n",
+                                    "  --mst=lsh            MST of the pairs that collide in SimHash tables\n",
+                                    "  --lsh-tables=<l>     hash tables for --mst=lsh (default 8)\n",
+                                    "  --lsh-bits=<b>       signature bits per table, at most 32 (default about 8 images per bucket)\n",
+                                    "  --lsh-bucket=<n>     partners per image within one bucket (default 32)\n",
+                                    "  --project=<k>        reduce descriptors to k dimensions with a sparse random projection\n",
+                                    "                       (bhattacharyya and l2 only, 64 to 256 is typical). Without it, --plan\n",
+                                    "                       may project to 128 when full size distances would be too slow or large\n",
+                                    "  --checkpoint=<file>  keep descriptors and finished parts of the --mst=dense table in a file\n",
+                                    "  --checkpoint-interval=<seconds>  how often finished parts are flushed (default 60)\n",
+                                    "  --resume             continue from the checkpoint if the inputs are unchanged\n",
+                                    "  --shard=<i>/<n>      compute shard i of n of the image pairs into a shard file\n",
+                                    "  --merge              build the tree from all n shard files, written with the same options\n",
+                                    "  --batch=<file>       sort every \"<source>\\t<output>\" directory pair listed in file, several\n",
+                                    "                       at once in one process, and report the time of each\n",
+                                    "  --time-budget=<seconds>  anytime mode: the best order found within the budget, from a\n",
+                                    "                       space-filling curve up to the exact MST, refined with 2-opt\n",
+                                    "  --progress=<seconds> log the rate, share done and time left of the running stage this often\n",
+                                    "  --progress-file=<file>  write the same to file, replaced each time (every 5 seconds unless\n",
+                                    "                       --progress is given)\n",
+                                    "  --metrics-file=<file.prom>  export stage times, rates, cache hits, failures and peak memory\n",
+                                    "                       for node_exporter's textfile collector, during the run and at its end\n",
+                                    "  --metrics-interval=<seconds>  how often the metrics file is rewritten (default 15)\n",
+                                    "  --partial-output     when interrupted, still link every image in a best-effort order\n",
+                                    "  --slow-files=<n>     list the n images slowest to read and decode after the latency\n",
+                                    "                       percentiles of the histogram stage, 0 for none (default 10)\n",
+                                    "  --shutdown-grace=<seconds>  how long an interrupted sort may take to save its progress\n",
+                                    "                       before the process exits anyway (default 10)\n",
+                                    "  --plan=<auto|off>    choose --mst, --table-precision and --project from the image count,\n",
+                                    "                       available memory and cores, keeping any given explicitly (default auto)\n",
+                                    "  --kernels=<auto|scalar|sse4.2|avx2|avx512>  distance and Prim kernels (default the best the CPU runs)\n",
+                                    "  --tune=<file>        time tile widths of the --mst=dense pair stage once per host, remembered in file\n",
+                                    "  --colour-space=<bgr|ycbcr>  colour space of the histograms; ycbcr reads JPEGs without\n",
+                                    "                       upsampling or colour conversion (default bgr)\n",
+                                    "  --jpeg-dc            histograms of JPEGs from the mean of every 8x8 block, without a full decode\n",
+                                    "  --exif-thumbnail=<n> histograms of JPEGs from their EXIF thumbnail where both its sides\n",
+                                    "                       are at least n pixels (120 takes the usual 160x120)\n",
+                                    "  --target-resolution=<n>  decode JPEGs at 1/2, 1/4 or 1/8 scale and interlaced PNGs from\n",
+                                    "                       their first passes, down to n pixels on the shorter side\n",
+                                    "  --stream-above=<megapixels>  decode JPEGs and PNGs of at least this size a row at a time\n",
+                                    "                       rather than whole (default 64, 0 for all)\n",
+                                    "  --read-order=<listed|inode|extent>  order images are read in, for disks that seek; the\n",
+                                    "                       output is the same (default listed)\n",
+                                    "  --cache=<file>       keep descriptors (and product quantiser codes) in a memory-mapped file\n",
+                                    "                       and reuse them for unchanged images on the next run");
+    }
 
-        void clear() {
-            mat.release();
-        }
-    };
+    std::optional<options> parse_options(int argc, const char** argv) {
+        options opts;
+        std::vector<std::string_view> positional;
 
-    class tree {
-#ifndef NDEBUG
-        std::vector<bool> m_parent;
-#endif
-        std::vector<boost::container::small_vector<std::size_t, 1>> m_adjacency_list;
-        std::size_t m_num_edges = 0;
-
-    public:
-        tree(std::size_t size)
-            :m_adjacency_list(size)
-        {
-            RUNTIME_ASSERT(size > 0);
-#ifndef NDEBUG
-            m_parent.assign(size, false);
-#endif
-        }
+        for (int i = 1; i < argc; ++i) {
+            const std::string_view arg = argv[i];
 
-        bool try_insert(std::size_t parent, std::size_t child) {
-            RUNTIME_ASSERT(parent < m_adjacency_list.size());
-            
-#ifndef NDEBUG
-            RUNTIME_ASSERT(child < m_parent.size());
-            if (contains(child)) {
-                return false;
+            if (auto value = flag_value(arg, "--metric")) {
+                const auto metric = parse_metric(*value);
+                if (!metric) {
+                    logger::post<logger::error>("Unrecognised metric ", *value);
+                    return std::nullopt;
+                }
+                opts.metric = *metric;
+            }
+            else if (auto value = flag_value(arg, "--mst")) {
+                opts.forced.mst = true;
+                if (*value == "dense") {
+                    opts.mst = mst_engine::dense;
+                }
+                else if (*value == "pivot") {
+                    opts.mst = mst_engine::pivot;
+                }
+                else if (*value == "pq") {
+                    opts.mst = mst_engine::pq;
+                }
+                else if (*value == "lsh") {
+                    opts.mst = mst_engine::lsh;
+                }
+                else {
+                    logger::post<logger::error>("Unrecognised MST engine ", *value);
+                    return std::nullopt;
+                }
+            }
+            else if (auto value = flag_value(arg, "--table-precision")) {
+                opts.forced.precision = true;
+                if (*value == "double") {
+                    opts.precision = table_precision::f64;
+                }
+                else if (*value == "float") {
+                    opts.precision = table_precision::f32;
+                }
+                else if (*value == "uint16") {
+                    opts.precision = table_precision::u16;
+                }
+                else if (*value == "uint8") {
+                    opts.precision = table_precision::u8;
+                }
+                else {
+                    logger::post<logger::error>("Unrecognised table precision ", *value);
+                    return std::nullopt;
+                }
+            }
+            else if (auto value = flag_value(arg, "--pivots")) {
+                const auto num_pivots = parse_number<std::size_t>(*value);
+                if (!num_pivots || *num_pivots == 0) {
+                    logger::post<logger::error>("Invalid pivot count ", *value);
+                    return std::nullopt;
+                }
+                opts.num_pivots = *num_pivots;
+            }
+            else if (auto value = flag_value(arg, "--knn")) {
+                const auto k = parse_number<std::size_t>(*value);
+                if (!k || *k == 0) {
+                    logger::post<logger::error>("Invalid neighbour count ", *value);
+                    return std::nullopt;
+                }
+                opts.pq.num_neighbours = *k;
+            }
+            else if (auto value = flag_value(arg, "--pq-subspaces")) {
+                const auto m = parse_number<std::size_t>(*value);
+                if (!m || *m == 0 || *m % 2 != 0 || *m > 256) {
+                    logger::post<logger::error>("Subspace count must be even and at most 256, got ", *value);
+                    return std::nullopt;
+                }
+                opts.pq.num_subspaces = *m;
+            }
+            else if (auto value = flag_value(arg, "--pq-refine")) {
+                const auto n = parse_number<std::size_t>(*value);
+                if (!n || *n == 0) {
+                    logger::post<logger::error>("Invalid refinement count ", *value);
+                    return std::nullopt;
+                }
+                opts.pq.num_refined = *n;
+            }
+            else if (auto value = flag_value(arg, "--lsh-tables")) {
+                const auto l = parse_number<std::size_t>(*value);
+                if (!l || *l == 0) {
+                    logger::post<logger::error>("Invalid table count ", *value);
+                    return std::nullopt;
+                }
+                opts.lsh.num_tables = *l;
+            }
+            else if (auto value = flag_value(arg, "--lsh-bits")) {
+                const auto b = parse_number<std::size_t>(*value);
+                if (!b || *b == 0 || *b > 32) {
+                    logger::post<logger::error>("Signature bits must be between 1 and 32, got ", *value);
+                    return std::nullopt;
+                }
+                opts.lsh.num_bits = *b;
+            }
+            else if (auto value = flag_value(arg, "--lsh-bucket")) {
+                const auto n = parse_number<std::size_t>(*value);
+                if (!n || *n == 0) {
+                    logger::post<logger::error>("Invalid bucket size ", *value);
+                    return std::nullopt;
+                }
+                opts.lsh.max_bucket_size = *n;
+            }
+            else if (auto value = flag_value(arg, "--project")) {
+                const auto k = parse_number<std::size_t>(*value);
+                if (!k || *k == 0) {
+                    logger::post<logger::error>("Invalid projection dimension ", *value);
+                    return std::nullopt;
+                }
+                opts.projection_dim = *k;
+                opts.forced.projection = true;
+            }
+            else if (auto value = flag_value(arg, "--checkpoint")) {
+                opts.checkpoint_file = std::filesystem::path{ *value };
+            }
+            else if (auto value = flag_value(arg, "--checkpoint-interval")) {
+                const auto seconds = parse_number<std::size_t>(*value);
+                if (!seconds || *seconds == 0) {
+                    logger::post<logger::error>("Invalid checkpoint interval ", *value);
+                    return std::nullopt;
+                }
+                opts.checkpoint_interval = std::chrono::seconds{ *seconds };
+            }
+            else if (arg == "--resume") {
+                opts.resume = true;
+            }
+            else if (auto value = flag_value(arg, "--shard")) {
+                const auto slash = value->find('/');
+                const auto index = parse_number<std::size_t>(value->substr(0, slash));
+                const auto count = slash == std::string_view::npos ? std::nullopt : parse_number<std::size_t>(value->substr(slash + 1));
+                if (!index || !count || *count == 0 || *index >= *count) {
+                    logger::post<logger::error>("Shard must be <i>/<n> with i < n, got ", *value);
+                    return std::nullopt;
+                }
+                opts.shard = std::pair{ *index, *count };
+            }
+            else if (arg == "--merge") {
+                opts.merge = true;
+            }
+            else if (auto value = flag_value(arg, "--batch")) {
+                opts.batch_file = std::filesystem::path{ *value };
+            }
+            else if (auto value = flag_value(arg, "--time-budget")) {
+                const auto seconds = parse_number<double>(*value);
+                if (!seconds || *seconds <= 0.0) {
+                    logger::post<logger::error>("Invalid time budget ", *value);
+                    return std::nullopt;
+                }
+                opts.time_budget = std::chrono::duration<double>{ *seconds };
+            }
+            else if (auto value = flag_value(arg, "--progress")) {
+                const auto seconds = parse_number<std::size_t>(*value);
+                if (!seconds || *seconds == 0) {
+                    logger::post<logger::error>("Invalid progress interval ", *value);
+                    return std::nullopt;
+                }
+                opts.progress_interval = std::chrono::seconds{ *seconds };
+            }
+            else if (auto value = flag_value(arg, "--progress-file")) {
+                opts.progress_file = std::filesystem::path{ *value };
+            }
+            else if (auto value = flag_value(arg, "--metrics-file")) {
+                opts.metrics_file = std::filesystem::path{ *value };
+            }
+            else if (auto value = flag_value(arg, "--metrics-interval")) {
+                const auto seconds = parse_number<std::size_t>(*value);
+                if (!seconds || *seconds == 0) {
+                    logger::post<logger::error>("Invalid metrics interval ", *value);
+                    return std::nullopt;
+                }
+                opts.metrics_interval = std::chrono::seconds{ *seconds };
+            }
+            else if (arg == "--partial-output") {
+                opts.partial_output = true;
+            }
+            else if (auto value = flag_value(arg, "--slow-files")) {
+                const auto n = parse_number<std::size_t>(*value);
+                if (!n) {
+                    logger::post<logger::error>("Invalid slow file count ", *value);
+                    return std::nullopt;
+                }
+                opts.slow_files = *n;
+            }
+            else if (auto value = flag_value(arg, "--shutdown-grace")) {
+                const auto seconds = parse_number<std::size_t>(*value);
+                if (!seconds) {
+                    logger::post<logger::error>("Invalid shutdown grace ", *value);
+                    return std::nullopt;
+                }
+                opts.shutdown_grace = std::chrono::seconds{ *seconds };
+            }
+            else if (auto value = flag_value(arg, "--plan")) {
+                if (*value == "auto") {
+                    opts.plan = true;
+                }
+                else if (*value == "off") {
+                    opts.plan = false;
+                }
+                else {
+                    logger::post<logger::error>("Unrecognised plan mode ", *value);
+                    return std::nullopt;
+                }
+            }
+            else if (auto value = flag_value(arg, "--kernels")) {
+                if (*value != "auto") {
+                    opts.kernels = kernel::parse_instruction_set(*value);
+                    if (!opts.kernels) {
+                        logger::post<logger::error>("Unrecognised instruction set ", *value);
+                        return std::nullopt;
+                    }
+                }
+            }
+            else if (auto value = flag_value(arg, "--tune")) {
+                opts.tune_file = std::filesystem::path{ *value };
+            }
+            else if (auto value = flag_value(arg, "--cache")) {
+                opts.cache_file = std::filesystem::path{ *value };
+            }
+            else if (auto value = flag_value(arg, "--colour-space")) {
+                if (*value == "bgr") {
+                    opts.ingest.colour = colour_space::bgr;
+                }
+                else if (*value == "ycbcr") {
+                    opts.ingest.colour = colour_space::ycbcr;
+                }
+                else {
+                    logger::post<logger::error>("Unrecognised colour space ", *value);
+                    return std::nullopt;
+                }
+            }
+            else if (auto value = flag_value(arg, "--exif-thumbnail")) {
+                const auto min_side = parse_number<std::size_t>(*value);
+                if (!min_side || *min_side == 0 || *min_side > 65535) {
+                    logger::post<logger::error>("Invalid thumbnail size ", *value);
+                    return std::nullopt;
+                }
+                opts.ingest.exif_thumbnail = *min_side;
+            }
+            else if (auto value = flag_value(arg, "--target-resolution")) {
+                const auto min_side = parse_number<std::size_t>(*value);
+                if (!min_side || *min_side == 0 || *min_side > 65535) {
+                    logger::post<logger::error>("Invalid target resolution ", *value);
+                    return std::nullopt;
+                }
+                opts.ingest.target_resolution = *min_side;
+            }
+            else if (auto value = flag_value(arg, "--stream-above")) {
+                const auto megapixels = parse_number<std::size_t>(*value);
+                if (!megapixels || *megapixels > 65535) {
+                    logger::post<logger::error>("Invalid streaming threshold ", *value);
+                    return std::nullopt;
+                }
+                opts.ingest.stream_pixels = *megapixels * 1'000'000;
+            }
+            else if (auto value = flag_value(arg, "--read-order")) {
+                if (*value == "listed") {
+                    opts.file_order = read_order::listed;
+                }
+                else if (*value == "inode") {
+                    opts.file_order = read_order::inode;
+                }
+                else if (*value == "extent") {
+                    opts.file_order = read_order::extent;
+                }
+                else {
+                    logger::post<logger::error>("Unrecognised read order ", *value);
+                    return std::nullopt;
+                }
+            }
+            else if (arg == "--jpeg-dc") {
+                opts.ingest.jpeg_dc = true;
+            }
+            else if (arg == "--benchmark-metrics") {
+                opts.benchmark_metrics = true;
+            }
+            else if (arg == "--benchmark-decode") {
+                opts.benchmark_decode = true;
+            }
+            else if (arg.substr(0, 2) == "--") {
+                logger::post<logger::error>("Unrecognised option ", arg);
+                return std::nullopt;
+            }
+            else {
+                positional.push_back(arg);
             }
-            m_parent[child] = true;
-#endif
-            m_adjacency_list[parent].emplace_back(child);
-            ++m_num_edges;
-            return true;
         }
 
-#ifndef NDEBUG
-        bool contains(std::size_t node) const {
-            return node == 0 || m_parent[node];
+        if (opts.shard && opts.merge) {
+            logger::post<logger::error>("--shard and --merge are separate steps");
+            return std::nullopt;
         }
-#endif
 
-        auto &children(std::size_t node) const {
-            RUNTIME_ASSERT(node < m_adjacency_list.size());
-            return m_adjacency_list[node];
+        const bool benchmark = opts.benchmark_metrics || opts.benchmark_decode;
+        if ((opts.shard || opts.merge) && (benchmark || opts.checkpoint_file || opts.cache_file)) {
+            logger::post<logger::error>("--shard and --merge do not combine with benchmarks, --checkpoint or --cache");
+            return std::nullopt;
         }
 
-        std::size_t num_edges() const noexcept {
-            return m_num_edges;
+        if (opts.time_budget && (opts.shard || opts.merge || opts.checkpoint_file)) {
+            logger::post<logger::error>("--time-budget does not combine with --shard, --merge or --checkpoint");
+            return std::nullopt;
         }
-    };
-
-    cv::Mat calculate_histogram(const std::filesystem::path &filename) {
-        try {
-            cv::Mat img = cv::imread(filename.string());
-            if (img.empty()) {
-                logger::post<logger::warning>("Failed to load ", filename);
-                return {};
-            }
 
-            cv::Mat hist;
-
-            int bbins = 32, gbins = 32, rbins = 32;
-            int histSize[] = { bbins, gbins, rbins };
-
-            float branges[] = { 0, 256 };
-            float granges[] = { 0, 256 };
-            float tranges[] = { 0, 256 };
-
-            const float* ranges[] = { branges, granges, tranges };
-            int channels[] = { 0, 1, 2 };
-
-            cv::calcHist(&img, 1, channels, cv::Mat(), hist, 3, histSize, ranges, true, false);
-
-            return hist;
+        if (opts.batch_file && (benchmark || opts.shard || opts.merge || opts.checkpoint_file || opts.cache_file || opts.tune_file)) {
+            logger::post<logger::error>("--batch does not combine with benchmarks, --shard, --merge, --checkpoint, --cache or --tune");
+            return std::nullopt;
         }
-        catch (...) {
-            logger::post<logger::error>("Failed to calculate histogram for ", filename);
-        }
-
-        return {};
-    }
-
-    double compute_histogram_diff(const histogram &lhs, const histogram &rhs) {
-        return cv::compareHist(lhs.mat, rhs.mat, cv::HISTCMP_BHATTACHARYYA);
-        //return cv::compareHist(lhs.mat, rhs.mat, cv::HISTCMP_HELLINGER);
-        //return cv::compareHist(lhs.mat, rhs.mat, cv::HISTCMP_KL_DIV);
-    }
 
-    template <typename T>
-    tree compute_mst(std::size_t size, const triangular_table<T> &weights) {
-        RUNTIME_ASSERT(size >= 2);
-        tree t{ size };
-
-        struct pq_entry {
-            std::size_t source;
-            std::size_t destination;
-            T cost = std::numeric_limits<T>::max();
-        };
-
-        std::vector<pq_entry> candidates(size);
-        for (std::size_t i = 0; i < size; ++i) {
-            candidates[i].destination = i;
+        if (opts.batch_file && (opts.progress_interval || opts.progress_file)) {
+            logger::post<logger::error>("--progress and --progress-file follow one sort and do not combine with --batch");
+            return std::nullopt;
         }
 
-        const pq_entry dummy_entry;
-        const auto final_num_edges = size - 1;
-        std::size_t just_inserted_index = 0;
-        std::size_t just_inserted = 0;
+        if (opts.batch_file ? !positional.empty() : opts.merge ? positional.size() < 3 : positional.size() != (benchmark ? 1 : 2)) {
+            return std::nullopt;
+        }
 
-        while (t.num_edges() < final_num_edges) {
-            std::swap(candidates[just_inserted_index], candidates[candidates.size() - 1]);
-            candidates.pop_back();
+        if (opts.projection_dim > 0 && !get_metric_functions(opts.metric).is_euclidean) {
+            logger::post<logger::error>("--project needs a Euclidean metric (bhattacharyya or l2), ",
+                                        get_metric_functions(opts.metric).name, " is not");
+            return std::nullopt;
+        }
 
-            const pq_entry* min_entry = &dummy_entry;
+        if (opts.checkpoint_file && opts.mst != mst_engine::dense) {
+            logger::post<logger::error>("--checkpoint only applies to --mst=dense");
+            return std::nullopt;
+        }
 
-            // Might be interesting to parallelise for large size
-            for (auto &curr_candidate : candidates) {
-                const auto cost_to_just_inserted = weights(just_inserted, curr_candidate.destination);
-                if (cost_to_just_inserted <= curr_candidate.cost) {
-                    curr_candidate.source = just_inserted;
-                    curr_candidate.cost = cost_to_just_inserted;
-                }
+        if (opts.resume && !opts.checkpoint_file) {
+            logger::post<logger::error>("--resume needs --checkpoint=<file>");
+            return std::nullopt;
+        }
 
-                if (cost_to_just_inserted <= min_entry->cost) {
-                    min_entry = &curr_candidate;
-                }
-            }
+        if (opts.mst == mst_engine::pivot && !get_metric_functions(opts.metric).is_metric) {
+            logger::post<logger::error>("--mst=pivot needs a metric that satisfies the triangle inequality, ",
+                                        get_metric_functions(opts.metric).name, " does not");
+            return std::nullopt;
+        }
 
-            bool insert_result = t.try_insert(min_entry->source, min_entry->destination);
-            RUNTIME_ASSERT(insert_result);
-            just_inserted_index = min_entry - candidates.data();
-            just_inserted = min_entry->destination;
+        if (opts.batch_file) {
+            return opts;
         }
 
-        return t;
+        opts.source_directory = std::filesystem::path{ positional[0] };
+        if (!benchmark) {
+            opts.output_directory = std::filesystem::path{ positional[1] };
+        }
+        if (opts.merge) {
+            opts.shard_files.assign(positional.begin() + 2, positional.end());
+        }
+        return opts;
     }
 
-    std::optional<std::vector<std::size_t>> pre_order(const tree &mst) {
-        std::vector<std::size_t> order;
-        order.reserve(mst.num_edges() + 1);
-
-        std::stack<std::size_t, std::vector<std::size_t>> stack;
-        stack.push(0);
-
-        while (!stack.empty()) {
-            std::size_t curr_node = stack.top();
-            stack.pop();
+#if !defined(_WIN32)
+    // Written to by the signal handler to wake the shutdown watchdog. write is async-signal-safe, unlike any way
+    // of notifying a condition variable.
+    int interrupt_pipe[2]{ -1, -1 };
+#endif
 
-            order.push_back(curr_node);
+    // The first interrupt asks the sort to stop and keep what it has, a second one ends the process at once
+    void on_interrupt(int) {
+        if (cancellation::requested()) std::_Exit(cancelled_status);
+        cancellation::request();
+#if !defined(_WIN32)
+        const int saved_errno = errno;
+        [[maybe_unused]] const auto written = ::write(interrupt_pipe[1], "", 1);
+        errno = saved_errno;
+#endif
+    }
 
-            for (std::size_t child : boost::adaptors::reverse(mst.children(curr_node))) {
-                stack.push(child);
+    // Blocks until the first interrupt. Windows signal handlers have nothing to wake a thread with, so it polls
+    // there, as it does should the pipe be unusable.
+    void wait_for_interrupt() {
+#if !defined(_WIN32)
+        if (interrupt_pipe[0] >= 0) {
+            char byte;
+            while (!cancellation::requested()) {
+                if (::read(interrupt_pipe[0], &byte, 1) < 0 && errno != EINTR) break;
             }
         }
+#endif
+        while (!cancellation::requested()) std::this_thread::sleep_for(std::chrono::milliseconds{ 100 });
+    }
 
-        RUNTIME_ASSERT(order.size() == (mst.num_edges() + 1));
-        return order;
+    // Ends the process once an interrupted sort has had grace to save its progress, however far it got
+    void start_shutdown_watchdog(std::chrono::seconds grace) {
+#if !defined(_WIN32)
+        // An interrupt before this only sets the flag, which the watchdog checks before it first reads
+        if (::pipe(interrupt_pipe) != 0) interrupt_pipe[0] = interrupt_pipe[1] = -1;
+#endif
+        std::thread{ [grace]() {
+            wait_for_interrupt();
+
+            logger::post<logger::warning>("Interrupted, saving progress for up to ", grace.count(), "s. Interrupt again to exit now");
+            std::this_thread::sleep_for(grace);
+            logger::post<logger::fatal>("Still saving after ", grace.count(), "s, exiting");
+            std::_Exit(cancelled_status);
+        } }.detach();
     }
 }
 
 int main(int argc, const char** argv) {
     using logger = img_sort::logger;
 
-    if (argc != 3) {
-        logger::post<logger::error>("Usage: img_sort <source directory> <output directory>");
+    auto opts = img_sort::parse_options(argc, argv);
+    if (!opts) {
+        img_sort::print_usage();
         return -1;
     }
 
-    const auto source_directory = std::filesystem::path{ argv[1] };
-    const auto output_directory = std::filesystem::path{ argv[2] };
-    if (std::filesystem::equivalent(source_directory, output_directory)) {
-        logger::post<logger::error>("Source and destination directories and equivalent!");
+    if (opts->kernels && !img_sort::kernel::select(*opts->kernels)) {
+        logger::post<logger::error>("This CPU cannot run ", img_sort::kernel::name(*opts->kernels), " kernels");
         return -1;
     }
 
-    //
-    // listdir
-    //
-
-    if (!std::filesystem::is_directory(source_directory)) {
-        logger::post<logger::error>(source_directory, " is not a directory");
-        return -1;
-    }
-
-    logger::post<logger::info>("Searching for images in ", source_directory, "...");
-
-    std::vector<std::filesystem::path> filenames;
-    {
-        auto is_recognised_img_extension = [](const auto &entry) {
-            const auto ext = entry.path().extension().string();
-            return ext == ".png" || ext == ".jpg" || ext == ".jpeg" || ext == ".jfif";
-        };
-
-        const auto range_of_img_files =
-            boost::make_iterator_range( std::filesystem::directory_iterator{ source_directory,
-                                                                             std::filesystem::directory_options::follow_directory_symlink },
-                                        std::filesystem::directory_iterator{} )
-            | boost::adaptors::filtered(is_recognised_img_extension)
-            | boost::adaptors::filtered([](const auto &entry) { return entry.is_regular_file() || entry.is_symlink(); })
-            | boost::adaptors::transformed([](const auto &entry) { return entry.path(); });
-
-        filenames.assign(range_of_img_files.begin(), range_of_img_files.end());
-    }
-
-    if (filenames.empty()) {
-        logger::post<logger::info>(source_directory, " is empty. Nothing to do");
-        return 0;
-    }
-
-    //
-    // Read images from disk and compute histograms
-    //
-
-    logger::post<logger::info>("Found ", filenames.size(), " images. Computing histograms...");
+    std::signal(SIGINT, img_sort::on_interrupt);
+    std::signal(SIGTERM, img_sort::on_interrupt);
+    img_sort::start_shutdown_watchdog(opts->shutdown_grace);
 
-    std::vector<img_sort::histogram> histograms(filenames.size());
-    {
-        logger::benchmark([&]() {
-            std::transform(img_sort::execution_policy, filenames.begin(), filenames.end(), histograms.begin(),
-                [](const auto &f) { return img_sort::histogram{ img_sort::calculate_histogram(f), f }; });
-        });
-
-        auto new_end = std::partition(histograms.begin(), histograms.end(), [](const auto &h) { return !h.mat.empty(); });
-        histograms.erase(new_end, histograms.end());
+    std::optional<img_sort::metrics_exporter> exporter;
+    if (opts->metrics_file) {
+        exporter.emplace(*opts->metrics_file, opts->metrics_interval);
     }
 
-    if (histograms.empty()) {
-        logger::post<logger::warning>("No histograms were computed");
-        return -1;
+    std::optional<img_sort::progress_reporter> reporter;
+    if (opts->progress_interval || opts->progress_file) {
+        reporter.emplace(opts->progress_interval.value_or(std::chrono::seconds{ 5 }), opts->progress_interval.has_value(), opts->progress_file);
     }
-    else if (histograms.size() == 1) {
-        logger::post<logger::info>("Only one image loaded. Nothing to do");
-        return 0;
-    }
-
-    //
-    // Calculate differences
-    //
-
-    logger::post<logger::info>("Computed ", histograms.size(), " histograms. Calculating differences...");
 
-    img_sort::triangular_table<double> diff_table{ histograms.size() };
-    {
-        auto compute_diff = [&](auto kvp) {
-            auto [coord, res] = kvp;
-            auto [x, y] = coord;
+    if (opts->batch_file) {
+        std::ifstream file{ *opts->batch_file };
+        if (!file) {
+            logger::post<logger::error>("Cannot read batch list ", *opts->batch_file);
+            return -1;
+        }
 
-            RUNTIME_ASSERT(x != y);
-            res = img_sort::compute_histogram_diff(histograms[x], histograms[y]);
-        };
+        const auto jobs = img_sort::parse_batch_list(file);
+        if (!jobs) return -1;
 
-        logger::benchmark([&]() { std::for_each(img_sort::execution_policy, diff_table.begin(), diff_table.end(), compute_diff); });
-        // Reduce memory footprint
-        std::for_each(img_sort::execution_policy, histograms.begin(), histograms.end(), [](auto &h) { h.clear(); });
+        img_sort::batch_runner runner;
+        const auto results = runner.run(*jobs, *opts);
+        if (img_sort::cancellation::requested()) return img_sort::cancelled_status;
+        return std::all_of(results.begin(), results.end(), [](const auto &r) { return r.status == 0; }) ? 0 : -1;
     }
 
-    //
-    // Create MST
-    //
-
-    logger::post<logger::info>("Computing MST...");
-    const img_sort::tree mst = logger::benchmark([&]() { return img_sort::compute_mst(histograms.size(), diff_table); });
-
-    // Reduce memory footprint
-    diff_table.clear();
-
-    //
-    // Perform traversal
-    //
-
-    logger::post<logger::info>("Generating sort order...");
-    const auto sort_order_opt = logger::benchmark([&]() { return img_sort::pre_order(mst); });
-    if (!sort_order_opt) return -1;
-
-    //
-    // Create symlinks in output directory
-    //
-
-    logger::post<logger::info>("Populating output directory ", output_directory, "...");
-    std::filesystem::create_directories(output_directory);
-
-    std::size_t idx = 0;
-    for (std::size_t entry : *sort_order_opt) {
-        const auto src_path = histograms[entry].filename;
-
-        std::filesystem::path dest_name = (boost::format{ "%05zu." } % idx++).str();
-        dest_name += src_path.filename();
-        
-        std::filesystem::create_hard_link(src_path, output_directory / dest_name);
-    }
-}
\ No newline at end of file
+    img_sort::sorter sorter;
+    const int status = sorter.run(std::move(*opts));
+    img_sort::run_metrics::job_done(status == 0);
+    return status;
+}
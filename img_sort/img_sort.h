@@ -1,7 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <execution>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 #include "boost/range/irange.hpp"
@@ -24,6 +29,10 @@ namespace img_sort {
 
         template <type T, typename... S>
         static void post(const S&... msg) {
+            if constexpr (T == info || T == profile) {
+                if (quiet_flag().load(std::memory_order_relaxed)) return;
+            }
+
             constexpr auto prefix = type_string<T>();
             static std::mutex mtx;
             std::lock_guard lock{ mtx };
@@ -66,7 +75,17 @@ namespace img_sort {
             return std::forward<Func>(func)();
         }
 
+        // Drops info and timing messages while set, for runs that report on their own. Warnings and errors still show.
+        static void set_quiet(bool quiet) noexcept {
+            quiet_flag().store(quiet, std::memory_order_relaxed);
+        }
+
     private:
+        static std::atomic<bool> &quiet_flag() noexcept {
+            static std::atomic<bool> flag{ false };
+            return flag;
+        }
+
         template <type T>
         static constexpr std::string_view type_string() {
             if constexpr (T == type::info) {
@@ -90,15 +109,128 @@ namespace img_sort {
         }
     };
 
+    // Cooperative cancellation of the sorts in this process. Long stages check it between items of work and
+    // stop early, leaving what they finished for the caller to save. request() may be called from a signal handler.
+    class cancellation {
+    public:
+        static bool requested() noexcept {
+            return flag().load(std::memory_order_relaxed);
+        }
+
+        static void request() noexcept {
+            flag().store(true, std::memory_order_relaxed);
+        }
+
+        static void reset() noexcept {
+            flag().store(false, std::memory_order_relaxed);
+        }
+
+    private:
+        static std::atomic<bool> &flag() noexcept {
+            static std::atomic<bool> flag{ false };
+            return flag;
+        }
+    };
+
+    // Splits the rows of a triangular table of width n into blocks holding about the same number of entries.
+    // Row y holds y entries, and the entries of consecutive rows are contiguous, so every block is one
+    // contiguous range of the table.
+    class row_blocks {
+        std::vector<std::size_t> m_bounds;
+
+    public:
+        row_blocks(std::size_t n, std::size_t num_blocks) {
+            RUNTIME_ASSERT(num_blocks > 0);
+            const auto total = n * (n - std::min<std::size_t>(n, 1)) / 2;
+
+            m_bounds.push_back(0);
+            std::size_t entries = 0;
+            for (std::size_t y = 0; y < n; ++y) {
+                entries += y;
+                if (entries * num_blocks >= total * m_bounds.size()) {
+                    m_bounds.push_back(y + 1);
+                }
+            }
+
+            if (m_bounds.back() != n) m_bounds.push_back(n);
+        }
+
+        // One block per few threads' worth of work, so that uneven progress still balances out
+        static std::size_t default_count() {
+            return 4 * std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        std::size_t size() const noexcept {
+            return m_bounds.size() - 1;
+        }
+
+        // Rows [first, second)
+        std::pair<std::size_t, std::size_t> rows(std::size_t block) const {
+            RUNTIME_ASSERT(block < size());
+            return { m_bounds[block], m_bounds[block + 1] };
+        }
+    };
+
+    // Default table storage: a std::vector, initialised by the calling thread
     template <typename T>
-    class triangular_table {
+    class vector_storage {
         std::vector<T> m_data;
+
+    public:
+        static constexpr bool parallel_first_touch = false;
+
+        vector_storage(std::size_t size, const T &val)
+            :m_data(size, val)
+        {}
+
+        T *data() noexcept { return m_data.data(); }
+        const T *data() const noexcept { return m_data.data(); }
+
+        void clear() {
+            m_data.clear();
+        }
+    };
+
+    // Storage owned elsewhere, such as a mapped file. The table neither initialises nor frees it.
+    template <typename T>
+    class view_storage {
+        T *m_data = nullptr;
+
+    public:
+        static constexpr bool parallel_first_touch = false;
+
+        explicit view_storage(T *data) noexcept
+            :m_data{ data }
+        {}
+
+        T *data() noexcept { return m_data; }
+        const T *data() const noexcept { return m_data; }
+
+        void clear() noexcept {
+            m_data = nullptr;
+        }
+    };
+
+    template <typename T, typename Storage = vector_storage<T>>
+    class triangular_table {
+        Storage m_storage;
+        row_blocks m_blocks;
         std::size_t m_width;
 
         static constexpr std::size_t nth_triangular(std::size_t n) noexcept {
             return n * (n + 1) / 2;
         }
 
+        static Storage make_storage(std::size_t n, const T &val) {
+            RUNTIME_ASSERT(n > 0);
+            if constexpr (Storage::parallel_first_touch) {
+                return Storage{ nth_triangular(n) - n };
+            }
+            else {
+                return Storage{ nth_triangular(n) - n, val };
+            }
+        }
+
     public:
         using coordinate = std::pair<std::size_t, std::size_t>;
 
@@ -125,7 +257,7 @@ namespace img_sort {
 
             reference operator*() const {
                 RUNTIME_ASSERT(m_y < m_table->m_width);
-                return { std::pair{ m_x, m_y }, m_table->m_data[m_prev_triangular + m_x] };
+                return { std::pair{ m_x, m_y }, m_table->m_storage.data()[m_prev_triangular + m_x] };
             }
 
             iterator &operator++() {
@@ -168,13 +300,35 @@ namespace img_sort {
             }
         };
 
-        triangular_table(std::size_t n, const T& val = T())
-            :m_data( nth_triangular(n) - n, val ),
+        triangular_table(std::size_t n, const T& val = T(), std::size_t num_blocks = row_blocks::default_count())
+            :m_storage{ make_storage(n, val) },
+            m_blocks{ n, num_blocks },
             m_width{ n }
         {
             RUNTIME_ASSERT(n > 0);
+
+            // Each block's pages are first written, and so placed, by the worker that fills the block
+            if constexpr (Storage::parallel_first_touch) {
+                const auto range = boost::irange<std::size_t>(0, m_blocks.size());
+                std::for_each(std::execution::par, range.begin(), range.end(), [&](std::size_t block) {
+                    const auto [first, last] = m_blocks.rows(block);
+                    std::uninitialized_fill(row_data(first), row_data(first) + (nth_triangular(last) - last) - (nth_triangular(first) - first), val);
+                });
+            }
         }
 
+        // Adopts storage with its contents as they are
+        triangular_table(std::size_t n, Storage storage, std::size_t num_blocks)
+            :m_storage{ std::move(storage) },
+            m_blocks{ n, num_blocks },
+            m_width{ n }
+        {
+            RUNTIME_ASSERT(n > 0);
+        }
+
+        const row_blocks &blocks() const noexcept { return m_blocks; }
+        const Storage &storage() const noexcept { return m_storage; }
+
         auto begin() { return iterator{ *this }; }
         auto end() { return iterator{}; }
 
@@ -184,7 +338,13 @@ namespace img_sort {
 
             if (y < x) std::swap(x, y);
             // y > x >= 0
-            return m_data[nth_triangular(y - 1) + x];
+            return m_storage.data()[nth_triangular(y - 1) + x];
+        }
+
+        // Entries (x, y) for x in [0, y), contiguous
+        T *row_data(std::size_t y) {
+            RUNTIME_ASSERT(y < m_width);
+            return m_storage.data() + (y == 0 ? 0 : nth_triangular(y - 1));
         }
 
         auto row(std::size_t y) const {
@@ -199,7 +359,7 @@ namespace img_sort {
         }
 
         void clear() {
-            m_data.clear();
+            m_storage.clear();
             m_width = 0;
         }
     };
@@ -0,0 +1,421 @@
+#pragma once
+
+#include "img_sort.h"
+#include "colour.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <vector>
+
+#if __has_include(<jpeglib.h>)
+#define IMG_SORT_HAS_LIBJPEG
+#include <csetjmp>
+#include <jpeglib.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "jpeg")
+#endif
+#endif
+
+namespace img_sort {
+
+#if defined(IMG_SORT_HAS_LIBJPEG)
+
+    namespace detail {
+        // libjpeg reports errors by calling error_exit, which must not return. This one jumps back to the
+        // decoder, which then cleans up and falls back, instead of the default exit().
+        struct jpeg_error : jpeg_error_mgr {
+            std::jmp_buf jump;
+        };
+
+        inline void jpeg_error_exit(j_common_ptr cinfo) {
+            std::longjmp(static_cast<jpeg_error *>(cinfo->err)->jump, 1);
+        }
+
+        inline void jpeg_silent(j_common_ptr, int) {}
+
+        // Owns a decompressor reading from a file, destroyed with it
+        class jpeg_reader {
+            std::FILE *m_file = nullptr;
+
+        public:
+            jpeg_decompress_struct cinfo{};
+            jpeg_error error{};
+
+            explicit jpeg_reader(const std::filesystem::path &path) {
+                cinfo.err = jpeg_std_error(&error);
+                error.error_exit = jpeg_error_exit;
+                error.emit_message = jpeg_silent;
+                jpeg_create_decompress(&cinfo);
+
+#if defined(_WIN32)
+                m_file = _wfopen(path.c_str(), L"rb");
+#else
+                m_file = std::fopen(path.c_str(), "rb");
+#endif
+                if (m_file) jpeg_stdio_src(&cinfo, m_file);
+            }
+
+            jpeg_reader(const jpeg_reader &) = delete;
+            jpeg_reader &operator=(const jpeg_reader &) = delete;
+
+            ~jpeg_reader() {
+                jpeg_destroy_decompress(&cinfo);
+                if (m_file) std::fclose(m_file);
+            }
+
+            bool is_open() const noexcept {
+                return m_file != nullptr;
+            }
+        };
+
+        // Output colour space to bin in: RGB, the file's own YCbCr, or grey for greyscale files
+        inline J_COLOR_SPACE output_colour_space(const jpeg_decompress_struct &cinfo, colour_space space) noexcept {
+            if (cinfo.jpeg_color_space == JCS_GRAYSCALE) return JCS_GRAYSCALE;
+            return space == colour_space::ycbcr ? JCS_YCbCr : JCS_RGB;
+        }
+
+        // Bins every remaining scanline of a started decompressor, reading one at a time into row
+        inline void bin_scanlines(jpeg_decompress_struct &cinfo, std::vector<JSAMPLE> &row, std::vector<float> &res, std::size_t bins, colour_space space) {
+            const bool grey = cinfo.out_color_space == JCS_GRAYSCALE;
+            row.resize(static_cast<std::size_t>(cinfo.output_width) * cinfo.output_components);
+            while (cinfo.output_scanline < cinfo.output_height) {
+                JSAMPROW rows[] = { row.data() };
+                if (jpeg_read_scanlines(&cinfo, rows, 1) == 0) break;
+
+                for (JDIMENSION x = 0; x < cinfo.output_width; ++x) {
+                    const JSAMPLE *p = &row[x * cinfo.output_components];
+                    if (grey) res[colour_bin(p[0], p[0], p[0], bins, space)] += 1.0f;
+                    else if (space == colour_space::ycbcr) res[ycbcr_bin(p[0], p[1], p[2], bins)] += 1.0f;
+                    else res[bgr_bin(p[2], p[1], p[0], bins)] += 1.0f;
+                }
+            }
+        }
+    }
+
+    // Colour histogram of a JPEG from the DC coefficient of every 8x8 block, which is the block's mean. Only
+    // entropy decoding runs: no IDCT, upsampling or colour conversion, and one colour per block instead of 64
+    // pixels. Each block counts for the pixels it covers, so the total matches a full decode. Chroma blocks
+    // are shared by the luma blocks they cover under subsampling.
+    //
+    // Returns an empty histogram (for a full decode instead) unless the file is a baseline or progressive
+    // JPEG in YCbCr or greyscale.
+    inline std::vector<float> jpeg_dc_histogram(const std::filesystem::path &path, std::size_t bins, colour_space space) {
+        detail::jpeg_reader reader{ path };
+        if (!reader.is_open()) return {};
+
+        auto &cinfo = reader.cinfo;
+        std::vector<float> res;
+
+        // Nothing with a non-trivial destructor may live between here and the longjmp target
+        if (setjmp(reader.error.jump)) {
+            return {};
+        }
+
+        jpeg_read_header(&cinfo, TRUE);
+        const bool colour = cinfo.jpeg_color_space == JCS_YCbCr && cinfo.num_components == 3;
+        const bool grey = cinfo.jpeg_color_space == JCS_GRAYSCALE && cinfo.num_components == 1;
+        if (!colour && !grey) {
+            jpeg_abort_decompress(&cinfo);
+            return {};
+        }
+
+        jvirt_barray_ptr *coefficients = jpeg_read_coefficients(&cinfo);
+        res.assign(bins * bins * bins, 0.0f);
+
+        const auto &luma = cinfo.comp_info[0];
+        const int luma_width = static_cast<int>((cinfo.image_width * luma.h_samp_factor + cinfo.max_h_samp_factor - 1) / cinfo.max_h_samp_factor);
+        const int luma_height = static_cast<int>((cinfo.image_height * luma.v_samp_factor + cinfo.max_v_samp_factor - 1) / cinfo.max_v_samp_factor);
+        const double pixels_per_luma = static_cast<double>(cinfo.max_h_samp_factor * cinfo.max_v_samp_factor) / (luma.h_samp_factor * luma.v_samp_factor);
+
+        // Dequantised DC is 8 times the block mean, level shifted by 128
+        double dc_scale[3];
+        for (int c = 0; c < cinfo.num_components; ++c) {
+            dc_scale[c] = cinfo.comp_info[c].quant_table->quantval[0] / 8.0;
+        }
+
+        for (JDIMENSION by = 0; by < luma.height_in_blocks; ++by) {
+            JBLOCKROW rows[3];
+            for (int c = 0; c < cinfo.num_components; ++c) {
+                const auto &comp = cinfo.comp_info[c];
+                const JDIMENSION row = std::min<JDIMENSION>(by * comp.v_samp_factor / luma.v_samp_factor, comp.height_in_blocks - 1);
+                rows[c] = (*cinfo.mem->access_virt_barray)(reinterpret_cast<j_common_ptr>(&cinfo), coefficients[c], row, 1, FALSE)[0];
+            }
+
+            const int block_height = std::min(8, luma_height - static_cast<int>(by) * 8);
+            for (JDIMENSION bx = 0; bx < luma.width_in_blocks; ++bx) {
+                const double y = rows[0][bx][0] * dc_scale[0] + 128.0;
+                auto mean = [&](int c) {
+                    const auto &comp = cinfo.comp_info[c];
+                    const JDIMENSION col = std::min<JDIMENSION>(bx * comp.h_samp_factor / luma.h_samp_factor, comp.width_in_blocks - 1);
+                    return rows[c][col][0] * dc_scale[c] + 128.0;
+                };
+                const double cb = colour ? mean(1) : 128.0;
+                const double cr = colour ? mean(2) : 128.0;
+
+                std::size_t bin;
+                if (space == colour_space::ycbcr) {
+                    const auto sample = [](double v) { return static_cast<int>(std::clamp(std::lround(v), 0l, 255l)); };
+                    bin = ycbcr_bin(sample(y), sample(cb), sample(cr), bins);
+                }
+                else {
+                    int r, g, b;
+                    ycbcr_to_rgb(y, cb, cr, r, g, b);
+                    bin = bgr_bin(b, g, r, bins);
+                }
+
+                const int block_width = std::min(8, luma_width - static_cast<int>(bx) * 8);
+                res[bin] += static_cast<float>(block_width * block_height * pixels_per_luma);
+            }
+        }
+
+        jpeg_finish_decompress(&cinfo);
+        return res;
+    }
+
+    // YCbCr histogram of a JPEG from libjpeg's raw planar output, before upsampling and colour conversion.
+    // Every pixel pairs its luma sample with the chroma samples that cover it, which stay at their subsampled
+    // resolution: a quarter of the chroma bytes of a BGR decode for 4:2:0.
+    //
+    // Returns an empty histogram (for a full decode instead) unless the file is a JPEG in YCbCr or greyscale.
+    inline std::vector<float> jpeg_ycbcr_histogram(const std::filesystem::path &path, std::size_t bins) {
+        detail::jpeg_reader reader{ path };
+        if (!reader.is_open()) return {};
+
+        auto &cinfo = reader.cinfo;
+        std::vector<float> res;
+        std::vector<JSAMPLE> planes[3];
+        std::vector<JSAMPROW> plane_rows[3];
+        std::vector<JDIMENSION> columns[3];
+
+        // Nothing with a non-trivial destructor may live between here and the longjmp target
+        if (setjmp(reader.error.jump)) {
+            return {};
+        }
+
+        jpeg_read_header(&cinfo, TRUE);
+        const bool colour = cinfo.jpeg_color_space == JCS_YCbCr && cinfo.num_components == 3;
+        const bool grey = cinfo.jpeg_color_space == JCS_GRAYSCALE && cinfo.num_components == 1;
+        if (!colour && !grey) {
+            jpeg_abort_decompress(&cinfo);
+            return {};
+        }
+
+        cinfo.raw_data_out = TRUE;
+        cinfo.do_fancy_upsampling = FALSE;
+        jpeg_start_decompress(&cinfo);
+
+        // jpeg_read_raw_data returns one iMCU row: v_samp_factor blocks of 8 rows per component
+        JSAMPARRAY arrays[3] = {};
+        for (int c = 0; c < cinfo.num_components; ++c) {
+            const auto &comp = cinfo.comp_info[c];
+            const std::size_t width = comp.width_in_blocks * DCTSIZE;
+            const std::size_t height = comp.v_samp_factor * DCTSIZE;
+
+            planes[c].resize(width * height);
+            plane_rows[c].resize(height);
+            for (std::size_t r = 0; r < height; ++r) {
+                plane_rows[c][r] = &planes[c][r * width];
+            }
+            arrays[c] = plane_rows[c].data();
+
+            columns[c].resize(cinfo.output_width);
+            for (JDIMENSION x = 0; x < cinfo.output_width; ++x) {
+                columns[c][x] = x * comp.h_samp_factor / cinfo.max_h_samp_factor;
+            }
+        }
+
+        res.assign(bins * bins * bins, 0.0f);
+        const JDIMENSION band = cinfo.max_v_samp_factor * DCTSIZE;
+        while (cinfo.output_scanline < cinfo.output_height) {
+            const JDIMENSION first = cinfo.output_scanline;
+            if (jpeg_read_raw_data(&cinfo, arrays, band) == 0) break;
+
+            auto row = [&](int c, JDIMENSION r) { return plane_rows[c][r * cinfo.comp_info[c].v_samp_factor / cinfo.max_v_samp_factor]; };
+            for (JDIMENSION r = 0; r < std::min(band, cinfo.output_height - first); ++r) {
+                const JSAMPLE *y = row(0, r);
+                if (colour) {
+                    const JSAMPLE *cb = row(1, r);
+                    const JSAMPLE *cr = row(2, r);
+                    for (JDIMENSION x = 0; x < cinfo.output_width; ++x) {
+                        res[ycbcr_bin(y[columns[0][x]], cb[columns[1][x]], cr[columns[2][x]], bins)] += 1.0f;
+                    }
+                }
+                else {
+                    for (JDIMENSION x = 0; x < cinfo.output_width; ++x) {
+                        res[ycbcr_bin(y[columns[0][x]], 128, 128, bins)] += 1.0f;
+                    }
+                }
+            }
+        }
+
+        jpeg_finish_decompress(&cinfo);
+        return res;
+    }
+
+    // Histogram of a JPEG decoded with the smallest DCT scale (1/8, 1/4 or 1/2) whose shorter side is still
+    // at least min_side pixels. A scale of 1/s only reads the s x s lowest frequencies of each block, so a
+    // progressive JPEG is decoded as soon as the scans received cover those, and the rest of the file is
+    // never read; at 1/8 that is after the DC scans. stopped_early reports whether that happened.
+    //
+    // Returns an empty histogram (for a full decode instead) if no scale is small enough, or unless the file
+    // is a JPEG in YCbCr or greyscale.
+    inline std::vector<float> jpeg_reduced_histogram(const std::filesystem::path &path, std::size_t bins, std::size_t min_side,
+                                                     colour_space space, bool &stopped_early) {
+        stopped_early = false;
+        detail::jpeg_reader reader{ path };
+        if (!reader.is_open()) return {};
+
+        auto &cinfo = reader.cinfo;
+        std::vector<float> res;
+        std::vector<JSAMPLE> row;
+
+        // Nothing with a non-trivial destructor may live between here and the longjmp target
+        if (setjmp(reader.error.jump)) {
+            return {};
+        }
+
+        jpeg_read_header(&cinfo, TRUE);
+        const bool colour = cinfo.jpeg_color_space == JCS_YCbCr && cinfo.num_components == 3;
+        const bool grey = cinfo.jpeg_color_space == JCS_GRAYSCALE && cinfo.num_components == 1;
+
+        // Largest of 8, 4 and 2 that keeps the shorter side at min_side, and the last zigzag index its IDCT reads
+        const std::size_t shorter = std::min(cinfo.image_width, cinfo.image_height);
+        unsigned int denom = 8;
+        while (denom > 1 && (shorter + denom - 1) / denom < min_side) denom /= 2;
+        if ((!colour && !grey) || denom == 1) {
+            jpeg_abort_decompress(&cinfo);
+            return {};
+        }
+        const int last_coefficient = denom == 8 ? 0 : denom == 4 ? 4 : 24;
+
+        cinfo.scale_num = 1;
+        cinfo.scale_denom = denom;
+        cinfo.out_color_space = detail::output_colour_space(cinfo, space);
+        cinfo.buffered_image = jpeg_has_multiple_scans(&cinfo);
+
+        // Smoothing makes up the missing frequencies of a partial image from neighbouring blocks, which blurs
+        // colours across blocks that a histogram would rather keep apart
+        cinfo.do_block_smoothing = FALSE;
+        jpeg_start_decompress(&cinfo);
+
+        if (cinfo.buffered_image) {
+            // coef_bits of a coefficient turns non-negative once a scan that codes it has started, and scans
+            // are only complete when the next one is about to start
+            auto covered = [&]() {
+                for (int c = 0; c < cinfo.num_components; ++c) {
+                    for (int k = 0; k <= last_coefficient; ++k) {
+                        if (cinfo.coef_bits[c][k] < 0) return false;
+                    }
+                }
+                return true;
+            };
+
+            for (;;) {
+                const int status = jpeg_consume_input(&cinfo);
+                if (status == JPEG_REACHED_EOI || status == JPEG_SUSPENDED) break;
+                if (status == JPEG_SCAN_COMPLETED && covered()) {
+                    stopped_early = true;
+                    break;
+                }
+            }
+            jpeg_start_output(&cinfo, cinfo.input_scan_number);
+        }
+
+        res.assign(bins * bins * bins, 0.0f);
+        detail::bin_scanlines(cinfo, row, res, bins, space);
+
+        // Scans not yet read are dropped with the decompressor
+        if (!cinfo.buffered_image) {
+            jpeg_finish_decompress(&cinfo);
+        }
+        return res;
+    }
+
+    // Histogram of a JPEG of at least min_pixels pixels, decoded a scanline at a time as cv::imread would decode
+    // it, so that memory stays at a few rows however tall the image is. Progressive JPEGs still hold every
+    // coefficient, as libjpeg needs them all before the first row.
+    //
+    // Returns an empty histogram unless the file is a JPEG in YCbCr or greyscale. Smaller images are decoded
+    // whole into image if given, from the same header read, and otherwise left to cv::imread.
+    inline std::vector<float> jpeg_streamed_histogram(const std::filesystem::path &path, std::size_t bins, std::size_t min_pixels, colour_space space,
+                                                      bgr_image *image = nullptr) {
+        detail::jpeg_reader reader{ path };
+        if (!reader.is_open()) return {};
+
+        auto &cinfo = reader.cinfo;
+        std::vector<float> res;
+        std::vector<JSAMPLE> row;
+
+        // Nothing with a non-trivial destructor may live between here and the longjmp target
+        if (setjmp(reader.error.jump)) {
+            if (image) image->pixels.clear();
+            return {};
+        }
+
+        jpeg_read_header(&cinfo, TRUE);
+        const bool colour = cinfo.jpeg_color_space == JCS_YCbCr && cinfo.num_components == 3;
+        const bool grey = cinfo.jpeg_color_space == JCS_GRAYSCALE && cinfo.num_components == 1;
+        const bool small = static_cast<std::size_t>(cinfo.image_width) * cinfo.image_height < min_pixels;
+        if ((!colour && !grey) || (small && !image)) {
+            jpeg_abort_decompress(&cinfo);
+            return {};
+        }
+
+        if (small) {
+            cinfo.out_color_space = grey ? JCS_GRAYSCALE : JCS_RGB;
+            jpeg_start_decompress(&cinfo);
+
+            image->width = cinfo.output_width;
+            image->height = cinfo.output_height;
+            image->pixels.resize(image->width * image->height * 3);
+            row.resize(cinfo.output_width);
+            while (cinfo.output_scanline < cinfo.output_height) {
+                std::uint8_t *out = image->pixels.data() + static_cast<std::size_t>(cinfo.output_scanline) * image->width * 3;
+                JSAMPROW rows[] = { grey ? row.data() : out };
+                if (jpeg_read_scanlines(&cinfo, rows, 1) == 0) break;
+
+                for (JDIMENSION x = 0; x < cinfo.output_width; ++x) {
+                    std::uint8_t *p = out + x * 3;
+                    if (grey) p[0] = p[1] = p[2] = row[x];
+                    else std::swap(p[0], p[2]);
+                }
+            }
+
+            jpeg_finish_decompress(&cinfo);
+            return {};
+        }
+
+        cinfo.out_color_space = detail::output_colour_space(cinfo, space);
+        jpeg_start_decompress(&cinfo);
+
+        res.assign(bins * bins * bins, 0.0f);
+        detail::bin_scanlines(cinfo, row, res, bins, space);
+
+        jpeg_finish_decompress(&cinfo);
+        return res;
+    }
+
+#else
+
+    inline std::vector<float> jpeg_dc_histogram(const std::filesystem::path &, std::size_t, colour_space) {
+        return {};
+    }
+
+    inline std::vector<float> jpeg_ycbcr_histogram(const std::filesystem::path &, std::size_t) {
+        return {};
+    }
+
+    inline std::vector<float> jpeg_reduced_histogram(const std::filesystem::path &, std::size_t, std::size_t, colour_space, bool &stopped_early) {
+        stopped_early = false;
+        return {};
+    }
+
+    inline std::vector<float> jpeg_streamed_histogram(const std::filesystem::path &, std::size_t, std::size_t, colour_space, bgr_image * = nullptr) {
+        return {};
+    }
+
+#endif
+
+}
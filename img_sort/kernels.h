@@ -0,0 +1,1116 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define IMG_SORT_KERNEL_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+// Compiles the functions up to the matching pop for the given target, whatever the flags of the translation
+// unit, so that one binary carries every variant. MSVC needs neither: its intrinsics are always available.
+#define IMG_SORT_PRAGMA(...) _Pragma(#__VA_ARGS__)
+#if defined(__clang__)
+#define IMG_SORT_PUSH_TARGET(isa) IMG_SORT_PRAGMA(clang attribute push(__attribute__((target(isa))), apply_to = function))
+#define IMG_SORT_POP_TARGET() IMG_SORT_PRAGMA(clang attribute pop)
+#elif defined(__GNUC__)
+#define IMG_SORT_PUSH_TARGET(isa) IMG_SORT_PRAGMA(GCC push_options) IMG_SORT_PRAGMA(GCC target(isa))
+#define IMG_SORT_POP_TARGET() IMG_SORT_PRAGMA(GCC pop_options)
+#else
+#define IMG_SORT_PUSH_TARGET(isa)
+#define IMG_SORT_POP_TARGET()
+#endif
+
+namespace img_sort {
+
+    // Hot loops over descriptors and Prim candidates, compiled once per instruction set and chosen at startup
+    // from what the CPU supports. Distance reductions accumulate in float lanes and return the horizontal sum,
+    // so variants agree to rounding; the histogram and relax kernels give the same results on every variant.
+    namespace kernel {
+
+        //
+        // Scalar
+        //
+
+        namespace scalar {
+            template <typename ScalarOp>
+            float reduce(const float *a, const float *b, std::size_t n, ScalarOp scalar_op) noexcept {
+                float res = 0.0f;
+                for (std::size_t i = 0; i < n; ++i) {
+                    res += scalar_op(a[i], b[i]);
+                }
+                return res;
+            }
+
+            inline float l1(const float *a, const float *b, std::size_t n) noexcept {
+                return reduce(a, b, n, [](float x, float y) { return std::abs(x - y); });
+            }
+
+            inline float l2_squared(const float *a, const float *b, std::size_t n) noexcept {
+                return reduce(a, b, n, [](float x, float y) { return (x - y) * (x - y); });
+            }
+
+            inline float min_sum(const float *a, const float *b, std::size_t n) noexcept {
+                return reduce(a, b, n, [](float x, float y) { return std::min(x, y); });
+            }
+
+            // sum (a - b)^2 / (a + b), skipping bins that are empty in both
+            inline float chi_square(const float *a, const float *b, std::size_t n) noexcept {
+                return reduce(a, b, n, [](float x, float y) { return x + y > 0.0f ? (x - y) * (x - y) / (x + y) : 0.0f; });
+            }
+
+            inline double sum(const float *in, std::size_t n) noexcept {
+                double res = 0.0;
+                for (std::size_t i = 0; i < n; ++i) {
+                    res += in[i];
+                }
+                return res;
+            }
+
+            inline void scale(const float *in, std::size_t n, double factor, float *out) noexcept {
+                for (std::size_t i = 0; i < n; ++i) {
+                    out[i] = static_cast<float>(in[i] * factor);
+                }
+            }
+
+            inline void sqrt(float *inout, std::size_t n) noexcept {
+                for (std::size_t i = 0; i < n; ++i) {
+                    inout[i] = std::sqrt(inout[i]);
+                }
+            }
+
+            // Last index of the lowest cost, the candidate Prim takes next
+            template <typename T>
+            std::size_t last_min_index(const T *cost, std::size_t n, T min) noexcept {
+                std::size_t i = n;
+                while (i > 1 && cost[i - 1] != min) --i;
+                return i - 1;
+            }
+
+            // Prim's relax step over n candidates: lowers cost[i] to weight[i] wherever that is no higher,
+            // setting source[i] to from, and returns the last index of the lowest cost
+            template <typename T>
+            std::size_t relax(const T *weight, T *cost, std::uint64_t *source, std::size_t n, std::uint64_t from) noexcept {
+                std::size_t res = 0;
+                for (std::size_t i = 0; i < n; ++i) {
+                    if (weight[i] <= cost[i]) {
+                        cost[i] = weight[i];
+                        source[i] = from;
+                    }
+                    if (cost[i] <= cost[res]) {
+                        res = i;
+                    }
+                }
+                return res;
+            }
+
+            inline std::size_t tie_words(std::size_t n) noexcept {
+                return (n + 63) / 64;
+            }
+
+            inline unsigned lowest_bit(std::uint64_t bits) noexcept {
+#if defined(_MSC_VER) && !defined(__clang__)
+                unsigned long res;
+                _BitScanForward64(&res, bits);
+                return static_cast<unsigned>(res);
+#else
+                return static_cast<unsigned>(__builtin_ctzll(bits));
+#endif
+            }
+
+            // Sets source[first + k] to from for every bit k of lower
+            inline void set_sources(std::uint64_t *source, std::size_t first, std::uint64_t lower, std::uint64_t from) noexcept {
+                for (; lower != 0; lower &= lower - 1) {
+                    source[first + lowest_bit(lower)] = from;
+                }
+            }
+
+            // Merges per-lane minimums into the lowest cost and how many candidates have it. Bit k of repeated is
+            // set if lane k met its minimum more than once.
+            template <typename T>
+            void merge_lanes(const T *lane_min, std::size_t num_lanes, std::uint64_t repeated, T &min, std::size_t &num_min) noexcept {
+                for (std::size_t k = 0; k < num_lanes; ++k) {
+                    const std::size_t count = 1 + ((repeated >> k) & 1);
+                    if (num_min == 0 || lane_min[k] < min) {
+                        min = lane_min[k];
+                        num_min = count;
+                    }
+                    else if (lane_min[k] == min) {
+                        num_min += count;
+                    }
+                }
+            }
+
+            // Last candidate at the lowest cost after a relax step, and whether others have that cost too
+            struct relax_result {
+                std::size_t index = 0;
+                bool shared = false;
+            };
+
+            // relax_ties from candidate first on, given the lowest cost before it and how many candidates have it
+            template <typename T>
+            relax_result relax_ties_tail(const T *weight, T *cost, std::uint64_t *source, std::uint64_t *tied, std::size_t first,
+                                         std::size_t n, std::uint64_t from, T min, std::size_t num_min) noexcept {
+                for (std::size_t i = first; i < n; ++i) {
+                    if (weight[i] < cost[i]) {
+                        cost[i] = weight[i];
+                        source[i] = from;
+                    }
+                    else if (weight[i] == cost[i]) {
+                        tied[i / 64] |= std::uint64_t{ 1 } << (i % 64);
+                    }
+
+                    if (num_min == 0 || cost[i] < min) {
+                        min = cost[i];
+                        num_min = 1;
+                    }
+                    else if (cost[i] == min) {
+                        ++num_min;
+                    }
+                }
+                return { last_min_index(cost, n, min), num_min > 1 };
+            }
+
+            // Prim's relax step over quantised costs, where ties are common and matter: lowers cost[i] to weight[i]
+            // wherever that is lower, setting source[i] to from, and sets bit i of tied (tie_words(n) words, all
+            // written) wherever the two are equal, so that from is another source at that cost
+            template <typename T>
+            relax_result relax_ties(const T *weight, T *cost, std::uint64_t *source, std::uint64_t *tied, std::size_t n, std::uint64_t from) noexcept {
+                std::fill(tied, tied + tie_words(n), 0);
+                return relax_ties_tail(weight, cost, source, tied, 0, n, from, T{}, 0);
+            }
+
+            // Sums of 16 byte lookup tables, one per subspace, over the 16 vectors of a block of product quantiser
+            // codes. Codes hold 8 bytes per subspace: vector j in the low nibble of byte j, vector j + 8 in the high.
+            inline void pq_scan(const std::uint8_t *tables, const std::uint8_t *codes, std::size_t num_subspaces, std::uint16_t *out) noexcept {
+                std::fill_n(out, 16, std::uint16_t{ 0 });
+                for (std::size_t m = 0; m < num_subspaces; ++m) {
+                    const std::uint8_t *table = tables + m * 16;
+                    const std::uint8_t *packed = codes + m * 8;
+                    for (std::size_t lane = 0; lane < 16; ++lane) {
+                        const auto k = lane < 8 ? packed[lane] & 0x0F : packed[lane - 8] >> 4;
+                        out[lane] = static_cast<std::uint16_t>(out[lane] + table[k]);
+                    }
+                }
+            }
+        }
+
+#if defined(IMG_SORT_KERNEL_X86)
+
+        //
+        // SSE4.2
+        //
+
+        IMG_SORT_PUSH_TARGET("sse4.2")
+        namespace sse42 {
+            inline float horizontal_sum(__m128 v) noexcept {
+                v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+                v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 0x55));
+                return _mm_cvtss_f32(v);
+            }
+
+            // Applies op(acc, a, b) over 8 floats per iteration with two independent accumulators,
+            // then finishes the tail with the scalar op.
+            template <typename Op>
+            float reduce(const float *a, const float *b, std::size_t n, Op op) noexcept {
+                __m128 acc0 = _mm_setzero_ps();
+                __m128 acc1 = _mm_setzero_ps();
+
+                std::size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    acc0 = op(acc0, _mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                    acc1 = op(acc1, _mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+                }
+
+                float res = horizontal_sum(_mm_add_ps(acc0, acc1));
+                for (; i < n; ++i) {
+                    res += op(a[i], b[i]);
+                }
+                return res;
+            }
+
+            // Operations are function objects rather than lambdas, so that they are compiled for this target too
+            struct l1_op {
+                __m128 operator()(__m128 acc, __m128 x, __m128 y) const noexcept { return _mm_add_ps(acc, _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(x, y))); }
+                float operator()(float x, float y) const noexcept { return std::abs(x - y); }
+            };
+
+            struct l2_op {
+                __m128 operator()(__m128 acc, __m128 x, __m128 y) const noexcept { const __m128 d = _mm_sub_ps(x, y); return _mm_add_ps(acc, _mm_mul_ps(d, d)); }
+                float operator()(float x, float y) const noexcept { return (x - y) * (x - y); }
+            };
+
+            struct min_op {
+                __m128 operator()(__m128 acc, __m128 x, __m128 y) const noexcept { return _mm_add_ps(acc, _mm_min_ps(x, y)); }
+                float operator()(float x, float y) const noexcept { return std::min(x, y); }
+            };
+
+            struct chi_square_op {
+                __m128 operator()(__m128 acc, __m128 x, __m128 y) const noexcept {
+                    const __m128 d = _mm_sub_ps(x, y);
+                    const __m128 s = _mm_add_ps(x, y);
+                    const __m128 nonzero = _mm_cmpgt_ps(s, _mm_setzero_ps());
+                    const __m128 q = _mm_div_ps(_mm_mul_ps(d, d), _mm_blendv_ps(_mm_set1_ps(1.0f), s, nonzero));
+                    return _mm_add_ps(acc, _mm_and_ps(q, nonzero));
+                }
+                float operator()(float x, float y) const noexcept { return x + y > 0.0f ? (x - y) * (x - y) / (x + y) : 0.0f; }
+            };
+
+            inline float l1(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, l1_op{}); }
+            inline float l2_squared(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, l2_op{}); }
+            inline float min_sum(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, min_op{}); }
+            inline float chi_square(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, chi_square_op{}); }
+
+            inline double sum(const float *in, std::size_t n) noexcept {
+                __m128d acc0 = _mm_setzero_pd();
+                __m128d acc1 = _mm_setzero_pd();
+
+                std::size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    const __m128 v = _mm_loadu_ps(in + i);
+                    acc0 = _mm_add_pd(acc0, _mm_cvtps_pd(v));
+                    acc1 = _mm_add_pd(acc1, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+                }
+
+                const __m128d acc = _mm_add_pd(acc0, acc1);
+                double res = _mm_cvtsd_f64(_mm_add_sd(acc, _mm_unpackhi_pd(acc, acc)));
+                for (; i < n; ++i) {
+                    res += in[i];
+                }
+                return res;
+            }
+
+            inline void scale(const float *in, std::size_t n, double factor, float *out) noexcept {
+                const __m128d f = _mm_set1_pd(factor);
+
+                std::size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    const __m128 v = _mm_loadu_ps(in + i);
+                    const __m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(v), f));
+                    const __m128 hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), f));
+                    _mm_storeu_ps(out + i, _mm_movelh_ps(lo, hi));
+                }
+                for (; i < n; ++i) {
+                    out[i] = static_cast<float>(in[i] * factor);
+                }
+            }
+
+            inline void sqrt(float *inout, std::size_t n) noexcept {
+                std::size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    _mm_storeu_ps(inout + i, _mm_sqrt_ps(_mm_loadu_ps(inout + i)));
+                }
+                for (; i < n; ++i) {
+                    inout[i] = std::sqrt(inout[i]);
+                }
+            }
+
+            inline std::size_t relax(const double *weight, double *cost, std::uint64_t *source, std::size_t n, std::uint64_t from) noexcept {
+                const __m128d from_bits = _mm_castsi128_pd(_mm_set1_epi64x(static_cast<long long>(from)));
+                __m128d lowest = _mm_set1_pd(std::numeric_limits<double>::infinity());
+
+                std::size_t i = 0;
+                for (; i + 2 <= n; i += 2) {
+                    const __m128d w = _mm_loadu_pd(weight + i);
+                    const __m128d c = _mm_loadu_pd(cost + i);
+                    const __m128d lower = _mm_cmple_pd(w, c);
+                    const __m128d relaxed = _mm_blendv_pd(c, w, lower);
+                    _mm_storeu_pd(cost + i, relaxed);
+
+                    double *s = reinterpret_cast<double *>(source + i);
+                    _mm_storeu_pd(s, _mm_blendv_pd(_mm_loadu_pd(s), from_bits, lower));
+                    lowest = _mm_min_pd(lowest, relaxed);
+                }
+
+                double min = _mm_cvtsd_f64(_mm_min_sd(lowest, _mm_unpackhi_pd(lowest, lowest)));
+                for (; i < n; ++i) {
+                    if (weight[i] <= cost[i]) {
+                        cost[i] = weight[i];
+                        source[i] = from;
+                    }
+                    min = std::min(min, cost[i]);
+                }
+                return scalar::last_min_index(cost, n, min);
+            }
+
+            // Lanes of the quantised costs, with comparisons as one bit per lane
+            template <typename T>
+            struct lanes;
+
+            template <>
+            struct lanes<float> {
+                using vec = __m128;
+                static constexpr std::size_t count = 4;
+                static vec load(const float *p) noexcept { return _mm_loadu_ps(p); }
+                static void store(float *p, vec v) noexcept { _mm_storeu_ps(p, v); }
+                static vec min(vec a, vec b) noexcept { return _mm_min_ps(a, b); }
+                static std::uint64_t less(vec a, vec b) noexcept { return static_cast<unsigned>(_mm_movemask_ps(_mm_cmplt_ps(a, b))); }
+                static std::uint64_t equal(vec a, vec b) noexcept { return static_cast<unsigned>(_mm_movemask_ps(_mm_cmpeq_ps(a, b))); }
+            };
+
+            template <>
+            struct lanes<std::uint16_t> {
+                using vec = __m128i;
+                static constexpr std::size_t count = 8;
+                static vec load(const std::uint16_t *p) noexcept { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)); }
+                static void store(std::uint16_t *p, vec v) noexcept { _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v); }
+                static vec min(vec a, vec b) noexcept { return _mm_min_epu16(a, b); }
+                static std::uint64_t bits(vec mask) noexcept { return static_cast<unsigned>(_mm_movemask_epi8(_mm_packs_epi16(mask, _mm_setzero_si128()))); }
+                static std::uint64_t less(vec a, vec b) noexcept { return ~bits(_mm_cmpeq_epi16(_mm_max_epu16(a, b), a)) & 0xff; }
+                static std::uint64_t equal(vec a, vec b) noexcept { return bits(_mm_cmpeq_epi16(a, b)); }
+            };
+
+            template <>
+            struct lanes<std::uint8_t> {
+                using vec = __m128i;
+                static constexpr std::size_t count = 16;
+                static vec load(const std::uint8_t *p) noexcept { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)); }
+                static void store(std::uint8_t *p, vec v) noexcept { _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v); }
+                static vec min(vec a, vec b) noexcept { return _mm_min_epu8(a, b); }
+                static std::uint64_t less(vec a, vec b) noexcept { return ~static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(a, b), a))) & 0xffff; }
+                static std::uint64_t equal(vec a, vec b) noexcept { return static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b))); }
+            };
+
+            template <typename T>
+            scalar::relax_result relax_ties(const T *weight, T *cost, std::uint64_t *source, std::uint64_t *tied, std::size_t n, std::uint64_t from) noexcept {
+                using L = lanes<T>;
+                std::fill(tied, tied + scalar::tie_words(n), 0);
+
+                typename L::vec lowest{};
+                std::uint64_t repeated = 0;
+                std::size_t i = 0;
+                for (; i + L::count <= n; i += L::count) {
+                    const auto w = L::load(weight + i);
+                    const auto c = L::load(cost + i);
+                    const auto relaxed = L::min(w, c);
+                    L::store(cost + i, relaxed);
+                    scalar::set_sources(source, i, L::less(w, c), from);
+                    tied[i / 64] |= L::equal(w, c) << (i % 64);
+
+                    if (i == 0) {
+                        lowest = relaxed;
+                    }
+                    else {
+                        repeated = (repeated & ~L::less(relaxed, lowest)) | L::equal(relaxed, lowest);
+                        lowest = L::min(lowest, relaxed);
+                    }
+                }
+
+                T lane_min[L::count];
+                T min{};
+                std::size_t num_min = 0;
+                if (i > 0) {
+                    L::store(lane_min, lowest);
+                    scalar::merge_lanes(lane_min, L::count, repeated, min, num_min);
+                }
+                return scalar::relax_ties_tail(weight, cost, source, tied, i, n, from, min, num_min);
+            }
+
+            // The 16 codes of one subspace as shuffle indices, vectors 0 to 15 in order
+            inline __m128i pq_indices(const std::uint8_t *packed) noexcept {
+                const __m128i low_nibble = _mm_set1_epi8(0x0F);
+                const __m128i codes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(packed));
+                return _mm_unpacklo_epi64(_mm_and_si128(codes, low_nibble), _mm_and_si128(_mm_srli_epi16(codes, 4), low_nibble));
+            }
+
+            // One SSSE3 shuffle looks up a subspace for all 16 vectors
+            inline void pq_scan(const std::uint8_t *tables, const std::uint8_t *codes, std::size_t num_subspaces, std::uint16_t *out) noexcept {
+                const __m128i zero = _mm_setzero_si128();
+                __m128i acc_lo = zero;
+                __m128i acc_hi = zero;
+
+                for (std::size_t m = 0; m < num_subspaces; ++m) {
+                    const __m128i table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tables + m * 16));
+                    const __m128i distances = _mm_shuffle_epi8(table, pq_indices(codes + m * 8));
+                    acc_lo = _mm_add_epi16(acc_lo, _mm_unpacklo_epi8(distances, zero));
+                    acc_hi = _mm_add_epi16(acc_hi, _mm_unpackhi_epi8(distances, zero));
+                }
+
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out), acc_lo);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 8), acc_hi);
+            }
+        }
+        IMG_SORT_POP_TARGET()
+
+        //
+        // AVX2
+        //
+
+        IMG_SORT_PUSH_TARGET("avx2")
+        namespace avx2 {
+            inline float horizontal_sum(__m256 v) noexcept {
+                __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+                lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+                lo = _mm_add_ss(lo, _mm_shuffle_ps(lo, lo, 0x55));
+                return _mm_cvtss_f32(lo);
+            }
+
+            // Applies op(acc, a, b) over 16 floats per iteration with two independent accumulators,
+            // then finishes the tail with the scalar op.
+            template <typename Op>
+            float reduce(const float *a, const float *b, std::size_t n, Op op) noexcept {
+                __m256 acc0 = _mm256_setzero_ps();
+                __m256 acc1 = _mm256_setzero_ps();
+
+                std::size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    acc0 = op(acc0, _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                    acc1 = op(acc1, _mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+                }
+
+                float res = horizontal_sum(_mm256_add_ps(acc0, acc1));
+                for (; i < n; ++i) {
+                    res += op(a[i], b[i]);
+                }
+                return res;
+            }
+
+            struct l1_op {
+                __m256 operator()(__m256 acc, __m256 x, __m256 y) const noexcept { return _mm256_add_ps(acc, _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(x, y))); }
+                float operator()(float x, float y) const noexcept { return std::abs(x - y); }
+            };
+
+            struct l2_op {
+                __m256 operator()(__m256 acc, __m256 x, __m256 y) const noexcept { const __m256 d = _mm256_sub_ps(x, y); return _mm256_add_ps(acc, _mm256_mul_ps(d, d)); }
+                float operator()(float x, float y) const noexcept { return (x - y) * (x - y); }
+            };
+
+            struct min_op {
+                __m256 operator()(__m256 acc, __m256 x, __m256 y) const noexcept { return _mm256_add_ps(acc, _mm256_min_ps(x, y)); }
+                float operator()(float x, float y) const noexcept { return std::min(x, y); }
+            };
+
+            struct chi_square_op {
+                __m256 operator()(__m256 acc, __m256 x, __m256 y) const noexcept {
+                    const __m256 d = _mm256_sub_ps(x, y);
+                    const __m256 s = _mm256_add_ps(x, y);
+                    const __m256 nonzero = _mm256_cmp_ps(s, _mm256_setzero_ps(), _CMP_GT_OQ);
+                    const __m256 q = _mm256_div_ps(_mm256_mul_ps(d, d), _mm256_blendv_ps(_mm256_set1_ps(1.0f), s, nonzero));
+                    return _mm256_add_ps(acc, _mm256_and_ps(q, nonzero));
+                }
+                float operator()(float x, float y) const noexcept { return x + y > 0.0f ? (x - y) * (x - y) / (x + y) : 0.0f; }
+            };
+
+            inline float l1(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, l1_op{}); }
+            inline float l2_squared(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, l2_op{}); }
+            inline float min_sum(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, min_op{}); }
+            inline float chi_square(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, chi_square_op{}); }
+
+            inline double sum(const float *in, std::size_t n) noexcept {
+                __m256d acc0 = _mm256_setzero_pd();
+                __m256d acc1 = _mm256_setzero_pd();
+
+                std::size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    acc0 = _mm256_add_pd(acc0, _mm256_cvtps_pd(_mm_loadu_ps(in + i)));
+                    acc1 = _mm256_add_pd(acc1, _mm256_cvtps_pd(_mm_loadu_ps(in + i + 4)));
+                }
+
+                const __m256d acc = _mm256_add_pd(acc0, acc1);
+                __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+                double res = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+                for (; i < n; ++i) {
+                    res += in[i];
+                }
+                return res;
+            }
+
+            inline void scale(const float *in, std::size_t n, double factor, float *out) noexcept {
+                const __m256d f = _mm256_set1_pd(factor);
+
+                std::size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    _mm_storeu_ps(out + i, _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_cvtps_pd(_mm_loadu_ps(in + i)), f)));
+                }
+                for (; i < n; ++i) {
+                    out[i] = static_cast<float>(in[i] * factor);
+                }
+            }
+
+            inline void sqrt(float *inout, std::size_t n) noexcept {
+                std::size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    _mm256_storeu_ps(inout + i, _mm256_sqrt_ps(_mm256_loadu_ps(inout + i)));
+                }
+                for (; i < n; ++i) {
+                    inout[i] = std::sqrt(inout[i]);
+                }
+            }
+
+            inline std::size_t relax(const double *weight, double *cost, std::uint64_t *source, std::size_t n, std::uint64_t from) noexcept {
+                const __m256d from_bits = _mm256_castsi256_pd(_mm256_set1_epi64x(static_cast<long long>(from)));
+                __m256d lowest = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+
+                std::size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    const __m256d w = _mm256_loadu_pd(weight + i);
+                    const __m256d c = _mm256_loadu_pd(cost + i);
+                    const __m256d lower = _mm256_cmp_pd(w, c, _CMP_LE_OQ);
+                    const __m256d relaxed = _mm256_blendv_pd(c, w, lower);
+                    _mm256_storeu_pd(cost + i, relaxed);
+
+                    double *s = reinterpret_cast<double *>(source + i);
+                    _mm256_storeu_pd(s, _mm256_blendv_pd(_mm256_loadu_pd(s), from_bits, lower));
+                    lowest = _mm256_min_pd(lowest, relaxed);
+                }
+
+                __m128d half = _mm_min_pd(_mm256_castpd256_pd128(lowest), _mm256_extractf128_pd(lowest, 1));
+                double min = _mm_cvtsd_f64(_mm_min_sd(half, _mm_unpackhi_pd(half, half)));
+                for (; i < n; ++i) {
+                    if (weight[i] <= cost[i]) {
+                        cost[i] = weight[i];
+                        source[i] = from;
+                    }
+                    min = std::min(min, cost[i]);
+                }
+                return scalar::last_min_index(cost, n, min);
+            }
+
+            // Lanes of the quantised costs, with comparisons as one bit per lane
+            template <typename T>
+            struct lanes;
+
+            template <>
+            struct lanes<float> {
+                using vec = __m256;
+                static constexpr std::size_t count = 8;
+                static vec load(const float *p) noexcept { return _mm256_loadu_ps(p); }
+                static void store(float *p, vec v) noexcept { _mm256_storeu_ps(p, v); }
+                static vec min(vec a, vec b) noexcept { return _mm256_min_ps(a, b); }
+                static std::uint64_t less(vec a, vec b) noexcept { return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ))); }
+                static std::uint64_t equal(vec a, vec b) noexcept { return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ))); }
+            };
+
+            template <>
+            struct lanes<std::uint16_t> {
+                using vec = __m256i;
+                static constexpr std::size_t count = 16;
+                static vec load(const std::uint16_t *p) noexcept { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)); }
+                static void store(std::uint16_t *p, vec v) noexcept { _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v); }
+                static vec min(vec a, vec b) noexcept { return _mm256_min_epu16(a, b); }
+                static std::uint64_t bits(vec mask) noexcept {
+                    return static_cast<unsigned>(_mm_movemask_epi8(_mm_packs_epi16(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1))));
+                }
+                static std::uint64_t less(vec a, vec b) noexcept { return ~bits(_mm256_cmpeq_epi16(_mm256_max_epu16(a, b), a)) & 0xffff; }
+                static std::uint64_t equal(vec a, vec b) noexcept { return bits(_mm256_cmpeq_epi16(a, b)); }
+            };
+
+            template <>
+            struct lanes<std::uint8_t> {
+                using vec = __m256i;
+                static constexpr std::size_t count = 32;
+                static vec load(const std::uint8_t *p) noexcept { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)); }
+                static void store(std::uint8_t *p, vec v) noexcept { _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v); }
+                static vec min(vec a, vec b) noexcept { return _mm256_min_epu8(a, b); }
+                static std::uint64_t bits(vec mask) noexcept { return static_cast<unsigned>(_mm256_movemask_epi8(mask)); }
+                static std::uint64_t less(vec a, vec b) noexcept { return ~bits(_mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a)) & 0xffffffff; }
+                static std::uint64_t equal(vec a, vec b) noexcept { return bits(_mm256_cmpeq_epi8(a, b)); }
+            };
+
+            template <typename T>
+            scalar::relax_result relax_ties(const T *weight, T *cost, std::uint64_t *source, std::uint64_t *tied, std::size_t n, std::uint64_t from) noexcept {
+                using L = lanes<T>;
+                std::fill(tied, tied + scalar::tie_words(n), 0);
+
+                typename L::vec lowest{};
+                std::uint64_t repeated = 0;
+                std::size_t i = 0;
+                for (; i + L::count <= n; i += L::count) {
+                    const auto w = L::load(weight + i);
+                    const auto c = L::load(cost + i);
+                    const auto relaxed = L::min(w, c);
+                    L::store(cost + i, relaxed);
+                    scalar::set_sources(source, i, L::less(w, c), from);
+                    tied[i / 64] |= L::equal(w, c) << (i % 64);
+
+                    if (i == 0) {
+                        lowest = relaxed;
+                    }
+                    else {
+                        repeated = (repeated & ~L::less(relaxed, lowest)) | L::equal(relaxed, lowest);
+                        lowest = L::min(lowest, relaxed);
+                    }
+                }
+
+                T lane_min[L::count];
+                T min{};
+                std::size_t num_min = 0;
+                if (i > 0) {
+                    L::store(lane_min, lowest);
+                    scalar::merge_lanes(lane_min, L::count, repeated, min, num_min);
+                }
+                return scalar::relax_ties_tail(weight, cost, source, tied, i, n, from, min, num_min);
+            }
+
+            inline __m128i pq_indices(const std::uint8_t *packed) noexcept {
+                const __m128i low_nibble = _mm_set1_epi8(0x0F);
+                const __m128i codes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(packed));
+                return _mm_unpacklo_epi64(_mm_and_si128(codes, low_nibble), _mm_and_si128(_mm_srli_epi16(codes, 4), low_nibble));
+            }
+
+            // Two subspaces per shuffle, one in each 128-bit lane, whose tables are adjacent
+            inline void pq_scan(const std::uint8_t *tables, const std::uint8_t *codes, std::size_t num_subspaces, std::uint16_t *out) noexcept {
+                __m256i acc = _mm256_setzero_si256();
+
+                std::size_t m = 0;
+                for (; m + 2 <= num_subspaces; m += 2) {
+                    const __m256i table = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(tables + m * 16));
+                    const __m256i indices = _mm256_inserti128_si256(_mm256_castsi128_si256(pq_indices(codes + m * 8)), pq_indices(codes + (m + 1) * 8), 1);
+                    const __m256i distances = _mm256_shuffle_epi8(table, indices);
+                    acc = _mm256_add_epi16(acc, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(distances)));
+                    acc = _mm256_add_epi16(acc, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(distances, 1)));
+                }
+                if (m < num_subspaces) {
+                    const __m128i table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tables + m * 16));
+                    acc = _mm256_add_epi16(acc, _mm256_cvtepu8_epi16(_mm_shuffle_epi8(table, pq_indices(codes + m * 8))));
+                }
+
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), acc);
+            }
+        }
+        IMG_SORT_POP_TARGET()
+
+        //
+        // AVX-512
+        //
+
+        IMG_SORT_PUSH_TARGET("avx512f,avx512bw")
+#if defined(__GNUC__) && !defined(__clang__)
+        // GCC 12 warns that the _mm512_undefined_* passthrough of masked builtins is uninitialized, in its own
+        // headers, wherever an AVX-512 intrinsic is inlined (GCC bug 105593)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+        namespace avx512 {
+            // Applies op(acc, a, b) over 32 floats per iteration with two independent accumulators,
+            // then finishes the tail with the scalar op.
+            template <typename Op>
+            float reduce(const float *a, const float *b, std::size_t n, Op op) noexcept {
+                __m512 acc0 = _mm512_setzero_ps();
+                __m512 acc1 = _mm512_setzero_ps();
+
+                std::size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    acc0 = op(acc0, _mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+                    acc1 = op(acc1, _mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+                }
+
+                float res = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+                for (; i < n; ++i) {
+                    res += op(a[i], b[i]);
+                }
+                return res;
+            }
+
+            struct l1_op {
+                __m512 operator()(__m512 acc, __m512 x, __m512 y) const noexcept { return _mm512_add_ps(acc, _mm512_abs_ps(_mm512_sub_ps(x, y))); }
+                float operator()(float x, float y) const noexcept { return std::abs(x - y); }
+            };
+
+            struct l2_op {
+                __m512 operator()(__m512 acc, __m512 x, __m512 y) const noexcept { const __m512 d = _mm512_sub_ps(x, y); return _mm512_fmadd_ps(d, d, acc); }
+                float operator()(float x, float y) const noexcept { return (x - y) * (x - y); }
+            };
+
+            struct min_op {
+                __m512 operator()(__m512 acc, __m512 x, __m512 y) const noexcept { return _mm512_add_ps(acc, _mm512_min_ps(x, y)); }
+                float operator()(float x, float y) const noexcept { return std::min(x, y); }
+            };
+
+            struct chi_square_op {
+                __m512 operator()(__m512 acc, __m512 x, __m512 y) const noexcept {
+                    const __m512 d = _mm512_sub_ps(x, y);
+                    const __m512 s = _mm512_add_ps(x, y);
+                    const __mmask16 nonzero = _mm512_cmp_ps_mask(s, _mm512_setzero_ps(), _CMP_GT_OQ);
+                    return _mm512_mask_add_ps(acc, nonzero, acc, _mm512_maskz_div_ps(nonzero, _mm512_mul_ps(d, d), s));
+                }
+                float operator()(float x, float y) const noexcept { return x + y > 0.0f ? (x - y) * (x - y) / (x + y) : 0.0f; }
+            };
+
+            inline float l1(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, l1_op{}); }
+            inline float l2_squared(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, l2_op{}); }
+            inline float min_sum(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, min_op{}); }
+            inline float chi_square(const float *a, const float *b, std::size_t n) noexcept { return reduce(a, b, n, chi_square_op{}); }
+
+            inline double sum(const float *in, std::size_t n) noexcept {
+                __m512d acc0 = _mm512_setzero_pd();
+                __m512d acc1 = _mm512_setzero_pd();
+
+                std::size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    acc0 = _mm512_add_pd(acc0, _mm512_cvtps_pd(_mm256_loadu_ps(in + i)));
+                    acc1 = _mm512_add_pd(acc1, _mm512_cvtps_pd(_mm256_loadu_ps(in + i + 8)));
+                }
+
+                double res = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+                for (; i < n; ++i) {
+                    res += in[i];
+                }
+                return res;
+            }
+
+            inline void scale(const float *in, std::size_t n, double factor, float *out) noexcept {
+                const __m512d f = _mm512_set1_pd(factor);
+
+                std::size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    _mm256_storeu_ps(out + i, _mm512_cvtpd_ps(_mm512_mul_pd(_mm512_cvtps_pd(_mm256_loadu_ps(in + i)), f)));
+                }
+                for (; i < n; ++i) {
+                    out[i] = static_cast<float>(in[i] * factor);
+                }
+            }
+
+            inline void sqrt(float *inout, std::size_t n) noexcept {
+                std::size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    _mm512_storeu_ps(inout + i, _mm512_sqrt_ps(_mm512_loadu_ps(inout + i)));
+                }
+                for (; i < n; ++i) {
+                    inout[i] = std::sqrt(inout[i]);
+                }
+            }
+
+            inline std::size_t relax(const double *weight, double *cost, std::uint64_t *source, std::size_t n, std::uint64_t from) noexcept {
+                const __m512i from_vec = _mm512_set1_epi64(static_cast<long long>(from));
+                __m512d lowest = _mm512_set1_pd(std::numeric_limits<double>::infinity());
+
+                std::size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    const __m512d w = _mm512_loadu_pd(weight + i);
+                    const __m512d c = _mm512_loadu_pd(cost + i);
+                    const __mmask8 lower = _mm512_cmp_pd_mask(w, c, _CMP_LE_OQ);
+                    const __m512d relaxed = _mm512_mask_blend_pd(lower, c, w);
+                    _mm512_storeu_pd(cost + i, relaxed);
+                    _mm512_mask_storeu_epi64(source + i, lower, from_vec);
+                    lowest = _mm512_min_pd(lowest, relaxed);
+                }
+
+                double min = _mm512_reduce_min_pd(lowest);
+                for (; i < n; ++i) {
+                    if (weight[i] <= cost[i]) {
+                        cost[i] = weight[i];
+                        source[i] = from;
+                    }
+                    min = std::min(min, cost[i]);
+                }
+                return scalar::last_min_index(cost, n, min);
+            }
+
+            // Lanes of the quantised costs, with comparisons as one bit per lane. Bytes and words need AVX512BW.
+            template <typename T>
+            struct lanes;
+
+            template <>
+            struct lanes<float> {
+                using vec = __m512;
+                static constexpr std::size_t count = 16;
+                static vec load(const float *p) noexcept { return _mm512_loadu_ps(p); }
+                static void store(float *p, vec v) noexcept { _mm512_storeu_ps(p, v); }
+                static vec min(vec a, vec b) noexcept { return _mm512_min_ps(a, b); }
+                static std::uint64_t less(vec a, vec b) noexcept { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+                static std::uint64_t equal(vec a, vec b) noexcept { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+            };
+
+            template <>
+            struct lanes<std::uint16_t> {
+                using vec = __m512i;
+                static constexpr std::size_t count = 32;
+                static vec load(const std::uint16_t *p) noexcept { return _mm512_loadu_si512(p); }
+                static void store(std::uint16_t *p, vec v) noexcept { _mm512_storeu_si512(p, v); }
+                static vec min(vec a, vec b) noexcept { return _mm512_min_epu16(a, b); }
+                static std::uint64_t less(vec a, vec b) noexcept { return _mm512_cmplt_epu16_mask(a, b); }
+                static std::uint64_t equal(vec a, vec b) noexcept { return _mm512_cmpeq_epu16_mask(a, b); }
+            };
+
+            template <>
+            struct lanes<std::uint8_t> {
+                using vec = __m512i;
+                static constexpr std::size_t count = 64;
+                static vec load(const std::uint8_t *p) noexcept { return _mm512_loadu_si512(p); }
+                static void store(std::uint8_t *p, vec v) noexcept { _mm512_storeu_si512(p, v); }
+                static vec min(vec a, vec b) noexcept { return _mm512_min_epu8(a, b); }
+                static std::uint64_t less(vec a, vec b) noexcept { return _mm512_cmplt_epu8_mask(a, b); }
+                static std::uint64_t equal(vec a, vec b) noexcept { return _mm512_cmpeq_epu8_mask(a, b); }
+            };
+
+            template <typename T>
+            scalar::relax_result relax_ties(const T *weight, T *cost, std::uint64_t *source, std::uint64_t *tied, std::size_t n, std::uint64_t from) noexcept {
+                using L = lanes<T>;
+                std::fill(tied, tied + scalar::tie_words(n), 0);
+
+                typename L::vec lowest{};
+                std::uint64_t repeated = 0;
+                std::size_t i = 0;
+                for (; i + L::count <= n; i += L::count) {
+                    const auto w = L::load(weight + i);
+                    const auto c = L::load(cost + i);
+                    const auto relaxed = L::min(w, c);
+                    L::store(cost + i, relaxed);
+                    scalar::set_sources(source, i, L::less(w, c), from);
+                    tied[i / 64] |= L::equal(w, c) << (i % 64);
+
+                    if (i == 0) {
+                        lowest = relaxed;
+                    }
+                    else {
+                        repeated = (repeated & ~L::less(relaxed, lowest)) | L::equal(relaxed, lowest);
+                        lowest = L::min(lowest, relaxed);
+                    }
+                }
+
+                T lane_min[L::count];
+                T min{};
+                std::size_t num_min = 0;
+                if (i > 0) {
+                    L::store(lane_min, lowest);
+                    scalar::merge_lanes(lane_min, L::count, repeated, min, num_min);
+                }
+                return scalar::relax_ties_tail(weight, cost, source, tied, i, n, from, min, num_min);
+            }
+
+            inline __m128i pq_indices(const std::uint8_t *packed) noexcept {
+                const __m128i low_nibble = _mm_set1_epi8(0x0F);
+                const __m128i codes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(packed));
+                return _mm_unpacklo_epi64(_mm_and_si128(codes, low_nibble), _mm_and_si128(_mm_srli_epi16(codes, 4), low_nibble));
+            }
+
+            // Four subspaces per shuffle, one in each 128-bit lane
+            inline void pq_scan(const std::uint8_t *tables, const std::uint8_t *codes, std::size_t num_subspaces, std::uint16_t *out) noexcept {
+                __m512i acc = _mm512_setzero_si512();
+
+                std::size_t m = 0;
+                for (; m + 4 <= num_subspaces; m += 4) {
+                    const __m512i table = _mm512_loadu_si512(tables + m * 16);
+                    __m512i indices = _mm512_castsi128_si512(pq_indices(codes + m * 8));
+                    indices = _mm512_inserti32x4(indices, pq_indices(codes + (m + 1) * 8), 1);
+                    indices = _mm512_inserti32x4(indices, pq_indices(codes + (m + 2) * 8), 2);
+                    indices = _mm512_inserti32x4(indices, pq_indices(codes + (m + 3) * 8), 3);
+                    const __m512i distances = _mm512_shuffle_epi8(table, indices);
+                    acc = _mm512_add_epi16(acc, _mm512_cvtepu8_epi16(_mm512_castsi512_si256(distances)));
+                    acc = _mm512_add_epi16(acc, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(distances, 1)));
+                }
+
+                // The low half sums subspaces m and m + 2 of each vector, the high half m + 1 and m + 3
+                __m256i res = _mm256_add_epi16(_mm512_castsi512_si256(acc), _mm512_extracti64x4_epi64(acc, 1));
+                for (; m < num_subspaces; ++m) {
+                    const __m128i table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tables + m * 16));
+                    res = _mm256_add_epi16(res, _mm256_cvtepu8_epi16(_mm_shuffle_epi8(table, pq_indices(codes + m * 8))));
+                }
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), res);
+            }
+        }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+        IMG_SORT_POP_TARGET()
+
+#endif
+
+        //
+        // Dispatch
+        //
+
+        enum class instruction_set {
+            scalar,
+            sse42,
+            avx2,
+            avx512
+        };
+
+        constexpr instruction_set all_instruction_sets[] = {
+            instruction_set::scalar,
+            instruction_set::sse42,
+            instruction_set::avx2,
+            instruction_set::avx512
+        };
+
+        struct kernel_set {
+            std::string_view name;
+            float (*l1)(const float *a, const float *b, std::size_t n);
+            float (*l2_squared)(const float *a, const float *b, std::size_t n);
+            float (*min_sum)(const float *a, const float *b, std::size_t n);
+            float (*chi_square)(const float *a, const float *b, std::size_t n);
+            double (*sum)(const float *in, std::size_t n);
+            void (*scale)(const float *in, std::size_t n, double factor, float *out);
+            void (*sqrt)(float *inout, std::size_t n);
+            std::size_t (*relax)(const double *weight, double *cost, std::uint64_t *source, std::size_t n, std::uint64_t from);
+            scalar::relax_result (*relax_f32)(const float *weight, float *cost, std::uint64_t *source, std::uint64_t *tied, std::size_t n, std::uint64_t from);
+            scalar::relax_result (*relax_u16)(const std::uint16_t *weight, std::uint16_t *cost, std::uint64_t *source, std::uint64_t *tied, std::size_t n, std::uint64_t from);
+            scalar::relax_result (*relax_u8)(const std::uint8_t *weight, std::uint8_t *cost, std::uint64_t *source, std::uint64_t *tied, std::size_t n, std::uint64_t from);
+            void (*pq_scan)(const std::uint8_t *tables, const std::uint8_t *codes, std::size_t num_subspaces, std::uint16_t *out);
+        };
+
+        namespace detail {
+#if defined(IMG_SORT_KERNEL_X86) && defined(_MSC_VER) && !defined(__clang__)
+            // CPUID leaf 7 feature bits, and whether the OS saves the registers they use (XGETBV)
+            inline bool cpu_supports(instruction_set set) noexcept {
+                int info[4];
+                __cpuid(info, 0);
+                const int max_leaf = info[0];
+
+                __cpuid(info, 1);
+                const bool sse42 = (info[2] & (1 << 20)) != 0;
+                const bool osxsave = (info[2] & (1 << 27)) != 0;
+                const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+
+                int leaf7[4] = {};
+                if (max_leaf >= 7) __cpuidex(leaf7, 7, 0);
+
+                switch (set) {
+                case instruction_set::sse42:  return sse42;
+                case instruction_set::avx2:   return (leaf7[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+                case instruction_set::avx512: return (leaf7[1] & (1 << 16)) != 0 && (leaf7[1] & (1 << 30)) != 0 && (xcr0 & 0xe6) == 0xe6;
+                default:                      return true;
+                }
+            }
+#elif defined(IMG_SORT_KERNEL_X86)
+            inline bool cpu_supports(instruction_set set) noexcept {
+                __builtin_cpu_init();
+                switch (set) {
+                case instruction_set::sse42:  return __builtin_cpu_supports("sse4.2");
+                case instruction_set::avx2:   return __builtin_cpu_supports("avx2");
+                case instruction_set::avx512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+                default:                      return true;
+                }
+            }
+#else
+            inline bool cpu_supports(instruction_set set) noexcept {
+                return set == instruction_set::scalar;
+            }
+#endif
+        }
+
+        constexpr std::string_view name(instruction_set set) noexcept {
+            switch (set) {
+            case instruction_set::sse42:  return "SSE4.2";
+            case instruction_set::avx2:   return "AVX2";
+            case instruction_set::avx512: return "AVX-512";
+            default:                      return "scalar";
+            }
+        }
+
+        inline std::optional<instruction_set> parse_instruction_set(std::string_view str) noexcept {
+            if (str == "scalar") return instruction_set::scalar;
+            if (str == "sse4.2") return instruction_set::sse42;
+            if (str == "avx2") return instruction_set::avx2;
+            if (str == "avx512") return instruction_set::avx512;
+            return std::nullopt;
+        }
+
+        // Whether this binary carries the variant and the CPU can run it
+        inline bool is_supported(instruction_set set) noexcept {
+#if defined(IMG_SORT_KERNEL_X86)
+            return detail::cpu_supports(set);
+#else
+            return set == instruction_set::scalar;
+#endif
+        }
+
+        inline instruction_set best_instruction_set() noexcept {
+            auto res = instruction_set::scalar;
+            for (auto set : all_instruction_sets) {
+                if (is_supported(set)) res = set;
+            }
+            return res;
+        }
+
+        // Function pointers of one variant, which must be supported
+        inline const kernel_set &kernels(instruction_set set) noexcept {
+#if defined(IMG_SORT_KERNEL_X86)
+            static constexpr kernel_set sets[] = {
+                { name(instruction_set::scalar), &scalar::l1, &scalar::l2_squared, &scalar::min_sum, &scalar::chi_square,
+                  &scalar::sum, &scalar::scale, &scalar::sqrt, &scalar::relax<double>,
+                  &scalar::relax_ties<float>, &scalar::relax_ties<std::uint16_t>, &scalar::relax_ties<std::uint8_t>, &scalar::pq_scan },
+                { name(instruction_set::sse42), &sse42::l1, &sse42::l2_squared, &sse42::min_sum, &sse42::chi_square,
+                  &sse42::sum, &sse42::scale, &sse42::sqrt, &sse42::relax,
+                  &sse42::relax_ties<float>, &sse42::relax_ties<std::uint16_t>, &sse42::relax_ties<std::uint8_t>, &sse42::pq_scan },
+                { name(instruction_set::avx2), &avx2::l1, &avx2::l2_squared, &avx2::min_sum, &avx2::chi_square,
+                  &avx2::sum, &avx2::scale, &avx2::sqrt, &avx2::relax,
+                  &avx2::relax_ties<float>, &avx2::relax_ties<std::uint16_t>, &avx2::relax_ties<std::uint8_t>, &avx2::pq_scan },
+                { name(instruction_set::avx512), &avx512::l1, &avx512::l2_squared, &avx512::min_sum, &avx512::chi_square,
+                  &avx512::sum, &avx512::scale, &avx512::sqrt, &avx512::relax,
+                  &avx512::relax_ties<float>, &avx512::relax_ties<std::uint16_t>, &avx512::relax_ties<std::uint8_t>, &avx512::pq_scan }
+            };
+            return sets[static_cast<int>(set)];
+#else
+            static constexpr kernel_set scalar_set = {
+                name(instruction_set::scalar), &scalar::l1, &scalar::l2_squared, &scalar::min_sum, &scalar::chi_square,
+                &scalar::sum, &scalar::scale, &scalar::sqrt, &scalar::relax<double>,
+                &scalar::relax_ties<float>, &scalar::relax_ties<std::uint16_t>, &scalar::relax_ties<std::uint8_t>, &scalar::pq_scan
+            };
+            return scalar_set;
+#endif
+        }
+
+        namespace detail {
+            inline const kernel_set *&active() noexcept {
+                static const kernel_set *res = &kernels(best_instruction_set());
+                return res;
+            }
+        }
+
+        // The variant in use, the best supported one unless select() chose another
+        inline const kernel_set &active() noexcept {
+            return *detail::active();
+        }
+
+        // Switches every kernel to the given variant. Meant for startup, before any worker runs.
+        inline bool select(instruction_set set) noexcept {
+            if (!is_supported(set)) return false;
+            detail::active() = &kernels(set);
+            return true;
+        }
+
+        inline float l1(const float *a, const float *b, std::size_t n) noexcept { return active().l1(a, b, n); }
+        inline float l2_squared(const float *a, const float *b, std::size_t n) noexcept { return active().l2_squared(a, b, n); }
+        inline float min_sum(const float *a, const float *b, std::size_t n) noexcept { return active().min_sum(a, b, n); }
+        inline float chi_square(const float *a, const float *b, std::size_t n) noexcept { return active().chi_square(a, b, n); }
+        inline double sum(const float *in, std::size_t n) noexcept { return active().sum(in, n); }
+        inline void scale(const float *in, std::size_t n, double factor, float *out) noexcept { active().scale(in, n, factor, out); }
+        inline void sqrt(float *inout, std::size_t n) noexcept { active().sqrt(inout, n); }
+        inline void pq_scan(const std::uint8_t *tables, const std::uint8_t *codes, std::size_t num_subspaces, std::uint16_t *out) noexcept {
+            active().pq_scan(tables, codes, num_subspaces, out);
+        }
+
+        // Vectorised for double, the exact table. Quantised tables tie, and their Prim uses relax_ties.
+        template <typename T>
+        std::size_t relax(const T *weight, T *cost, std::uint64_t *source, std::size_t n, std::uint64_t from) noexcept {
+            if constexpr (std::is_same_v<T, double>) {
+                return active().relax(weight, cost, source, n, from);
+            }
+            else {
+                return scalar::relax(weight, cost, source, n, from);
+            }
+        }
+
+        template <typename T>
+        scalar::relax_result relax_ties(const T *weight, T *cost, std::uint64_t *source, std::uint64_t *tied, std::size_t n, std::uint64_t from) noexcept {
+            if constexpr (std::is_same_v<T, float>) {
+                return active().relax_f32(weight, cost, source, tied, n, from);
+            }
+            else if constexpr (std::is_same_v<T, std::uint16_t>) {
+                return active().relax_u16(weight, cost, source, tied, n, from);
+            }
+            else if constexpr (std::is_same_v<T, std::uint8_t>) {
+                return active().relax_u8(weight, cost, source, tied, n, from);
+            }
+            else {
+                return scalar::relax_ties(weight, cost, source, tied, n, from);
+            }
+        }
+
+    }
+
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "boost/format.hpp"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+namespace img_sort {
+
+    // User and system time of the calling thread. Windows counts it in scheduler ticks, about 15ms.
+    inline std::chrono::nanoseconds thread_cpu_time() noexcept {
+#if defined(_WIN32)
+        FILETIME creation, exit, kernel, user;
+        if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) return {};
+        auto ticks = [](const FILETIME &t) { return (static_cast<std::uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+        return std::chrono::nanoseconds{ (ticks(kernel) + ticks(user)) * 100 };  // 100ns units
+#else
+        timespec ts{};
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return {};
+        return std::chrono::seconds{ ts.tv_sec } + std::chrono::nanoseconds{ ts.tv_nsec };
+#endif
+    }
+
+    // Counts of values in buckets 1/64 of a power of two wide, as HdrHistogram keeps them with two significant
+    // digits: percentiles are within 1.6% of the exact ones, whatever the range, in a fixed 30KB. Values below 128
+    // have buckets of their own.
+    class latency_histogram {
+        static constexpr unsigned sub_bucket_bits = 6;
+        static constexpr std::size_t num_buckets = (64 - sub_bucket_bits + 1) << sub_bucket_bits;
+
+        std::array<std::uint64_t, num_buckets> m_counts{};
+        std::uint64_t m_count = 0;
+        std::uint64_t m_max = 0;
+
+    public:
+        static std::size_t bucket(std::uint64_t value) noexcept {
+            if (value < (std::uint64_t{ 2 } << sub_bucket_bits)) return static_cast<std::size_t>(value);
+
+            unsigned magnitude = 0;
+            while (magnitude < 63 && (value >> (magnitude + 1)) != 0) ++magnitude;
+            const unsigned shift = magnitude - sub_bucket_bits;
+            return (static_cast<std::size_t>(shift) << sub_bucket_bits) + static_cast<std::size_t>(value >> shift);
+        }
+
+        // Largest value that falls in the bucket
+        static std::uint64_t highest_equivalent(std::size_t bucket) noexcept {
+            if (bucket < (std::size_t{ 2 } << sub_bucket_bits)) return bucket;
+
+            const auto shift = static_cast<unsigned>((bucket >> sub_bucket_bits) - 1);
+            const auto lowest = static_cast<std::uint64_t>(bucket - (static_cast<std::size_t>(shift) << sub_bucket_bits)) << shift;
+            return lowest + ((std::uint64_t{ 1 } << shift) - 1);
+        }
+
+        void record(std::uint64_t value) noexcept {
+            ++m_counts[bucket(value)];
+            ++m_count;
+            m_max = std::max(m_max, value);
+        }
+
+        std::uint64_t count() const noexcept { return m_count; }
+        std::uint64_t max() const noexcept { return m_max; }
+
+        // Value that percent of the recorded values are at most, to the width of its bucket. 0 if none were recorded.
+        std::uint64_t percentile(double percent) const noexcept {
+            if (m_count == 0) return 0;
+
+            const auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(std::clamp(percent, 0.0, 100.0) / 100.0 * m_count)));
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < num_buckets; ++i) {
+                seen += m_counts[i];
+                if (seen >= rank) return std::min(highest_equivalent(i), m_max);
+            }
+            return m_max;
+        }
+    };
+
+    // Time one image took in the histogram stage. The worker's CPU time is the decode, histogram and descriptor;
+    // the rest of its wall time it waited, mostly for the file to be read.
+    struct file_latency {
+        std::size_t file_index = 0;
+        std::chrono::microseconds read{ 0 };
+        std::chrono::microseconds decode{ 0 };
+        std::uint64_t bytes = 0;
+        std::uint64_t pixels = 0;  // Histogrammed, fewer than the image's for reduced decodes
+
+        std::chrono::microseconds total() const noexcept { return read + decode; }
+    };
+
+    // Splits the wall time of an image between reading and decoding
+    inline file_latency measure_latency(std::size_t file_index, std::chrono::steady_clock::duration wall, std::chrono::nanoseconds cpu) {
+        const auto wall_us = std::chrono::duration_cast<std::chrono::microseconds>(wall);
+        const auto cpu_us = std::min(std::chrono::duration_cast<std::chrono::microseconds>(cpu), wall_us);
+
+        file_latency res;
+        res.file_index = file_index;
+        res.decode = cpu_us;
+        res.read = wall_us - cpu_us;
+        return res;
+    }
+
+    // The n slowest images, slowest first
+    inline std::vector<file_latency> slowest_files(const std::vector<file_latency> &files, std::size_t n) {
+        std::vector<file_latency> res(std::min(n, files.size()));
+        std::partial_sort_copy(files.begin(), files.end(), res.begin(), res.end(), [](const auto &a, const auto &b) {
+            return a.total() != b.total() ? a.total() > b.total() : a.file_index < b.file_index;
+        });
+        return res;
+    }
+
+    // Lines for the log: percentiles of the total, read and decode times, then a table of the n slowest images
+    inline std::vector<std::string> describe_latencies(const std::vector<file_latency> &files, const std::vector<std::filesystem::path> &filenames, std::size_t n) {
+        static constexpr double percents[] = { 50.0, 90.0, 99.0, 99.9 };
+
+        std::vector<std::string> res;
+        if (files.empty()) return res;
+
+        latency_histogram total, read, decode;
+        for (const auto &f : files) {
+            total.record(static_cast<std::uint64_t>(f.total().count()));
+            read.record(static_cast<std::uint64_t>(f.read.count()));
+            decode.record(static_cast<std::uint64_t>(f.decode.count()));
+        }
+
+        res.push_back((boost::format{ "Latency of %1% decoded images in ms:" } % files.size()).str());
+        res.push_back("              p50      p90      p99    p99.9      max");
+        for (const auto &[name, h] : { std::pair{ "total", &total }, std::pair{ "read", &read }, std::pair{ "decode", &decode } }) {
+            std::string line = (boost::format{ "  %1$-6s" } % name).str();
+            for (auto p : percents) line += (boost::format{ " %1$8.3f" } % (h->percentile(p) / 1000.0)).str();
+            line += (boost::format{ " %1$8.3f" } % (h->max() / 1000.0)).str();
+            res.push_back(std::move(line));
+        }
+
+        const auto slowest = slowest_files(files, n);
+        if (slowest.empty()) return res;
+
+        res.push_back((boost::format{ "Slowest %1% images:" } % slowest.size()).str());
+        res.push_back("   total ms   read ms  decode ms      MiB  Mpixels  file");
+        for (const auto &f : slowest) {
+            res.push_back((boost::format{ "  %1$9.3f %2$9.3f  %3$9.3f %4$8.2f %5$8.2f  %6%" }
+                           % (f.total().count() / 1000.0) % (f.read.count() / 1000.0) % (f.decode.count() / 1000.0)
+                           % (f.bytes / (1024.0 * 1024.0)) % (f.pixels / 1e6) % filenames[f.file_index].string()).str());
+        }
+        return res;
+    }
+
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "projection.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <execution>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace img_sort {
+
+    // SimHash tables: every table hashes a point to the signs of num_bits random Gaussian projections, taken
+    // about the mean of the points so that the hyperplanes cut through the data rather than past it. Points
+    // that share a signature in any table collide. Buckets are intrusive singly linked lists with atomic heads,
+    // so that all points are inserted concurrently without locks.
+    class simhash_index {
+        static constexpr std::uint32_t npos = ~std::uint32_t{ 0 };
+
+        std::size_t m_size = 0;
+        std::size_t m_num_tables = 0;
+        std::size_t m_num_bits = 0;
+        std::size_t m_num_slots = 0;  // Per table, a power of two
+        std::vector<std::uint32_t> m_keys;  // m_keys[table * size + point]
+        std::vector<std::uint32_t> m_next;  // m_next[table * size + point], next point in the same slot
+        std::vector<std::atomic<std::uint32_t>> m_heads;  // m_heads[table * num_slots + slot]
+
+        std::size_t slot(std::size_t table, std::uint32_t key) const noexcept {
+            // Fibonacci hashing, salted per table
+            const std::uint64_t h = (key ^ (table * 0x9E3779B9u)) * 0x9E3779B97F4A7C15ull;
+            return static_cast<std::size_t>(h >> 32) & (m_num_slots - 1);
+        }
+
+        void insert(std::size_t table, std::size_t point) noexcept {
+            auto &head = m_heads[table * m_num_slots + slot(table, m_keys[table * m_size + point])];
+            auto &next = m_next[table * m_size + point];
+
+            next = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(next, static_cast<std::uint32_t>(point), std::memory_order_release, std::memory_order_relaxed));
+        }
+
+    public:
+        simhash_index(const std::vector<const float *> &rows, std::size_t dim, std::size_t num_tables, std::size_t num_bits, std::uint32_t seed = 0)
+            :m_size{ rows.size() },
+             m_num_tables{ num_tables },
+             m_num_bits{ num_bits },
+             m_keys(num_tables * rows.size(), 0),
+             m_next(num_tables * rows.size(), npos)
+        {
+            RUNTIME_ASSERT(m_size > 0 && m_size < npos);
+            RUNTIME_ASSERT(num_tables > 0 && num_bits > 0 && num_bits <= 32);
+
+            m_num_slots = 1;
+            while (m_num_slots < m_size) m_num_slots *= 2;
+            m_heads = std::vector<std::atomic<std::uint32_t>>(num_tables * m_num_slots);
+            for (auto &head : m_heads) head.store(npos, std::memory_order_relaxed);
+
+            //
+            // Project onto every hyperplane of every table at once
+            //
+
+            const auto num_hyperplanes = num_tables * num_bits;
+            std::vector<float> hyperplanes(dim * num_hyperplanes);
+            {
+                std::mt19937 rng{ seed };
+                std::normal_distribution<float> normal;
+                for (auto &h : hyperplanes) h = normal(rng);
+            }
+
+            std::vector<float> mean(dim, 0.0f);
+            for (const float *row : rows) {
+                for (std::size_t i = 0; i < dim; ++i) mean[i] += row[i];
+            }
+            for (auto &m : mean) m /= static_cast<float>(m_size);
+
+            std::vector<float> offsets(num_hyperplanes);
+            multiply({ mean.data() }, dim, hyperplanes.data(), num_hyperplanes, offsets.data());
+
+            std::vector<float> projections(m_size * num_hyperplanes);
+            multiply(rows, dim, hyperplanes.data(), num_hyperplanes, projections.data());
+
+            //
+            // Hash and insert
+            //
+
+            const auto points = boost::irange<std::size_t>(0, m_size);
+            std::for_each(std::execution::par, points.begin(), points.end(), [&](std::size_t point) {
+                const float *p = projections.data() + point * num_hyperplanes;
+                for (std::size_t table = 0; table < num_tables; ++table) {
+                    std::uint32_t key = 0;
+                    for (std::size_t bit = 0; bit < num_bits; ++bit) {
+                        const auto h = table * num_bits + bit;
+                        key |= static_cast<std::uint32_t>(p[h] > offsets[h]) << bit;
+                    }
+
+                    m_keys[table * m_size + point] = key;
+                    insert(table, point);
+                }
+            });
+        }
+
+        std::size_t size() const noexcept { return m_size; }
+        std::size_t num_tables() const noexcept { return m_num_tables; }
+        std::size_t num_bits() const noexcept { return m_num_bits; }
+
+        // Pairs (x < y) that collide in at least one table, without duplicates. Within a bucket of more
+        // than max_bucket_size + 1 points, each point is paired with the max_bucket_size points after it
+        // only, which bounds the work on degenerate buckets (e.g. many identical images).
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> candidate_pairs(std::size_t max_bucket_size) const {
+            RUNTIME_ASSERT(max_bucket_size > 0);
+
+            std::vector<std::vector<std::pair<std::uint32_t, std::uint32_t>>> per_table(m_num_tables);
+            const auto tables = boost::irange<std::size_t>(0, m_num_tables);
+
+            std::for_each(std::execution::par, tables.begin(), tables.end(), [&](std::size_t table) {
+                auto &pairs = per_table[table];
+                std::vector<std::pair<std::uint32_t, std::uint32_t>> members;  // (key, point)
+
+                for (std::size_t s = 0; s < m_num_slots; ++s) {
+                    members.clear();
+                    for (auto point = m_heads[table * m_num_slots + s].load(std::memory_order_acquire); point != npos; point = m_next[table * m_size + point]) {
+                        members.emplace_back(m_keys[table * m_size + point], point);
+                    }
+
+                    // Several keys may share a slot, and insertion order is not deterministic
+                    std::sort(members.begin(), members.end());
+
+                    for (std::size_t begin = 0; begin < members.size();) {
+                        auto end = begin + 1;
+                        while (end < members.size() && members[end].first == members[begin].first) ++end;
+
+                        for (auto a = begin; a < end; ++a) {
+                            for (auto b = a + 1; b < std::min(end, a + 1 + max_bucket_size); ++b) {
+                                pairs.emplace_back(members[a].second, members[b].second);
+                            }
+                        }
+                        begin = end;
+                    }
+                }
+            });
+
+            std::vector<std::pair<std::uint32_t, std::uint32_t>> res;
+            for (auto &pairs : per_table) {
+                res.insert(res.end(), pairs.begin(), pairs.end());
+                pairs = {};
+            }
+
+            std::sort(std::execution::par, res.begin(), res.end());
+            res.erase(std::unique(res.begin(), res.end()), res.end());
+            return res;
+        }
+    };
+
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include "img_sort.h"
+#include "progress.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <thread>
+
+#include "boost/format.hpp"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "psapi")
+#endif
+#else
+#include <sys/resource.h>
+#endif
+
+namespace img_sort {
+
+    // Stages of a sort as sorter::run times them
+    enum class pipeline_stage {
+        scan,
+        histograms,
+        tree,
+        order,
+        output
+    };
+
+    static constexpr std::size_t num_pipeline_stages = 5;
+    static constexpr const char *pipeline_stage_names[num_pipeline_stages] = { "scan", "histograms", "tree", "order", "output" };
+
+    // Largest resident set of the process so far, 0 if the platform cannot tell
+    inline std::uint64_t peak_rss_bytes() {
+#if defined(_WIN32)
+        PROCESS_MEMORY_COUNTERS counters{};
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+        return counters.PeakWorkingSetSize;
+#else
+        rusage usage{};
+        if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+        return static_cast<std::uint64_t>(usage.ru_maxrss);
+#else
+        return static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;  // Kilobytes
+#endif
+#endif
+    }
+
+    // Totals of every sort in the process, for export. Stages and jobs add to relaxed atomics once each, and the
+    // item counters are the ones progress keeps, so nothing is counted twice on the hot paths.
+    class run_metrics {
+        struct state {
+            std::array<std::atomic<std::uint64_t>, num_pipeline_stages> stage_nanoseconds{};
+            std::atomic<std::uint64_t> cache_lookups{ 0 };
+            std::atomic<std::uint64_t> cache_hits{ 0 };
+            std::atomic<std::uint64_t> decode_failures{ 0 };
+            std::atomic<std::uint64_t> jobs_succeeded{ 0 };
+            std::atomic<std::uint64_t> jobs_failed{ 0 };
+        };
+
+        static state &get() noexcept {
+            static state s;
+            return s;
+        }
+
+    public:
+        struct snapshot {
+            std::array<double, num_pipeline_stages> stage_seconds{};
+            std::uint64_t cache_lookups = 0;
+            std::uint64_t cache_hits = 0;
+            std::uint64_t decode_failures = 0;
+            std::uint64_t jobs_succeeded = 0;
+            std::uint64_t jobs_failed = 0;
+            progress::snapshot items;
+            std::uint64_t peak_rss = 0;
+            bool running = false;
+            double timestamp = 0.0;  // Unix time of the snapshot
+        };
+
+        // Runs func, adding its wall time to stage
+        template <typename Func>
+        static decltype(auto) time(pipeline_stage stage, Func &&func) {
+            struct timer {
+                pipeline_stage stage;
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+                ~timer() {
+                    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+                    get().stage_nanoseconds[static_cast<std::size_t>(stage)].fetch_add(static_cast<std::uint64_t>(elapsed.count()), std::memory_order_relaxed);
+                }
+            } t{ stage };
+
+            return std::forward<Func>(func)();
+        }
+
+        static void cache_used(std::uint64_t lookups, std::uint64_t hits) noexcept {
+            get().cache_lookups.fetch_add(lookups, std::memory_order_relaxed);
+            get().cache_hits.fetch_add(hits, std::memory_order_relaxed);
+        }
+
+        static void decode_failed() noexcept {
+            get().decode_failures.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        static void job_done(bool succeeded) noexcept {
+            (succeeded ? get().jobs_succeeded : get().jobs_failed).fetch_add(1, std::memory_order_relaxed);
+        }
+
+        static snapshot sample(bool running) {
+            const auto &s = get();
+            snapshot res;
+            for (std::size_t i = 0; i < num_pipeline_stages; ++i) {
+                res.stage_seconds[i] = s.stage_nanoseconds[i].load(std::memory_order_relaxed) * 1e-9;
+            }
+            res.cache_lookups = s.cache_lookups.load(std::memory_order_relaxed);
+            res.cache_hits = s.cache_hits.load(std::memory_order_relaxed);
+            res.decode_failures = s.decode_failures.load(std::memory_order_relaxed);
+            res.jobs_succeeded = s.jobs_succeeded.load(std::memory_order_relaxed);
+            res.jobs_failed = s.jobs_failed.load(std::memory_order_relaxed);
+            res.items = progress::sample();
+            res.peak_rss = peak_rss_bytes();
+            res.running = running;
+            res.timestamp = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+            return res;
+        }
+    };
+
+    // Prometheus text exposition format, as node_exporter's textfile collector reads it. Rates are per second
+    // of stage time, which for a batch adds up over the jobs running at once.
+    inline void write_prometheus(std::ostream &os, const run_metrics::snapshot &m) {
+        auto family = [&](const char *name, const char *type, const char *help) {
+            os << "# HELP img_sort_" << name << ' ' << help << "\n# TYPE img_sort_" << name << ' ' << type << '\n';
+        };
+        auto ratio = [](double num, double den) { return den > 0.0 ? num / den : 0.0; };
+        const auto &stage = m.stage_seconds;
+
+        family("stage_seconds_total", "counter", "Wall time spent in each stage of the sorts.");
+        for (std::size_t i = 0; i < num_pipeline_stages; ++i) {
+            os << "img_sort_stage_seconds_total{stage=\"" << pipeline_stage_names[i] << "\"} " << boost::format{ "%1$.6f" } % stage[i] << '\n';
+        }
+
+        family("images_total", "counter", "Images histogrammed or restored.");
+        os << "img_sort_images_total " << m.items.files << '\n';
+        family("bytes_read_total", "counter", "Bytes of the image files decoded.");
+        os << "img_sort_bytes_read_total " << m.items.bytes << '\n';
+        family("pairs_total", "counter", "Distances computed by the dense pair stage.");
+        os << "img_sort_pairs_total " << m.items.pairs << '\n';
+        family("mst_edges_total", "counter", "Edges added by Prim.");
+        os << "img_sort_mst_edges_total " << m.items.edges << '\n';
+        family("decode_failures_total", "counter", "Images that could not be decoded.");
+        os << "img_sort_decode_failures_total " << m.decode_failures << '\n';
+
+        family("images_per_second", "gauge", "Images per second of histogram stage time.");
+        os << "img_sort_images_per_second " << boost::format{ "%1$.3f" } % ratio(m.items.files, stage[static_cast<std::size_t>(pipeline_stage::histograms)]) << '\n';
+        family("pairs_per_second", "gauge", "Pairs per second of tree stage time.");
+        os << "img_sort_pairs_per_second " << boost::format{ "%1$.3f" } % ratio(m.items.pairs, stage[static_cast<std::size_t>(pipeline_stage::tree)]) << '\n';
+
+        family("cache_lookups_total", "counter", "Images looked up in the descriptor cache.");
+        os << "img_sort_cache_lookups_total " << m.cache_lookups << '\n';
+        family("cache_hits_total", "counter", "Images restored from the descriptor cache.");
+        os << "img_sort_cache_hits_total " << m.cache_hits << '\n';
+        family("cache_hit_ratio", "gauge", "Share of descriptor cache lookups that hit.");
+        os << "img_sort_cache_hit_ratio " << boost::format{ "%1$.4f" } % ratio(m.cache_hits, m.cache_lookups) << '\n';
+
+        family("jobs_total", "counter", "Sorts finished, by outcome.");
+        os << "img_sort_jobs_total{status=\"succeeded\"} " << m.jobs_succeeded << '\n';
+        os << "img_sort_jobs_total{status=\"failed\"} " << m.jobs_failed << '\n';
+
+        family("peak_rss_bytes", "gauge", "Largest resident set of the process so far.");
+        os << "img_sort_peak_rss_bytes " << m.peak_rss << '\n';
+        family("running", "gauge", "1 while the process is sorting, 0 once it has finished.");
+        os << "img_sort_running " << (m.running ? 1 : 0) << '\n';
+        family("last_update_timestamp_seconds", "gauge", "Unix time this file was written.");
+        os << "img_sort_last_update_timestamp_seconds " << boost::format{ "%1$.3f" } % m.timestamp << '\n';
+    }
+
+    // Writes the metrics to a .prom file every interval while the process runs, and a last time on destruction.
+    // Each write goes to a temporary file beside it that is renamed over it, as the textfile collector requires.
+    class metrics_exporter {
+        std::filesystem::path m_path;
+        std::chrono::steady_clock::duration m_interval;
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_stop = false;
+        std::thread m_thread;
+
+        void write(bool running) const {
+            auto temp_path = m_path;
+            temp_path += ".tmp";
+            {
+                std::ofstream file{ temp_path, std::ios::trunc };
+                write_prometheus(file, run_metrics::sample(running));
+                if (!file) {
+                    logger::post<logger::warning>("Cannot write metrics to ", temp_path);
+                    return;
+                }
+            }
+
+            std::error_code ec;
+            std::filesystem::rename(temp_path, m_path, ec);
+        }
+
+        void run() {
+            std::unique_lock lock{ m_mutex };
+            while (!m_cv.wait_for(lock, m_interval, [this]() { return m_stop; })) {
+                write(true);
+            }
+            write(false);
+        }
+
+    public:
+        metrics_exporter(std::filesystem::path path, std::chrono::steady_clock::duration interval)
+            :m_path{ std::move(path) },
+             m_interval{ interval },
+             m_thread{ [this]() { run(); } }
+        {}
+
+        metrics_exporter(const metrics_exporter &) = delete;
+        metrics_exporter &operator=(const metrics_exporter &) = delete;
+
+        ~metrics_exporter() {
+            {
+                std::lock_guard lock{ m_mutex };
+                m_stop = true;
+            }
+            m_cv.notify_one();
+            m_thread.join();
+        }
+    };
+
+}
@@ -0,0 +1,389 @@
+#pragma once
+
+#include "img_sort.h"
+#include "kernels.h"
+#include "probes.h"
+#include "progress.h"
+
+#include <algorithm>
+#include <cmath>
+#include <execution>
+#include <limits>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+
+#include "boost/container/small_vector.hpp"
+
+namespace img_sort {
+
+    class tree {
+#ifndef NDEBUG
+        std::vector<bool> m_parent;
+#endif
+        std::vector<boost::container::small_vector<std::size_t, 1>> m_adjacency_list;
+        std::size_t m_num_edges = 0;
+
+    public:
+        tree(std::size_t size)
+            :m_adjacency_list(size)
+        {
+            RUNTIME_ASSERT(size > 0);
+#ifndef NDEBUG
+            m_parent.assign(size, false);
+#endif
+        }
+
+        bool try_insert(std::size_t parent, std::size_t child) {
+            RUNTIME_ASSERT(parent < m_adjacency_list.size());
+
+#ifndef NDEBUG
+            RUNTIME_ASSERT(child < m_parent.size());
+            if (contains(child)) {
+                return false;
+            }
+            m_parent[child] = true;
+#endif
+            m_adjacency_list[parent].emplace_back(child);
+            ++m_num_edges;
+            return true;
+        }
+
+#ifndef NDEBUG
+        bool contains(std::size_t node) const {
+            return node == 0 || m_parent[node];
+        }
+#endif
+
+        auto &children(std::size_t node) const {
+            RUNTIME_ASSERT(node < m_adjacency_list.size());
+            return m_adjacency_list[node];
+        }
+
+        std::size_t num_edges() const noexcept {
+            return m_num_edges;
+        }
+
+        std::size_t size() const noexcept {
+            return m_adjacency_list.size();
+        }
+    };
+
+    // Dense Prim. weights(x, y) may be a triangular_table or any callable returning the edge cost.
+    // Once cancellation is requested, this and the other Prims return the tree grown so far, rooted at 0.
+    template <typename Weights>
+    tree compute_mst(std::size_t size, const Weights &weights) {
+        using T = std::decay_t<decltype(weights(std::size_t{}, std::size_t{}))>;
+
+        RUNTIME_ASSERT(size >= 2);
+        tree t{ size };
+
+        // Candidates as separate arrays, so that the relax step is a kernel over contiguous costs
+        std::vector<std::size_t> destination(size);
+        std::vector<std::uint64_t> source(size, 0);
+        std::vector<T> cost(size, std::numeric_limits<T>::max());
+        std::vector<T> weight(size);
+        std::iota(destination.begin(), destination.end(), std::size_t{ 0 });
+
+        const auto final_num_edges = size - 1;
+        std::size_t num_candidates = size;
+        std::size_t just_inserted_index = 0;
+        std::size_t just_inserted = 0;
+
+        while (t.num_edges() < final_num_edges && !cancellation::requested()) {
+            --num_candidates;
+            std::swap(destination[just_inserted_index], destination[num_candidates]);
+            std::swap(source[just_inserted_index], source[num_candidates]);
+            std::swap(cost[just_inserted_index], cost[num_candidates]);
+
+            // Might be interesting to parallelise for large size
+            for (std::size_t i = 0; i < num_candidates; ++i) {
+                weight[i] = weights(just_inserted, destination[i]);
+            }
+            const auto min_index = kernel::relax(weight.data(), cost.data(), source.data(), num_candidates, just_inserted);
+
+            bool insert_result = t.try_insert(static_cast<std::size_t>(source[min_index]), destination[min_index]);
+            RUNTIME_ASSERT(insert_result);
+            progress::edge_done();
+            if (t.num_edges() % probe_edge_batch == 0 || t.num_edges() == final_num_edges) IMG_SORT_PROBE(mst__edges, t.num_edges(), final_num_edges);
+            just_inserted_index = min_index;
+            just_inserted = destination[min_index];
+        }
+
+        return t;
+    }
+
+    struct mst_stats {
+        std::size_t evaluated = 0;
+        std::size_t pruned = 0;
+
+        static constexpr std::size_t num_pairs(std::size_t size) noexcept {
+            return size * (size - 1) / 2;
+        }
+    };
+
+    // Stores a distance in [0, 1] as T. Integers are fixed point over [0, 1]. Every conversion is monotone,
+    // so d1 < d2 implies quantise(d1) <= quantise(d2): quantisation can merge distances but never reorder them.
+    template <typename T>
+    T quantise(double d) noexcept {
+        if constexpr (std::is_floating_point_v<T>) {
+            return static_cast<T>(d);
+        }
+        else {
+            static_assert(std::is_unsigned_v<T>);
+            constexpr double max = std::numeric_limits<T>::max();
+            return static_cast<T>(std::round(std::clamp(d, 0.0, 1.0) * max));
+        }
+    }
+
+    // Prim over quantised weights that still returns the exact MST of dist. Because quantisation is monotone,
+    // the cheapest candidate is always among those tied at the minimum key, and its cheapest edge among the
+    // sources tied at its key. Only those ties are resolved with exact distances, counted in stats.evaluated.
+    template <typename Weights, typename Distance>
+    tree compute_mst_refined(std::size_t size, const Weights &weights, const Distance &dist, mst_stats &stats) {
+        using T = std::decay_t<decltype(weights(std::size_t{}, std::size_t{}))>;
+
+        RUNTIME_ASSERT(size >= 2);
+        tree t{ size };
+
+        static constexpr std::uint64_t no_source = std::numeric_limits<std::uint64_t>::max();
+
+        // Candidates as separate arrays, so that the relax step is a kernel over contiguous keys. A candidate's
+        // sources are source[i] and, if extra[i] is still about it, extra[i].others, all at distance key[i].
+        struct tie_state {
+            std::uint64_t source = no_source;  // The source[i] this is about, stale once that changes
+            boost::container::small_vector<std::size_t, 1> others;
+            double cost = 0.0;  // Exact distance to source, if has_cost
+            bool has_cost = false;
+        };
+
+        std::vector<std::size_t> destination(size);
+        std::vector<std::uint64_t> source(size, no_source);
+        std::vector<T> key(size, std::numeric_limits<T>::max());
+        std::vector<T> weight(size);
+        std::vector<tie_state> extra(size);
+        std::vector<std::uint64_t> tied(kernel::scalar::tie_words(size));
+        std::iota(destination.begin(), destination.end(), std::size_t{ 0 });
+
+        auto has_ties = [&](std::size_t i) {
+            return extra[i].source == source[i] && !extra[i].others.empty();
+        };
+
+        // Reduces the sources of a candidate to the exactly closest one, returning its distance
+        auto resolve = [&](std::size_t i) {
+            auto &state = extra[i];
+            if (state.source != source[i]) {
+                state = tie_state{};
+                state.source = source[i];
+            }
+            if (state.has_cost && state.others.empty()) return state.cost;
+
+            if (!state.has_cost) {
+                state.cost = dist(static_cast<std::size_t>(state.source), destination[i]);
+                state.has_cost = true;
+                ++stats.evaluated;
+            }
+            for (auto other : state.others) {
+                const double cost = dist(other, destination[i]);
+                ++stats.evaluated;
+                if (cost < state.cost) {
+                    state.cost = cost;
+                    state.source = other;
+                }
+            }
+
+            state.others.clear();
+            source[i] = state.source;
+            return state.cost;
+        };
+
+        const auto final_num_edges = size - 1;
+        std::size_t num_candidates = size;
+        std::size_t just_inserted_index = 0;
+        std::size_t just_inserted = 0;
+
+        while (t.num_edges() < final_num_edges && !cancellation::requested()) {
+            --num_candidates;
+            std::swap(destination[just_inserted_index], destination[num_candidates]);
+            std::swap(source[just_inserted_index], source[num_candidates]);
+            std::swap(key[just_inserted_index], key[num_candidates]);
+            std::swap(extra[just_inserted_index], extra[num_candidates]);
+
+            for (std::size_t i = 0; i < num_candidates; ++i) {
+                weight[i] = weights(just_inserted, destination[i]);
+            }
+            const auto lowest = kernel::relax_ties(weight.data(), key.data(), source.data(), tied.data(), num_candidates, just_inserted);
+
+            // Record just_inserted as another source wherever it ties the key, or as the first if there was none
+            for (std::size_t w = 0; w < kernel::scalar::tie_words(num_candidates); ++w) {
+                for (auto bits = tied[w]; bits != 0; bits &= bits - 1) {
+                    const std::size_t i = w * 64 + kernel::scalar::lowest_bit(bits);
+                    if (source[i] == no_source) {
+                        source[i] = just_inserted;
+                        continue;
+                    }
+                    if (extra[i].source != source[i]) {
+                        extra[i] = tie_state{};
+                        extra[i].source = source[i];
+                    }
+                    extra[i].others.push_back(just_inserted);
+                }
+            }
+
+            // A lone candidate needs no exact distance unless its own sources tie
+            std::size_t min_index = lowest.index;
+            if (!lowest.shared) {
+                if (has_ties(min_index)) resolve(min_index);
+            }
+            else {
+                const T min_key = key[lowest.index];
+                double min_cost = std::numeric_limits<double>::infinity();
+                for (std::size_t i = 0; i < num_candidates; ++i) {
+                    if (key[i] != min_key) continue;
+                    const double cost = resolve(i);
+                    if (cost < min_cost) {
+                        min_cost = cost;
+                        min_index = i;
+                    }
+                }
+            }
+
+            bool insert_result = t.try_insert(static_cast<std::size_t>(source[min_index]), destination[min_index]);
+            RUNTIME_ASSERT(insert_result);
+            progress::edge_done();
+            if (t.num_edges() % probe_edge_batch == 0 || t.num_edges() == final_num_edges) IMG_SORT_PROBE(mst__edges, t.num_edges(), final_num_edges);
+            just_inserted_index = min_index;
+            just_inserted = destination[min_index];
+        }
+
+        return t;
+    }
+
+    // Distances from every point to a small set of pivots. By the triangle inequality,
+    // |d(a, p) - d(b, p)| <= d(a, b) for every pivot p, which gives a cheap lower bound.
+    class pivot_index {
+        std::vector<std::size_t> m_pivots;
+        std::vector<double> m_distances;  // m_distances[point * num_pivots + pivot]
+        std::size_t m_size = 0;
+
+    public:
+        // Pivots are picked farthest-first, starting from point 0. Every pivot costs size - 1 evaluations.
+        template <typename Distance>
+        pivot_index(std::size_t size, std::size_t num_pivots, const Distance &dist, mst_stats &stats)
+            :m_size{ size }
+        {
+            RUNTIME_ASSERT(size > 0);
+            num_pivots = std::min(num_pivots, size);
+
+            std::vector<double> nearest_pivot(size, std::numeric_limits<double>::max());
+            std::vector<double> column(size);
+            std::vector<std::vector<double>> columns;
+
+            std::size_t next = 0;
+            for (std::size_t p = 0; p < num_pivots; ++p) {
+                m_pivots.push_back(next);
+
+                const auto range = boost::irange<std::size_t>(0, size);
+                std::for_each(std::execution::par, range.begin(), range.end(), [&](std::size_t i) {
+                    column[i] = i == next ? 0.0 : static_cast<double>(dist(next, i));
+                    nearest_pivot[i] = std::min(nearest_pivot[i], column[i]);
+                });
+                stats.evaluated += size - 1;
+                columns.push_back(column);
+
+                next = std::max_element(nearest_pivot.begin(), nearest_pivot.end()) - nearest_pivot.begin();
+                if (nearest_pivot[next] <= 0.0) break;  // Every point coincides with a pivot
+            }
+
+            m_distances.resize(size * m_pivots.size());
+            for (std::size_t i = 0; i < size; ++i) {
+                for (std::size_t p = 0; p < m_pivots.size(); ++p) {
+                    m_distances[i * m_pivots.size() + p] = columns[p][i];
+                }
+            }
+        }
+
+        double lower_bound(std::size_t a, std::size_t b) const noexcept {
+            const auto m = m_pivots.size();
+            const double* da = m_distances.data() + a * m;
+            const double* db = m_distances.data() + b * m;
+
+            double res = 0.0;
+            for (std::size_t p = 0; p < m; ++p) {
+                res = std::max(res, std::abs(da[p] - db[p]));
+            }
+            return res;
+        }
+
+        std::size_t num_pivots() const noexcept {
+            return m_pivots.size();
+        }
+    };
+
+    // Prim that evaluates dist(x, y) lazily, skipping every pair whose pivot lower bound already
+    // exceeds the candidate's current best. Exact for true metrics, up to rounding in dist.
+    template <typename Distance>
+    tree compute_mst_pruned(std::size_t size, const Distance &dist, const pivot_index &pivots, mst_stats &stats) {
+        RUNTIME_ASSERT(size >= 2);
+        tree t{ size };
+
+        // Slack for floating point error in the kernels, which may violate the triangle inequality by an ulp or so
+        constexpr double tolerance = 1e-6;
+
+        struct pq_entry {
+            std::size_t source = 0;
+            std::size_t destination = 0;
+            double cost = std::numeric_limits<double>::max();
+            bool evaluated = false;
+        };
+
+        std::vector<pq_entry> candidates(size);
+        for (std::size_t i = 0; i < size; ++i) {
+            candidates[i].destination = i;
+        }
+
+        const auto final_num_edges = size - 1;
+        std::size_t just_inserted_index = 0;
+        std::size_t just_inserted = 0;
+
+        while (t.num_edges() < final_num_edges && !cancellation::requested()) {
+            std::swap(candidates[just_inserted_index], candidates[candidates.size() - 1]);
+            candidates.pop_back();
+
+            std::for_each(std::execution::par, candidates.begin(), candidates.end(), [&](pq_entry &curr_candidate) {
+                curr_candidate.evaluated = pivots.lower_bound(just_inserted, curr_candidate.destination) <= curr_candidate.cost + tolerance;
+                if (!curr_candidate.evaluated) return;
+
+                const double cost_to_just_inserted = dist(just_inserted, curr_candidate.destination);
+                if (cost_to_just_inserted <= curr_candidate.cost) {
+                    curr_candidate.source = just_inserted;
+                    curr_candidate.cost = cost_to_just_inserted;
+                }
+            });
+
+            const pq_entry* min_entry = &candidates.front();
+            for (const auto &curr_candidate : candidates) {
+                if (curr_candidate.evaluated) {
+                    ++stats.evaluated;
+                }
+                else {
+                    ++stats.pruned;
+                }
+
+                if (curr_candidate.cost <= min_entry->cost) {
+                    min_entry = &curr_candidate;
+                }
+            }
+
+            bool insert_result = t.try_insert(min_entry->source, min_entry->destination);
+            RUNTIME_ASSERT(insert_result);
+            progress::edge_done();
+            if (t.num_edges() % probe_edge_batch == 0 || t.num_edges() == final_num_edges) IMG_SORT_PROBE(mst__edges, t.num_edges(), final_num_edges);
+            just_inserted_index = min_entry - candidates.data();
+            just_inserted = min_entry->destination;
+        }
+
+        return t;
+    }
+
+}
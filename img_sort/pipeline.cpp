@@ -0,0 +1,1722 @@
+
+
+#include "pipeline.h"
+#include "anytime.h"
+#include "checkpoint.h"
+#include "distance_metric.h"
+#include "descriptor_cache.h"
+#include "exif.h"
+#include "huge_page_storage.h"
+#include "jpeg_decode.h"
+#include "lsh.h"
+#include "metrics.h"
+#include "mst.h"
+#include "png_decode.h"
+#include "pq.h"
+#include "probes.h"
+#include "progress.h"
+#include "projection.h"
+#include "read_order.h"
+#include "shard.h"
+#include "sparse_mst.h"
+#include "system_resources.h"
+#include "tuning.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <execution>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <stack>
+#include <queue>
+
+#include "boost/format.hpp"
+#include "boost/range/adaptor/reversed.hpp"
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/highgui.hpp"
+#include "opencv2/imgproc.hpp"
+
+namespace img_sort {
+
+    bool is_jpeg(const std::filesystem::path &filename) {
+        const auto ext = filename.extension().string();
+        return ext == ".jpg" || ext == ".jpeg" || ext == ".jfif";
+    }
+
+    bool is_png(const std::filesystem::path &filename) {
+        return filename.extension() == ".png";
+    }
+
+    cv::Mat make_histogram_mat(const std::vector<float> &bins) {
+        constexpr int bins_per_channel = static_cast<int>(histogram_bins);
+        const int sizes[] = { bins_per_channel, bins_per_channel, bins_per_channel };
+        cv::Mat res(3, sizes, CV_32F);
+        RUNTIME_ASSERT(bins.size() == res.total());
+        std::copy(bins.begin(), bins.end(), res.ptr<float>());
+        return res;
+    }
+
+    // Histogram of a BGR image, converted to the given colour space
+    cv::Mat image_histogram(cv::Mat img, colour_space colour) {
+        if (colour == colour_space::ycbcr) {
+            cv::cvtColor(img, img, cv::COLOR_BGR2YCrCb);
+        }
+
+        cv::Mat hist;
+
+        int bbins = histogram_bins, gbins = histogram_bins, rbins = histogram_bins;
+        int histSize[] = { bbins, gbins, rbins };
+
+        float branges[] = { 0, 256 };
+        float granges[] = { 0, 256 };
+        float tranges[] = { 0, 256 };
+
+        const float* ranges[] = { branges, granges, tranges };
+        int channels[] = { 0, 1, 2 };
+
+        cv::calcHist(&img, 1, channels, cv::Mat(), hist, 3, histSize, ranges, true, false);
+
+        return hist;
+    }
+
+    // Histogram of an image decoded in full
+    cv::Mat decoded_histogram(const std::filesystem::path &filename, colour_space colour) {
+        cv::Mat img = cv::imread(filename.string());
+        if (img.empty()) {
+            logger::post<logger::warning>("Failed to load ", filename);
+            return {};
+        }
+        return image_histogram(std::move(img), colour);
+    }
+
+    // Histogram of the EXIF thumbnail of a JPEG, if it has one with sides of at least min_side pixels
+    cv::Mat exif_thumbnail_histogram(const std::filesystem::path &filename, std::size_t min_side, colour_space colour) {
+        const auto thumbnail = read_exif_thumbnail(filename);
+        const auto dimensions = jpeg_dimensions(thumbnail.data(), thumbnail.size());
+        if (!dimensions || std::min(dimensions->first, dimensions->second) < min_side) return {};
+
+        cv::Mat img = cv::imdecode(thumbnail, cv::IMREAD_COLOR);
+        if (img.empty()) return {};
+        return image_histogram(std::move(img), colour);
+    }
+
+    cv::Mat calculate_histogram(const std::filesystem::path &filename, const ingest_options &ingest, ingest_stats *stats = nullptr) {
+        try {
+            if (is_jpeg(filename) && ingest.exif_thumbnail > 0) {
+                cv::Mat hist = exif_thumbnail_histogram(filename, ingest.exif_thumbnail, ingest.colour);
+                if (!hist.empty()) {
+                    if (stats) stats->exif_thumbnails.fetch_add(1, std::memory_order_relaxed);
+                    return hist;
+                }
+            }
+
+            if (is_jpeg(filename) && ingest.jpeg_dc) {
+                const auto bins = jpeg_dc_histogram(filename, histogram_bins, ingest.colour);
+                if (!bins.empty()) return make_histogram_mat(bins);
+            }
+
+            if (ingest.target_resolution > 0 && (is_jpeg(filename) || is_png(filename))) {
+                bool stopped_early = true;
+                const auto bins = is_jpeg(filename) ? jpeg_reduced_histogram(filename, histogram_bins, ingest.target_resolution, ingest.colour, stopped_early)
+                                                    : png_adam7_histogram(filename, histogram_bins, ingest.target_resolution, ingest.colour);
+                if (!bins.empty()) {
+                    if (stats) {
+                        stats->reduced_decodes.fetch_add(1, std::memory_order_relaxed);
+                        if (stopped_early) stats->partial_reads.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    return make_histogram_mat(bins);
+                }
+            }
+
+            if (is_jpeg(filename) && ingest.colour == colour_space::ycbcr) {
+                const auto bins = jpeg_ycbcr_histogram(filename, histogram_bins);
+                if (!bins.empty()) return make_histogram_mat(bins);
+            }
+
+            // Large images never exist in full, so that a worker holds a row rather than the whole image. Smaller
+            // ones are decoded whole from the same header read, rather than opened again by cv::imread.
+            if (is_jpeg(filename) || is_png(filename)) {
+                bgr_image image;
+                const auto bins = is_jpeg(filename) ? jpeg_streamed_histogram(filename, histogram_bins, ingest.stream_pixels, ingest.colour, &image)
+                                                    : png_streamed_histogram(filename, histogram_bins, ingest.stream_pixels, ingest.colour, &image);
+                if (!bins.empty()) {
+                    if (stats) stats->streamed_decodes.fetch_add(1, std::memory_order_relaxed);
+                    return make_histogram_mat(bins);
+                }
+                if (!image.pixels.empty()) {
+                    return image_histogram(cv::Mat(static_cast<int>(image.height), static_cast<int>(image.width), CV_8UC3, image.pixels.data()), ingest.colour);
+                }
+            }
+
+            return decoded_histogram(filename, ingest.colour);
+        }
+        catch (...) {
+            logger::post<logger::error>("Failed to calculate histogram for ", filename);
+        }
+
+        return {};
+    }
+
+    // Pixels a histogram counts: those of the image for full and DC decodes, those decoded for reduced ones
+    std::uint64_t histogram_pixels(const cv::Mat &hist) {
+        if (hist.empty()) return 0;
+        const auto *bins = hist.ptr<float>();
+        return static_cast<std::uint64_t>(std::reduce(bins, bins + hist.total(), 0.0) + 0.5);
+    }
+
+    cv::Mat make_descriptor(const metric_functions &metric, const cv::Mat &hist) {
+        if (hist.empty()) {
+            return {};
+        }
+
+        RUNTIME_ASSERT(hist.isContinuous() && hist.total() == histogram_bins * histogram_bins * histogram_bins);
+        cv::Mat descriptor(1, static_cast<int>(metric.descriptor_size(histogram_bins)), CV_32F);
+        metric.prepare(hist.ptr<float>(), histogram_bins, descriptor.ptr<float>());
+        return descriptor;
+    }
+
+    // Computes the descriptor straight into the cache, unless it can be restored from the previous run
+    histogram cached_histogram(const metric_functions &metric, const ingest_options &ingest, ingest_stats &stats, descriptor_cache &cache, const std::filesystem::path &filename, std::size_t i,
+                               std::uint64_t *pixels = nullptr) {
+        if (!cache.restore(i)) {
+            const cv::Mat hist = calculate_histogram(filename, ingest, &stats);
+            if (pixels) *pixels = histogram_pixels(hist);
+            if (hist.empty()) {
+                return {};
+            }
+
+            RUNTIME_ASSERT(hist.isContinuous() && hist.total() == histogram_bins * histogram_bins * histogram_bins);
+            metric.prepare(hist.ptr<float>(), histogram_bins, cache.descriptor(i));
+            cache.set_valid(i);
+        }
+
+        // Points into the mapped file, valid until cache.commit()
+        return { cv::Mat(1, static_cast<int>(cache.descriptor_size()), CV_32F, cache.descriptor(i)), filename, i };
+    }
+
+    double compute_histogram_diff(const metric_functions &metric, const histogram &lhs, const histogram &rhs) {
+        RUNTIME_ASSERT(lhs.mat.total() == rhs.mat.total());
+        return metric.distance(lhs.mat.ptr<float>(), rhs.mat.ptr<float>(), lhs.mat.total());
+    }
+
+    // Single-threaded pairs per second of each metric over the descriptors of the given histograms
+    void benchmark_metrics(const std::vector<cv::Mat> &hists) {
+        RUNTIME_ASSERT(hists.size() >= 2);
+        logger::post<logger::info>("Benchmarking distance metrics on ", hists.size(), " images (", kernel::active().name, " kernels)...");
+
+        for (auto type : all_metric_types) {
+            const auto metric = get_metric_functions(type);
+
+            std::vector<histogram> descriptors(hists.size());
+            std::transform(hists.begin(), hists.end(), descriptors.begin(),
+                [&](const auto &h) { return histogram{ make_descriptor(metric, h), {} }; });
+
+            std::size_t num_pairs = 0;
+            double checksum = 0.0;
+
+            const auto start = std::chrono::steady_clock::now();
+            auto elapsed = std::chrono::duration<double>::zero();
+            do {
+                for (std::size_t y = 1; y < descriptors.size(); ++y) {
+                    for (std::size_t x = 0; x < y; ++x) {
+                        checksum += compute_histogram_diff(metric, descriptors[x], descriptors[y]);
+                    }
+                }
+
+                num_pairs += descriptors.size() * (descriptors.size() - 1) / 2;
+                elapsed = std::chrono::steady_clock::now() - start;
+            } while (elapsed < std::chrono::milliseconds{ 500 });
+
+            logger::post<logger::info>(boost::format{ "%-16s %14.0f pairs/s  (mean distance %.4f)" }
+                                       % metric.name % (num_pairs / elapsed.count()) % (checksum / num_pairs));
+        }
+    }
+
+    // Single-threaded decode time of each ingest path over the given files, and how far its histograms are from
+    // those of a full decode: the mean Bhattacharyya distance, and how often an image keeps its nearest neighbour.
+    // EXIF thumbnails are taken at any size and reduced decodes go down to 64 pixels, unless ingest says otherwise.
+    void benchmark_decode(const std::vector<std::filesystem::path> &filenames, const ingest_options &ingest) {
+        logger::post<logger::info>("Benchmarking decoders on ", filenames.size(), " images...");
+        const std::size_t min_thumbnail_side = ingest.exif_thumbnail;
+        const std::size_t thumbnail = std::max<std::size_t>(min_thumbnail_side, 1);
+        const std::size_t target_resolution = ingest.target_resolution > 0 ? ingest.target_resolution : 64;
+        ingest_stats stats;
+        const auto metric = get_metric_functions(metric_type::bhattacharyya);
+
+        // Warm the page cache, so that the first path is not charged for the reads
+        for (const auto &f : filenames) {
+            std::ifstream file{ f, std::ios::binary };
+            std::vector<char> buffer(1 << 16);
+            while (file.read(buffer.data(), buffer.size())) {}
+        }
+
+        // The first path of each colour space is the reference for the others
+        struct decode_path {
+            std::string_view name;
+            colour_space colour;
+            std::function<cv::Mat(const std::filesystem::path &)> decode;
+        };
+        const decode_path paths[] = {
+            { "BGR   full decode", colour_space::bgr, [](const auto &f) { return decoded_histogram(f, colour_space::bgr); } },
+            { "BGR   JPEG DC only", colour_space::bgr, [](const auto &f) { return calculate_histogram(f, { true, colour_space::bgr }); } },
+            { "BGR   EXIF thumbnail", colour_space::bgr, [&](const auto &f) { return calculate_histogram(f, { false, colour_space::bgr, thumbnail }, &stats); } },
+            { "BGR   reduced", colour_space::bgr, [&](const auto &f) { return calculate_histogram(f, { false, colour_space::bgr, 0, target_resolution }, &stats); } },
+            { "YCbCr full decode", colour_space::ycbcr, [](const auto &f) { return decoded_histogram(f, colour_space::ycbcr); } },
+            { "YCbCr JPEG planar", colour_space::ycbcr, [](const auto &f) { return calculate_histogram(f, { false, colour_space::ycbcr }); } },
+            { "YCbCr JPEG DC only", colour_space::ycbcr, [](const auto &f) { return calculate_histogram(f, { true, colour_space::ycbcr }); } }
+        };
+
+        std::vector<histogram> reference;
+        std::optional<colour_space> reference_colour;
+        double reference_seconds = 0.0;
+        auto nearest = [&](const std::vector<histogram> &descriptors, std::size_t i) {
+            std::size_t res = i == 0 ? 1 : 0;
+            for (std::size_t j = 0; j < descriptors.size(); ++j) {
+                if (j != i && compute_histogram_diff(metric, descriptors[i], descriptors[j]) < compute_histogram_diff(metric, descriptors[i], descriptors[res])) res = j;
+            }
+            return res;
+        };
+
+        for (const auto &[name, colour, decode] : paths) {
+            std::vector<histogram> descriptors;
+            const auto start = std::chrono::steady_clock::now();
+            for (const auto &f : filenames) {
+                descriptors.emplace_back(make_descriptor(metric, decode(f)), f);
+            }
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            if (reference_colour != colour) {
+                reference = descriptors;
+                reference_colour = colour;
+                reference_seconds = elapsed.count();
+                logger::post<logger::info>(boost::format{ "%-20s %8.2f ms/image" } % name % (elapsed.count() * 1e3 / filenames.size()));
+                continue;
+            }
+
+            std::size_t compared = 0, same_neighbour = 0;
+            double total_distance = 0.0, max_distance = 0.0;
+            for (std::size_t i = 0; i < filenames.size(); ++i) {
+                if (reference[i].mat.empty() || descriptors[i].mat.empty()) continue;
+
+                const double d = compute_histogram_diff(metric, reference[i], descriptors[i]);
+                total_distance += d;
+                max_distance = std::max(max_distance, d);
+                same_neighbour += filenames.size() > 2 && nearest(reference, i) == nearest(descriptors, i);
+                ++compared;
+            }
+
+            logger::post<logger::info>(boost::format{ "%-20s %8.2f ms/image  %5.1fx  distance to full decode mean %.4f, max %.4f  same nearest neighbour %.0f%%" }
+                                       % name % (elapsed.count() * 1e3 / filenames.size()) % (reference_seconds / elapsed.count())
+                                       % (total_distance / std::max<std::size_t>(compared, 1)) % max_distance
+                                       % (100.0 * same_neighbour / std::max<std::size_t>(compared, 1)));
+        }
+
+        logger::post<logger::info>(stats.exif_thumbnails.load(), " of ", filenames.size(), " images had an EXIF thumbnail",
+                                   min_thumbnail_side > 0 ? " of at least " + std::to_string(min_thumbnail_side) + " pixels a side" : std::string{});
+        logger::post<logger::info>(stats.reduced_decodes.load(), " of ", filenames.size(), " images could be decoded down to ", target_resolution,
+                                   " pixels a side, ", stats.partial_reads.load(), " of them from the first part of the file");
+    }
+
+    std::optional<std::vector<std::size_t>> pre_order(const tree &mst) {
+        std::vector<std::size_t> order;
+        order.reserve(mst.num_edges() + 1);
+
+        std::stack<std::size_t, std::vector<std::size_t>> stack;
+        stack.push(0);
+
+        while (!stack.empty()) {
+            std::size_t curr_node = stack.top();
+            stack.pop();
+
+            order.push_back(curr_node);
+
+            for (std::size_t child : boost::adaptors::reverse(mst.children(curr_node))) {
+                stack.push(child);
+            }
+        }
+
+        RUNTIME_ASSERT(order.size() == (mst.num_edges() + 1));
+        return order;
+    }
+
+    // Replaces every descriptor by a sparse random projection of it. Euclidean distances between the reduced
+    // descriptors approximate the full metric, which must be Euclidean on its descriptors.
+    void project_descriptors(const metric_functions &metric, std::vector<histogram> &histograms, std::size_t target_dim) {
+        RUNTIME_ASSERT(metric.is_euclidean);
+        const auto dim = histograms.front().mat.total();
+        const auto reduced_metric = get_metric_functions(metric_type::l2);
+
+        //
+        // Report distortion on a sample for a few dimensions
+        //
+
+        constexpr std::size_t sample_size = 128;
+        std::vector<const float *> sample;
+        for (const auto &h : histograms) {
+            sample.push_back(h.mat.ptr<float>());
+        }
+
+        std::mt19937 rng{ 0 };
+        std::shuffle(sample.begin(), sample.end(), rng);
+        sample.resize(std::min(sample.size(), sample_size));
+
+        std::vector<std::size_t> dims = { 64, 128, 256, target_dim };
+        std::sort(dims.begin(), dims.end());
+        dims.erase(std::unique(dims.begin(), dims.end()), dims.end());
+
+        logger::post<logger::info>("Distortion of ", metric.name, " on ", mst_stats::num_pairs(sample.size()), " sample pairs:");
+        for (auto d : dims) {
+            const auto reduced = random_projection{ dim, d }.project(sample);
+            const auto error = measure_distortion(sample.size(),
+                [&](std::size_t x, std::size_t y) { return metric.distance(sample[x], sample[y], dim); },
+                [&](std::size_t x, std::size_t y) { return reduced_metric.distance(&reduced[x * d], &reduced[y * d], d); });
+
+            logger::post<logger::info>(boost::format{ "  %1$4d dims: mean error %2$.4f (%3$.1f%%), max error %4$.4f%5%" }
+                                       % d % error.mean_absolute_error % (100.0 * error.mean_relative_error) % error.max_absolute_error
+                                       % (d == target_dim ? "  <- selected" : ""));
+        }
+
+        //
+        // Project
+        //
+
+        logger::post<logger::info>("Projecting ", histograms.size(), " descriptors from ", dim, " to ", target_dim, " dimensions...");
+        logger::benchmark([&]() {
+            std::vector<const float *> rows;
+            for (const auto &h : histograms) {
+                rows.push_back(h.mat.ptr<float>());
+            }
+
+            const auto reduced = random_projection{ dim, target_dim }.project(rows);
+            for (std::size_t i = 0; i < histograms.size(); ++i) {
+                histograms[i].mat = cv::Mat(1, static_cast<int>(target_dim), CV_32F, const_cast<float *>(&reduced[i * target_dim])).clone();
+            }
+        });
+    }
+
+    // Dense Prim over a full table of distances stored as T. Anything narrower than double is resolved to the
+    // exact MST with compute_mst_refined, which needs the descriptors for the few tied pairs, so they are kept.
+    template <typename T, typename Storage>
+    tree build_mst_dense(const metric_functions &metric,
+                         std::vector<histogram> &histograms,
+                         triangular_table<T, Storage> &diff_table,
+                         checkpoint *cp,
+                         std::chrono::seconds checkpoint_interval,
+                         std::size_t tile_columns) {
+        constexpr bool exact = std::is_same_v<T, double>;
+        auto dist = [&](std::size_t x, std::size_t y) { return compute_histogram_diff(metric, histograms[x], histograms[y]); };
+
+        //
+        // Calculate differences
+        //
+
+        {
+            // Blocks that were flushed before are flagged, and everything else is overwritten
+            std::optional<checkpoint_writer> writer;
+            if (cp) {
+                writer.emplace(*cp, diff_table.blocks(), checkpoint_interval);
+            }
+
+            // Same row blocks as the table's first touch, so that each block is filled where its pages were placed.
+            // Once the run is cancelled the remaining pairs are skipped, and unfinished blocks are left unflagged.
+            auto compute_block = [&](std::size_t block) {
+                if (cancellation::requested() || (cp && cp->is_complete(block))) return;
+
+                const auto [first, last] = diff_table.blocks().rows(block);
+                std::uint64_t batch = 0;
+                for_each_pair_tiled(first, last, tile_columns, [&](std::size_t x, std::size_t y) {
+                    if (cancellation::requested()) return;
+
+                    diff_table.row_data(y)[x] = quantise<T>(dist(x, y));
+                    if (++batch == progress::pair_batch) {
+                        progress::pairs_done(batch);
+                        batch = 0;
+                    }
+                });
+                progress::pairs_done(batch);
+
+                if (cancellation::requested()) return;
+                if (writer) writer->block_done(block);
+                IMG_SORT_PROBE(pairs__block, block, first, last);
+            };
+
+            const auto blocks = boost::irange<std::size_t>(0, diff_table.blocks().size());
+            std::uint64_t pending_pairs = 0;
+            for (auto block : blocks) {
+                const auto [first, last] = diff_table.blocks().rows(block);
+                if (!(cp && cp->is_complete(block))) pending_pairs += mst_stats::num_pairs(last) - mst_stats::num_pairs(first);
+            }
+            progress::begin(progress_stage::pairs, pending_pairs);
+            logger::benchmark([&]() { std::for_each(execution_policy, blocks.begin(), blocks.end(), compute_block); });
+            if (cancellation::requested()) {
+                // No edges, and the descriptors kept for ordering what there is
+                return tree{ histograms.size() };
+            }
+        }
+
+        //
+        // Create MST
+        //
+
+        logger::post<logger::info>("Computing MST...");
+        progress::begin(progress_stage::mst, histograms.size() - 1);
+        if constexpr (exact) {
+            tree mst = logger::benchmark([&]() { return compute_mst(histograms.size(), diff_table); });
+
+            // Reduce memory footprint. Prim allocates next to nothing, so keeping them until now adds nothing to the
+            // peak, and a cancelled run still places the images Prim did not reach by them.
+            if (!cancellation::requested()) {
+                std::for_each(execution_policy, histograms.begin(), histograms.end(), [](auto &h) { h.clear(); });
+            }
+            return mst;
+        }
+        else {
+            mst_stats stats;
+            tree mst = logger::benchmark([&]() { return compute_mst_refined(histograms.size(), diff_table, dist, stats); });
+            logger::post<logger::info>("Resolved ties with ", stats.evaluated, " exact distances");
+            return mst;
+        }
+    }
+
+    // The table lives in the checkpoint file when there is one, and in the arena's huge pages otherwise
+    template <typename T>
+    tree build_mst_dense(const metric_functions &metric, std::vector<histogram> &histograms, checkpoint *cp, table_arena &arena, std::chrono::seconds checkpoint_interval, std::size_t tile_columns) {
+        const auto size = histograms.size();
+        logger::post<logger::info>(boost::format{ "Computed %1% histograms. Calculating differences (%2$.1f MiB table)..." }
+                                   % size % (mst_stats::num_pairs(size) * sizeof(T) / (1024.0 * 1024.0)));
+
+        if (cp) {
+            auto num_blocks = row_blocks::default_count();
+            T *data = cp->table<T>(size, num_blocks);
+
+            triangular_table<T, view_storage<T>> diff_table{ size, view_storage<T>{ data }, num_blocks };
+            if (const auto num_complete = cp->num_complete(); num_complete > 0) {
+                logger::post<logger::info>("Resuming from ", cp->path(), ", ", num_complete, " of ", diff_table.blocks().size(), " row blocks already complete");
+            }
+            return build_mst_dense(metric, histograms, diff_table, cp, checkpoint_interval, tile_columns);
+        }
+
+        // Every entry is written before it is read, so a reused arena needs no clearing. Its pages are first
+        // touched by the workers that fill them, as the row blocks of the pair stage are the table's.
+        const bool reused = arena.capacity() >= mst_stats::num_pairs(size) * sizeof(T);
+        triangular_table<T, view_storage<T>> diff_table{ size, view_storage<T>{ arena.reserve<T>(mst_stats::num_pairs(size)) }, row_blocks::default_count() };
+        logger::post<logger::info>("Distance table on ", arena.kind(), reused ? " kept from the last run" : "", ", ", diff_table.blocks().size(), " row blocks");
+        return build_mst_dense(metric, histograms, diff_table, nullptr, checkpoint_interval, tile_columns);
+    }
+
+    std::size_t entry_size(table_precision precision) noexcept {
+        switch (precision) {
+        case table_precision::f32: return sizeof(float);
+        case table_precision::u16: return sizeof(std::uint16_t);
+        case table_precision::u8:  return sizeof(std::uint8_t);
+        default:                   return sizeof(double);
+        }
+    }
+
+    tree build_mst_dense(const metric_functions &metric,
+                         std::vector<histogram> &histograms,
+                         table_precision precision,
+                         checkpoint *cp,
+                         table_arena &arena,
+                         std::chrono::seconds checkpoint_interval,
+                         std::size_t tile_columns) {
+        switch (precision) {
+        case table_precision::f32: return build_mst_dense<float>(metric, histograms, cp, arena, checkpoint_interval, tile_columns);
+        case table_precision::u16: return build_mst_dense<std::uint16_t>(metric, histograms, cp, arena, checkpoint_interval, tile_columns);
+        case table_precision::u8:  return build_mst_dense<std::uint8_t>(metric, histograms, cp, arena, checkpoint_interval, tile_columns);
+        default:                   return build_mst_dense<double>(metric, histograms, cp, arena, checkpoint_interval, tile_columns);
+        }
+    }
+
+    tree build_mst_pivot(const metric_functions &metric, std::vector<histogram> &histograms, std::size_t num_pivots) {
+        RUNTIME_ASSERT(metric.is_metric);
+
+        auto dist = [&](std::size_t x, std::size_t y) { return compute_histogram_diff(metric, histograms[x], histograms[y]); };
+        mst_stats stats;
+
+        logger::post<logger::info>("Computed ", histograms.size(), " histograms. Selecting ", num_pivots, " pivots...");
+        const pivot_index pivots = logger::benchmark([&]() { return pivot_index{ histograms.size(), num_pivots, dist, stats }; });
+
+        logger::post<logger::info>("Computing MST with pivot pruning...");
+        progress::begin(progress_stage::mst, histograms.size() - 1);
+        tree mst = logger::benchmark([&]() { return compute_mst_pruned(histograms.size(), dist, pivots, stats); });
+
+        const auto num_pairs = mst_stats::num_pairs(histograms.size());
+        logger::post<logger::info>(boost::format{ "Evaluated %1% of %2% pairs (%3$.1f%% avoided, %4% pivots)" }
+                                   % stats.evaluated % num_pairs
+                                   % (100.0 * (1.0 - static_cast<double>(stats.evaluated) / num_pairs))
+                                   % pivots.num_pivots());
+
+        // Reduce memory footprint
+        std::for_each(execution_policy, histograms.begin(), histograms.end(), [](auto &h) { h.clear(); });
+        return mst;
+    }
+
+    // Sparse kNN graph MST. Candidate neighbours come from a full scan of product quantised codes,
+    // are refined with exact distances, and the kNN graph's spanning forest is joined into a tree.
+    tree build_mst_pq(const metric_functions &metric, std::vector<histogram> &histograms, const pq_options &pq_opts, descriptor_cache *cache) {
+        const auto size = histograms.size();
+        const auto dim = histograms.front().mat.total();
+        auto dist = [&](std::size_t x, std::size_t y) { return compute_histogram_diff(metric, histograms[x], histograms[y]); };
+
+        product_quantiser pq{ dim, std::min(pq_opts.num_subspaces, dim - dim % 2) };
+
+        //
+        // Train codebooks and encode
+        //
+
+        if (cache && cache->has_codebook()) {
+            logger::post<logger::info>("Computed ", size, " histograms. Reusing product quantiser from the descriptor cache...");
+            std::copy_n(cache->codebook(), pq.centroids().size(), pq.centroids().begin());
+        }
+        else {
+            std::vector<const float *> samples;
+            for (const auto &h : histograms) {
+                samples.push_back(h.mat.ptr<float>());
+            }
+
+            std::mt19937 rng{ 0 };
+            std::shuffle(samples.begin(), samples.end(), rng);
+            samples.resize(std::min(samples.size(), pq_opts.num_training_samples));
+
+            logger::post<logger::info>("Computed ", size, " histograms. Training product quantiser (", pq.num_subspaces(), " subspaces) on ", samples.size(), " samples...");
+            logger::benchmark([&]() { pq.train(samples); });
+
+            if (cache) {
+                std::copy(pq.centroids().begin(), pq.centroids().end(), cache->codebook());
+                cache->set_codebook_trained();
+            }
+        }
+
+        std::vector<std::uint8_t> codes(size * pq.code_size());
+        {
+            logger::post<logger::info>("Encoding ", size, " descriptors into ", pq.code_size(), " bytes each...");
+
+            const auto range = boost::irange<std::size_t>(0, size);
+            logger::benchmark([&]() {
+                std::for_each(execution_policy, range.begin(), range.end(), [&](std::size_t i) {
+                    std::uint8_t *code = codes.data() + i * pq.code_size();
+                    const auto slot = histograms[i].file_index;
+
+                    if (cache && cache->has_code(slot)) {
+                        std::copy_n(cache->code(slot), pq.code_size(), code);
+                        return;
+                    }
+
+                    pq.encode(histograms[i].mat.ptr<float>(), code);
+                    if (cache) {
+                        std::copy_n(code, pq.code_size(), cache->code(slot));
+                    }
+                });
+            });
+        }
+
+        //
+        // Build the kNN graph
+        //
+
+        const pq_code_blocks blocks{ pq, codes.data(), size };
+        const auto num_refined = std::min(std::max(pq_opts.num_refined, pq_opts.num_neighbours), size - 1);
+        const auto num_neighbours = std::min(pq_opts.num_neighbours, num_refined);
+
+        std::vector<std::vector<edge>> neighbours(size);
+        {
+            logger::post<logger::info>("Searching ", num_neighbours, " nearest neighbours of each image, refining ", num_refined, " candidates...");
+
+            const auto range = boost::irange<std::size_t>(0, size);
+            logger::benchmark([&]() {
+                std::for_each(execution_policy, range.begin(), range.end(), [&](std::size_t i) {
+                    const auto lut = pq.make_lookup_table(histograms[i].mat.ptr<float>());
+
+                    // Max-heap of the best approximate candidates so far
+                    std::vector<std::pair<std::uint16_t, std::size_t>> candidates;
+                    candidates.reserve(num_refined + 1);
+
+                    std::uint16_t sums[pq_code_blocks::block_size];
+                    for (std::size_t block = 0; block < pq_code_blocks::num_blocks(size); ++block) {
+                        blocks.scan(lut, block, sums);
+
+                        for (std::size_t lane = 0; lane < pq_code_blocks::block_size; ++lane) {
+                            const auto j = block * pq_code_blocks::block_size + lane;
+                            if (j >= size || j == i) continue;
+                            if (candidates.size() == num_refined && sums[lane] >= candidates.front().first) continue;
+
+                            candidates.emplace_back(sums[lane], j);
+                            std::push_heap(candidates.begin(), candidates.end());
+                            if (candidates.size() > num_refined) {
+                                std::pop_heap(candidates.begin(), candidates.end());
+                                candidates.pop_back();
+                            }
+                        }
+                    }
+
+                    auto &res = neighbours[i];
+                    for (const auto &[approx, j] : candidates) {
+                        res.push_back({ i, j, dist(i, j) });
+                    }
+
+                    std::partial_sort(res.begin(), res.begin() + num_neighbours, res.end());
+                    res.resize(num_neighbours);
+                });
+            });
+        }
+
+        //
+        // Create MST
+        //
+
+        logger::post<logger::info>("Computing MST of the kNN graph...");
+        return logger::benchmark([&]() {
+            std::vector<edge> edges;
+            for (auto &n : neighbours) {
+                edges.insert(edges.end(), n.begin(), n.end());
+                n = {};
+            }
+
+            auto forest = minimum_spanning_forest(size, std::move(edges));
+            const auto num_components = size - forest.size();
+            if (num_components > 1) {
+                logger::post<logger::info>("Joining ", num_components, " components of the kNN graph");
+            }
+
+            const auto num_pairs = mst_stats::num_pairs(size);
+            const auto evaluated = size * num_refined + mst_stats::num_pairs(num_components);
+            logger::post<logger::info>(boost::format{ "Evaluated %1% of %2% pairs exactly (%3$.1f%% avoided)" }
+                                       % evaluated % num_pairs % (100.0 * (1.0 - static_cast<double>(evaluated) / num_pairs)));
+
+            return make_tree(size, connect_components(size, std::move(forest), dist));
+        });
+    }
+
+    // Sparse MST over the pairs that collide in SimHash tables. Only colliding pairs are evaluated exactly,
+    // and whatever the tables leave disconnected is joined by a dense MST over one image per component.
+    tree build_mst_lsh(const metric_functions &metric, std::vector<histogram> &histograms, const lsh_options &lsh_opts) {
+        const auto size = histograms.size();
+        const auto dim = histograms.front().mat.total();
+        auto dist = [&](std::size_t x, std::size_t y) { return compute_histogram_diff(metric, histograms[x], histograms[y]); };
+
+        auto num_bits = lsh_opts.num_bits;
+        if (num_bits == 0) {
+            num_bits = 1;
+            while (num_bits < 32 && (std::size_t{ 8 } << num_bits) < size) ++num_bits;
+        }
+
+        //
+        // Hash
+        //
+
+        std::vector<std::pair<std::uint32_t, std::uint32_t>> pairs;
+        {
+            logger::post<logger::info>("Computed ", size, " histograms. Hashing into ", lsh_opts.num_tables, " tables of ", num_bits, " bit signatures...");
+
+            std::vector<const float *> rows;
+            for (const auto &h : histograms) {
+                rows.push_back(h.mat.ptr<float>());
+            }
+
+            logger::benchmark([&]() {
+                const simhash_index index{ rows, dim, lsh_opts.num_tables, num_bits };
+                pairs = index.candidate_pairs(lsh_opts.max_bucket_size);
+            });
+        }
+
+        //
+        // Evaluate colliding pairs
+        //
+
+        std::vector<edge> edges(pairs.size());
+        {
+            logger::post<logger::info>("Calculating differences of ", pairs.size(), " colliding pairs...");
+            logger::benchmark([&]() {
+                std::transform(execution_policy, pairs.begin(), pairs.end(), edges.begin(), [&](const auto &p) {
+                    return edge{ p.first, p.second, dist(p.first, p.second) };
+                });
+            });
+        }
+
+        //
+        // Create MST
+        //
+
+        logger::post<logger::info>("Computing MST of the collision graph...");
+        return logger::benchmark([&]() {
+            auto forest = minimum_spanning_forest(size, std::move(edges));
+            const auto num_components = size - forest.size();
+            if (num_components > 1) {
+                logger::post<logger::info>("Joining ", num_components, " components of the collision graph");
+            }
+
+            const auto num_pairs = mst_stats::num_pairs(size);
+            const auto evaluated = pairs.size() + mst_stats::num_pairs(num_components);
+            logger::post<logger::info>(boost::format{ "Evaluated %1% of %2% pairs exactly (%3$.1f%% avoided)" }
+                                       % evaluated % num_pairs % (100.0 * (1.0 - static_cast<double>(evaluated) / num_pairs)));
+
+            return make_tree(size, connect_components(size, std::move(forest), dist));
+        });
+    }
+
+    // Anytime ordering. A Hilbert curve through randomly projected descriptors comes first; then, each only if
+    // its predicted time fits what is left of the budget, the MST of the LSH collision graph and the exact
+    // MST. The cheapest order so far is refined with windowed 2-opt until the deadline. Stages that start are
+    // not interrupted by the deadline, so the prediction errs on the side of skipping them. Cancellation acts
+    // as an early deadline: the best complete order so far is returned.
+    std::vector<std::size_t> build_order_anytime(const metric_functions &metric,
+                                                 std::vector<histogram> &histograms,
+                                                 const lsh_options &lsh_opts,
+                                                 table_arena &arena,
+                                                 std::chrono::steady_clock::time_point deadline) {
+        using clock = std::chrono::steady_clock;
+        constexpr double safety_factor = 1.5;
+        constexpr std::size_t two_opt_window = 16;
+
+        const auto size = histograms.size();
+        auto dist = [&](std::size_t x, std::size_t y) { return compute_histogram_diff(metric, histograms[x], histograms[y]); };
+
+        struct stage_report {
+            std::string name;
+            double milliseconds = 0.0;
+            double cost = 0.0;
+        };
+        std::vector<stage_report> reports;
+        std::vector<std::size_t> best;
+        double best_cost = std::numeric_limits<double>::max();
+
+        const std::optional<double> no_cost;
+
+        // Wall time per distance evaluation, measured on the path cost of the first order
+        double seconds_per_pair = 0.0;
+
+        // make_order returns an order, and its cost if it already knows it
+        auto run_stage = [&](std::string name, auto &&make_order) {
+            const auto start = clock::now();
+            auto [order, known_cost] = make_order();
+            if (order.size() < size) {
+                // Only a cancelled stage returns part of an order
+                logger::post<logger::info>("Anytime: ", name, " was cancelled");
+                return;
+            }
+            const double cost = known_cost ? *known_cost : path_cost(order, dist);
+            const auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+            logger::post<logger::info>(boost::format{ "Anytime: %1% in %2$.0fms, path cost %3$.4f" } % name % (1000.0 * elapsed) % cost);
+            reports.push_back({ std::move(name), 1000.0 * elapsed, cost });
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = std::move(order);
+            }
+        };
+
+        auto fits = [&](std::size_t num_pairs) {
+            if (cancellation::requested()) return false;
+            const auto predicted = std::chrono::duration<double>(safety_factor * num_pairs * seconds_per_pair);
+            return clock::now() + std::chrono::duration_cast<clock::duration>(predicted) < deadline;
+        };
+
+        //
+        // Space-filling curve
+        //
+
+        run_stage("Hilbert curve", [&]() {
+            constexpr std::size_t curve_dims = 4;
+            std::vector<const float *> rows;
+            for (const auto &h : histograms) {
+                rows.push_back(h.mat.ptr<float>());
+            }
+            return std::pair{ hilbert_order<curve_dims>(random_projection{ histograms.front().mat.total(), curve_dims }.project(rows), size), no_cost };
+        });
+
+        {
+            const auto start = clock::now();
+            path_cost(best, dist);
+            seconds_per_pair = std::chrono::duration<double>(clock::now() - start).count() / std::max<std::size_t>(size - 1, 1);
+        }
+
+        //
+        // Sparse graph MST, then exact MST
+        //
+
+        if (fits(size * lsh_opts.num_tables * 8)) {
+            run_stage("LSH graph MST", [&]() { return std::pair{ *pre_order(build_mst_lsh(metric, histograms, lsh_opts)), no_cost }; });
+        }
+        else {
+            logger::post<logger::info>("Anytime: skipping the LSH graph MST, it would not finish in time");
+        }
+
+        if (fits(mst_stats::num_pairs(size))) {
+            // A float table keeps the descriptors, which 2-opt still needs, and is resolved to the exact MST
+            run_stage("exact MST", [&]() { return std::pair{ *pre_order(build_mst_dense<float>(metric, histograms, nullptr, arena, std::chrono::seconds{ 0 }, 0)), no_cost }; });
+        }
+        else {
+            logger::post<logger::info>("Anytime: skipping the exact MST, it would not finish in time");
+        }
+
+        //
+        // Local refinement
+        //
+
+        if (clock::now() < deadline && !cancellation::requested()) {
+            run_stage("2-opt", [&]() {
+                auto order = best;
+                const double improvement = two_opt(order, dist, two_opt_window, deadline);
+                return std::pair{ std::move(order), std::optional<double>{ best_cost - improvement } };
+            });
+        }
+
+        logger::post<logger::info>("Anytime stages:");
+        for (const auto &r : reports) {
+            logger::post<logger::info>(boost::format{ "  %1$-16s %2$8.0fms  path cost %3$.4f%4%" }
+                                       % r.name % r.milliseconds % r.cost % (r.cost == best_cost ? "  <- best" : ""));
+        }
+
+        if (clock::now() > deadline + std::chrono::milliseconds{ 1 }) {
+            logger::post<logger::warning>(boost::format{ "Time budget exceeded by %1$.0fms" }
+                                          % std::chrono::duration<double, std::milli>(clock::now() - deadline).count());
+        }
+
+        return best;
+    }
+
+    // Names what descriptors were computed with: the metric, then a letter for each ingest setting that changes
+    // the histograms ("bhattacharyya+dyt120r256"). Short enough for the 32 byte field of the descriptor cache.
+    std::string descriptor_tag(const options &opts) {
+        std::string ingest;
+        if (opts.ingest.jpeg_dc) ingest += 'd';
+        if (opts.ingest.colour == colour_space::ycbcr) ingest += 'y';
+        if (opts.ingest.exif_thumbnail > 0) ingest += 't' + std::to_string(opts.ingest.exif_thumbnail);
+        if (opts.ingest.target_resolution > 0) ingest += 'r' + std::to_string(opts.ingest.target_resolution);
+
+        std::string res{ get_metric_functions(opts.metric).name };
+        if (!ingest.empty()) res += '+' + ingest;
+        RUNTIME_ASSERT(res.size() < 32);
+        return res;
+    }
+
+    // Identifies the inputs and settings a checkpoint was written for: FNV-1a over the settings that shape
+    // the table, and over the path, size and modification time of every image
+    std::uint64_t input_fingerprint(const options &opts, const std::vector<std::filesystem::path> &filenames) {
+        std::uint64_t res = 14695981039346656037ull;
+        auto hash = [&](const void *data, std::size_t size) {
+            for (std::size_t i = 0; i < size; ++i) {
+                res = (res ^ static_cast<const unsigned char *>(data)[i]) * 1099511628211ull;
+            }
+        };
+        auto hash_value = [&](auto value) { hash(&value, sizeof(value)); };
+
+        const auto tag = descriptor_tag(opts);
+        hash(tag.data(), tag.size());
+        hash_value(static_cast<std::uint64_t>(histogram_bins));
+        hash_value(static_cast<std::uint64_t>(opts.precision));
+        hash_value(static_cast<std::uint64_t>(opts.projection_dim));
+
+        for (const auto &f : filenames) {
+            const auto path = f.generic_string();
+            hash(path.data(), path.size());
+
+            std::error_code ec;
+            hash_value(static_cast<std::uint64_t>(std::filesystem::file_size(f, ec)));
+            hash_value(static_cast<std::int64_t>(std::filesystem::last_write_time(f, ec).time_since_epoch().count()));
+        }
+        return res;
+    }
+
+    //
+    // Execution planning
+    //
+
+    // Rough single-core costs that plans are predicted from. They only need to hold to within a small factor,
+    // since engines are swapped where the predictions differ by orders of magnitude.
+    namespace plan_costs {
+        constexpr double seconds_per_decode = 0.02;   // Decoding one image and computing its histogram
+        constexpr double seconds_per_element = 1e-9;  // One descriptor element of one distance
+        constexpr double seconds_per_lookup = 5e-10;  // One product quantiser table lookup
+        constexpr double table_bandwidth = 10e9;      // Bytes per second Prim reads the table at
+        constexpr double max_dense_seconds = 600.0;   // Beyond this a sparse engine is preferred
+        constexpr double usable_memory = 0.8;         // Share of the available memory a plan may take
+        constexpr std::size_t projected_dim = 128;
+    }
+
+    // Cost of a descriptor element relative to an L1 or L2 term
+    double metric_cost(metric_type type) noexcept {
+        switch (type) {
+        case metric_type::jensen_shannon: return 20.0;  // Logarithms
+        case metric_type::chi_square:     return 2.0;   // A division
+        default:                          return 1.0;
+        }
+    }
+
+    struct plan_estimate {
+        double bytes = 0.0;
+        double seconds = 0.0;
+    };
+
+    // Peak memory and time of decoding plus the pair stage, for size images with dim dimensional descriptors
+    plan_estimate estimate_plan(const options &opts, std::size_t size, std::size_t dim, std::size_t cores) {
+        const double n = static_cast<double>(size);
+        const double pairs = n * (n - 1.0) / 2.0;
+        const double distance = static_cast<double>(dim) * plan_costs::seconds_per_element * metric_cost(opts.metric);
+
+        plan_estimate res{ n * dim * sizeof(float), n * plan_costs::seconds_per_decode / cores };
+        switch (opts.mst) {
+        case mst_engine::pivot:
+            // Pruning usually skips most pairs, but how many depends on the data, so this is an upper bound
+            res.bytes += n * opts.num_pivots * sizeof(double);
+            res.seconds += pairs * distance / cores;
+            break;
+        case mst_engine::pq:
+            res.bytes += n * (opts.pq.num_subspaces / 2 + opts.pq.num_neighbours * sizeof(edge));
+            res.seconds += (pairs * opts.pq.num_subspaces * plan_costs::seconds_per_lookup + n * opts.pq.num_refined * distance) / cores;
+            break;
+        case mst_engine::lsh: {
+            // About 8 images per bucket with the default signature width
+            const double candidates = n * opts.lsh.num_tables * 8.0;
+            res.bytes += candidates * sizeof(edge);
+            res.seconds += candidates * distance / cores;
+            break;
+        }
+        default: {
+            // A checkpoint maps the table from its file, which the page cache can evict
+            const double table = pairs * entry_size(opts.precision);
+            if (!opts.checkpoint_file) res.bytes += table;
+            res.seconds += pairs * distance / cores + 2.0 * table / plan_costs::table_bandwidth;
+            break;
+        }
+        }
+        return res;
+    }
+
+    // Fills in whatever the command line left open: descriptors projected when distances at full dimension
+    // would take too long, the dense engine with the widest table that fits in memory, and otherwise the
+    // matrix-free pivot engine or, failing that, the sparse kNN engine. Logs the plan and its predictions.
+    void plan_execution(options &opts, std::size_t size, const system_resources &resources) {
+        const auto metric = get_metric_functions(opts.metric);
+        const auto full_dim = metric.descriptor_size(histogram_bins);
+        const double budget = plan_costs::usable_memory * static_cast<double>(resources.available_memory);
+
+        auto estimate = [&](const options &o) {
+            const auto dim = o.projection_dim > 0 ? std::min(o.projection_dim, full_dim) : full_dim;
+            return estimate_plan(o, size, dim, resources.cores);
+        };
+        auto dense_fits = [&](options &o) {
+            o.mst = mst_engine::dense;
+            if (o.forced.precision) return estimate(o).bytes <= budget;
+            for (auto precision : { table_precision::f64, table_precision::f32, table_precision::u16, table_precision::u8 }) {
+                o.precision = precision;
+                if (estimate(o).bytes <= budget) return true;
+            }
+            return false;
+        };
+
+        // A checkpoint is only resumable with the setup it was written for, which must not move with the memory
+        // that happens to be free, so its run keeps the given choices
+        if (!opts.checkpoint_file) {
+            options dense = opts;
+            dense.mst = opts.forced.mst ? opts.mst : mst_engine::dense;
+            const auto full = estimate(dense);
+
+            if (!opts.forced.projection && metric.is_euclidean && full_dim > plan_costs::projected_dim &&
+                (full.seconds > plan_costs::max_dense_seconds || full.bytes > budget)) {
+                opts.projection_dim = plan_costs::projected_dim;
+            }
+
+            if (!opts.forced.mst) {
+                options candidate = opts;
+                const bool fits = dense_fits(candidate);
+                const bool fast = estimate(candidate).seconds <= plan_costs::max_dense_seconds;
+
+                if (fits && fast) {
+                    opts.precision = candidate.precision;
+                }
+                else {
+                    opts.mst = fast && metric.is_metric ? mst_engine::pivot : mst_engine::pq;
+                }
+            }
+            else if (opts.mst == mst_engine::dense && !opts.forced.precision) {
+                options candidate = opts;
+                dense_fits(candidate);
+                opts.precision = candidate.precision;
+            }
+        }
+
+        constexpr std::string_view engine_names[] = { "dense Prim", "pivot Prim (matrix free)", "kNN graph (product quantised)", "LSH candidate graph" };
+        constexpr std::string_view precision_names[] = { "double", "float", "uint16", "uint8" };
+        auto forced = [](bool f) { return f ? " (given)" : ""; };
+
+        std::string storage = "none";
+        if (opts.mst == mst_engine::dense) {
+            storage = std::string{ precision_names[static_cast<int>(opts.precision)] } +
+                      (opts.checkpoint_file ? " table mapped from the checkpoint" : " table in memory") +
+                      forced(opts.forced.precision);
+        }
+
+        const auto predicted = estimate(opts);
+        logger::post<logger::info>(boost::format{ "Plan for %1% images on %2% cores with %3$.2f GB available: %4%%5%, %6% dimensional descriptors%7%, storage %8%. Predicted peak %9$.2f GB, %10$.0f s" }
+                                   % size % resources.cores % (resources.available_memory / 1e9)
+                                   % engine_names[static_cast<int>(opts.mst)] % forced(opts.forced.mst)
+                                   % (opts.projection_dim > 0 ? std::min(opts.projection_dim, full_dim) : full_dim) % forced(opts.forced.projection)
+                                   % storage % (predicted.bytes / 1e9) % predicted.seconds);
+
+        if (predicted.bytes > budget) {
+            logger::post<logger::warning>("The plan is predicted to need more than the ", boost::format{ "%1$.2f" } % (budget / 1e9), " GB it may use");
+        }
+    }
+
+    // Columns per tile of the dense pair stage: whole rows unless tuning is on, in which case the width timed
+    // fastest for this host, kernel variant, metric and descriptor size is reused, or found and remembered
+    std::size_t dense_tile_columns(const options &opts, const metric_functions &metric, const std::vector<histogram> &histograms) {
+        if (!opts.tune_file) return 0;
+
+        const auto key = (boost::format{ "%1%/%2%/%3%/%4%/tile_columns" }
+                          % host_name() % kernel::active().name % metric.name % histograms.front().mat.total()).str();
+
+        tuning_cache cache{ *opts.tune_file };
+        if (auto tile = cache.find(key)) {
+            logger::post<logger::info>("Using tuned tile width of ", *tile, " columns from ", *opts.tune_file);
+            return *tile;
+        }
+
+        logger::post<logger::info>("Tuning the pair stage...");
+        auto dist = [&](std::size_t x, std::size_t y) { return compute_histogram_diff(metric, histograms[x], histograms[y]); };
+        const auto tile = logger::benchmark([&]() { return tune_tile_columns(histograms.size(), dist, { 0, 64, 16, 4 }); });
+        cache.store(key, tile);
+        return tile;
+    }
+
+    //
+    // Stages
+    //
+
+    std::vector<std::filesystem::path> scanner::scan(const std::filesystem::path &directory) const {
+        auto is_recognised_img_extension = [](const auto &entry) {
+            const auto ext = entry.path().extension().string();
+            return ext == ".png" || ext == ".jpg" || ext == ".jpeg" || ext == ".jfif";
+        };
+
+        const auto range_of_img_files =
+            boost::make_iterator_range( std::filesystem::directory_iterator{ directory,
+                                                                             std::filesystem::directory_options::follow_directory_symlink },
+                                        std::filesystem::directory_iterator{} )
+            | boost::adaptors::filtered(is_recognised_img_extension)
+            | boost::adaptors::filtered([](const auto &entry) { return entry.is_regular_file() || entry.is_symlink(); })
+            | boost::adaptors::transformed([](const auto &entry) { return entry.path(); });
+
+        return { range_of_img_files.begin(), range_of_img_files.end() };
+    }
+
+    std::vector<histogram> &descriptor_extractor::extract(const std::vector<std::filesystem::path> &filenames, const options &opts, const metric_functions &metric,
+                                                          descriptor_cache *cache, checkpoint *cp) {
+        m_stats.exif_thumbnails = 0;
+        m_stats.reduced_decodes = 0;
+        m_stats.partial_reads = 0;
+        m_stats.streamed_decodes = 0;
+
+        const auto descriptor_size = static_cast<int>(metric.descriptor_size(histogram_bins));
+        const bool restored = cp && cp->has_descriptors();
+        const bool partly_restored = cp && cp->has_partial_descriptors();
+        std::atomic<std::size_t> cache_lookups{ 0 };
+
+        // Counts the pixels of a decoded image into pixels, if given
+        auto make_histogram = [&](std::size_t i, std::uint64_t *pixels) {
+            if (restored || (partly_restored && cp->is_valid(i))) {
+                cv::Mat mat = cp->is_valid(i) ? cv::Mat(1, descriptor_size, CV_32F, cp->descriptor(i)) : cv::Mat{};
+                return histogram{ std::move(mat), filenames[i], i };
+            }
+            if (cache) {
+                cache_lookups.fetch_add(1, std::memory_order_relaxed);
+                return cached_histogram(metric, opts.ingest, m_stats, *cache, filenames[i], i, pixels);
+            }
+            const cv::Mat hist = calculate_histogram(filenames[i], opts.ingest, &m_stats);
+            if (pixels) *pixels = histogram_pixels(hist);
+            return histogram{ make_descriptor(metric, hist), filenames[i], i };
+        };
+
+        // Images are handed to the workers one at a time in schedule order, which is storage order if asked for,
+        // while the files a few places further on are read ahead
+        m_schedule.resize(filenames.size());
+        std::iota(m_schedule.begin(), m_schedule.end(), std::size_t{ 0 });
+        std::size_t readahead = 0;
+        if (opts.file_order != read_order::listed && !restored) {
+            m_locations.resize(filenames.size());
+            logger::benchmark([&]() {
+                std::transform(execution_policy, filenames.begin(), filenames.end(), m_locations.begin(),
+                               [&](const auto &f) { return locate_file(f, opts.file_order); });
+                m_schedule = storage_order(m_locations);
+            });
+
+            const auto located = std::count_if(m_locations.begin(), m_locations.end(), [](const auto &l) { return l.has_value(); });
+            logger::post<logger::info>("Reading ", located, " of ", filenames.size(), " images in ", opts.file_order == read_order::inode ? "inode" : "extent",
+                                       " order", static_cast<std::size_t>(located) < filenames.size() ? ", then the rest as listed" : "");
+            readahead = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        // Whether image i is read from its file rather than restored
+        auto is_decoded = [&](std::size_t i) {
+            return !restored && !(partly_restored && cp->is_valid(i)) && !(cache && cache->is_cached(i));
+        };
+
+        auto prefetch = [&](std::size_t k) {
+            if (k < m_schedule.size() && is_decoded(m_schedule[k])) prefetch_file(filenames[m_schedule[k]]);
+        };
+
+        // Once the run is cancelled, workers finish the image they are on and take no more. Each worker times the
+        // images it decodes in a list of its own.
+        m_histograms.clear();
+        m_histograms.resize(filenames.size());
+        const auto num_workers = std::min<std::size_t>(filenames.size(), std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<std::vector<file_latency>> worker_latencies(num_workers);
+        progress::begin(progress_stage::histograms, filenames.size());
+        logger::benchmark([&]() {
+            for (std::size_t k = 0; k < readahead; ++k) prefetch(k);
+
+            std::atomic<std::size_t> next{ 0 };
+            const auto workers = boost::irange<std::size_t>(0, num_workers);
+            std::for_each(execution_policy, workers.begin(), workers.end(), [&](std::size_t worker) {
+                for (auto k = next.fetch_add(1, std::memory_order_relaxed); k < m_schedule.size() && !cancellation::requested(); k = next.fetch_add(1, std::memory_order_relaxed)) {
+                    if (readahead > 0) prefetch(k + readahead);
+
+                    const auto i = m_schedule[k];
+                    const bool decoded = is_decoded(i);
+                    const auto wall_start = std::chrono::steady_clock::now();
+                    const auto cpu_start = decoded ? thread_cpu_time() : std::chrono::nanoseconds{};
+                    std::error_code ec;
+                    const auto bytes = decoded ? std::filesystem::file_size(filenames[i], ec) : 0;
+                    if (decoded) IMG_SORT_PROBE(decode__start, i, filenames[i].c_str(), ec ? 0 : bytes);
+
+                    // The pixel count is only worth its pass over the histogram when something reports it
+                    std::uint64_t pixels = 0;
+                    m_histograms[i] = make_histogram(i, has_probes || opts.slow_files > 0 ? &pixels : nullptr);
+                    if (decoded) {
+                        IMG_SORT_PROBE(decode__done, i, filenames[i].c_str(), ec ? 0 : bytes, pixels);
+
+                        auto latency = measure_latency(i, std::chrono::steady_clock::now() - wall_start, thread_cpu_time() - cpu_start);
+                        latency.bytes = ec ? 0 : bytes;
+                        latency.pixels = pixels;
+                        worker_latencies[worker].push_back(latency);
+                    }
+                    IMG_SORT_PROBE(histogram__done, i, decoded ? 0 : 1, m_histograms[i].mat.empty() ? 0 : 1);
+                    progress::file_done(ec ? 0 : bytes);
+                    if (decoded && m_histograms[i].mat.empty()) run_metrics::decode_failed();
+                }
+            });
+        });
+        progress::end();
+
+        m_latencies.clear();
+        for (const auto &latencies : worker_latencies) m_latencies.insert(m_latencies.end(), latencies.begin(), latencies.end());
+        if (cache) run_metrics::cache_used(cache_lookups.load(), cache->num_restored());
+        const bool stopped = cancellation::requested();
+
+        if (opts.ingest.exif_thumbnail > 0) {
+            logger::post<logger::info>(m_stats.exif_thumbnails.load(), " of ", filenames.size(), " images were read from their EXIF thumbnail");
+        }
+        if (opts.ingest.target_resolution > 0) {
+            logger::post<logger::info>(m_stats.reduced_decodes.load(), " of ", filenames.size(), " images were decoded at reduced resolution, ",
+                                       m_stats.partial_reads.load(), " of them from the first part of the file");
+        }
+        if (m_stats.streamed_decodes.load() > 0) {
+            logger::post<logger::info>(m_stats.streamed_decodes.load(), " of ", filenames.size(), " images were decoded a row at a time");
+        }
+        for (const auto &line : describe_latencies(m_latencies, filenames, opts.slow_files)) {
+            logger::post<logger::info>(line);
+        }
+
+        if (restored) {
+            logger::post<logger::info>("Restored descriptors from checkpoint ", cp->path());
+        }
+        else if (cp) {
+            if (partly_restored) {
+                const auto num_restored = std::count_if(m_histograms.begin(), m_histograms.end(), [&](const auto &h) {
+                    return !h.mat.empty() && h.mat.template ptr<float>() == cp->descriptor(h.file_index);
+                });
+                logger::post<logger::info>("Restored ", num_restored, " of ", filenames.size(), " descriptors from checkpoint ", cp->path());
+            }
+
+            // Move every descriptor into the checkpoint, so that a resumed run skips decoding as well. A cancelled
+            // run keeps the ones it got to.
+            cp->start_descriptors();
+            std::for_each(execution_policy, m_histograms.begin(), m_histograms.end(), [&](auto &h) {
+                if (h.mat.empty() || h.mat.template ptr<float>() == cp->descriptor(h.file_index)) return;
+
+                std::copy_n(h.mat.template ptr<float>(), descriptor_size, cp->descriptor(h.file_index));
+                cp->set_valid(h.file_index);
+                h.mat = cv::Mat(1, descriptor_size, CV_32F, cp->descriptor(h.file_index));
+            });
+            cp->finish_descriptors(stopped);
+        }
+        else if (cache) {
+            logger::post<logger::info>("Restored ", cache->num_restored(), " of ", filenames.size(), " descriptors from ", *opts.cache_file);
+        }
+
+        auto new_end = std::partition(m_histograms.begin(), m_histograms.end(), [](const auto &h) { return !h.mat.empty(); });
+        m_histograms.erase(new_end, m_histograms.end());
+        return m_histograms;
+    }
+
+    distance_engine::distance_engine(metric_type type)
+        :m_metric{ get_metric_functions(type) }
+    {}
+
+    bool distance_engine::project(std::vector<histogram> &histograms, std::size_t dim) {
+        if (dim >= histograms.front().mat.total()) return false;
+
+        project_descriptors(m_metric, histograms, dim);
+        m_metric = get_metric_functions(metric_type::l2);
+        return true;
+    }
+
+    double distance_engine::operator()(const histogram &lhs, const histogram &rhs) const {
+        return compute_histogram_diff(m_metric, lhs, rhs);
+    }
+
+    tree tree_builder::build(const options &opts, const distance_engine &distance, std::vector<histogram> &histograms, descriptor_cache *cache, checkpoint *cp) {
+        const auto &metric = distance.metric();
+        switch (opts.mst) {
+        case mst_engine::pivot: return build_mst_pivot(metric, histograms, opts.num_pivots);
+        case mst_engine::lsh:   return build_mst_lsh(metric, histograms, opts.lsh);
+        case mst_engine::pq:    return build_mst_pq(metric, histograms, opts.pq, cache);
+        default:                return build_mst_dense(metric, histograms, opts.precision, cp, m_arena, opts.checkpoint_interval,
+                                                       dense_tile_columns(opts, metric, histograms));
+        }
+    }
+
+    std::optional<std::vector<std::size_t>> orderer::order(const tree &mst) const {
+        logger::post<logger::info>("Generating sort order...");
+        return logger::benchmark([&]() { return pre_order(mst); });
+    }
+
+    std::vector<std::size_t> orderer::order(const distance_engine &distance, std::vector<histogram> &histograms, const lsh_options &lsh,
+                                            std::chrono::steady_clock::time_point deadline) {
+        return build_order_anytime(distance.metric(), histograms, lsh, m_arena, deadline);
+    }
+
+    std::vector<std::size_t> orderer::order_partial(const tree *partial, const std::vector<histogram> &histograms) const {
+        std::vector<std::size_t> res;
+        std::vector<bool> placed(histograms.size(), false);
+        if (partial && partial->num_edges() > 0) {
+            res = *pre_order(*partial);
+            for (auto i : res) placed[i] = true;
+        }
+
+        std::vector<std::size_t> rest;
+        std::vector<const float *> rows;
+        for (std::size_t i = 0; i < histograms.size(); ++i) {
+            if (placed[i] || histograms[i].mat.empty()) continue;
+            rest.push_back(i);
+            rows.push_back(histograms[i].mat.ptr<float>());
+        }
+        if (rest.size() > 1) {
+            constexpr std::size_t curve_dims = 4;
+            const auto curve = hilbert_order<curve_dims>(random_projection{ histograms[rest.front()].mat.total(), curve_dims }.project(rows), rest.size());
+            for (auto k : curve) res.push_back(rest[k]);
+        }
+        else {
+            res.insert(res.end(), rest.begin(), rest.end());
+        }
+        for (auto i : rest) placed[i] = true;
+
+        for (std::size_t i = 0; i < histograms.size(); ++i) {
+            if (!placed[i]) res.push_back(i);
+        }
+        return res;
+    }
+
+    int output_writer::write(const std::vector<std::size_t> &order, const std::vector<histogram> &histograms, const std::filesystem::path &output_directory) const {
+        //
+        // Create symlinks in output directory
+        //
+
+        logger::post<logger::info>("Populating output directory ", output_directory, "...");
+        std::filesystem::create_directories(output_directory);
+
+        std::size_t idx = 0;
+        for (std::size_t entry : order) {
+            const auto src_path = histograms[entry].filename;
+
+            std::filesystem::path dest_name = (boost::format{ "%05zu." } % idx).str();
+            dest_name += src_path.filename();
+        
+            const auto dest_path = output_directory / dest_name;
+            std::filesystem::create_hard_link(src_path, dest_path);
+            IMG_SORT_PROBE(link__created, idx, src_path.c_str(), dest_path.c_str());
+            ++idx;
+        }
+
+        return 0;
+    }
+
+    //
+    // Sort requests
+    //
+
+    int sorter::run(options opts) {
+        const auto start_time = std::chrono::steady_clock::now();
+
+        const auto &source_directory = opts.source_directory;
+        const auto &output_directory = opts.output_directory;
+        if (!opts.benchmark_metrics && !opts.benchmark_decode && !opts.shard && std::filesystem::equivalent(source_directory, output_directory)) {
+            logger::post<logger::error>("Source and destination directories and equivalent!");
+            return -1;
+        }
+
+        //
+        // listdir
+        //
+
+        if (!std::filesystem::is_directory(source_directory)) {
+            logger::post<logger::error>(source_directory, " is not a directory");
+            return -1;
+        }
+
+        logger::post<logger::info>("Searching for images in ", source_directory, "...");
+        auto filenames = run_metrics::time(pipeline_stage::scan, [&]() { return m_scanner.scan(source_directory); });
+
+        if (filenames.empty()) {
+            logger::post<logger::info>(source_directory, " is empty. Nothing to do");
+            return 0;
+        }
+
+        if (opts.benchmark_metrics) {
+            constexpr std::size_t max_benchmark_images = 64;
+            filenames.resize(std::min(filenames.size(), max_benchmark_images));
+
+            std::vector<cv::Mat> hists(filenames.size());
+            std::transform(execution_policy, filenames.begin(), filenames.end(), hists.begin(),
+                           [&](const auto &f) { return calculate_histogram(f, opts.ingest); });
+            hists.erase(std::remove_if(hists.begin(), hists.end(), [](const auto &h) { return h.empty(); }), hists.end());
+
+            if (hists.size() < 2) {
+                logger::post<logger::warning>("Need at least two readable images to benchmark");
+                return -1;
+            }
+
+            benchmark_metrics(hists);
+            return 0;
+        }
+
+        if (opts.benchmark_decode) {
+            constexpr std::size_t max_benchmark_images = 64;
+            filenames.resize(std::min(filenames.size(), max_benchmark_images));
+            benchmark_decode(filenames, opts.ingest);
+            return 0;
+        }
+
+        //
+        // Merge shards
+        //
+
+        if (opts.merge) {
+            const auto fingerprint = input_fingerprint(opts, filenames);
+
+            std::vector<shard> shards;
+            for (const auto &f : opts.shard_files) {
+                shards.push_back(read_shard(f));
+                const auto &s = shards.back();
+                if (s.fingerprint != fingerprint || s.nodes != shards.front().nodes) {
+                    logger::post<logger::error>("Shard ", f, " was computed from different images or options");
+                    return -1;
+                }
+            }
+
+            std::vector<bool> present(shards.front().count, false);
+            for (const auto &s : shards) {
+                if (s.count == present.size() && !present[s.index]) present[s.index] = true;
+                else {
+                    logger::post<logger::error>("Shard ", s.index, "/", s.count, " is duplicated or from a different split");
+                    return -1;
+                }
+            }
+            if (std::find(present.begin(), present.end(), false) != present.end()) {
+                logger::post<logger::error>("Expected ", present.size(), " shards, got ", shards.size());
+                return -1;
+            }
+
+            const auto &nodes = shards.front().nodes;
+            if (nodes.size() < 2) {
+                logger::post<logger::info>("Fewer than two images loaded. Nothing to do");
+                return 0;
+            }
+
+            logger::post<logger::info>("Merging ", shards.size(), " shard forests over ", nodes.size(), " images...");
+            const tree mst = logger::benchmark([&]() { return make_tree(nodes.size(), merge_shards(shards)); });
+
+            std::vector<histogram> histograms;
+            for (auto i : nodes) {
+                histograms.emplace_back(cv::Mat{}, filenames[i], i);
+            }
+
+            const auto order = run_metrics::time(pipeline_stage::order, [&]() { return m_orderer.order(mst); });
+            if (!order) return -1;
+            return run_metrics::time(pipeline_stage::output, [&]() { return m_writer.write(*order, histograms, output_directory); });
+        }
+
+        //
+        // Plan
+        //
+
+        // Shards follow the dense layout and anytime mode picks its own stages
+        if (opts.plan && !opts.shard && !opts.time_budget) {
+            plan_execution(opts, filenames.size(), opts.resources ? *opts.resources : detect_system_resources());
+        }
+
+        //
+        // Read images from disk and compute histograms
+        //
+
+        distance_engine distance{ opts.metric };
+        const auto &metric = distance.metric();
+        logger::post<logger::info>("Found ", filenames.size(), " images. Computing histograms (", metric.name, ", ", kernel::active().name, " kernels)...");
+
+        // Product quantiser codes of projected descriptors depend on the projection, so only full descriptors keep theirs
+        const bool cache_codes = opts.mst == mst_engine::pq && opts.projection_dim == 0;
+
+        std::optional<descriptor_cache> cache;
+        if (opts.cache_file) {
+            cache.emplace(*opts.cache_file, descriptor_tag(opts), metric.descriptor_size(histogram_bins),
+                          cache_codes ? opts.pq.num_subspaces : 0, filenames);
+        }
+
+        std::optional<checkpoint> cp;
+        if (opts.checkpoint_file) {
+            cp.emplace(*opts.checkpoint_file, input_fingerprint(opts, filenames), filenames.size(),
+                       metric.descriptor_size(histogram_bins), entry_size(opts.precision), opts.resume);
+        }
+
+        auto &histograms = run_metrics::time(pipeline_stage::histograms, [&]() -> std::vector<histogram> & {
+            return m_extractor.extract(filenames, opts, metric, cache ? &*cache : nullptr, cp ? &*cp : nullptr);
+        });
+
+        // Keeps what a cancelled run computed. The stages have flushed their descriptors and row blocks to the
+        // checkpoint already; the cache is committed here. A best-effort order of every image is written if asked for.
+        auto cancelled = [&](const tree *partial) {
+            logger::post<logger::warning>("Cancelled with ", histograms.size(), " of ", filenames.size(), " descriptors",
+                                          partial ? ", " + std::to_string(partial->num_edges()) + " tree edges" : std::string{});
+
+            // Images that were not reached follow those that were, without a descriptor
+            std::vector<histogram> entries;
+            std::vector<std::size_t> order;
+            if (opts.partial_output) {
+                entries = histograms;
+                std::vector<bool> reached(filenames.size(), false);
+                for (const auto &h : histograms) reached[h.file_index] = true;
+                for (std::size_t i = 0; i < filenames.size(); ++i) {
+                    if (!reached[i]) entries.emplace_back(cv::Mat{}, filenames[i], i);
+                }
+                order = run_metrics::time(pipeline_stage::order, [&]() { return m_orderer.order_partial(partial, entries); });
+                std::for_each(entries.begin(), entries.end(), [](auto &h) { h.clear(); });
+            }
+
+            if (cache || cp) {
+                std::for_each(histograms.begin(), histograms.end(), [](auto &h) { h.clear(); });
+            }
+            if (cache) {
+                cache->commit();
+                logger::post<logger::info>("Kept the descriptors computed so far in ", *opts.cache_file);
+            }
+            if (cp) {
+                logger::post<logger::info>("Kept progress in checkpoint ", cp->path(), ", continue with --resume");
+            }
+
+            if (opts.partial_output) {
+                run_metrics::time(pipeline_stage::output, [&]() { return m_writer.write(order, entries, output_directory); });
+            }
+            return cancelled_status;
+        };
+
+        if (cancellation::requested()) {
+            return cancelled(nullptr);
+        }
+
+        if (histograms.empty()) {
+            logger::post<logger::warning>("No histograms were computed");
+            return -1;
+        }
+        else if (histograms.size() == 1) {
+            logger::post<logger::info>("Only one image loaded. Nothing to do");
+            return 0;
+        }
+
+        //
+        // Reduce dimensionality
+        //
+
+        if (opts.projection_dim > 0 && !distance.project(histograms, opts.projection_dim)) {
+            logger::post<logger::warning>("Projection to ", opts.projection_dim, " dimensions would not reduce ", histograms.front().mat.total(), " dimensional descriptors, skipping it");
+        }
+
+        //
+        // Anytime ordering
+        //
+
+        if (opts.time_budget) {
+            const auto deadline = start_time + std::chrono::duration_cast<std::chrono::steady_clock::duration>(*opts.time_budget);
+            const auto order = run_metrics::time(pipeline_stage::order, [&]() { return m_orderer.order(distance, histograms, opts.lsh, deadline); });
+
+            if (cache) {
+                std::for_each(histograms.begin(), histograms.end(), [](auto &h) { h.clear(); });
+                cache->commit();
+            }
+
+            // Cancellation only brings the deadline forward, so the order is complete either way
+            const int status = run_metrics::time(pipeline_stage::output, [&]() { return m_writer.write(order, histograms, output_directory); });
+            return cancellation::requested() && status == 0 ? cancelled_status : status;
+        }
+
+        //
+        // Compute one shard
+        //
+
+        if (opts.shard) {
+            const auto [index, count] = *opts.shard;
+            auto dist = [&](std::size_t x, std::size_t y) { return distance(histograms[x], histograms[y]); };
+
+            shard s;
+            s.fingerprint = input_fingerprint(opts, filenames);
+            s.index = index;
+            s.count = count;
+            for (const auto &h : histograms) {
+                s.nodes.push_back(h.file_index);
+            }
+
+            logger::post<logger::info>("Computed ", histograms.size(), " histograms. Computing shard ", index, "/", count, "...");
+            s.forest = logger::benchmark([&]() { return compute_shard_forest(histograms.size(), index, count, dist); });
+
+            logger::post<logger::info>("Writing ", s.forest.size(), " forest edges to ", output_directory);
+            write_shard(output_directory, s);
+            return 0;
+        }
+
+        const tree mst = run_metrics::time(pipeline_stage::tree, [&]() {
+            return m_tree_builder.build(opts, distance, histograms, cache && cache_codes ? &*cache : nullptr, cp ? &*cp : nullptr);
+        });
+        progress::end();
+        if (cancellation::requested()) {
+            return cancelled(&mst);
+        }
+
+        if (cache || cp) {
+            // Descriptors in the mapped files are not used past this point
+            std::for_each(histograms.begin(), histograms.end(), [](auto &h) { h.clear(); });
+        }
+
+        if (cache) {
+            cache->commit();
+        }
+
+        if (cp) {
+            cp->remove();
+        }
+
+        const auto order = run_metrics::time(pipeline_stage::order, [&]() { return m_orderer.order(mst); });
+        if (!order) return -1;
+        return run_metrics::time(pipeline_stage::output, [&]() { return m_writer.write(*order, histograms, output_directory); });
+    }
+
+    //
+    // Batches
+    //
+
+    std::unique_ptr<sorter> batch_runner::acquire() {
+        std::lock_guard lock{ m_mutex };
+        if (m_idle.empty()) return std::make_unique<sorter>();
+
+        auto res = std::move(m_idle.back());
+        m_idle.pop_back();
+        return res;
+    }
+
+    void batch_runner::give_back(std::unique_ptr<sorter> s) {
+        std::lock_guard lock{ m_mutex };
+        m_idle.push_back(std::move(s));
+    }
+
+    std::vector<batch_result> batch_runner::run(const std::vector<batch_job> &jobs, const options &opts) {
+        const auto start_time = std::chrono::steady_clock::now();
+        std::vector<batch_result> res(jobs.size());
+
+        std::vector<std::size_t> sizes(jobs.size());
+        std::transform(execution_policy, jobs.begin(), jobs.end(), sizes.begin(), [](const auto &job) {
+            std::error_code ec;
+            return std::filesystem::is_directory(job.source, ec) ? scanner{}.scan(job.source).size() : std::size_t{ 0 };
+        });
+        const auto schedule = batch_schedule(sizes);
+
+        // Jobs log from many threads at once, so only their warnings and errors are shown
+        logger::set_quiet(true);
+
+        // Every job running at once plans with its part of the machine, so that together they still fit
+        const auto num_workers = std::min<std::size_t>(jobs.size(), std::max(1u, std::thread::hardware_concurrency()));
+        const auto resources = share_of(opts.resources ? *opts.resources : detect_system_resources(), num_workers);
+
+        std::atomic<std::size_t> next{ 0 };
+        const auto workers = boost::irange<std::size_t>(0, num_workers);
+        std::for_each(execution_policy, workers.begin(), workers.end(), [&](std::size_t) {
+            for (auto k = next.fetch_add(1, std::memory_order_relaxed); k < schedule.size(); k = next.fetch_add(1, std::memory_order_relaxed)) {
+                const auto i = schedule[k];
+                auto &result = res[i];
+                result.images = sizes[i];
+                if (cancellation::requested()) {
+                    result.status = cancelled_status;
+                    result.error = "cancelled before it started";
+                    continue;
+                }
+
+                auto job_opts = opts;
+                job_opts.source_directory = jobs[i].source;
+                job_opts.output_directory = jobs[i].output;
+                job_opts.resources = resources;
+
+                auto s = acquire();
+                const auto start = std::chrono::steady_clock::now();
+                try {
+                    result.status = s->run(std::move(job_opts));
+                }
+                catch (const std::exception &e) {
+                    result.status = -1;
+                    result.error = e.what();
+                }
+                catch (...) {
+                    result.status = -1;
+                    result.error = "unknown error";
+                }
+                if (result.status == cancelled_status && result.error.empty()) result.error = "cancelled";
+                run_metrics::job_done(result.status == 0);
+                result.elapsed = std::chrono::steady_clock::now() - start;
+                give_back(std::move(s));
+            }
+        });
+
+        logger::set_quiet(false);
+
+        //
+        // Report
+        //
+
+        const std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start_time;
+        std::chrono::duration<double> busy{ 0 };
+        std::size_t failed = 0, images = 0;
+        for (std::size_t i = 0; i < jobs.size(); ++i) {
+            const auto &r = res[i];
+            busy += r.elapsed;
+            const auto ms = static_cast<long long>(r.elapsed.count() * 1000.0);
+            if (r.status == 0) {
+                logger::post<logger::info>(jobs[i].source, " -> ", jobs[i].output, ": ", r.images, " images in ", ms, "ms");
+                images += r.images;
+            }
+            else {
+                ++failed;
+                logger::post<logger::error>(jobs[i].source, " -> ", jobs[i].output, ": failed after ", ms, "ms", r.error.empty() ? "" : ", ", r.error);
+            }
+        }
+
+        logger::post<logger::info>(boost::format{ "Sorted %1% of %2% directories, %3% images, in %4$.2fs (%5$.2fs of jobs, %6$.1f at a time)" }
+                                   % (jobs.size() - failed) % jobs.size() % images % wall.count() % busy.count() % (busy.count() / std::max(wall.count(), 1e-9)));
+        return res;
+    }
+}
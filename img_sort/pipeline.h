@@ -0,0 +1,270 @@
+#pragma once
+
+#include "img_sort.h"
+#include "colour.h"
+#include "distance_metric.h"
+#include "huge_page_storage.h"
+#include "kernels.h"
+#include "latency.h"
+#include "mst.h"
+#include "read_order.h"
+#include "system_resources.h"
+#include "batch.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+// Library interface: the stages of a sort as objects that keep their buffers from one run to the next, so
+// that a process serving many sort requests pays for its allocations once. Parallel work goes through the
+// standard execution policy, whose thread pool is the process's own and outlives every run.
+
+namespace img_sort {
+
+    static constexpr auto execution_policy = std::execution::par;
+    static constexpr std::size_t histogram_bins = 32;
+    static constexpr int cancelled_status = 130;  // What a sort returns once cancelled, as shells report an interrupt
+
+    struct histogram {
+        cv::Mat mat;
+        std::filesystem::path filename;
+        std::size_t file_index = 0;  // Position in the directory listing, and slot in the descriptor cache
+
+        histogram() {}
+
+        histogram(cv::Mat &&m, const std::filesystem::path &f, std::size_t i = 0)
+        :mat{ std::move(m) },
+         filename{ f },
+         file_index{ i }
+        {}
+
+        void clear() {
+            mat.release();
+        }
+    };
+
+    // How images are decoded for their histogram. Anything but the defaults trades accuracy for speed.
+    struct ingest_options {
+        bool jpeg_dc = false;  // JPEGs from the DC coefficients of their blocks, without the IDCT
+        colour_space colour = colour_space::bgr;  // YCbCr histograms JPEGs in their own colour space
+        std::size_t exif_thumbnail = 0;  // Shortest side of an EXIF thumbnail that may stand in for its JPEG, 0 for none
+        std::size_t target_resolution = 0;  // Shortest side that JPEGs and interlaced PNGs are decoded down to, 0 for full size
+        std::size_t stream_pixels = 64'000'000;  // JPEGs and PNGs of at least this many pixels are decoded a row at a time
+    };
+
+    // How many images took each shortcut, counted across the workers of one run
+    struct ingest_stats {
+        std::atomic<std::size_t> exif_thumbnails{ 0 };
+        std::atomic<std::size_t> reduced_decodes{ 0 };
+        std::atomic<std::size_t> partial_reads{ 0 };  // Reduced decodes that stopped before the end of the file
+        std::atomic<std::size_t> streamed_decodes{ 0 };
+    };
+
+    enum class table_precision {
+        f64,
+        f32,
+        u16,
+        u8
+    };
+
+    struct pq_options {
+        std::size_t num_subspaces = 64;
+        std::size_t num_neighbours = 8;
+        std::size_t num_refined = 32;
+        std::size_t num_training_samples = 2048;
+    };
+
+    struct lsh_options {
+        std::size_t num_tables = 8;
+        std::size_t num_bits = 0;  // 0 picks about 8 images per bucket
+        std::size_t max_bucket_size = 32;
+    };
+
+    enum class mst_engine {
+        dense,
+        pivot,
+        pq,
+        lsh
+    };
+
+    struct options {
+        std::filesystem::path source_directory;
+        std::filesystem::path output_directory;
+        metric_type metric = metric_type::bhattacharyya;
+        bool benchmark_metrics = false;
+        bool benchmark_decode = false;
+        ingest_options ingest;
+        read_order file_order = read_order::listed;
+        mst_engine mst = mst_engine::dense;
+        table_precision precision = table_precision::f64;
+        std::size_t num_pivots = 16;
+        pq_options pq;
+        lsh_options lsh;
+        std::optional<std::filesystem::path> cache_file;
+        std::size_t projection_dim = 0;
+        std::optional<std::filesystem::path> checkpoint_file;
+        std::chrono::seconds checkpoint_interval{ 60 };
+        bool resume = false;
+        std::optional<std::pair<std::size_t, std::size_t>> shard;  // (index, count)
+        bool merge = false;
+        std::vector<std::filesystem::path> shard_files;
+        std::optional<std::filesystem::path> batch_file;  // Source and output directories come from here instead
+        std::optional<std::chrono::duration<double>> time_budget;
+        bool partial_output = false;  // Write a best-effort order when cancelled
+        std::size_t slow_files = 10;  // Slowest images listed with the decode latencies, 0 for none
+        std::optional<std::chrono::seconds> progress_interval;  // Log progress this often
+        std::optional<std::filesystem::path> progress_file;  // Status file progress is written to
+        std::optional<std::filesystem::path> metrics_file;  // Prometheus textfile the process's totals are exported to
+        std::chrono::seconds metrics_interval{ 15 };
+        std::chrono::seconds shutdown_grace{ 10 };  // How long a cancelled process may take to save its progress
+        bool plan = true;
+        std::optional<system_resources> resources;  // What the plan may use, all the process has if not given
+        std::optional<kernel::instruction_set> kernels;
+        std::optional<std::filesystem::path> tune_file;
+
+        // Choices made on the command line, which the planner keeps
+        struct {
+            bool mst = false;
+            bool precision = false;
+            bool projection = false;
+        } forced;
+    };
+
+    class checkpoint;
+    class descriptor_cache;
+
+    // Chooses what opts leaves open (engine, table precision, projection) for size images within resources
+    void plan_execution(options &opts, std::size_t size, const system_resources &resources);
+
+    //
+    // Stages
+    //
+
+    // Lists the images of a directory, in the order the directory returns them
+    class scanner {
+    public:
+        std::vector<std::filesystem::path> scan(const std::filesystem::path &directory) const;
+    };
+
+    // Histograms, and from them descriptors, of a list of images: restored from a checkpoint or descriptor cache
+    // where one is given, otherwise decoded in the read order of the options
+    class descriptor_extractor {
+        std::vector<histogram> m_histograms;
+        std::vector<std::size_t> m_schedule;
+        std::vector<std::optional<file_location>> m_locations;
+        std::vector<file_latency> m_latencies;
+        ingest_stats m_stats;
+
+    public:
+        // Descriptors of the images that could be read, in listing order. The result is reused by the next call.
+        std::vector<histogram> &extract(const std::vector<std::filesystem::path> &filenames, const options &opts, const metric_functions &metric,
+                                        descriptor_cache *cache, checkpoint *cp);
+
+        // Shortcuts taken by the last call
+        const ingest_stats &stats() const noexcept { return m_stats; }
+
+        // Time each image decoded by the last call took. Restored images are not listed.
+        const std::vector<file_latency> &latencies() const noexcept { return m_latencies; }
+    };
+
+    // The metric descriptors are compared with, and the projection that makes it cheaper
+    class distance_engine {
+        metric_functions m_metric;
+
+    public:
+        explicit distance_engine(metric_type type);
+
+        const metric_functions &metric() const noexcept { return m_metric; }
+
+        // Projects descriptors to dim dimensions, after which they are compared with L2. False if that would not reduce them.
+        bool project(std::vector<histogram> &histograms, std::size_t dim);
+
+        double operator()(const histogram &lhs, const histogram &rhs) const;
+    };
+
+    // Minimum spanning tree of the descriptors with the engine of the options. The memory of the dense
+    // distance table is kept for the next tree of at most the same size.
+    class tree_builder {
+        table_arena m_arena;
+
+    public:
+        tree build(const options &opts, const distance_engine &distance, std::vector<histogram> &histograms, descriptor_cache *cache, checkpoint *cp);
+
+        // Returns the kept table memory to the OS
+        void release() noexcept { m_arena.release(); }
+    };
+
+    // The order images are written in: a pre-order walk of a tree, or the anytime order within a deadline, whose
+    // exact stage keeps its table memory like tree_builder
+    class orderer {
+        table_arena m_arena;
+
+    public:
+        std::optional<std::vector<std::size_t>> order(const tree &mst) const;
+        std::vector<std::size_t> order(const distance_engine &distance, std::vector<histogram> &histograms, const lsh_options &lsh,
+                                       std::chrono::steady_clock::time_point deadline);
+
+        // Best-effort order for a cancelled run: a walk of the tree grown so far, if any, then the other images with
+        // descriptors along a Hilbert curve, then the images without one as listed
+        std::vector<std::size_t> order_partial(const tree *partial, const std::vector<histogram> &histograms) const;
+
+        void release() noexcept { m_arena.release(); }
+    };
+
+    // Links every image into the output directory, numbered by its position in the order
+    class output_writer {
+    public:
+        int write(const std::vector<std::size_t> &order, const std::vector<histogram> &histograms, const std::filesystem::path &output_directory) const;
+    };
+
+    // Runs sort requests one after another through one set of stages. Returns 0 on success, as main would, and
+    // cancelled_status once cancellation is requested, after keeping what was computed in the cache and checkpoint.
+    class sorter {
+        scanner m_scanner;
+        descriptor_extractor m_extractor;
+        tree_builder m_tree_builder;
+        orderer m_orderer;
+        output_writer m_writer;
+
+    public:
+        int run(options opts);
+
+        // Returns memory kept for later runs to the OS
+        void release() noexcept {
+            m_tree_builder.release();
+            m_orderer.release();
+        }
+    };
+
+    // Outcome of one job of a batch
+    struct batch_result {
+        std::size_t images = 0;
+        int status = 0;  // As sorter::run returns it
+        std::chrono::duration<double> elapsed{ 0 };
+        std::string error;  // What a job that threw failed with
+    };
+
+    // Runs many sort requests at once on the process's thread pool. Jobs start largest first, one per core at
+    // a time; the parallel stages inside each job share the same pool, so a large job spreads over the cores
+    // that the small ones leave free. Every job gets the same options, and sorters are reused by later jobs.
+    class batch_runner {
+        std::mutex m_mutex;
+        std::vector<std::unique_ptr<sorter>> m_idle;
+
+        std::unique_ptr<sorter> acquire();
+        void give_back(std::unique_ptr<sorter> s);
+
+    public:
+        // Results in the order of jobs, which are also logged with their times and totals. Info messages of the
+        // jobs themselves are not shown.
+        std::vector<batch_result> run(const std::vector<batch_job> &jobs, const options &opts);
+    };
+
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "img_sort.h"
+#include "colour.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <vector>
+
+#if __has_include(<png.h>)
+#define IMG_SORT_HAS_LIBPNG
+#include <csetjmp>
+#include <png.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "libpng16")
+#endif
+#endif
+
+namespace img_sort {
+
+    // Adam7 pass that completes a grid of every step-th pixel in both directions, for steps of 8, 4, 2 and 1
+    inline int adam7_last_pass(std::size_t step) noexcept {
+        return step >= 8 ? 0 : step >= 4 ? 2 : step >= 2 ? 4 : 6;
+    }
+
+#if defined(IMG_SORT_HAS_LIBPNG)
+
+    namespace detail {
+        // libpng reports errors through a longjmp to png_jmpbuf; this one does so without printing
+        inline void png_error_exit(png_structp png, png_const_charp) {
+            png_longjmp(png, 1);
+        }
+
+        inline void png_silent(png_structp, png_const_charp) {}
+
+        // Owns a PNG read struct reading from a file, destroyed with it
+        class png_reader {
+            std::FILE *m_file = nullptr;
+
+        public:
+            png_structp png = nullptr;
+            png_infop info = nullptr;
+
+            explicit png_reader(const std::filesystem::path &path) {
+#if defined(_WIN32)
+                m_file = _wfopen(path.c_str(), L"rb");
+#else
+                m_file = std::fopen(path.c_str(), "rb");
+#endif
+                if (!m_file) return;
+
+                png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_exit, png_silent);
+                if (png) info = png_create_info_struct(png);
+                if (info) png_init_io(png, m_file);
+            }
+
+            png_reader(const png_reader &) = delete;
+            png_reader &operator=(const png_reader &) = delete;
+
+            ~png_reader() {
+                if (png) png_destroy_read_struct(&png, info ? &info : nullptr, nullptr);
+                if (m_file) std::fclose(m_file);
+            }
+
+            bool is_open() const noexcept {
+                return info != nullptr;
+            }
+        };
+
+        // Histogram of the passes up to last_pass(width, height, interlaced) of a PNG, -1 to reject the file,
+        // which is then decoded whole into image if given. Rows are read as they are stored, one at a time: the
+        // rows of each Adam7 pass at that pass's width, each pixel once. Pixels are converted as cv::imread
+        // converts them: 16 bit samples truncated, palettes expanded, grey replicated and alpha dropped.
+        template <typename LastPass>
+        std::vector<float> png_pass_histogram(const std::filesystem::path &path, std::size_t bins, colour_space space, LastPass &&last_pass,
+                                              bgr_image *image = nullptr) {
+            png_reader reader{ path };
+            if (!reader.is_open()) return {};
+
+            png_structp png = reader.png;
+            png_infop info = reader.info;
+            std::vector<float> res;
+            std::vector<png_byte> row;
+
+            // Nothing with a non-trivial destructor may live between here and the longjmp target
+            if (setjmp(png_jmpbuf(png))) {
+                if (image) image->pixels.clear();
+                return {};
+            }
+
+            png_read_info(png, info);
+            const auto width = png_get_image_width(png, info);
+            const auto height = png_get_image_height(png, info);
+            const bool interlaced = png_get_interlace_type(png, info) == PNG_INTERLACE_ADAM7;
+            const int passes = last_pass(width, height, interlaced);
+            if (passes < 0 && !image) return {};
+
+            png_set_expand(png);
+            png_set_strip_16(png);
+            png_set_strip_alpha(png);
+            png_set_gray_to_rgb(png);
+            if (passes < 0) {
+                png_set_bgr(png);
+                const int interlace_passes = png_set_interlace_handling(png);
+                png_read_update_info(png, info);
+                if (png_get_channels(png, info) != 3) return {};
+
+                // libpng puts each pass into the rows read so far
+                image->width = width;
+                image->height = height;
+                image->pixels.resize(static_cast<std::size_t>(width) * height * 3);
+                for (int pass = 0; pass < interlace_passes; ++pass) {
+                    for (png_uint_32 r = 0; r < height; ++r) {
+                        png_read_row(png, image->pixels.data() + static_cast<std::size_t>(r) * width * 3, nullptr);
+                    }
+                }
+                return {};
+            }
+
+            png_read_update_info(png, info);
+            if (png_get_channels(png, info) != 3) return {};
+
+            res.assign(bins * bins * bins, 0.0f);
+            row.resize(png_get_rowbytes(png, info));
+            for (int pass = 0; pass <= (interlaced ? passes : 0); ++pass) {
+                const auto columns = interlaced ? PNG_PASS_COLS(width, pass) : width;
+                const auto rows = interlaced ? PNG_PASS_ROWS(height, pass) : height;
+                if (columns == 0 || rows == 0) continue;
+
+                for (png_uint_32 r = 0; r < rows; ++r) {
+                    png_read_row(png, row.data(), nullptr);
+                    for (png_uint_32 x = 0; x < columns; ++x) {
+                        res[colour_bin(row[x * 3], row[x * 3 + 1], row[x * 3 + 2], bins, space)] += 1.0f;
+                    }
+                }
+            }
+
+            // Anything not read, later passes included, is dropped with the read struct
+            return res;
+        }
+    }
+
+    // Histogram of an interlaced (Adam7) PNG from its first passes only. Passes 1, 3 and 5 complete grids of
+    // every 8th, 4th and 2nd pixel; this stops after the coarsest grid whose shorter side is still at least
+    // min_side pixels, and never reads the rest of the file.
+    //
+    // Returns an empty histogram (for a full decode instead) if the PNG is not interlaced or no grid is coarse enough.
+    inline std::vector<float> png_adam7_histogram(const std::filesystem::path &path, std::size_t bins, std::size_t min_side, colour_space space) {
+        return detail::png_pass_histogram(path, bins, space, [min_side](std::size_t width, std::size_t height, bool interlaced) {
+            std::size_t step = 8;
+            while (step > 1 && (std::min(width, height) + step - 1) / step < min_side) step /= 2;
+            return interlaced && step > 1 ? adam7_last_pass(step) : -1;
+        });
+    }
+
+    // Histogram of a PNG of at least min_pixels pixels, read a row at a time so that memory stays at one row
+    // however tall the image is. Interlaced PNGs are read pass by pass, which covers every pixel once without
+    // the whole image libpng would otherwise need to put the passes together.
+    //
+    // Returns an empty histogram for smaller images, which are decoded whole into image if given, from the same
+    // header read, and otherwise left to cv::imread.
+    inline std::vector<float> png_streamed_histogram(const std::filesystem::path &path, std::size_t bins, std::size_t min_pixels, colour_space space,
+                                                     bgr_image *image = nullptr) {
+        return detail::png_pass_histogram(path, bins, space, [min_pixels](std::size_t width, std::size_t height, bool) {
+            return width * height >= min_pixels ? adam7_last_pass(1) : -1;
+        }, image);
+    }
+
+#else
+
+    inline std::vector<float> png_adam7_histogram(const std::filesystem::path &, std::size_t, std::size_t, colour_space) {
+        return {};
+    }
+
+    inline std::vector<float> png_streamed_histogram(const std::filesystem::path &, std::size_t, std::size_t, colour_space, bgr_image * = nullptr) {
+        return {};
+    }
+
+#endif
+
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+#include "img_sort.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <execution>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace img_sort {
+
+    // Product quantiser with 16 centroids per subspace, so that every code is a nibble and a
+    // whole subspace lookup table fits one 128-bit shuffle. Approximates squared L2 distances.
+    class product_quantiser {
+    public:
+        static constexpr std::size_t num_centroids = 16;
+
+        // Per-query distance tables, quantised to bytes: distance ~= sum * scale + bias
+        struct lookup_table {
+            std::vector<std::uint8_t> table;  // table[subspace * num_centroids + centroid]
+            double scale = 1.0;
+            double bias = 0.0;
+
+            double distance(std::uint32_t sum) const noexcept {
+                return sum * scale + bias;
+            }
+        };
+
+    private:
+        std::size_t m_dim = 0;
+        std::size_t m_num_subspaces = 0;
+        std::vector<float> m_centroids;  // Subspace m starts at subspace_begin(m) * num_centroids
+
+        std::size_t subspace_begin(std::size_t m) const noexcept {
+            return m * m_dim / m_num_subspaces;
+        }
+
+        std::size_t subspace_dim(std::size_t m) const noexcept {
+            return subspace_begin(m + 1) - subspace_begin(m);
+        }
+
+        const float *centroid(std::size_t m, std::size_t k) const noexcept {
+            return m_centroids.data() + subspace_begin(m) * num_centroids + k * subspace_dim(m);
+        }
+
+        static float squared_distance(const float *a, const float *b, std::size_t n) noexcept {
+            float res = 0.0f;
+            for (std::size_t i = 0; i < n; ++i) {
+                res += (a[i] - b[i]) * (a[i] - b[i]);
+            }
+            return res;
+        }
+
+        std::size_t nearest_centroid(std::size_t m, const float *sub) const noexcept {
+            std::size_t best = 0;
+            float best_dist = std::numeric_limits<float>::max();
+            for (std::size_t k = 0; k < num_centroids; ++k) {
+                const float d = squared_distance(sub, centroid(m, k), subspace_dim(m));
+                if (d < best_dist) {
+                    best_dist = d;
+                    best = k;
+                }
+            }
+            return best;
+        }
+
+        // Lloyd's algorithm with k-means++ seeding on one subspace
+        void train_subspace(std::size_t m, const std::vector<const float *> &samples, std::size_t iterations, std::uint32_t seed) {
+            const auto begin = subspace_begin(m);
+            const auto dim = subspace_dim(m);
+            float *centroids = m_centroids.data() + begin * num_centroids;
+
+            std::mt19937 rng{ seed + static_cast<std::uint32_t>(m) };
+            std::vector<float> nearest(samples.size(), std::numeric_limits<float>::max());
+
+            auto seed_centroid = [&](std::size_t k, std::size_t sample) {
+                std::copy_n(samples[sample] + begin, dim, centroids + k * dim);
+                for (std::size_t i = 0; i < samples.size(); ++i) {
+                    nearest[i] = std::min(nearest[i], squared_distance(samples[i] + begin, centroids + k * dim, dim));
+                }
+            };
+
+            seed_centroid(0, std::uniform_int_distribution<std::size_t>{ 0, samples.size() - 1 }(rng));
+            for (std::size_t k = 1; k < num_centroids; ++k) {
+                std::discrete_distribution<std::size_t> pick{ nearest.begin(), nearest.end() };
+                // All weights are zero when there are fewer distinct samples than centroids
+                const bool degenerate = std::all_of(nearest.begin(), nearest.end(), [](float d) { return d <= 0.0f; });
+                seed_centroid(k, degenerate ? k % samples.size() : pick(rng));
+            }
+
+            std::vector<std::size_t> assignment(samples.size());
+            std::vector<double> sums(num_centroids * dim);
+            std::vector<std::size_t> counts(num_centroids);
+
+            for (std::size_t iteration = 0; iteration < iterations; ++iteration) {
+                std::fill(sums.begin(), sums.end(), 0.0);
+                std::fill(counts.begin(), counts.end(), 0);
+
+                for (std::size_t i = 0; i < samples.size(); ++i) {
+                    const auto k = nearest_centroid(m, samples[i] + begin);
+                    assignment[i] = k;
+                    ++counts[k];
+                    for (std::size_t j = 0; j < dim; ++j) {
+                        sums[k * dim + j] += samples[i][begin + j];
+                    }
+                }
+
+                for (std::size_t k = 0; k < num_centroids; ++k) {
+                    if (counts[k] == 0) {
+                        // Re-seed empty clusters with the sample farthest from its centroid
+                        std::size_t farthest = 0;
+                        float farthest_dist = -1.0f;
+                        for (std::size_t i = 0; i < samples.size(); ++i) {
+                            const float d = squared_distance(samples[i] + begin, centroid(m, assignment[i]), dim);
+                            if (d > farthest_dist) {
+                                farthest_dist = d;
+                                farthest = i;
+                            }
+                        }
+                        std::copy_n(samples[farthest] + begin, dim, centroids + k * dim);
+                        continue;
+                    }
+
+                    for (std::size_t j = 0; j < dim; ++j) {
+                        centroids[k * dim + j] = static_cast<float>(sums[k * dim + j] / counts[k]);
+                    }
+                }
+            }
+        }
+
+    public:
+        product_quantiser() {}
+
+        product_quantiser(std::size_t dim, std::size_t num_subspaces)
+            :m_dim{ dim },
+             m_num_subspaces{ num_subspaces },
+             m_centroids(dim * num_centroids)
+        {
+            // Even, so that codes pack into whole bytes; at most 256, so that 16 bit scan sums cannot overflow
+            RUNTIME_ASSERT(num_subspaces > 0 && num_subspaces % 2 == 0 && num_subspaces <= 256);
+            RUNTIME_ASSERT(dim >= num_subspaces);
+        }
+
+        // Trains every subspace independently and in parallel
+        void train(const std::vector<const float *> &samples, std::size_t iterations = 16, std::uint32_t seed = 0) {
+            RUNTIME_ASSERT(!samples.empty());
+
+            const auto subspaces = boost::irange<std::size_t>(0, m_num_subspaces);
+            std::for_each(std::execution::par, subspaces.begin(), subspaces.end(),
+                [&](std::size_t m) { train_subspace(m, samples, iterations, seed); });
+        }
+
+        std::size_t dim() const noexcept { return m_dim; }
+        std::size_t num_subspaces() const noexcept { return m_num_subspaces; }
+        std::size_t code_size() const noexcept { return m_num_subspaces / 2; }
+
+        const std::vector<float> &centroids() const noexcept { return m_centroids; }
+        std::vector<float> &centroids() noexcept { return m_centroids; }
+
+        // Two subspaces per byte, even subspace in the low nibble
+        void encode(const float *x, std::uint8_t *code) const {
+            std::fill_n(code, code_size(), std::uint8_t{ 0 });
+            for (std::size_t m = 0; m < m_num_subspaces; ++m) {
+                const auto k = static_cast<std::uint8_t>(nearest_centroid(m, x + subspace_begin(m)));
+                code[m / 2] |= m % 2 == 0 ? k : static_cast<std::uint8_t>(k << 4);
+            }
+        }
+
+        std::size_t code_at(const std::uint8_t *code, std::size_t m) const noexcept {
+            return m % 2 == 0 ? code[m / 2] & 0x0F : code[m / 2] >> 4;
+        }
+
+        lookup_table make_lookup_table(const float *query) const {
+            std::vector<float> distances(m_num_subspaces * num_centroids);
+            double bias = 0.0;
+            float range = 0.0f;
+
+            for (std::size_t m = 0; m < m_num_subspaces; ++m) {
+                float *row = distances.data() + m * num_centroids;
+                for (std::size_t k = 0; k < num_centroids; ++k) {
+                    row[k] = squared_distance(query + subspace_begin(m), centroid(m, k), subspace_dim(m));
+                }
+
+                const float row_min = *std::min_element(row, row + num_centroids);
+                std::transform(row, row + num_centroids, row, [row_min](float d) { return d - row_min; });
+                bias += row_min;
+                range = std::max(range, *std::max_element(row, row + num_centroids));
+            }
+
+            lookup_table res;
+            res.scale = range > 0.0f ? range / 255.0 : 1.0;
+            res.bias = bias;
+            res.table.resize(distances.size());
+            std::transform(distances.begin(), distances.end(), res.table.begin(),
+                [&](float d) { return static_cast<std::uint8_t>(std::min(255.0, std::round(d / res.scale))); });
+            return res;
+        }
+
+        // Exact-table asymmetric distance of a single code, without the byte quantisation
+        double distance(const float *query, const std::uint8_t *code) const noexcept {
+            double res = 0.0;
+            for (std::size_t m = 0; m < m_num_subspaces; ++m) {
+                res += squared_distance(query + subspace_begin(m), centroid(m, code_at(code, m)), subspace_dim(m));
+            }
+            return res;
+        }
+    };
+
+    // Codes regrouped into blocks of 16, one shuffle per subspace per block. For each subspace a block holds
+    // 8 bytes; byte j has the code of vector j in its low nibble and that of vector j + 8 in its high nibble.
+    class pq_code_blocks {
+        std::vector<std::uint8_t> m_data;
+        std::size_t m_num_subspaces = 0;
+        std::size_t m_size = 0;
+
+    public:
+        static constexpr std::size_t block_size = 16;
+
+        pq_code_blocks() {}
+
+        pq_code_blocks(const product_quantiser &pq, const std::uint8_t *codes, std::size_t size)
+            :m_data(num_blocks(size) * pq.num_subspaces() * block_size / 2),
+             m_num_subspaces{ pq.num_subspaces() },
+             m_size{ size }
+        {
+            for (std::size_t i = 0; i < size; ++i) {
+                const std::uint8_t *code = codes + i * pq.code_size();
+                std::uint8_t *block = m_data.data() + (i / block_size) * m_num_subspaces * block_size / 2;
+                const auto lane = i % block_size;
+
+                for (std::size_t m = 0; m < m_num_subspaces; ++m) {
+                    const auto k = static_cast<std::uint8_t>(pq.code_at(code, m));
+                    block[m * block_size / 2 + lane % 8] |= lane < 8 ? k : static_cast<std::uint8_t>(k << 4);
+                }
+            }
+        }
+
+        static constexpr std::size_t num_blocks(std::size_t size) noexcept {
+            return (size + block_size - 1) / block_size;
+        }
+
+        std::size_t size() const noexcept { return m_size; }
+
+        // Sums of the lookup table entries for the 16 vectors of one block
+        void scan(const product_quantiser::lookup_table &lut, std::size_t block, std::uint16_t *out) const noexcept {
+            const std::uint8_t *codes = m_data.data() + block * m_num_subspaces * block_size / 2;
+            kernel::pq_scan(lut.table.data(), codes, m_num_subspaces, out);
+        }
+    };
+
+}
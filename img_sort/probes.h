@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+
+// USDT probes of provider img_sort, for tracing with bpftrace, perf or SystemTap without logging or rebuilding:
+//
+//   decode__start(index, path, bytes)            an image is about to be read and decoded
+//   decode__done(index, path, bytes, pixels)     it was, with the pixels histogrammed, 0 if it failed
+//   histogram__done(index, restored, ok)         its descriptor is ready, decoded or restored from a cache
+//   pairs__block(block, first_row, last_row)     a row block of the dense distance table is complete
+//   mst__edges(edges, total)                     Prim has added another probe_edge_batch edges, or its last
+//   link__created(position, source, link)        an image is linked into the output directory
+//
+// Each site is a nop with a note in the ELF file, which a tracer replaces with a breakpoint while attached, so
+// unattached probes cost only their arguments. Those are values at hand, except for the pixel count, a pass over
+// the histogram of each decoded image. Without <sys/sdt.h> (from systemtap-sdt-dev or systemtap-sdt-devel) or
+// off Linux, probes and their arguments compile to nothing.
+#if defined(__linux__) && __has_include(<sys/sdt.h>)
+#define IMG_SORT_HAS_PROBES
+#include <sys/sdt.h>
+#define IMG_SORT_PROBE(name, ...) STAP_PROBEV(img_sort, name, __VA_ARGS__)
+#else
+#define IMG_SORT_PROBE(name, ...) do {} while (false)
+#endif
+
+namespace img_sort {
+
+#if defined(IMG_SORT_HAS_PROBES)
+    static constexpr bool has_probes = true;
+#else
+    static constexpr bool has_probes = false;
+#endif
+
+    // Edges Prim adds between mst__edges probes
+    static constexpr std::size_t probe_edge_batch = 1024;
+
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "boost/format.hpp"
+
+namespace img_sort {
+
+    enum class progress_stage {
+        idle,
+        histograms,  // Counted in files, with the bytes of the files decoded
+        pairs,       // Distances of the dense table
+        mst          // Edges added by Prim
+    };
+
+    // Progress of the running sort, for a reporter thread to sample. Workers only add to relaxed atomics, each on
+    // its own cache line, and per batch where items are small, so the hot paths never lock or log. The counters
+    // add up over the life of the process; a stage counts from where they stood when it began.
+    class progress {
+        struct alignas(64) counter {
+            std::atomic<std::uint64_t> value{ 0 };
+        };
+
+        struct state {
+            std::atomic<progress_stage> stage{ progress_stage::idle };
+            std::atomic<std::uint64_t> total{ 0 };
+            std::atomic<std::uint64_t> base{ 0 };
+            std::atomic<std::uint64_t> bytes_base{ 0 };
+            std::atomic<std::chrono::steady_clock::rep> start{ 0 };
+            counter files, bytes, pairs, edges;
+        };
+
+        static state &get() noexcept {
+            static state s;
+            return s;
+        }
+
+    public:
+        // Pairs a worker computes before adding them
+        static constexpr std::uint64_t pair_batch = 4096;
+
+        struct snapshot {
+            progress_stage stage = progress_stage::idle;
+            std::uint64_t total = 0;
+            std::uint64_t base = 0;
+            std::uint64_t bytes_base = 0;
+            std::chrono::steady_clock::time_point start;
+            std::uint64_t files = 0;
+            std::uint64_t bytes = 0;
+            std::uint64_t pairs = 0;
+            std::uint64_t edges = 0;
+
+            // Items of the current stage done so far
+            std::uint64_t done() const noexcept {
+                switch (stage) {
+                case progress_stage::histograms: return files - std::min(base, files);
+                case progress_stage::pairs: return pairs - std::min(base, pairs);
+                case progress_stage::mst: return edges - std::min(base, edges);
+                default: return 0;
+                }
+            }
+        };
+
+        // Starts counting a stage of total items
+        static void begin(progress_stage stage, std::uint64_t total) noexcept {
+            auto &s = get();
+            switch (stage) {
+            case progress_stage::histograms:
+                s.base.store(s.files.value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                s.bytes_base.store(s.bytes.value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                break;
+            case progress_stage::pairs: s.base.store(s.pairs.value.load(std::memory_order_relaxed), std::memory_order_relaxed); break;
+            case progress_stage::mst: s.base.store(s.edges.value.load(std::memory_order_relaxed), std::memory_order_relaxed); break;
+            default: break;
+            }
+            s.total.store(total, std::memory_order_relaxed);
+            s.start.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+            s.stage.store(stage, std::memory_order_relaxed);
+        }
+
+        static void end() noexcept {
+            get().stage.store(progress_stage::idle, std::memory_order_relaxed);
+        }
+
+        static void file_done(std::uint64_t bytes_read) noexcept {
+            get().files.value.fetch_add(1, std::memory_order_relaxed);
+            if (bytes_read > 0) get().bytes.value.fetch_add(bytes_read, std::memory_order_relaxed);
+        }
+
+        static void pairs_done(std::uint64_t count) noexcept {
+            if (count > 0) get().pairs.value.fetch_add(count, std::memory_order_relaxed);
+        }
+
+        static void edge_done() noexcept {
+            get().edges.value.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        static snapshot sample() noexcept {
+            const auto &s = get();
+            snapshot res;
+            res.stage = s.stage.load(std::memory_order_relaxed);
+            res.total = s.total.load(std::memory_order_relaxed);
+            res.base = s.base.load(std::memory_order_relaxed);
+            res.bytes_base = s.bytes_base.load(std::memory_order_relaxed);
+            res.start = std::chrono::steady_clock::time_point{ std::chrono::steady_clock::duration{ s.start.load(std::memory_order_relaxed) } };
+            res.files = s.files.value.load(std::memory_order_relaxed);
+            res.bytes = s.bytes.value.load(std::memory_order_relaxed);
+            res.pairs = s.pairs.value.load(std::memory_order_relaxed);
+            res.edges = s.edges.value.load(std::memory_order_relaxed);
+            return res;
+        }
+    };
+
+    // Rate, share done and time left of a stage, from its average rate since it began
+    struct progress_estimate {
+        double percent = 0.0;
+        double rate = 0.0;  // Items per second
+        std::optional<std::chrono::seconds> remaining;  // Unknown until an item is done
+    };
+
+    inline progress_estimate estimate_progress(const progress::snapshot &s, std::chrono::steady_clock::time_point now) {
+        progress_estimate res;
+        const auto done = s.done();
+        const double elapsed = std::chrono::duration<double>(now - s.start).count();
+        if (s.total > 0) res.percent = 100.0 * static_cast<double>(std::min(done, s.total)) / static_cast<double>(s.total);
+        if (elapsed > 0.0) res.rate = static_cast<double>(done) / elapsed;
+        if (res.rate > 0.0) {
+            res.remaining = std::chrono::seconds{ static_cast<std::int64_t>(static_cast<double>(s.total - std::min(done, s.total)) / res.rate + 0.5) };
+        }
+        return res;
+    }
+
+    // "17s", "3m05s", "2h07m"
+    inline std::string format_duration(std::chrono::seconds duration) {
+        const auto seconds = duration.count();
+        if (seconds < 60) return (boost::format{ "%1%s" } % seconds).str();
+        if (seconds < 3600) return (boost::format{ "%1%m%2$02ds" } % (seconds / 60) % (seconds % 60)).str();
+        return (boost::format{ "%1%h%2$02dm" } % (seconds / 3600) % (seconds % 3600 / 60)).str();
+    }
+
+    // One line for the log, empty while idle
+    inline std::string describe_progress(const progress::snapshot &s, std::chrono::steady_clock::time_point now) {
+        const auto e = estimate_progress(s, now);
+        const auto left = e.remaining ? format_duration(*e.remaining) + " left" : std::string{ "estimating" };
+
+        switch (s.stage) {
+        case progress_stage::histograms: {
+            const double elapsed = std::max(std::chrono::duration<double>(now - s.start).count(), 1e-9);
+            const auto bytes = s.bytes - std::min(s.bytes_base, s.bytes);
+            return (boost::format{ "Histograms: %1% of %2% images (%3$.1f%%), %4$.1f images/s, %5$.1f MiB/s read, %6%" }
+                    % s.done() % s.total % e.percent % e.rate % (bytes / elapsed / (1024.0 * 1024.0)) % left).str();
+        }
+        case progress_stage::pairs:
+            return (boost::format{ "Pairs: %1% of %2% (%3$.1f%%), %4$.0f pairs/s, %5%" } % s.done() % s.total % e.percent % e.rate % left).str();
+        case progress_stage::mst:
+            return (boost::format{ "MST: %1% of %2% edges (%3$.1f%%), %4$.0f edges/s, %5%" } % s.done() % s.total % e.percent % e.rate % left).str();
+        default:
+            return {};
+        }
+    }
+
+    // Samples progress every interval on its own thread, and logs it, writes it to a status file, or both. The
+    // file is replaced whole each time, as "key=value" lines, so that readers never see half of it.
+    class progress_reporter {
+        std::chrono::steady_clock::duration m_interval;
+        bool m_log;
+        std::optional<std::filesystem::path> m_file;
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_stop = false;
+        std::thread m_thread;
+
+        void write_status(const progress::snapshot &s, std::chrono::steady_clock::time_point now) const {
+            static constexpr const char *stage_names[] = { "idle", "histograms", "pairs", "mst" };
+            const auto e = estimate_progress(s, now);
+
+            auto temp_path = *m_file;
+            temp_path += ".tmp";
+            {
+                std::ofstream file{ temp_path, std::ios::trunc };
+                file << "stage=" << stage_names[static_cast<int>(s.stage)] << '\n'
+                     << "done=" << s.done() << '\n'
+                     << "total=" << s.total << '\n'
+                     << "percent=" << e.percent << '\n'
+                     << "rate=" << e.rate << '\n'
+                     << "eta_seconds=" << (e.remaining ? std::to_string(e.remaining->count()) : std::string{}) << '\n'
+                     << "files=" << s.files << '\n'
+                     << "bytes=" << s.bytes << '\n'
+                     << "pairs=" << s.pairs << '\n'
+                     << "edges=" << s.edges << '\n';
+                if (!file) return;
+            }
+
+            std::error_code ec;
+            std::filesystem::rename(temp_path, *m_file, ec);
+        }
+
+        void run() {
+            std::unique_lock lock{ m_mutex };
+            while (!m_cv.wait_for(lock, m_interval, [this]() { return m_stop; })) {
+                const auto s = progress::sample();
+                const auto now = std::chrono::steady_clock::now();
+                if (m_log && s.stage != progress_stage::idle) logger::post<logger::info>(describe_progress(s, now));
+                if (m_file) write_status(s, now);
+            }
+
+            // The file ends with the last state of the run
+            if (m_file) write_status(progress::sample(), std::chrono::steady_clock::now());
+        }
+
+    public:
+        progress_reporter(std::chrono::steady_clock::duration interval, bool log, std::optional<std::filesystem::path> file)
+            :m_interval{ interval },
+             m_log{ log },
+             m_file{ std::move(file) },
+             m_thread{ [this]() { run(); } }
+        {}
+
+        progress_reporter(const progress_reporter &) = delete;
+        progress_reporter &operator=(const progress_reporter &) = delete;
+
+        ~progress_reporter() {
+            {
+                std::lock_guard lock{ m_mutex };
+                m_stop = true;
+            }
+            m_cv.notify_one();
+            m_thread.join();
+        }
+    };
+
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <execution>
+#include <random>
+#include <vector>
+
+namespace img_sort {
+
+    // out (rows.size() x cols) = A (rows.size() x dim) * B (dim x cols), with A given as row pointers and B row-major.
+    // Blocked so that a panel of B stays in cache while a block of rows streams past it. Zero entries of A are
+    // skipped, which matters for colour histograms where most bins are empty.
+    inline void multiply(const std::vector<const float *> &rows, std::size_t dim, const float *b, std::size_t cols, float *out) {
+        constexpr std::size_t row_block = 16;
+        constexpr std::size_t dim_block = 256;
+
+        const auto num_row_blocks = (rows.size() + row_block - 1) / row_block;
+        const auto blocks = boost::irange<std::size_t>(0, num_row_blocks);
+
+        std::for_each(std::execution::par, blocks.begin(), blocks.end(), [&](std::size_t block) {
+            const auto row_begin = block * row_block;
+            const auto row_end = std::min(row_begin + row_block, rows.size());
+            std::fill(out + row_begin * cols, out + row_end * cols, 0.0f);
+
+            for (std::size_t k_begin = 0; k_begin < dim; k_begin += dim_block) {
+                const auto k_end = std::min(k_begin + dim_block, dim);
+
+                for (std::size_t r = row_begin; r < row_end; ++r) {
+                    const float *a = rows[r];
+                    float *c = out + r * cols;
+
+                    for (std::size_t k = k_begin; k < k_end; ++k) {
+                        const float a_k = a[k];
+                        if (a_k == 0.0f) continue;
+
+                        const float *b_k = b + k * cols;
+                        for (std::size_t j = 0; j < cols; ++j) {
+                            c[j] += a_k * b_k[j];
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    // Very sparse random projection (Li, Hastie and Church): entries are +-sqrt(s / k) with probability 1 / 2s
+    // each and zero otherwise, with s = sqrt(dim). Preserves squared L2 distances in expectation.
+    class random_projection {
+        std::size_t m_dim = 0;
+        std::size_t m_target_dim = 0;
+        std::vector<float> m_matrix;  // dim x target_dim, row-major
+
+    public:
+        random_projection(std::size_t dim, std::size_t target_dim, std::uint32_t seed = 0)
+            :m_dim{ dim },
+             m_target_dim{ target_dim },
+             m_matrix(dim * target_dim, 0.0f)
+        {
+            RUNTIME_ASSERT(dim > 0 && target_dim > 0);
+
+            const double s = std::sqrt(static_cast<double>(dim));
+            const auto value = static_cast<float>(std::sqrt(s / target_dim));
+
+            std::mt19937 rng{ seed };
+            std::uniform_real_distribution<double> uniform{ 0.0, 1.0 };
+            for (auto &v : m_matrix) {
+                const double u = uniform(rng) * s;
+                if (u < 0.5) v = value;
+                else if (u < 1.0) v = -value;
+            }
+        }
+
+        std::size_t dim() const noexcept { return m_dim; }
+        std::size_t target_dim() const noexcept { return m_target_dim; }
+
+        // Returns the projected rows, rows.size() x target_dim
+        std::vector<float> project(const std::vector<const float *> &rows) const {
+            std::vector<float> res(rows.size() * m_target_dim);
+            multiply(rows, m_dim, m_matrix.data(), m_target_dim, res.data());
+            return res;
+        }
+    };
+
+    struct distortion {
+        double mean_absolute_error = 0.0;
+        double max_absolute_error = 0.0;
+        double mean_relative_error = 0.0;
+        std::size_t num_pairs = 0;
+    };
+
+    // Compares exact(x, y) with approximate(x, y) over every pair of [0, size)
+    template <typename Exact, typename Approximate>
+    distortion measure_distortion(std::size_t size, const Exact &exact, const Approximate &approximate) {
+        distortion res;
+        for (std::size_t y = 1; y < size; ++y) {
+            for (std::size_t x = 0; x < y; ++x) {
+                const double e = exact(x, y);
+                const double error = std::abs(approximate(x, y) - e);
+
+                res.mean_absolute_error += error;
+                res.max_absolute_error = std::max(res.max_absolute_error, error);
+                if (e > 0.0) res.mean_relative_error += error / e;
+                ++res.num_pairs;
+            }
+        }
+
+        if (res.num_pairs > 0) {
+            res.mean_absolute_error /= res.num_pairs;
+            res.mean_relative_error /= res.num_pairs;
+        }
+        return res;
+    }
+
+}
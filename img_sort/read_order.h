@@ -0,0 +1,150 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <winioctl.h>
+#endif
+
+namespace img_sort {
+
+    // Order the histogram stage reads files in. The output order does not depend on it.
+    enum class read_order {
+        listed,  // As the directory listing returned them
+        inode,   // By file number, which most file systems allocate close to the data
+        extent   // By the physical offset of the first extent on the device
+    };
+
+    // Where a file lives: reading in increasing order of (device, position) keeps a disk head moving one way
+    struct file_location {
+        std::uint64_t device = 0;
+        std::uint64_t position = 0;
+
+        bool operator<(const file_location &other) const noexcept {
+            return device != other.device ? device < other.device : position < other.position;
+        }
+    };
+
+    namespace detail {
+#if defined(__linux__)
+        // Physical byte offset of the first extent, if the file system reports one
+        inline std::optional<std::uint64_t> first_extent(int fd) {
+            // The header and room for one extent in its trailing array
+            alignas(fiemap) unsigned char request[sizeof(fiemap) + sizeof(fiemap_extent)]{};
+            auto *map = reinterpret_cast<fiemap *>(request);
+            map->fm_start = 0;
+            map->fm_length = FIEMAP_MAX_OFFSET;
+            map->fm_extent_count = 1;
+
+            if (ioctl(fd, FS_IOC_FIEMAP, map) != 0 || map->fm_mapped_extents == 0) return std::nullopt;
+
+            // Inline and not yet allocated data have no meaningful offset
+            const auto &extent = map->fm_extents[0];
+            if (extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)) return std::nullopt;
+            return extent.fe_physical;
+        }
+#elif defined(_WIN32)
+        // First logical cluster of the file, in clusters rather than bytes, which orders the same way
+        inline std::optional<std::uint64_t> first_extent(HANDLE file) {
+            STARTING_VCN_INPUT_BUFFER input{};
+            RETRIEVAL_POINTERS_BUFFER output{};
+            DWORD bytes = 0;
+
+            // A fragmented file reports ERROR_MORE_DATA with its first extent filled in
+            if (!DeviceIoControl(file, FSCTL_GET_RETRIEVAL_POINTERS, &input, sizeof(input), &output, sizeof(output), &bytes, nullptr)
+                && GetLastError() != ERROR_MORE_DATA) {
+                return std::nullopt;
+            }
+            if (output.ExtentCount == 0 || output.Extents[0].Lcn.QuadPart < 0) return std::nullopt;
+            return static_cast<std::uint64_t>(output.Extents[0].Lcn.QuadPart);
+        }
+#endif
+    }
+
+    // Location of a file for the given order, or nothing if the platform or file system cannot tell
+    inline std::optional<file_location> locate_file(const std::filesystem::path &path, read_order order) {
+        if (order == read_order::listed) return std::nullopt;
+
+#if defined(__linux__)
+        if (order == read_order::inode) {
+            struct stat st{};
+            if (::stat(path.c_str(), &st) != 0) return std::nullopt;
+            return file_location{ static_cast<std::uint64_t>(st.st_dev), static_cast<std::uint64_t>(st.st_ino) };
+        }
+
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return std::nullopt;
+
+        std::optional<file_location> res;
+        struct stat st{};
+        if (::fstat(fd, &st) == 0) {
+            if (auto offset = detail::first_extent(fd)) res = file_location{ static_cast<std::uint64_t>(st.st_dev), *offset };
+        }
+        ::close(fd);
+        return res;
+#elif defined(_WIN32)
+        // Opened for attributes only, which is all both queries need
+        HANDLE file = CreateFileW(path.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                  nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return std::nullopt;
+
+        std::optional<file_location> res;
+        BY_HANDLE_FILE_INFORMATION info{};
+        if (GetFileInformationByHandle(file, &info)) {
+            if (order == read_order::inode) {
+                res = file_location{ info.dwVolumeSerialNumber, (std::uint64_t{ info.nFileIndexHigh } << 32) | info.nFileIndexLow };
+            }
+            else if (auto cluster = detail::first_extent(file)) {
+                res = file_location{ info.dwVolumeSerialNumber, *cluster };
+            }
+        }
+        CloseHandle(file);
+        return res;
+#else
+        return std::nullopt;
+#endif
+    }
+
+    // Indices of locations in increasing location order. Files without one follow in their listed order.
+    inline std::vector<std::size_t> storage_order(const std::vector<std::optional<file_location>> &locations) {
+        std::vector<std::size_t> res(locations.size());
+        std::iota(res.begin(), res.end(), std::size_t{ 0 });
+        std::stable_sort(res.begin(), res.end(), [&](std::size_t a, std::size_t b) {
+            if (!locations[a] || !locations[b]) return locations[a].has_value() && !locations[b].has_value();
+            return *locations[a] < *locations[b];
+        });
+        return res;
+    }
+
+    // Asks the kernel to start reading a file into the page cache, so that it is there when a worker gets to it.
+    // Windows has no equivalent for files that are not yet open, so this does nothing there.
+    inline void prefetch_file(const std::filesystem::path &path) {
+#if defined(__linux__)
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        ::close(fd);
+#else
+        (void)path;
+#endif
+    }
+
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "sparse_mst.h"
+
+#include <cstdint>
+#include <cstring>
+#include <execution>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace img_sort {
+
+    // One process's share of the pair stage. The rows of the full distance table are cut into a fixed number
+    // of blocks per shard, independent of the host, and shard i takes every block b with b % count == i.
+    // Each shard keeps only the minimum spanning forest of its pairs: an edge that is the heaviest on a cycle
+    // within one shard is the heaviest on that cycle overall, so it cannot be in the MST, and Kruskal over
+    // the union of all shard forests gives the exact MST.
+    struct shard {
+        static constexpr std::size_t blocks_per_shard = 64;
+
+        std::uint64_t fingerprint = 0;
+        std::size_t index = 0;
+        std::size_t count = 1;
+        std::vector<std::uint64_t> nodes;  // File index of every node, in the order the edges refer to them
+        std::vector<edge> forest;
+
+        static row_blocks partition(std::size_t size, std::size_t count) {
+            return row_blocks{ size, count * blocks_per_shard };
+        }
+    };
+
+    // Minimum spanning forest of the pairs in shard index of count, built one row block at a time so that
+    // only a block's worth of edges is held at once
+    template <typename Distance>
+    std::vector<edge> compute_shard_forest(std::size_t size, std::size_t index, std::size_t count, const Distance &dist) {
+        RUNTIME_ASSERT(count > 0 && index < count);
+
+        const auto blocks = shard::partition(size, count);
+        std::vector<edge> forest;
+        std::vector<edge> edges;
+
+        for (std::size_t block = index; block < blocks.size(); block += count) {
+            const auto [first, last] = blocks.rows(block);
+            const auto row_offset = [first = first](std::size_t y) { return y * (y - std::min<std::size_t>(y, 1)) / 2 - first * (first - std::min<std::size_t>(first, 1)) / 2; };
+
+            edges.assign(row_offset(last), edge{});
+            const auto rows = boost::irange<std::size_t>(first, last);
+            std::for_each(std::execution::par, rows.begin(), rows.end(), [&](std::size_t y) {
+                edge *row = edges.data() + row_offset(y);
+                for (std::size_t x = 0; x < y; ++x) {
+                    row[x] = { x, y, static_cast<double>(dist(x, y)) };
+                }
+            });
+
+            edges.insert(edges.end(), forest.begin(), forest.end());
+            forest = minimum_spanning_forest(size, std::move(edges));
+            edges = {};
+        }
+
+        return forest;
+    }
+
+    namespace detail {
+        constexpr char shard_magic[8] = { 'I', 'M', 'G', 'S', 'O', 'R', 'T', 'S' };
+        constexpr std::uint32_t shard_version = 1;
+
+        struct shard_header {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t reserved;
+            std::uint64_t fingerprint;
+            std::uint64_t index;
+            std::uint64_t count;
+            std::uint64_t num_nodes;
+            std::uint64_t num_edges;
+        };
+
+        struct shard_edge {
+            std::uint32_t x;
+            std::uint32_t y;
+            double cost;
+        };
+    }
+
+    // Written to a temporary name and renamed, so that a merge never sees half a shard
+    inline void write_shard(const std::filesystem::path &path, const shard &s) {
+        detail::shard_header h{};
+        std::memcpy(h.magic, detail::shard_magic, sizeof(h.magic));
+        h.version = detail::shard_version;
+        h.fingerprint = s.fingerprint;
+        h.index = s.index;
+        h.count = s.count;
+        h.num_nodes = s.nodes.size();
+        h.num_edges = s.forest.size();
+
+        std::vector<detail::shard_edge> edges;
+        for (const auto &e : s.forest) {
+            edges.push_back({ static_cast<std::uint32_t>(e.x), static_cast<std::uint32_t>(e.y), e.cost });
+        }
+
+        const std::filesystem::path temp_path = path.string() + ".tmp";
+        {
+            std::ofstream file{ temp_path, std::ios::binary | std::ios::trunc };
+            file.write(reinterpret_cast<const char *>(&h), sizeof(h));
+            file.write(reinterpret_cast<const char *>(s.nodes.data()), s.nodes.size() * sizeof(std::uint64_t));
+            file.write(reinterpret_cast<const char *>(edges.data()), edges.size() * sizeof(detail::shard_edge));
+            RUNTIME_ASSERT(file.good());
+        }
+        std::filesystem::rename(temp_path, path);
+    }
+
+    inline shard read_shard(const std::filesystem::path &path) {
+        std::ifstream file{ path, std::ios::binary };
+        RUNTIME_ASSERT(file.good());
+
+        detail::shard_header h{};
+        file.read(reinterpret_cast<char *>(&h), sizeof(h));
+        RUNTIME_ASSERT(file.good() && std::memcmp(h.magic, detail::shard_magic, sizeof(h.magic)) == 0 && h.version == detail::shard_version);
+        RUNTIME_ASSERT(h.count > 0 && h.index < h.count && h.num_edges < h.num_nodes + (h.num_nodes == 0));
+
+        shard s;
+        s.fingerprint = h.fingerprint;
+        s.index = static_cast<std::size_t>(h.index);
+        s.count = static_cast<std::size_t>(h.count);
+        s.nodes.resize(static_cast<std::size_t>(h.num_nodes));
+        file.read(reinterpret_cast<char *>(s.nodes.data()), s.nodes.size() * sizeof(std::uint64_t));
+
+        std::vector<detail::shard_edge> edges(static_cast<std::size_t>(h.num_edges));
+        file.read(reinterpret_cast<char *>(edges.data()), edges.size() * sizeof(detail::shard_edge));
+        RUNTIME_ASSERT(file.good());
+
+        for (const auto &e : edges) {
+            RUNTIME_ASSERT(e.x < s.nodes.size() && e.y < s.nodes.size());
+            s.forest.push_back({ e.x, e.y, e.cost });
+        }
+        return s;
+    }
+
+    // Kruskal over the union of the forests of a complete, consistent set of shards
+    inline std::vector<edge> merge_shards(const std::vector<shard> &shards) {
+        RUNTIME_ASSERT(!shards.empty());
+
+        const auto &first = shards.front();
+        std::vector<bool> seen(first.count, false);
+        std::vector<edge> edges;
+
+        for (const auto &s : shards) {
+            RUNTIME_ASSERT(s.fingerprint == first.fingerprint && s.count == first.count && s.nodes == first.nodes);
+            RUNTIME_ASSERT(!seen[s.index]);
+            seen[s.index] = true;
+            edges.insert(edges.end(), s.forest.begin(), s.forest.end());
+        }
+        RUNTIME_ASSERT(shards.size() == first.count);
+
+        auto res = minimum_spanning_forest(first.nodes.size(), std::move(edges));
+        RUNTIME_ASSERT(res.size() + 1 == first.nodes.size());
+        return res;
+    }
+
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "mst.h"
+
+#include <algorithm>
+#include <execution>
+#include <numeric>
+#include <queue>
+#include <vector>
+
+namespace img_sort {
+
+    struct edge {
+        std::size_t x = 0;
+        std::size_t y = 0;
+        double cost = 0.0;
+
+        bool operator<(const edge &other) const noexcept {
+            return std::tie(cost, x, y) < std::tie(other.cost, other.x, other.y);
+        }
+    };
+
+    class disjoint_sets {
+        std::vector<std::size_t> m_parent;
+
+    public:
+        disjoint_sets(std::size_t size)
+            :m_parent(size)
+        {
+            std::iota(m_parent.begin(), m_parent.end(), std::size_t{ 0 });
+        }
+
+        std::size_t find(std::size_t i) noexcept {
+            while (m_parent[i] != i) {
+                i = m_parent[i] = m_parent[m_parent[i]];
+            }
+            return i;
+        }
+
+        bool unite(std::size_t a, std::size_t b) noexcept {
+            a = find(a);
+            b = find(b);
+            if (a == b) {
+                return false;
+            }
+
+            m_parent[std::max(a, b)] = std::min(a, b);
+            return true;
+        }
+    };
+
+    // Kruskal. Duplicate and self edges are allowed and ignored.
+    inline std::vector<edge> minimum_spanning_forest(std::size_t size, std::vector<edge> edges) {
+        std::sort(std::execution::par, edges.begin(), edges.end());
+
+        disjoint_sets sets{ size };
+        std::vector<edge> res;
+        for (const auto &e : edges) {
+            if (res.size() + 1 == size) break;
+            if (sets.unite(e.x, e.y)) {
+                res.push_back(e);
+            }
+        }
+        return res;
+    }
+
+    // Joins the components of a spanning forest with a dense MST over one representative per component,
+    // so the cost is quadratic in the number of components rather than in the number of points
+    template <typename Distance>
+    std::vector<edge> connect_components(std::size_t size, std::vector<edge> forest, const Distance &dist) {
+        if (forest.size() + 1 >= size) {
+            return forest;
+        }
+
+        disjoint_sets sets{ size };
+        for (const auto &e : forest) {
+            sets.unite(e.x, e.y);
+        }
+
+        std::vector<std::size_t> representatives;
+        for (std::size_t i = 0; i < size; ++i) {
+            if (sets.find(i) == i) {
+                representatives.push_back(i);
+            }
+        }
+
+        auto rep_dist = [&](std::size_t x, std::size_t y) { return static_cast<double>(dist(representatives[x], representatives[y])); };
+        const tree bridges = compute_mst(representatives.size(), rep_dist);
+        for (std::size_t node = 0; node < bridges.size(); ++node) {
+            for (auto child : bridges.children(node)) {
+                forest.push_back({ representatives[node], representatives[child], rep_dist(node, child) });
+            }
+        }
+
+        return forest;
+    }
+
+    // Roots a spanning tree given as undirected edges at node 0
+    inline tree make_tree(std::size_t size, const std::vector<edge> &edges) {
+        RUNTIME_ASSERT(edges.size() + 1 == size);
+
+        std::vector<std::vector<std::size_t>> neighbours(size);
+        for (const auto &e : edges) {
+            neighbours[e.x].push_back(e.y);
+            neighbours[e.y].push_back(e.x);
+        }
+
+        tree t{ size };
+        std::vector<bool> visited(size, false);
+        std::queue<std::size_t> queue;
+        queue.push(0);
+        visited[0] = true;
+
+        while (!queue.empty()) {
+            const auto node = queue.front();
+            queue.pop();
+
+            for (auto next : neighbours[node]) {
+                if (!visited[next]) {
+                    visited[next] = true;
+                    t.try_insert(node, next);
+                    queue.push(next);
+                }
+            }
+        }
+
+        RUNTIME_ASSERT(t.num_edges() + 1 == size);
+        return t;
+    }
+
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+namespace img_sort {
+
+    // Memory and cores this process may actually use: the host's, narrowed by any container (cgroup) limits
+    struct system_resources {
+        std::uint64_t available_memory = 0;  // Bytes
+        std::size_t cores = 1;
+    };
+
+    namespace detail {
+        inline std::optional<std::string> read_file(const char *path) {
+            std::ifstream file{ path };
+            if (!file) return std::nullopt;
+
+            std::stringstream ss;
+            ss << file.rdbuf();
+            return ss.str();
+        }
+
+        inline std::optional<std::uint64_t> parse_u64(std::string_view text) {
+            while (!text.empty() && (text.back() == '\n' || text.back() == ' ')) text.remove_suffix(1);
+            if (text.empty()) return std::nullopt;
+
+            std::uint64_t res = 0;
+            for (char c : text) {
+                if (c < '0' || c > '9') return std::nullopt;
+                res = res * 10 + static_cast<std::uint64_t>(c - '0');
+            }
+            return res;
+        }
+    }
+
+    // "MemAvailable:   16303284 kB" in /proc/meminfo
+    inline std::optional<std::uint64_t> parse_meminfo_available(std::string_view meminfo) {
+        constexpr std::string_view key = "MemAvailable:";
+        const auto pos = meminfo.find(key);
+        if (pos == std::string_view::npos) return std::nullopt;
+
+        auto rest = meminfo.substr(pos + key.size());
+        rest = rest.substr(std::min(rest.size(), rest.find_first_not_of(' ')));
+        const auto value = detail::parse_u64(rest.substr(0, rest.find(' ')));
+        if (!value) return std::nullopt;
+        return *value * 1024;
+    }
+
+    // cgroup v2 memory.max or v1 memory.limit_in_bytes: a byte count, or "max" for none. v1 reports "none"
+    // as a huge number rounded to the page size, so anything beyond 2^60 counts as unlimited.
+    inline std::optional<std::uint64_t> parse_cgroup_memory_limit(std::string_view text) {
+        const auto value = detail::parse_u64(text);
+        if (!value || *value >= (std::uint64_t{ 1 } << 60)) return std::nullopt;
+        return value;
+    }
+
+    // cgroup v2 cpu.max: "<quota> <period>" in microseconds, or "max <period>" for none. Rounded up to whole cores.
+    inline std::optional<std::size_t> parse_cgroup_cpu_max(std::string_view text) {
+        const auto space = text.find(' ');
+        if (space == std::string_view::npos) return std::nullopt;
+
+        const auto quota = detail::parse_u64(text.substr(0, space));
+        const auto period = detail::parse_u64(text.substr(space + 1));
+        if (!quota || !period || *period == 0) return std::nullopt;
+        return static_cast<std::size_t>(std::max<std::uint64_t>(1, (*quota + *period - 1) / *period));
+    }
+
+    inline system_resources detect_system_resources() {
+        system_resources res;
+        res.cores = std::max(1u, std::thread::hardware_concurrency());
+        res.available_memory = std::numeric_limits<std::uint64_t>::max();
+
+#if defined(__linux__)
+        if (auto meminfo = detail::read_file("/proc/meminfo")) {
+            if (auto available = parse_meminfo_available(*meminfo)) res.available_memory = *available;
+        }
+
+        // cgroup v2, then v1. The limit applies to the whole group, so subtract what it already uses.
+        auto apply_memory_limit = [&](const char *limit_path, const char *usage_path) {
+            const auto limit_text = detail::read_file(limit_path);
+            const auto limit = limit_text ? parse_cgroup_memory_limit(*limit_text) : std::nullopt;
+            if (!limit) return;
+
+            const auto usage_text = detail::read_file(usage_path);
+            const auto usage = usage_text ? detail::parse_u64(*usage_text) : std::nullopt;
+            const auto headroom = *limit - std::min(*limit, usage.value_or(0));
+            res.available_memory = std::min(res.available_memory, headroom);
+        };
+        apply_memory_limit("/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory.current");
+        apply_memory_limit("/sys/fs/cgroup/memory/memory.limit_in_bytes", "/sys/fs/cgroup/memory/memory.usage_in_bytes");
+
+        if (auto cpu_max = detail::read_file("/sys/fs/cgroup/cpu.max")) {
+            if (auto cores = parse_cgroup_cpu_max(*cpu_max)) res.cores = std::min(res.cores, *cores);
+        }
+        else {
+            const auto quota = detail::read_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+            const auto period = detail::read_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+            if (quota && period) {
+                // A quota of -1 means none, which fails to parse as unsigned
+                if (auto cores = parse_cgroup_cpu_max(*quota + " " + *period)) res.cores = std::min(res.cores, *cores);
+            }
+        }
+#elif defined(_WIN32)
+        MEMORYSTATUSEX status{};
+        status.dwLength = sizeof(status);
+        if (GlobalMemoryStatusEx(&status)) {
+            res.available_memory = status.ullAvailPhys;
+        }
+#endif
+
+        return res;
+    }
+
+    // What each of jobs sorts running at once may plan with: an equal part of the memory and of the cores
+    inline system_resources share_of(const system_resources &resources, std::size_t jobs) {
+        jobs = std::max<std::size_t>(jobs, 1);
+        system_resources res;
+        res.available_memory = resources.available_memory / jobs;
+        res.cores = std::max<std::size_t>(1, resources.cores / jobs);
+        return res;
+    }
+
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "img_sort.h"
+
+#include <algorithm>
+#include <chrono>
+#include <execution>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "boost/format.hpp"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace img_sort {
+
+    inline std::string host_name() {
+#if defined(_WIN32)
+        char name[MAX_COMPUTERNAME_LENGTH + 1] = {};
+        DWORD size = sizeof(name);
+        if (GetComputerNameA(name, &size)) return std::string{ name, size };
+#else
+        char name[256] = {};
+        if (gethostname(name, sizeof(name) - 1) == 0) return name;
+#endif
+        return "unknown";
+    }
+
+    // Tuned parameters that suit one host, kept in a small text file so that later runs skip the timing. Each
+    // line is "<key> <value>"; keys name the host and whatever else the value depends on, so that one file
+    // can be shared between machines, for example through a home directory.
+    class tuning_cache {
+        std::filesystem::path m_path;
+        std::vector<std::pair<std::string, std::size_t>> m_entries;
+
+    public:
+        explicit tuning_cache(const std::filesystem::path &path)
+            :m_path{ path }
+        {
+            std::ifstream file{ path };
+            std::string line;
+            while (std::getline(file, line)) {
+                std::istringstream ss{ line };
+                std::string key;
+                std::size_t value = 0;
+                if (ss >> key >> value) {
+                    m_entries.emplace_back(std::move(key), value);
+                }
+            }
+        }
+
+        std::optional<std::size_t> find(const std::string &key) const {
+            for (const auto &[k, v] : m_entries) {
+                if (k == key) return v;
+            }
+            return std::nullopt;
+        }
+
+        // Replaces any value under key and rewrites the file, through a temporary so that readers never see half of it
+        void store(const std::string &key, std::size_t value) {
+            m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [&](const auto &e) { return e.first == key; }), m_entries.end());
+            m_entries.emplace_back(key, value);
+
+            const std::filesystem::path temp_path = m_path.string() + ".tmp";
+            {
+                std::ofstream file{ temp_path, std::ios::trunc };
+                for (const auto &[k, v] : m_entries) {
+                    file << k << ' ' << v << '\n';
+                }
+                RUNTIME_ASSERT(file.good());
+            }
+            std::filesystem::rename(temp_path, m_path);
+        }
+    };
+
+    // Fills pairs (x, y) with x < y of rows [first, last) tile columns at a time, so that the descriptors of one
+    // tile stay in cache while every row of the range is compared against them. A tile of 0 means whole rows.
+    template <typename Store>
+    void for_each_pair_tiled(std::size_t first, std::size_t last, std::size_t tile, Store &&store) {
+        if (tile == 0) tile = std::max<std::size_t>(last, 1);
+        for (std::size_t x0 = 0; x0 < last; x0 += tile) {
+            const auto x1 = std::min(x0 + tile, last);
+            for (std::size_t y = std::max(first, x0 + 1); y < last; ++y) {
+                for (std::size_t x = x0; x < std::min(x1, y); ++x) {
+                    store(x, y);
+                }
+            }
+        }
+    }
+
+    // Times the pair stage on a sample of the table's longest rows with every candidate tile width (0 for whole
+    // rows), split into one block per core as the real stage is, and returns the fastest. Results are discarded.
+    template <typename Distance>
+    std::size_t tune_tile_columns(std::size_t size, const Distance &dist, const std::vector<std::size_t> &candidates) {
+        RUNTIME_ASSERT(!candidates.empty());
+        constexpr std::size_t sample_columns = 256;
+        constexpr std::size_t rows_per_block = 16;
+
+        // Rows above sample_columns, cut to sample_columns wide, so that every candidate sees the same pairs
+        const auto num_blocks = std::max<std::size_t>(1, std::thread::hardware_concurrency());
+        const auto columns = std::min(size / 2, sample_columns);
+        const auto first_row = std::max(columns, size - std::min(size - columns, num_blocks * rows_per_block));
+        if (columns == 0 || first_row >= size) return candidates.front();
+
+        std::size_t res = candidates.front();
+        double best = 0.0;
+        for (auto tile : candidates) {
+            std::vector<double> checksums(num_blocks);
+            const auto blocks = boost::irange<std::size_t>(0, num_blocks);
+            const auto start = std::chrono::steady_clock::now();
+            std::for_each(std::execution::par, blocks.begin(), blocks.end(), [&](std::size_t block) {
+                const auto rows = size - first_row;
+                const auto first = first_row + rows * block / num_blocks;
+                const auto last = first_row + rows * (block + 1) / num_blocks;
+
+                double sum = 0.0;
+                const auto width = tile == 0 ? columns : tile;
+                for (std::size_t x0 = 0; x0 < columns; x0 += width) {
+                    const auto x1 = std::min(x0 + width, columns);
+                    for (std::size_t y = first; y < last; ++y) {
+                        for (std::size_t x = x0; x < x1; ++x) {
+                            sum += dist(x, y);
+                        }
+                    }
+                }
+                checksums[block] = sum;
+            });
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            logger::post<logger::info>(boost::format{ "  %1$-16s %2$8.1f ms" } % (tile == 0 ? std::string{ "whole rows" } : std::to_string(tile) + " columns") % (elapsed.count() * 1e3));
+            if (tile == candidates.front() || elapsed.count() < best) {
+                best = elapsed.count();
+                res = tile;
+            }
+        }
+        return res;
+    }
+
+}
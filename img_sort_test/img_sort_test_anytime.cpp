@@ -0,0 +1,78 @@
+#include "../img_sort/anytime.h"
+#include "catch.hpp"
+
+#include <random>
+
+TEST_CASE("hilbert curve", "[anytime]") {
+    constexpr std::uint32_t bits = 3;
+    constexpr std::uint32_t side = 1u << bits;
+
+    GIVEN("a 2D grid") {
+        // Every cell gets its own index, and consecutive indices are adjacent cells
+        std::vector<std::array<std::uint32_t, 2>> by_index(side * side);
+        std::vector<bool> seen(side * side, false);
+        for (std::uint32_t x = 0; x < side; ++x) {
+            for (std::uint32_t y = 0; y < side; ++y) {
+                const auto h = img_sort::hilbert_index<2>({ x, y }, bits);
+                REQUIRE(h < seen.size());
+                CHECK_FALSE(seen[h]);
+                seen[h] = true;
+                by_index[h] = { x, y };
+            }
+        }
+
+        for (std::size_t h = 1; h < by_index.size(); ++h) {
+            const auto dx = std::abs(static_cast<int>(by_index[h][0]) - static_cast<int>(by_index[h - 1][0]));
+            const auto dy = std::abs(static_cast<int>(by_index[h][1]) - static_cast<int>(by_index[h - 1][1]));
+            CHECK(dx + dy == 1);
+        }
+    }
+
+    GIVEN("a 3D grid") {
+        std::vector<std::array<std::uint32_t, 3>> by_index(side * side * side);
+        for (std::uint32_t x = 0; x < side; ++x) {
+            for (std::uint32_t y = 0; y < side; ++y) {
+                for (std::uint32_t z = 0; z < side; ++z) {
+                    by_index[img_sort::hilbert_index<3>({ x, y, z }, bits)] = { x, y, z };
+                }
+            }
+        }
+
+        for (std::size_t h = 1; h < by_index.size(); ++h) {
+            int manhattan = 0;
+            for (std::size_t d = 0; d < 3; ++d) manhattan += std::abs(static_cast<int>(by_index[h][d]) - static_cast<int>(by_index[h - 1][d]));
+            CHECK(manhattan == 1);
+        }
+    }
+}
+
+TEST_CASE("hilbert order and 2-opt", "[anytime]") {
+    std::mt19937 rng{ 23 };
+    std::uniform_real_distribution<float> uniform{ 0.0f, 1.0f };
+
+    const std::size_t size = 500;
+    std::vector<float> points(size * 2);
+    for (auto &p : points) p = uniform(rng);
+    auto dist = [&](std::size_t x, std::size_t y) { return std::hypot(points[2 * x] - points[2 * y], points[2 * x + 1] - points[2 * y + 1]); };
+
+    std::vector<std::size_t> identity(size);
+    std::iota(identity.begin(), identity.end(), std::size_t{ 0 });
+
+    auto order = img_sort::hilbert_order<2>(points, size);
+    REQUIRE(std::is_permutation(order.begin(), order.end(), identity.begin()));
+
+    // Far shorter than visiting the points in random order
+    const double curve_cost = img_sort::path_cost(order, dist);
+    CHECK(curve_cost < 0.25 * img_sort::path_cost(identity, dist));
+
+    const auto no_deadline = std::chrono::steady_clock::now() + std::chrono::hours{ 1 };
+    const double improvement = img_sort::two_opt(order, dist, 16, no_deadline);
+    CHECK(improvement > 0.0);
+    CHECK(img_sort::path_cost(order, dist) == Approx(curve_cost - improvement));
+    CHECK(std::is_permutation(order.begin(), order.end(), identity.begin()));
+
+    // A passed deadline leaves the order alone
+    auto unchanged = img_sort::hilbert_order<2>(points, size);
+    CHECK(img_sort::two_opt(unchanged, dist, 16, std::chrono::steady_clock::now()) == 0.0);
+    CHECK(unchanged == img_sort::hilbert_order<2>(points, size));
+}
@@ -0,0 +1,37 @@
+#include "../img_sort/batch.h"
+#include "catch.hpp"
+
+#include <sstream>
+
+TEST_CASE("batch list", "[batch]") {
+    GIVEN("pairs with comments, blank lines and Windows line endings") {
+        std::istringstream in{ "# nightly albums\nalbums/2019 summer\tsorted/2019 summer\r\n\nalbums/2020\tsorted/2020\n" };
+        const auto jobs = img_sort::parse_batch_list(in);
+        REQUIRE(jobs);
+        REQUIRE(jobs->size() == 2);
+        CHECK((*jobs)[0].source == "albums/2019 summer");
+        CHECK((*jobs)[0].output == "sorted/2019 summer");
+        CHECK((*jobs)[1].source == "albums/2020");
+        CHECK((*jobs)[1].output == "sorted/2020");
+    }
+
+    GIVEN("lines without exactly two paths") {
+        for (const char *text : { "albums/2020 sorted/2020\n", "albums/2020\t\n", "\tsorted/2020\n", "a\tb\tc\n" }) {
+            std::istringstream in{ text };
+            CHECK_FALSE(img_sort::parse_batch_list(in));
+        }
+    }
+
+    GIVEN("an empty list") {
+        std::istringstream in{ "" };
+        const auto jobs = img_sort::parse_batch_list(in);
+        REQUIRE(jobs);
+        CHECK(jobs->empty());
+    }
+}
+
+TEST_CASE("batch schedule", "[batch]") {
+    // Largest first, ties as listed
+    CHECK(img_sort::batch_schedule({ 50, 500, 120, 500, 50 }) == std::vector<std::size_t>{ 1, 3, 2, 0, 4 });
+    CHECK(img_sort::batch_schedule({}).empty());
+}
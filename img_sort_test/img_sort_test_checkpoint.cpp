@@ -0,0 +1,139 @@
+#include "../img_sort/checkpoint.h"
+#include "catch.hpp"
+
+namespace {
+    struct temp_directory {
+        std::filesystem::path path;
+
+        temp_directory()
+            :path{ std::filesystem::temp_directory_path() / "img_sort_test_checkpoint" }
+        {
+            std::filesystem::remove_all(path);
+            std::filesystem::create_directories(path);
+        }
+
+        ~temp_directory() {
+            std::error_code ec;
+            std::filesystem::remove_all(path, ec);
+        }
+    };
+}
+
+TEST_CASE("resume", "[checkpoint]") {
+    temp_directory dir;
+    const auto file = dir.path / "checkpoint.bin";
+    const std::size_t num_files = 20, descriptor_size = 3, width = 18;
+
+    std::size_t num_blocks = 4;
+    {
+        img_sort::checkpoint cp{ file, 42, num_files, descriptor_size, sizeof(float), false };
+        CHECK_FALSE(cp.has_descriptors());
+
+        for (std::size_t i = 0; i < num_files; i += 2) {
+            std::fill_n(cp.descriptor(i), descriptor_size, static_cast<float>(i));
+            cp.set_valid(i);
+        }
+        cp.finish_descriptors();
+
+        float *data = cp.table<float>(width, num_blocks);
+        CHECK(num_blocks == 4);
+
+        img_sort::triangular_table<float, img_sort::view_storage<float>> table{ width, img_sort::view_storage<float>{ data }, num_blocks };
+        REQUIRE(table.blocks().size() >= 2);
+
+        // Fill and complete the first two blocks only, through the background writer
+        img_sort::checkpoint_writer writer{ cp, table.blocks(), std::chrono::seconds{ 60 } };
+        for (std::size_t block = 0; block < 2; ++block) {
+            const auto [first, last] = table.blocks().rows(block);
+            for (std::size_t y = first; y < last; ++y) {
+                for (std::size_t x = 0; x < y; ++x) table.row_data(y)[x] = static_cast<float>(y * 100 + x);
+            }
+            writer.block_done(block);
+        }
+    }
+
+    GIVEN("the same inputs") {
+        img_sort::checkpoint cp{ file, 42, num_files, descriptor_size, sizeof(float), true };
+        REQUIRE(cp.has_descriptors());
+        for (std::size_t i = 0; i < num_files; ++i) {
+            CHECK(cp.is_valid(i) == (i % 2 == 0));
+            if (cp.is_valid(i)) CHECK(cp.descriptor(i)[descriptor_size - 1] == static_cast<float>(i));
+        }
+
+        std::size_t resumed_blocks = 64;
+        float *data = cp.table<float>(width, resumed_blocks);
+        CHECK(resumed_blocks == num_blocks);
+        CHECK(cp.num_complete() == 2);
+        CHECK(cp.is_complete(0));
+        CHECK(cp.is_complete(1));
+        CHECK_FALSE(cp.is_complete(2));
+
+        img_sort::triangular_table<float, img_sort::view_storage<float>> table{ width, img_sort::view_storage<float>{ data }, resumed_blocks };
+        const auto [first, last] = table.blocks().rows(1);
+        for (std::size_t y = first; y < last; ++y) {
+            for (std::size_t x = 0; x < y; ++x) CHECK(table(x, y) == static_cast<float>(y * 100 + x));
+        }
+
+        cp.remove();
+        CHECK_FALSE(std::filesystem::exists(file));
+    }
+
+    GIVEN("a table of another width") {
+        img_sort::checkpoint cp{ file, 42, num_files, descriptor_size, sizeof(float), true };
+        std::size_t resumed_blocks = 8;
+        cp.table<float>(width - 1, resumed_blocks);
+        CHECK(resumed_blocks == 8);
+        CHECK(cp.num_complete() == 0);
+    }
+
+    GIVEN("different inputs") {
+        img_sort::checkpoint cp{ file, 43, num_files, descriptor_size, sizeof(float), true };
+        CHECK_FALSE(cp.has_descriptors());
+        CHECK_FALSE(cp.is_valid(0));
+    }
+
+    GIVEN("no resume") {
+        img_sort::checkpoint cp{ file, 42, num_files, descriptor_size, sizeof(float), false };
+        CHECK_FALSE(cp.has_descriptors());
+    }
+}
+
+TEST_CASE("partial descriptors", "[checkpoint]") {
+    temp_directory dir;
+    const auto file = dir.path / "checkpoint.bin";
+    const std::size_t num_files = 6, descriptor_size = 2;
+
+    // A cancelled run got to the first half
+    {
+        img_sort::checkpoint cp{ file, 7, num_files, descriptor_size, sizeof(float), false };
+        for (std::size_t i = 0; i < num_files / 2; ++i) {
+            std::fill_n(cp.descriptor(i), descriptor_size, static_cast<float>(i));
+            cp.set_valid(i);
+        }
+        cp.finish_descriptors(true);
+    }
+
+    {
+        img_sort::checkpoint cp{ file, 7, num_files, descriptor_size, sizeof(float), true };
+        CHECK_FALSE(cp.has_descriptors());
+        REQUIRE(cp.has_partial_descriptors());
+        for (std::size_t i = 0; i < num_files; ++i) {
+            CHECK(cp.is_valid(i) == (i < num_files / 2));
+        }
+        CHECK(cp.descriptor(2)[1] == 2.0f);
+
+        // While the rest are written the file claims nothing
+        cp.start_descriptors();
+        CHECK_FALSE(cp.has_partial_descriptors());
+        for (std::size_t i = num_files / 2; i < num_files; ++i) {
+            std::fill_n(cp.descriptor(i), descriptor_size, static_cast<float>(i));
+            cp.set_valid(i);
+        }
+        cp.finish_descriptors();
+    }
+
+    img_sort::checkpoint cp{ file, 7, num_files, descriptor_size, sizeof(float), true };
+    CHECK(cp.has_descriptors());
+    CHECK_FALSE(cp.has_partial_descriptors());
+    CHECK(cp.descriptor(5)[0] == 5.0f);
+}
@@ -0,0 +1,88 @@
+#include "../img_sort/descriptor_cache.h"
+#include "catch.hpp"
+
+namespace {
+    struct temp_directory {
+        std::filesystem::path path;
+
+        temp_directory()
+            :path{ std::filesystem::temp_directory_path() / "img_sort_test_descriptor_cache" }
+        {
+            std::filesystem::remove_all(path);
+            std::filesystem::create_directories(path);
+        }
+
+        ~temp_directory() {
+            std::error_code ec;
+            std::filesystem::remove_all(path, ec);
+        }
+    };
+
+    std::filesystem::path touch(const std::filesystem::path &path, std::string_view contents) {
+        std::ofstream{ path, std::ios::binary } << contents;
+        return path;
+    }
+}
+
+TEST_CASE("round trip", "[descriptor_cache]") {
+    temp_directory dir;
+    const auto cache_file = dir.path / "cache.bin";
+
+    std::vector<std::filesystem::path> files = {
+        touch(dir.path / "a.jpg", "a"),
+        touch(dir.path / "b.jpg", "bb"),
+        touch(dir.path / "c.jpg", "ccc")
+    };
+
+    {
+        img_sort::descriptor_cache cache{ cache_file, "l1", 4, 2, files };
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            CHECK_FALSE(cache.restore(i));
+            std::fill_n(cache.descriptor(i), 4, static_cast<float>(i + 1));
+            cache.code(i)[0] = static_cast<std::uint8_t>(i + 10);
+            cache.set_valid(i);
+        }
+
+        std::fill_n(cache.codebook(), 4 * 16, 0.5f);
+        cache.set_codebook_trained();
+        cache.commit();
+    }
+
+    REQUIRE(std::filesystem::exists(cache_file));
+    CHECK_FALSE(std::filesystem::exists(cache_file.string() + ".tmp"));
+
+    SECTION("unchanged files are restored, changed and new ones are not") {
+        touch(files[1], "changed");
+        files.push_back(touch(dir.path / "d.jpg", "d"));
+        std::swap(files[0], files[2]);
+
+        img_sort::descriptor_cache cache{ cache_file, "l1", 4, 2, files };
+        CHECK(cache.has_codebook());
+        CHECK(cache.codebook()[17] == 0.5f);
+
+        CHECK(cache.restore(0));
+        CHECK(cache.descriptor(0)[3] == 3.0f);
+        CHECK(cache.has_code(0));
+        CHECK(cache.code(0)[0] == 12);
+
+        CHECK_FALSE(cache.restore(1));
+        CHECK(cache.restore(2));
+        CHECK(cache.descriptor(2)[0] == 1.0f);
+        CHECK_FALSE(cache.restore(3));
+        CHECK_FALSE(cache.has_code(3));
+        CHECK(cache.num_restored() == 2);
+    }
+
+    SECTION("different settings invalidate the cache") {
+        img_sort::descriptor_cache cache{ cache_file, "l2", 4, 2, files };
+        CHECK_FALSE(cache.has_codebook());
+        CHECK_FALSE(cache.restore(0));
+    }
+
+    SECTION("a different quantiser keeps descriptors but not codes") {
+        img_sort::descriptor_cache cache{ cache_file, "l1", 4, 4, files };
+        CHECK_FALSE(cache.has_codebook());
+        CHECK(cache.restore(0));
+        CHECK_FALSE(cache.has_code(0));
+    }
+}
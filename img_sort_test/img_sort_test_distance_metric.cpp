@@ -0,0 +1,212 @@
+#include "../img_sort/distance_metric.h"
+#include "catch.hpp"
+
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace {
+    constexpr std::size_t bins = 8;
+
+    std::vector<float> random_histogram(std::mt19937 &rng) {
+        std::uniform_real_distribution<float> dist{ 0.0f, 1.0f };
+        std::vector<float> hist(bins * bins * bins);
+        for (auto &v : hist) {
+            // Mostly empty, like real colour histograms
+            v = dist(rng) < 0.8f ? 0.0f : dist(rng) * 100.0f;
+        }
+        return hist;
+    }
+
+    template <typename Metric>
+    std::vector<float> descriptor(const std::vector<float> &hist) {
+        std::vector<float> res(Metric::descriptor_size(bins));
+        Metric::prepare(hist.data(), bins, res.data());
+        return res;
+    }
+
+    // Reference Bhattacharyya distance as computed by cv::compareHist
+    double reference_bhattacharyya(const std::vector<float> &a, const std::vector<float> &b) {
+        double sum_a = 0.0, sum_b = 0.0, coeff = 0.0;
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            sum_a += a[i];
+            sum_b += b[i];
+            coeff += std::sqrt(static_cast<double>(a[i]) * b[i]);
+        }
+        return std::sqrt(std::max(1.0 - coeff / std::sqrt(sum_a * sum_b), 0.0));
+    }
+}
+
+TEST_CASE("kernels match scalar reference", "[distance_metric]") {
+    std::mt19937 rng{ 42 };
+    std::uniform_real_distribution<float> dist{ -1.0f, 1.0f };
+
+    // Odd sizes exercise the scalar tail
+    for (std::size_t n : { 1, 7, 16, 33, 100 }) {
+        std::vector<float> a(n), b(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            a[i] = std::abs(dist(rng));
+            b[i] = std::abs(dist(rng));
+        }
+        b[0] = a[0] = 0.0f;
+
+        double l1 = 0.0, l2 = 0.0, mins = 0.0, chi = 0.0;
+        for (std::size_t i = 0; i < n; ++i) {
+            l1 += std::abs(a[i] - b[i]);
+            l2 += (a[i] - b[i]) * (a[i] - b[i]);
+            mins += std::min(a[i], b[i]);
+            if (a[i] + b[i] > 0.0f) chi += (a[i] - b[i]) * (a[i] - b[i]) / (a[i] + b[i]);
+        }
+
+        // Every variant this CPU runs
+        for (auto set : img_sort::kernel::all_instruction_sets) {
+            if (!img_sort::kernel::is_supported(set)) continue;
+            const auto &k = img_sort::kernel::kernels(set);
+
+            CHECK(k.l1(a.data(), b.data(), n) == Approx(l1));
+            CHECK(k.l2_squared(a.data(), b.data(), n) == Approx(l2));
+            CHECK(k.min_sum(a.data(), b.data(), n) == Approx(mins));
+            CHECK(k.chi_square(a.data(), b.data(), n) == Approx(chi));
+        }
+    }
+}
+
+TEST_CASE("histogram and relax kernels match scalar exactly", "[distance_metric]") {
+    namespace kernel = img_sort::kernel;
+    std::mt19937 rng{ 3 };
+    std::uniform_int_distribution<int> coarse{ 0, 7 };
+
+    for (std::size_t n : { 1, 7, 16, 33, 100 }) {
+        std::vector<float> hist(n);
+        std::vector<double> weight(n), initial(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            hist[i] = static_cast<float>(coarse(rng)) * 13.0f;
+            // Few distinct values, so that ties are common
+            weight[i] = coarse(rng) / 8.0;
+            initial[i] = coarse(rng) / 8.0;
+        }
+
+        std::vector<float> expected(n);
+        kernel::scalar::scale(hist.data(), n, 1.0 / 7.0, expected.data());
+        kernel::scalar::sqrt(expected.data(), n);
+
+        std::vector<double> expected_cost = initial;
+        std::vector<std::uint64_t> expected_source(n, 1);
+        const auto expected_min = kernel::scalar::relax(weight.data(), expected_cost.data(), expected_source.data(), n, 2);
+
+        for (auto set : kernel::all_instruction_sets) {
+            if (!kernel::is_supported(set)) continue;
+            const auto &k = kernel::kernels(set);
+
+            std::vector<float> out(n);
+            k.scale(hist.data(), n, 1.0 / 7.0, out.data());
+            k.sqrt(out.data(), n);
+            CHECK(out == expected);
+            CHECK(k.sum(hist.data(), n) == kernel::scalar::sum(hist.data(), n));
+
+            std::vector<double> cost = initial;
+            std::vector<std::uint64_t> source(n, 1);
+            CHECK(k.relax(weight.data(), cost.data(), source.data(), n, 2) == expected_min);
+            CHECK(cost == expected_cost);
+            CHECK(source == expected_source);
+        }
+    }
+}
+
+TEST_CASE("quantised relax kernels match scalar exactly", "[distance_metric]") {
+    namespace kernel = img_sort::kernel;
+
+    auto check = [](auto type_tag, auto member) {
+        using T = decltype(type_tag);
+        std::mt19937 rng{ 5 };
+        std::uniform_int_distribution<int> coarse{ 0, 7 };
+        // Few distinct values, the largest the initial cost, so that ties are common at every lane
+        auto value = [&]() { return coarse(rng) == 7 ? std::numeric_limits<T>::max() : static_cast<T>(coarse(rng)); };
+
+        for (std::size_t n : { 1, 7, 16, 33, 64, 100, 257 }) {
+            for (int round = 0; round < 4; ++round) {
+                std::vector<T> weight(n), initial(n);
+                for (std::size_t i = 0; i < n; ++i) {
+                    weight[i] = value();
+                    initial[i] = value();
+                }
+
+                std::vector<T> expected_cost = initial;
+                std::vector<std::uint64_t> expected_source(n, 1), expected_tied(kernel::scalar::tie_words(n), ~std::uint64_t{ 0 });
+                const auto expected = kernel::scalar::relax_ties(weight.data(), expected_cost.data(), expected_source.data(), expected_tied.data(), n, 2);
+
+                for (auto set : kernel::all_instruction_sets) {
+                    if (!kernel::is_supported(set)) continue;
+                    const auto &k = kernel::kernels(set);
+
+                    std::vector<T> cost = initial;
+                    std::vector<std::uint64_t> source(n, 1), tied(kernel::scalar::tie_words(n), ~std::uint64_t{ 0 });
+                    const auto res = (k.*member)(weight.data(), cost.data(), source.data(), tied.data(), n, 2);
+                    CHECK(res.index == expected.index);
+                    CHECK(res.shared == expected.shared);
+                    CHECK(cost == expected_cost);
+                    CHECK(source == expected_source);
+                    CHECK(tied == expected_tied);
+                }
+            }
+        }
+    };
+
+    check(float{}, &kernel::kernel_set::relax_f32);
+    check(std::uint16_t{}, &kernel::kernel_set::relax_u16);
+    check(std::uint8_t{}, &kernel::kernel_set::relax_u8);
+}
+
+TEST_CASE("bhattacharyya matches compareHist", "[distance_metric]") {
+    using metric = img_sort::metric::bhattacharyya;
+    std::mt19937 rng{ 7 };
+
+    for (int i = 0; i < 10; ++i) {
+        const auto a = random_histogram(rng);
+        const auto b = random_histogram(rng);
+
+        const auto da = descriptor<metric>(a);
+        const auto db = descriptor<metric>(b);
+        CHECK(metric::distance(da.data(), db.data(), da.size()) == Approx(reference_bhattacharyya(a, b)).epsilon(1e-4));
+    }
+}
+
+TEMPLATE_TEST_CASE("metric properties", "[distance_metric]",
+                   img_sort::metric::bhattacharyya, img_sort::metric::chi_square, img_sort::metric::l1, img_sort::metric::l2,
+                   img_sort::metric::intersection, img_sort::metric::jensen_shannon, img_sort::metric::emd) {
+    std::mt19937 rng{ 1234 };
+
+    std::vector<std::vector<float>> descriptors;
+    for (int i = 0; i < 8; ++i) {
+        descriptors.push_back(descriptor<TestType>(random_histogram(rng)));
+    }
+
+    auto d = [](const auto &a, const auto &b) { return TestType::distance(a.data(), b.data(), a.size()); };
+
+    for (const auto &a : descriptors) {
+        CHECK(d(a, a) == Approx(0.0).margin(1e-3));
+
+        for (const auto &b : descriptors) {
+            CHECK(d(a, b) >= 0.0);
+            CHECK(d(a, b) <= 1.0);
+            CHECK(d(a, b) == Approx(d(b, a)).margin(1e-6));
+
+            if constexpr (TestType::is_metric) {
+                for (const auto &c : descriptors) {
+                    CHECK(d(a, c) <= d(a, b) + d(b, c) + 1e-5);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("parse metric", "[distance_metric]") {
+    CHECK(img_sort::parse_metric("bhattacharyya") == img_sort::metric_type::bhattacharyya);
+    CHECK(img_sort::parse_metric("hellinger") == img_sort::metric_type::bhattacharyya);
+    CHECK(img_sort::parse_metric("emd") == img_sort::metric_type::emd);
+    CHECK(!img_sort::parse_metric("kl"));
+
+    for (auto type : img_sort::all_metric_types) {
+        CHECK(img_sort::parse_metric(img_sort::get_metric_functions(type).name) == type);
+    }
+}
@@ -0,0 +1,123 @@
+#include "../img_sort/exif.h"
+#include "catch.hpp"
+
+#include <filesystem>
+#include <fstream>
+
+namespace {
+    void put(std::vector<unsigned char> &out, std::uint32_t value, std::size_t bytes, bool big_endian) {
+        for (std::size_t i = 0; i < bytes; ++i) {
+            const auto shift = 8 * (big_endian ? bytes - 1 - i : i);
+            out.push_back(static_cast<unsigned char>(value >> shift));
+        }
+    }
+
+    // An EXIF APP1 payload with an empty IFD0 and an IFD1 that points at thumbnail
+    std::vector<unsigned char> exif_payload(const std::vector<unsigned char> &thumbnail, bool big_endian, std::uint16_t length_type = 4) {
+        std::vector<unsigned char> res = { 'E', 'x', 'i', 'f', 0, 0 };
+        res.push_back(big_endian ? 'M' : 'I');
+        res.push_back(big_endian ? 'M' : 'I');
+        put(res, 42, 2, big_endian);
+        put(res, 8, 4, big_endian);
+
+        // IFD0 at 8: no entries, then IFD1 at 14
+        put(res, 0, 2, big_endian);
+        put(res, 14, 4, big_endian);
+
+        // IFD1 at 14: compression, offset and length, then no next IFD; the thumbnail follows at 56
+        put(res, 3, 2, big_endian);
+        const std::uint32_t entries[3][2] = { { 0x0103, 6 }, { 0x0201, 56 }, { 0x0202, static_cast<std::uint32_t>(thumbnail.size()) } };
+        for (const auto &[tag, value] : entries) {
+            const std::uint16_t type = tag == 0x0202 ? length_type : (tag == 0x0103 ? 3 : 4);
+            put(res, tag, 2, big_endian);
+            put(res, type, 2, big_endian);
+            put(res, 1, 4, big_endian);
+            put(res, value, type == 3 ? 2 : 4, big_endian);
+            if (type == 3) put(res, 0, 2, big_endian);
+        }
+        put(res, 0, 4, big_endian);
+
+        res.insert(res.end(), thumbnail.begin(), thumbnail.end());
+        return res;
+    }
+
+    // SOI, an SOF0 of the given size, EOI. Enough for jpeg_dimensions.
+    std::vector<unsigned char> jpeg_header(std::uint16_t width, std::uint16_t height) {
+        std::vector<unsigned char> res = { 0xFF, 0xD8, 0xFF, 0xC0, 0, 11, 8 };
+        put(res, height, 2, true);
+        put(res, width, 2, true);
+        res.insert(res.end(), { 1, 1, 0x11, 0, 0xFF, 0xD9 });
+        return res;
+    }
+}
+
+TEST_CASE("JPEG dimensions", "[exif]") {
+    const auto jpeg = jpeg_header(160, 120);
+    CHECK(img_sort::jpeg_dimensions(jpeg.data(), jpeg.size()) == std::pair<std::size_t, std::size_t>{ 160, 120 });
+
+    const std::vector<unsigned char> not_jpeg = { 0x89, 'P', 'N', 'G' };
+    CHECK_FALSE(img_sort::jpeg_dimensions(not_jpeg.data(), not_jpeg.size()));
+
+    // Truncated inside the frame header
+    CHECK_FALSE(img_sort::jpeg_dimensions(jpeg.data(), 8));
+}
+
+TEST_CASE("EXIF thumbnail range", "[exif]") {
+    const auto thumbnail = jpeg_header(160, 120);
+
+    GIVEN("either byte order and either integer type for the length") {
+        for (bool big_endian : { false, true }) {
+            for (std::uint16_t length_type : { 3, 4 }) {
+                const auto payload = exif_payload(thumbnail, big_endian, length_type);
+                const auto range = img_sort::exif_thumbnail_range(payload.data(), payload.size());
+                REQUIRE(range);
+                CHECK(std::equal(thumbnail.begin(), thumbnail.end(), payload.begin() + range->first));
+                CHECK(range->second == thumbnail.size());
+            }
+        }
+    }
+
+    GIVEN("a thumbnail that runs past the segment") {
+        auto payload = exif_payload(thumbnail, false);
+        payload.resize(payload.size() - 1);
+        CHECK_FALSE(img_sort::exif_thumbnail_range(payload.data(), payload.size()));
+    }
+
+    GIVEN("an APP1 segment that is not EXIF") {
+        const std::string xmp = "http://ns.adobe.com/xap/1.0/";
+        CHECK_FALSE(img_sort::exif_thumbnail_range(reinterpret_cast<const unsigned char *>(xmp.data()), xmp.size()));
+    }
+}
+
+TEST_CASE("EXIF thumbnail from a file", "[exif]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_exif.jpg";
+    const auto thumbnail = jpeg_header(160, 120);
+
+    auto write = [&](const std::vector<std::vector<unsigned char>> &segments) {
+        std::ofstream file{ path, std::ios::binary | std::ios::trunc };
+        file.write("\xFF\xD8", 2);
+        for (const auto &s : segments) {
+            file.write(reinterpret_cast<const char *>(s.data()), s.size());
+        }
+        file.write("\xFF\xD9", 2);
+    };
+    auto segment = [](unsigned char marker, const std::vector<unsigned char> &payload) {
+        std::vector<unsigned char> res = { 0xFF, marker };
+        put(res, static_cast<std::uint32_t>(payload.size() + 2), 2, true);
+        res.insert(res.end(), payload.begin(), payload.end());
+        return res;
+    };
+
+    GIVEN("EXIF after JFIF and XMP segments") {
+        const std::string xmp = "http://ns.adobe.com/xap/1.0/";
+        write({ segment(0xE0, { 'J', 'F', 'I', 'F', 0 }), segment(0xE1, { xmp.begin(), xmp.end() }), segment(0xE1, exif_payload(thumbnail, true)) });
+        CHECK(img_sort::read_exif_thumbnail(path) == thumbnail);
+    }
+
+    GIVEN("no EXIF ahead of the image data") {
+        write({ segment(0xE0, { 'J', 'F', 'I', 'F', 0 }), segment(0xDB, std::vector<unsigned char>(65, 1)) });
+        CHECK(img_sort::read_exif_thumbnail(path).empty());
+    }
+
+    std::filesystem::remove(path);
+}
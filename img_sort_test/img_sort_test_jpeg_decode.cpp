@@ -0,0 +1,308 @@
+#include "../img_sort/jpeg_decode.h"
+#include "../img_sort/pipeline.h"
+#include "catch.hpp"
+
+#include <filesystem>
+#include <numeric>
+
+TEST_CASE("histogram bin layout", "[jpeg_decode]") {
+    GIVEN("32 bins per channel") {
+        CHECK(img_sort::bgr_bin(0, 0, 0, 32) == 0);
+        CHECK(img_sort::bgr_bin(0, 0, 8, 32) == 1);
+        CHECK(img_sort::bgr_bin(0, 8, 0, 32) == 32);
+        CHECK(img_sort::bgr_bin(8, 0, 0, 32) == 32 * 32);
+        CHECK(img_sort::bgr_bin(255, 255, 255, 32) == 32 * 32 * 32 - 1);
+
+        // Y, Cr, Cb as cv::COLOR_BGR2YCrCb orders them
+        CHECK(img_sort::ycbcr_bin(8, 0, 0, 32) == 32 * 32);
+        CHECK(img_sort::ycbcr_bin(0, 0, 8, 32) == 32);
+        CHECK(img_sort::ycbcr_bin(0, 8, 0, 32) == 1);
+    }
+}
+
+TEST_CASE("YCbCr to RGB", "[jpeg_decode]") {
+    int r, g, b;
+
+    img_sort::ycbcr_to_rgb(128.0, 128.0, 128.0, r, g, b);
+    CHECK((r == 128 && g == 128 && b == 128));
+
+    // Pure red as libjpeg encodes it
+    img_sort::ycbcr_to_rgb(76.245, 84.972, 255.5, r, g, b);
+    CHECK((r == 255 && g == 0 && b == 0));
+
+    // Out of gamut values clamp
+    img_sort::ycbcr_to_rgb(255.0, 255.0, 255.0, r, g, b);
+    CHECK((r == 255 && b == 255));
+}
+
+#if defined(IMG_SORT_HAS_LIBJPEG)
+
+namespace {
+    // Writes a quality 100 JPEG of the given RGB pixels with the given luma sampling factors
+    void write_jpeg(const std::filesystem::path &path, int width, int height, const std::vector<unsigned char> &rgb, int h_samp, int v_samp, bool progressive = false) {
+        jpeg_compress_struct cinfo{};
+        jpeg_error_mgr error{};
+        cinfo.err = jpeg_std_error(&error);
+        jpeg_create_compress(&cinfo);
+
+        std::FILE *file = std::fopen(path.string().c_str(), "wb");
+        REQUIRE(file);
+        jpeg_stdio_dest(&cinfo, file);
+
+        cinfo.image_width = width;
+        cinfo.image_height = height;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, 100, TRUE);
+        cinfo.comp_info[0].h_samp_factor = h_samp;
+        cinfo.comp_info[0].v_samp_factor = v_samp;
+        if (progressive) jpeg_simple_progression(&cinfo);
+
+        jpeg_start_compress(&cinfo, TRUE);
+        while (cinfo.next_scanline < cinfo.image_height) {
+            JSAMPROW row = const_cast<unsigned char *>(&rgb[cinfo.next_scanline * width * 3]);
+            jpeg_write_scanlines(&cinfo, &row, 1);
+        }
+        jpeg_finish_compress(&cinfo);
+        jpeg_destroy_compress(&cinfo);
+        std::fclose(file);
+    }
+}
+
+TEST_CASE("JPEG DC histogram", "[jpeg_decode]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_jpeg_decode.jpg";
+    constexpr std::size_t bins = 32;
+
+    GIVEN("an image of flat 16x16 tiles, in the middle of their bins") {
+        constexpr int width = 32, height = 16;
+        const unsigned char colours[2][3] = { { 196, 52, 100 }, { 36, 164, 228 } };
+
+        std::vector<unsigned char> rgb(width * height * 3);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const auto &c = colours[x / 16];
+                std::copy(c, c + 3, &rgb[(y * width + x) * 3]);
+            }
+        }
+
+        for (int samp : { 1, 2 }) {
+            write_jpeg(path, width, height, rgb, samp, samp);
+            const auto hist = img_sort::jpeg_dc_histogram(path, bins, img_sort::colour_space::bgr);
+            REQUIRE(hist.size() == bins * bins * bins);
+
+            // Each tile lands whole in its colour's bin
+            for (const auto &c : colours) {
+                CHECK(hist[img_sort::bgr_bin(c[2], c[1], c[0], bins)] == Approx(16 * 16));
+            }
+        }
+    }
+
+    GIVEN("dimensions that are not whole blocks") {
+        constexpr int width = 21, height = 13;
+        std::vector<unsigned char> rgb(width * height * 3, 90);
+
+        for (int samp : { 1, 2 }) {
+            write_jpeg(path, width, height, rgb, samp, samp);
+            const auto hist = img_sort::jpeg_dc_histogram(path, bins, img_sort::colour_space::bgr);
+            REQUIRE(hist.size() == bins * bins * bins);
+
+            // Edge blocks count only the pixels inside the image
+            CHECK(std::accumulate(hist.begin(), hist.end(), 0.0) == Approx(width * height));
+        }
+    }
+
+    GIVEN("a file that is not a JPEG") {
+        std::FILE *file = std::fopen(path.string().c_str(), "wb");
+        std::fputs("not a JPEG", file);
+        std::fclose(file);
+
+        CHECK(img_sort::jpeg_dc_histogram(path, bins, img_sort::colour_space::bgr).empty());
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("JPEG YCbCr histogram", "[jpeg_decode]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_jpeg_decode_ycbcr.jpg";
+    constexpr std::size_t bins = 32;
+
+    GIVEN("an image of flat 16x16 tiles whose YCbCr is in the middle of its bins") {
+        constexpr int width = 32, height = 16;
+        const int ycbcr[2][3] = { { 100, 84, 180 }, { 180, 148, 108 } };
+
+        std::vector<unsigned char> rgb(width * height * 3);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const auto &c = ycbcr[x / 16];
+                int r, g, b;
+                img_sort::ycbcr_to_rgb(c[0], c[1], c[2], r, g, b);
+                rgb[(y * width + x) * 3 + 0] = static_cast<unsigned char>(r);
+                rgb[(y * width + x) * 3 + 1] = static_cast<unsigned char>(g);
+                rgb[(y * width + x) * 3 + 2] = static_cast<unsigned char>(b);
+            }
+        }
+
+        for (int samp : { 1, 2 }) {
+            write_jpeg(path, width, height, rgb, samp, samp);
+
+            // Planar samples and block means agree on flat tiles
+            for (const auto &hist : { img_sort::jpeg_ycbcr_histogram(path, bins), img_sort::jpeg_dc_histogram(path, bins, img_sort::colour_space::ycbcr) }) {
+                REQUIRE(hist.size() == bins * bins * bins);
+                for (const auto &c : ycbcr) {
+                    CHECK(hist[img_sort::ycbcr_bin(c[0], c[1], c[2], bins)] == Approx(16 * 16));
+                }
+            }
+        }
+    }
+
+    GIVEN("dimensions that are not whole blocks") {
+        constexpr int width = 21, height = 13;
+        std::vector<unsigned char> rgb(width * height * 3, 90);
+
+        for (int samp : { 1, 2 }) {
+            write_jpeg(path, width, height, rgb, samp, samp);
+            const auto hist = img_sort::jpeg_ycbcr_histogram(path, bins);
+            REQUIRE(hist.size() == bins * bins * bins);
+
+            // One count per pixel inside the image
+            CHECK(std::accumulate(hist.begin(), hist.end(), 0.0) == Approx(width * height));
+        }
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("JPEG reduced histogram", "[jpeg_decode]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_jpeg_decode_reduced.jpg";
+    constexpr std::size_t bins = 32;
+
+    // Flat 16x16 tiles in the middle of their bins, so that every scale sees the same colours
+    constexpr int width = 64, height = 32;
+    const unsigned char colours[4][3] = { { 196, 52, 100 }, { 36, 164, 228 }, { 100, 100, 100 }, { 20, 236, 84 } };
+    std::vector<unsigned char> rgb(width * height * 3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const auto &c = colours[x / 16];
+            std::copy(c, c + 3, &rgb[(y * width + x) * 3]);
+        }
+    }
+
+    GIVEN("a baseline JPEG") {
+        write_jpeg(path, width, height, rgb, 2, 2);
+
+        // 1/8 scale leaves 8x4 pixels, 1/4 leaves 16x8
+        for (auto [min_side, pixels] : { std::pair<std::size_t, double>{ 4, 8 * 4 }, { 5, 16 * 8 }, { 8, 16 * 8 } }) {
+            bool stopped_early = true;
+            const auto hist = img_sort::jpeg_reduced_histogram(path, bins, min_side, img_sort::colour_space::bgr, stopped_early);
+            REQUIRE(hist.size() == bins * bins * bins);
+            CHECK_FALSE(stopped_early);
+            for (const auto &c : colours) {
+                CHECK(hist[img_sort::bgr_bin(c[2], c[1], c[0], bins)] == Approx(pixels / 4));
+            }
+        }
+
+        // Full size is left to the other decoders
+        bool stopped_early = false;
+        CHECK(img_sort::jpeg_reduced_histogram(path, bins, 32, img_sort::colour_space::bgr, stopped_early).empty());
+    }
+
+    GIVEN("a progressive JPEG") {
+        write_jpeg(path, width, height, rgb, 2, 2, true);
+
+        // The DC scans are enough for 1/8, and the first scans with low frequencies for 1/4 and 1/2
+        for (std::size_t min_side : { 4, 8, 16 }) {
+            bool stopped_early = false;
+            const auto hist = img_sort::jpeg_reduced_histogram(path, bins, min_side, img_sort::colour_space::bgr, stopped_early);
+            REQUIRE(hist.size() == bins * bins * bins);
+            CHECK(stopped_early);
+            for (const auto &c : colours) {
+                CHECK(hist[img_sort::bgr_bin(c[2], c[1], c[0], bins)] == Approx(std::accumulate(hist.begin(), hist.end(), 0.0) / 4));
+            }
+        }
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("JPEG streamed histogram", "[jpeg_decode]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_jpeg_decode_streamed.jpg";
+    constexpr std::size_t bins = 32;
+
+    constexpr int width = 48, height = 40;
+    const unsigned char colours[3][3] = { { 196, 52, 100 }, { 36, 164, 228 }, { 20, 236, 84 } };
+    std::vector<unsigned char> rgb(width * height * 3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const auto &c = colours[x / 16];
+            std::copy(c, c + 3, &rgb[(y * width + x) * 3]);
+        }
+    }
+
+    for (bool progressive : { false, true }) {
+        // Full chroma, so that upsampling does not blend the tiles at their edges
+        write_jpeg(path, width, height, rgb, 1, 1, progressive);
+
+        // Every pixel once, at full size
+        const auto hist = img_sort::jpeg_streamed_histogram(path, bins, width * height, img_sort::colour_space::bgr);
+        REQUIRE(hist.size() == bins * bins * bins);
+        CHECK(std::accumulate(hist.begin(), hist.end(), 0.0) == width * height);
+        for (const auto &c : colours) {
+            CHECK(hist[img_sort::bgr_bin(c[2], c[1], c[0], bins)] == 16 * height);
+        }
+
+        // Smaller images are left to cv::imread, or decoded whole from the same header read
+        CHECK(img_sort::jpeg_streamed_histogram(path, bins, width * height + 1, img_sort::colour_space::bgr).empty());
+
+        img_sort::bgr_image image;
+        CHECK(img_sort::jpeg_streamed_histogram(path, bins, width * height + 1, img_sort::colour_space::bgr, &image).empty());
+        REQUIRE(image.width == width);
+        REQUIRE(image.height == height);
+        REQUIRE(image.pixels.size() == width * height * 3);
+
+        // The pixels the streamed decode binned, in BGR order
+        std::vector<float> image_hist(bins * bins * bins);
+        for (std::size_t i = 0; i < image.pixels.size(); i += 3) {
+            image_hist[img_sort::bgr_bin(image.pixels[i], image.pixels[i + 1], image.pixels[i + 2], bins)] += 1.0f;
+        }
+        CHECK(image_hist == hist);
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("small JPEGs are decoded once and not streamed", "[jpeg_decode]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_jpeg_decode_small.jpg";
+
+    constexpr int width = 32, height = 24;
+    std::vector<unsigned char> rgb(width * height * 3);
+    for (std::size_t i = 0; i < rgb.size(); ++i) {
+        rgb[i] = static_cast<unsigned char>(i * 7);
+    }
+    write_jpeg(path, width, height, rgb, 2, 2);
+
+    const auto metric = img_sort::get_metric_functions(img_sort::metric_type::bhattacharyya);
+    img_sort::options opts;
+    img_sort::descriptor_extractor extractor;
+
+    // Below the threshold the header read decides on a whole decode, without a streamed one
+    auto &whole = extractor.extract({ path }, opts, metric, nullptr, nullptr);
+    REQUIRE(whole.size() == 1);
+    CHECK(extractor.stats().streamed_decodes == 0);
+    const cv::Mat whole_descriptor = whole.front().mat.clone();
+
+    opts.ingest.stream_pixels = width * height;
+    auto &streamed = extractor.extract({ path }, opts, metric, nullptr, nullptr);
+    REQUIRE(streamed.size() == 1);
+    CHECK(extractor.stats().streamed_decodes == 1);
+
+    // Both see the same pixels
+    REQUIRE(streamed.front().mat.total() == whole_descriptor.total());
+    for (std::size_t i = 0; i < whole_descriptor.total(); ++i) {
+        CHECK(streamed.front().mat.ptr<float>()[i] == Approx(whole_descriptor.ptr<float>()[i]));
+    }
+
+    std::filesystem::remove(path);
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include "../img_sort/latency.h"
+#include "catch.hpp"
+
+#include <random>
+
+TEST_CASE("latency histogram", "[latency]") {
+    using img_sort::latency_histogram;
+
+    GIVEN("bucket bounds") {
+        // Exact below 128, then 64 buckets per power of two
+        CHECK(latency_histogram::bucket(0) == 0);
+        CHECK(latency_histogram::bucket(127) == 127);
+        CHECK(latency_histogram::bucket(128) == latency_histogram::bucket(129));
+        CHECK(latency_histogram::bucket(130) == latency_histogram::bucket(129) + 1);
+        CHECK(latency_histogram::highest_equivalent(latency_histogram::bucket(128)) == 129);
+
+        for (std::uint64_t value : { std::uint64_t{ 1000 }, std::uint64_t{ 123456789 }, ~std::uint64_t{ 0 } }) {
+            const auto highest = latency_histogram::highest_equivalent(latency_histogram::bucket(value));
+            CHECK(highest >= value);
+            CHECK(static_cast<double>(highest - value) <= static_cast<double>(value) / 64.0);
+            if (highest != ~std::uint64_t{ 0 }) CHECK(latency_histogram::bucket(highest + 1) == latency_histogram::bucket(value) + 1);
+        }
+    }
+
+    GIVEN("values from 1us to 1s") {
+        latency_histogram h;
+        std::vector<std::uint64_t> values;
+        std::mt19937_64 rng{ 7 };
+        std::lognormal_distribution<double> dist{ 7.0, 2.0 };
+        for (int i = 0; i < 10000; ++i) {
+            values.push_back(std::clamp<std::uint64_t>(static_cast<std::uint64_t>(dist(rng)), 1, 1'000'000));
+            h.record(values.back());
+        }
+        std::sort(values.begin(), values.end());
+
+        CHECK(h.count() == values.size());
+        CHECK(h.max() == values.back());
+        CHECK(h.percentile(100.0) == values.back());
+        for (double p : { 50.0, 90.0, 99.0, 99.9 }) {
+            const auto exact = values[static_cast<std::size_t>(std::ceil(p / 100.0 * values.size())) - 1];
+            CHECK(h.percentile(p) >= exact);
+            CHECK(static_cast<double>(h.percentile(p)) <= exact * (1.0 + 1.0 / 64.0));
+        }
+    }
+
+    CHECK(latency_histogram{}.percentile(99.0) == 0);
+}
+
+TEST_CASE("slowest files", "[latency]") {
+    using namespace std::chrono_literals;
+
+    const auto a = img_sort::measure_latency(0, 3ms, 1ms);
+    CHECK(a.read == 2ms);
+    CHECK(a.decode == 1ms);
+
+    // CPU time counted more coarsely than wall time is capped by it
+    const auto b = img_sort::measure_latency(1, 1ms, 5ms);
+    CHECK(b.read == 0us);
+    CHECK(b.decode == 1ms);
+
+    const auto c = img_sort::measure_latency(2, 10ms, 9ms);
+    const auto slowest = img_sort::slowest_files({ a, b, c }, 2);
+    REQUIRE(slowest.size() == 2);
+    CHECK(slowest[0].file_index == 2);
+    CHECK(slowest[1].file_index == 0);
+    CHECK(img_sort::slowest_files({ a }, 5).size() == 1);
+
+    const auto lines = img_sort::describe_latencies({ a, b, c }, { "a.jpg", "b.jpg", "c.png" }, 1);
+    REQUIRE(lines.size() == 8);
+    CHECK(lines[0] == "Latency of 3 decoded images in ms:");
+    CHECK(lines[2].rfind("  total ", 0) == 0);
+    CHECK(lines.back().find("c.png") != std::string::npos);
+    CHECK(img_sort::describe_latencies({}, {}, 10).empty());
+
+    // The thread's CPU time only moves forward
+    const auto before = img_sort::thread_cpu_time();
+    volatile double x = 0.0;
+    for (int i = 0; i < 1'000'000; ++i) x = x + 1.0;
+    CHECK(img_sort::thread_cpu_time() >= before);
+}
@@ -0,0 +1,52 @@
+#include "../img_sort/lsh.h"
+#include "catch.hpp"
+
+#include <random>
+
+TEST_CASE("simhash candidate pairs", "[lsh]") {
+    std::mt19937 rng{ 11 };
+    std::normal_distribution<float> noise{ 0.0f, 0.01f };
+    std::uniform_real_distribution<float> uniform{ -1.0f, 1.0f };
+
+    // Four tight clusters of 25 points each
+    const std::size_t dim = 64, num_clusters = 4, cluster_size = 25;
+    std::vector<std::vector<float>> points;
+    for (std::size_t c = 0; c < num_clusters; ++c) {
+        std::vector<float> centre(dim);
+        for (auto &v : centre) v = uniform(rng);
+
+        for (std::size_t i = 0; i < cluster_size; ++i) {
+            points.push_back(centre);
+            for (auto &v : points.back()) v += noise(rng);
+        }
+    }
+
+    std::vector<const float *> rows;
+    for (const auto &p : points) rows.push_back(p.data());
+
+    const img_sort::simhash_index index{ rows, dim, 4, 8 };
+
+    GIVEN("unbounded buckets") {
+        const auto pairs = index.candidate_pairs(points.size());
+        REQUIRE(!pairs.empty());
+        CHECK(std::is_sorted(pairs.begin(), pairs.end()));
+        CHECK(std::adjacent_find(pairs.begin(), pairs.end()) == pairs.end());
+
+        std::size_t within_cluster = 0;
+        for (const auto &[x, y] : pairs) {
+            CHECK(x < y);
+            if (x / cluster_size == y / cluster_size) ++within_cluster;
+        }
+
+        // Every cluster collides completely, and distinct clusters rarely do
+        CHECK(within_cluster == num_clusters * cluster_size * (cluster_size - 1) / 2);
+        CHECK(within_cluster * 10 >= pairs.size() * 9);
+    }
+
+    GIVEN("capped buckets") {
+        const std::size_t cap = 3;
+        const auto pairs = index.candidate_pairs(cap);
+        CHECK(pairs.size() <= index.num_tables() * points.size() * cap);
+        CHECK(pairs.size() >= num_clusters * (cluster_size - 1));
+    }
+}
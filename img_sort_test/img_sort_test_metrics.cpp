@@ -0,0 +1,83 @@
+#include "../img_sort/metrics.h"
+#include "catch.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+TEST_CASE("prometheus text", "[metrics]") {
+    img_sort::run_metrics::snapshot m;
+    m.stage_seconds[static_cast<std::size_t>(img_sort::pipeline_stage::histograms)] = 2.0;
+    m.stage_seconds[static_cast<std::size_t>(img_sort::pipeline_stage::tree)] = 4.0;
+    m.items.files = 100;
+    m.items.bytes = 12345;
+    m.items.pairs = 4950;
+    m.cache_lookups = 100;
+    m.cache_hits = 25;
+    m.decode_failures = 3;
+    m.jobs_succeeded = 2;
+    m.jobs_failed = 1;
+    m.peak_rss = 1 << 20;
+    m.running = true;
+
+    std::ostringstream os;
+    img_sort::write_prometheus(os, m);
+    const auto text = os.str();
+
+    CHECK(text.find("# TYPE img_sort_stage_seconds_total counter\n") != std::string::npos);
+    CHECK(text.find("img_sort_stage_seconds_total{stage=\"histograms\"} 2.000000\n") != std::string::npos);
+    CHECK(text.find("img_sort_stage_seconds_total{stage=\"scan\"} 0.000000\n") != std::string::npos);
+    CHECK(text.find("img_sort_bytes_read_total 12345\n") != std::string::npos);
+    CHECK(text.find("img_sort_decode_failures_total 3\n") != std::string::npos);
+    CHECK(text.find("img_sort_images_per_second 50.000\n") != std::string::npos);
+    CHECK(text.find("img_sort_pairs_per_second 1237.500\n") != std::string::npos);
+    CHECK(text.find("img_sort_cache_hit_ratio 0.2500\n") != std::string::npos);
+    CHECK(text.find("img_sort_jobs_total{status=\"failed\"} 1\n") != std::string::npos);
+    CHECK(text.find("img_sort_peak_rss_bytes 1048576\n") != std::string::npos);
+    CHECK(text.find("img_sort_running 1\n") != std::string::npos);
+
+    // Every sample line belongs to a family declared before it
+    std::istringstream lines{ text };
+    std::string line, family;
+    while (std::getline(lines, line)) {
+        if (line.rfind("# TYPE ", 0) == 0) family = line.substr(7, line.find(' ', 7) - 7);
+        else if (line[0] != '#') CHECK(line.rfind(family, 0) == 0);
+    }
+}
+
+TEST_CASE("run metrics", "[metrics]") {
+    const auto before = img_sort::run_metrics::sample(true);
+
+    CHECK(img_sort::run_metrics::time(img_sort::pipeline_stage::order, []() { return 7; }) == 7);
+    img_sort::run_metrics::cache_used(4, 3);
+    img_sort::run_metrics::decode_failed();
+    img_sort::run_metrics::job_done(false);
+
+    const auto after = img_sort::run_metrics::sample(true);
+    CHECK(after.stage_seconds[static_cast<std::size_t>(img_sort::pipeline_stage::order)] >= before.stage_seconds[static_cast<std::size_t>(img_sort::pipeline_stage::order)]);
+    CHECK(after.cache_lookups - before.cache_lookups == 4);
+    CHECK(after.cache_hits - before.cache_hits == 3);
+    CHECK(after.decode_failures - before.decode_failures == 1);
+    CHECK(after.jobs_failed - before.jobs_failed == 1);
+    CHECK(after.jobs_succeeded == before.jobs_succeeded);
+#if defined(_WIN32) || defined(__linux__)
+    CHECK(after.peak_rss > 0);
+#endif
+}
+
+TEST_CASE("metrics file", "[metrics]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_metrics.prom";
+    std::filesystem::remove(path);
+
+    // Written on destruction, marked finished
+    { img_sort::metrics_exporter exporter{ path, std::chrono::hours{ 1 } }; }
+
+    std::ifstream file{ path };
+    std::stringstream ss;
+    ss << file.rdbuf();
+    CHECK(ss.str().find("img_sort_running 0\n") != std::string::npos);
+    CHECK_FALSE(std::filesystem::exists(path.string() + ".tmp"));
+
+    file.close();
+    std::filesystem::remove(path);
+}
@@ -0,0 +1,203 @@
+#include "../img_sort/mst.h"
+#include "catch.hpp"
+
+#include <numeric>
+#include <random>
+
+namespace {
+    using point = std::array<double, 4>;
+
+    std::vector<point> random_points(std::size_t n, unsigned seed) {
+        std::mt19937 rng{ seed };
+        std::uniform_real_distribution<double> dist{ 0.0, 1.0 };
+
+        std::vector<point> res(n);
+        for (auto &p : res) {
+            for (auto &c : p) c = dist(rng);
+        }
+        return res;
+    }
+
+    double euclidean(const point &a, const point &b) {
+        double res = 0.0;
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            res += (a[i] - b[i]) * (a[i] - b[i]);
+        }
+        return std::sqrt(res);
+    }
+
+    template <typename Distance>
+    double tree_weight(const img_sort::tree &t, const Distance &dist) {
+        double res = 0.0;
+        for (std::size_t node = 0; node < t.size(); ++node) {
+            for (auto child : t.children(node)) {
+                res += dist(node, child);
+            }
+        }
+        return res;
+    }
+
+    // Kruskal over every pair
+    template <typename Distance>
+    double reference_mst_weight(std::size_t n, const Distance &dist) {
+        std::vector<std::tuple<double, std::size_t, std::size_t>> edges;
+        for (std::size_t y = 1; y < n; ++y) {
+            for (std::size_t x = 0; x < y; ++x) {
+                edges.emplace_back(dist(x, y), x, y);
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+
+        std::vector<std::size_t> parent(n);
+        std::iota(parent.begin(), parent.end(), 0);
+        auto find = [&](std::size_t i) {
+            while (parent[i] != i) i = parent[i] = parent[parent[i]];
+            return i;
+        };
+
+        double res = 0.0;
+        for (auto [w, x, y] : edges) {
+            const auto rx = find(x), ry = find(y);
+            if (rx != ry) {
+                parent[rx] = ry;
+                res += w;
+            }
+        }
+        return res;
+    }
+}
+
+TEST_CASE("dense prim", "[mst]") {
+    for (std::size_t n : { 2, 3, 10, 100 }) {
+        const auto points = random_points(n, static_cast<unsigned>(n));
+        auto dist = [&](std::size_t x, std::size_t y) { return euclidean(points[x], points[y]); };
+
+        img_sort::triangular_table<double> table{ n };
+        for (auto kvp : table) {
+            auto [x, y] = kvp.first;
+            kvp.second = dist(x, y);
+        }
+
+        const auto t = img_sort::compute_mst(n, table);
+        CHECK(t.num_edges() == n - 1);
+        CHECK(tree_weight(t, dist) == Approx(reference_mst_weight(n, dist)));
+
+        // Callables work as well as tables
+        CHECK(tree_weight(img_sort::compute_mst(n, dist), dist) == Approx(reference_mst_weight(n, dist)));
+    }
+}
+
+TEST_CASE("cancelled prim", "[mst]") {
+    constexpr std::size_t n = 50;
+    const auto points = random_points(n, 7);
+
+    // Cancels a few steps in
+    std::size_t calls = 0;
+    auto dist = [&](std::size_t x, std::size_t y) {
+        if (++calls == 4 * n) img_sort::cancellation::request();
+        return euclidean(points[x], points[y]);
+    };
+
+    const auto t = img_sort::compute_mst(n, dist);
+    img_sort::cancellation::reset();
+    CHECK(t.num_edges() > 0);
+    CHECK(t.num_edges() < n - 1);
+
+    // What was grown is one tree from the root
+    std::vector<std::size_t> stack{ 0 };
+    std::size_t reached = 0;
+    while (!stack.empty()) {
+        const auto node = stack.back();
+        stack.pop_back();
+        ++reached;
+        stack.insert(stack.end(), t.children(node).begin(), t.children(node).end());
+    }
+    CHECK(reached == t.num_edges() + 1);
+
+    CHECK(img_sort::compute_mst(n, dist).num_edges() == n - 1);
+}
+
+TEST_CASE("pivot pruned prim", "[mst]") {
+    for (std::size_t num_pivots : { 1, 4, 16 }) {
+        for (std::size_t n : { 2, 5, 200 }) {
+            const auto points = random_points(n, static_cast<unsigned>(n * 31 + num_pivots));
+            auto dist = [&](std::size_t x, std::size_t y) { return euclidean(points[x], points[y]); };
+
+            img_sort::mst_stats stats;
+            const img_sort::pivot_index pivots{ n, num_pivots, dist, stats };
+            CHECK(pivots.num_pivots() == std::min(n, num_pivots));
+
+            for (std::size_t x = 0; x < n; ++x) {
+                for (std::size_t y = 0; y < n; ++y) {
+                    CHECK(pivots.lower_bound(x, y) <= dist(x, y) + 1e-9);
+                }
+            }
+
+            const auto t = img_sort::compute_mst_pruned(n, dist, pivots, stats);
+            CHECK(t.num_edges() == n - 1);
+            CHECK(tree_weight(t, dist) == Approx(reference_mst_weight(n, dist)));
+            CHECK(stats.evaluated + stats.pruned == img_sort::mst_stats::num_pairs(n) + pivots.num_pivots() * (n - 1));
+        }
+    }
+}
+
+TEST_CASE("pivot pruning skips work on clustered data", "[mst]") {
+    // Two tight, far apart clusters; most cross-cluster pairs are bounded away by the pivots
+    auto points = random_points(400, 99);
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        for (auto &c : points[i]) c = c * 0.01 + (i % 2 == 0 ? 0.0 : 10.0);
+    }
+    auto dist = [&](std::size_t x, std::size_t y) { return euclidean(points[x], points[y]); };
+
+    img_sort::mst_stats stats;
+    const img_sort::pivot_index pivots{ points.size(), 8, dist, stats };
+    const auto t = img_sort::compute_mst_pruned(points.size(), dist, pivots, stats);
+
+    CHECK(tree_weight(t, dist) == Approx(reference_mst_weight(points.size(), dist)));
+    CHECK(stats.evaluated < img_sort::mst_stats::num_pairs(points.size()));
+}
+
+TEST_CASE("quantised tables give the exact MST", "[mst]") {
+    auto check = [](auto type_tag, std::size_t n) {
+        using T = decltype(type_tag);
+
+        // Scaled into [0, 1], and snapped to a coarse grid so that many exact distances tie as well
+        const auto points = random_points(n, static_cast<unsigned>(n + sizeof(T)));
+        auto dist = [&](std::size_t x, std::size_t y) { return std::round(euclidean(points[x], points[y]) * 500.0) / 1000.0; };
+
+        img_sort::triangular_table<T> table{ n };
+        for (auto kvp : table) {
+            auto [x, y] = kvp.first;
+            kvp.second = img_sort::quantise<T>(dist(x, y));
+        }
+
+        img_sort::mst_stats stats;
+        const auto t = img_sort::compute_mst_refined(n, table, dist, stats);
+        CHECK(t.num_edges() == n - 1);
+        CHECK(tree_weight(t, dist) == Approx(reference_mst_weight(n, dist)).epsilon(1e-12));
+        CHECK(stats.evaluated < img_sort::mst_stats::num_pairs(n));
+    };
+
+    // With every relax kernel this CPU runs
+    for (auto set : img_sort::kernel::all_instruction_sets) {
+        if (!img_sort::kernel::select(set)) continue;
+        for (std::size_t n : { 2, 3, 50, 300 }) {
+            check(float{}, n);
+            check(std::uint16_t{}, n);
+            check(std::uint8_t{}, n);
+        }
+    }
+    img_sort::kernel::select(img_sort::kernel::best_instruction_set());
+}
+
+TEST_CASE("quantisation is monotone", "[mst]") {
+    CHECK(img_sort::quantise<std::uint8_t>(0.0) == 0);
+    CHECK(img_sort::quantise<std::uint8_t>(1.0) == 255);
+    CHECK(img_sort::quantise<std::uint16_t>(1.5) == 65535);
+    CHECK(img_sort::quantise<std::uint16_t>(-0.5) == 0);
+
+    for (double d = 0.0; d < 1.0; d += 0.001) {
+        CHECK(img_sort::quantise<std::uint8_t>(d) <= img_sort::quantise<std::uint8_t>(d + 0.001));
+        CHECK(img_sort::quantise<std::uint16_t>(d) <= img_sort::quantise<std::uint16_t>(d + 0.001));
+    }
+}
@@ -0,0 +1,82 @@
+#include "../img_sort/pipeline.h"
+#include "catch.hpp"
+
+#include <random>
+#include <string>
+#include <thread>
+
+TEST_CASE("cancelled dense prim", "[pipeline]") {
+    // Two tight clusters, listed alternately
+    constexpr std::size_t n = 4000, dim = 16;
+    std::mt19937 rng{ 3 };
+    std::normal_distribution<float> noise{ 0.0f, 0.01f };
+    std::vector<img_sort::histogram> histograms;
+    for (std::size_t i = 0; i < n; ++i) {
+        cv::Mat mat(1, static_cast<int>(dim), CV_32F);
+        for (std::size_t d = 0; d < dim; ++d) mat.ptr<float>()[d] = (i % 2 == 0 ? 0.0f : 1.0f) + noise(rng);
+        histograms.emplace_back(std::move(mat), std::to_string(i), i);
+    }
+
+    // Cancelled once Prim has started, on the exact table, which is the one that frees the descriptors
+    img_sort::options opts;
+    REQUIRE(opts.precision == img_sort::table_precision::f64);
+    img_sort::distance_engine distance{ img_sort::metric_type::l2 };
+
+    img_sort::progress::end();
+    std::thread canceller{ []() {
+        while (img_sort::progress::sample().stage != img_sort::progress_stage::mst) std::this_thread::yield();
+        img_sort::cancellation::request();
+    } };
+    const auto partial = img_sort::tree_builder{}.build(opts, distance, histograms, nullptr, nullptr);
+    canceller.join();
+    img_sort::cancellation::reset();
+    img_sort::progress::end();
+
+    REQUIRE(partial.num_edges() < n - 1);
+    for (const auto &h : histograms) REQUIRE_FALSE(h.mat.empty());
+
+    const auto order = img_sort::orderer{}.order_partial(&partial, histograms);
+    REQUIRE(order.size() == n);
+    std::vector<bool> seen(n, false);
+    for (auto i : order) seen[i] = true;
+    CHECK(std::count(seen.begin(), seen.end(), true) == static_cast<std::ptrdiff_t>(n));
+
+    // The images Prim did not reach follow along a curve through their descriptors, a cluster at a time, rather
+    // than alternating as listed
+    const std::size_t tail = partial.num_edges() > 0 ? partial.num_edges() + 1 : 0;
+    std::size_t switches = 0;
+    for (std::size_t k = tail + 1; k < n; ++k) switches += order[k] % 2 != order[k - 1] % 2;
+    CHECK(switches < (n - tail) / 10);
+}
+
+TEST_CASE("batch jobs share the plan budget", "[pipeline]") {
+    // 10000 images with 128 dimensional descriptors: a 400MB double table or a 200MB float one, plus 5MB of
+    // descriptors, of which at most 80% of the memory may be planned
+    img_sort::options opts;
+    opts.projection_dim = 128;
+    opts.forced.projection = true;
+
+    img_sort::system_resources machine;
+    machine.available_memory = 600'000'000;
+    machine.cores = 8;
+
+    GIVEN("one job on the machine") {
+        img_sort::plan_execution(opts, 10000, machine);
+        CHECK(opts.mst == img_sort::mst_engine::dense);
+        CHECK(opts.precision == img_sort::table_precision::f64);
+    }
+
+    GIVEN("two such jobs running at once") {
+        const auto share = img_sort::share_of(machine, 2);
+        CHECK(share.available_memory == 300'000'000);
+        CHECK(share.cores == 4);
+
+        // Two double tables would take 810MB of the 600MB, two float ones fit
+        img_sort::plan_execution(opts, 10000, share);
+        CHECK(opts.mst == img_sort::mst_engine::dense);
+        CHECK(opts.precision == img_sort::table_precision::f32);
+    }
+
+    CHECK(img_sort::share_of(machine, 0).available_memory == machine.available_memory);
+    CHECK(img_sort::share_of(machine, 16).cores == 1);
+}
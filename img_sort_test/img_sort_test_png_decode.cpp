@@ -0,0 +1,133 @@
+#include "../img_sort/png_decode.h"
+#include "catch.hpp"
+
+#include <filesystem>
+#include <numeric>
+
+TEST_CASE("Adam7 passes", "[png_decode]") {
+    CHECK(img_sort::adam7_last_pass(8) == 0);
+    CHECK(img_sort::adam7_last_pass(4) == 2);
+    CHECK(img_sort::adam7_last_pass(2) == 4);
+    CHECK(img_sort::adam7_last_pass(1) == 6);
+}
+
+#if defined(IMG_SORT_HAS_LIBPNG)
+
+namespace {
+    void write_png(const std::filesystem::path &path, png_uint_32 width, png_uint_32 height, const std::vector<png_byte> &rgb, bool interlaced) {
+        std::FILE *file = std::fopen(path.string().c_str(), "wb");
+        REQUIRE(file);
+
+        png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        png_infop info = png_create_info_struct(png);
+        png_init_io(png, file);
+        png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, interlaced ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+        std::vector<png_bytep> rows(height);
+        for (png_uint_32 y = 0; y < height; ++y) {
+            rows[y] = const_cast<png_bytep>(&rgb[y * width * 3]);
+        }
+        png_set_rows(png, info, rows.data());
+        png_write_png(png, info, PNG_TRANSFORM_IDENTITY, nullptr);
+        png_destroy_write_struct(&png, &info);
+        std::fclose(file);
+    }
+}
+
+TEST_CASE("Adam7 histogram", "[png_decode]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_png_decode.png";
+    constexpr std::size_t bins = 32;
+
+    // Pixels on the grid of every 8th pixel are red, every other 4th green, every other 2nd blue, the rest grey
+    constexpr png_uint_32 width = 37, height = 21;
+    std::vector<png_byte> rgb(width * height * 3);
+    for (png_uint_32 y = 0; y < height; ++y) {
+        for (png_uint_32 x = 0; x < width; ++x) {
+            const bool on8 = x % 8 == 0 && y % 8 == 0, on4 = x % 4 == 0 && y % 4 == 0, on2 = x % 2 == 0 && y % 2 == 0;
+            const png_byte c[3] = { png_byte(on8 ? 252 : 4), png_byte(!on8 && on4 ? 252 : 4), png_byte(!on4 && on2 ? 252 : 4) };
+            std::copy(c, c + 3, &rgb[(y * width + x) * 3]);
+        }
+    }
+    const auto red = img_sort::bgr_bin(4, 4, 252, bins), green = img_sort::bgr_bin(4, 252, 4, bins), blue = img_sort::bgr_bin(252, 4, 4, bins);
+
+    GIVEN("an interlaced PNG") {
+        write_png(path, width, height, rgb, true);
+
+        // Each grid is complete and nothing finer is read: 5x3 pixels on the 8 grid, 10x6 on the 4 grid, 19x11 on the 2 grid
+        const auto hist8 = img_sort::png_adam7_histogram(path, bins, 3, img_sort::colour_space::bgr);
+        REQUIRE(hist8.size() == bins * bins * bins);
+        CHECK(hist8[red] == 15);
+        CHECK(std::accumulate(hist8.begin(), hist8.end(), 0.0) == 15);
+
+        const auto hist4 = img_sort::png_adam7_histogram(path, bins, 6, img_sort::colour_space::bgr);
+        REQUIRE(hist4.size() == bins * bins * bins);
+        CHECK(hist4[red] == 15);
+        CHECK(hist4[green] == 60 - 15);
+        CHECK(std::accumulate(hist4.begin(), hist4.end(), 0.0) == 60);
+
+        const auto hist2 = img_sort::png_adam7_histogram(path, bins, 11, img_sort::colour_space::bgr);
+        REQUIRE(hist2.size() == bins * bins * bins);
+        CHECK(hist2[blue] == 19 * 11 - 60);
+        CHECK(std::accumulate(hist2.begin(), hist2.end(), 0.0) == 19 * 11);
+
+        // Full size is left to the other decoders
+        CHECK(img_sort::png_adam7_histogram(path, bins, 12, img_sort::colour_space::bgr).empty());
+    }
+
+    GIVEN("a PNG that is not interlaced") {
+        write_png(path, width, height, rgb, false);
+        CHECK(img_sort::png_adam7_histogram(path, bins, 3, img_sort::colour_space::bgr).empty());
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("PNG streamed histogram", "[png_decode]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_png_decode_streamed.png";
+    constexpr std::size_t bins = 32;
+
+    // A colour per column, so that a pass read at the wrong width or offset lands in the wrong bins
+    constexpr png_uint_32 width = 29, height = 19;
+    std::vector<png_byte> rgb(width * height * 3);
+    for (png_uint_32 y = 0; y < height; ++y) {
+        for (png_uint_32 x = 0; x < width; ++x) {
+            const png_byte c[3] = { png_byte(x * 8 + 4), png_byte(y * 8 + 4), png_byte(4) };
+            std::copy(c, c + 3, &rgb[(y * width + x) * 3]);
+        }
+    }
+
+    for (bool interlaced : { false, true }) {
+        write_png(path, width, height, rgb, interlaced);
+
+        const auto hist = img_sort::png_streamed_histogram(path, bins, width * height, img_sort::colour_space::bgr);
+        REQUIRE(hist.size() == bins * bins * bins);
+        CHECK(std::accumulate(hist.begin(), hist.end(), 0.0) == width * height);
+        for (png_uint_32 y = 0; y < height; ++y) {
+            for (png_uint_32 x = 0; x < width; ++x) {
+                CHECK(hist[img_sort::bgr_bin(4, png_byte(y * 8 + 4), png_byte(x * 8 + 4), bins)] == 1);
+            }
+        }
+
+        CHECK(img_sort::png_streamed_histogram(path, bins, width * height + 1, img_sort::colour_space::bgr).empty());
+
+        // Or decoded whole, passes put together, from the same header read
+        img_sort::bgr_image image;
+        CHECK(img_sort::png_streamed_histogram(path, bins, width * height + 1, img_sort::colour_space::bgr, &image).empty());
+        REQUIRE(image.width == width);
+        REQUIRE(image.height == height);
+        REQUIRE(image.pixels.size() == width * height * 3);
+        for (png_uint_32 y = 0; y < height; ++y) {
+            for (png_uint_32 x = 0; x < width; ++x) {
+                const auto *p = &image.pixels[(y * width + x) * 3];
+                CHECK(p[0] == 4);
+                CHECK(p[1] == png_byte(y * 8 + 4));
+                CHECK(p[2] == png_byte(x * 8 + 4));
+            }
+        }
+    }
+
+    std::filesystem::remove(path);
+}
+
+#endif
@@ -0,0 +1,125 @@
+#include "../img_sort/pq.h"
+#include "catch.hpp"
+
+#include <algorithm>
+#include <random>
+
+namespace {
+    // Points scattered around a few well separated centres
+    std::vector<std::vector<float>> clustered_points(std::size_t n, std::size_t dim, unsigned seed) {
+        std::mt19937 rng{ seed };
+        std::normal_distribution<float> noise{ 0.0f, 0.05f };
+        std::uniform_real_distribution<float> uniform{ 0.0f, 1.0f };
+
+        std::vector<std::vector<float>> centres(5, std::vector<float>(dim));
+        for (auto &c : centres) {
+            for (auto &v : c) v = uniform(rng);
+        }
+
+        std::vector<std::vector<float>> res(n, std::vector<float>(dim));
+        for (std::size_t i = 0; i < n; ++i) {
+            for (std::size_t j = 0; j < dim; ++j) {
+                res[i][j] = centres[i % centres.size()][j] + noise(rng);
+            }
+        }
+        return res;
+    }
+
+    double squared_distance(const std::vector<float> &a, const std::vector<float> &b) {
+        double res = 0.0;
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            res += (a[i] - b[i]) * (a[i] - b[i]);
+        }
+        return res;
+    }
+}
+
+TEST_CASE("encode and approximate distances", "[pq]") {
+    constexpr std::size_t dim = 40;
+    const auto points = clustered_points(200, dim, 3);
+
+    std::vector<const float *> samples;
+    for (const auto &p : points) samples.push_back(p.data());
+
+    img_sort::product_quantiser pq{ dim, 8 };
+    pq.train(samples);
+    CHECK(pq.code_size() == 4);
+
+    std::vector<std::uint8_t> codes(points.size() * pq.code_size());
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        pq.encode(points[i].data(), codes.data() + i * pq.code_size());
+    }
+
+    // Asymmetric distances track the true ones closely on clustered data
+    for (std::size_t i = 0; i < 10; ++i) {
+        for (std::size_t j = 0; j < points.size(); j += 17) {
+            CHECK(pq.distance(points[i].data(), codes.data() + j * pq.code_size()) == Approx(squared_distance(points[i], points[j])).epsilon(0.15).margin(0.5));
+        }
+    }
+}
+
+TEST_CASE("block scan matches lookup table", "[pq]") {
+    constexpr std::size_t dim = 32;
+    // Not a multiple of the block size, to exercise the padding
+    const auto points = clustered_points(37, dim, 11);
+
+    std::vector<const float *> samples;
+    for (const auto &p : points) samples.push_back(p.data());
+
+    img_sort::product_quantiser pq{ dim, 16 };
+    pq.train(samples, 4);
+
+    std::vector<std::uint8_t> codes(points.size() * pq.code_size());
+    for (std::size_t i = 0; i < points.size(); ++i) {
+        pq.encode(points[i].data(), codes.data() + i * pq.code_size());
+    }
+
+    const img_sort::pq_code_blocks blocks{ pq, codes.data(), points.size() };
+    CHECK(img_sort::pq_code_blocks::num_blocks(points.size()) == 3);
+
+    const auto lut = pq.make_lookup_table(points[0].data());
+    std::uint16_t sums[img_sort::pq_code_blocks::block_size];
+
+    for (std::size_t block = 0; block < img_sort::pq_code_blocks::num_blocks(points.size()); ++block) {
+        blocks.scan(lut, block, sums);
+
+        for (std::size_t lane = 0; lane < img_sort::pq_code_blocks::block_size; ++lane) {
+            const auto i = block * img_sort::pq_code_blocks::block_size + lane;
+            if (i >= points.size()) break;
+
+            std::uint32_t expected = 0;
+            for (std::size_t m = 0; m < pq.num_subspaces(); ++m) {
+                expected += lut.table[m * img_sort::product_quantiser::num_centroids + pq.code_at(codes.data() + i * pq.code_size(), m)];
+            }
+            CHECK(sums[lane] == expected);
+
+            // Byte quantisation error is at most half a step per subspace
+            CHECK(lut.distance(sums[lane]) == Approx(pq.distance(points[0].data(), codes.data() + i * pq.code_size()))
+                                                  .margin(pq.num_subspaces() * lut.scale * 0.5 + 1e-6));
+        }
+    }
+}
+
+TEST_CASE("block scan kernels match scalar", "[pq]") {
+    namespace kernel = img_sort::kernel;
+    std::mt19937 rng{ 17 };
+    std::uniform_int_distribution<int> byte{ 0, 255 };
+
+    // Subspace counts that leave every tail of the two and four subspace variants
+    for (std::size_t num_subspaces : { 1, 2, 3, 5, 8, 16, 31, 256 }) {
+        std::vector<std::uint8_t> tables(num_subspaces * 16), codes(num_subspaces * 8);
+        for (auto &v : tables) v = static_cast<std::uint8_t>(byte(rng));
+        for (auto &v : codes) v = static_cast<std::uint8_t>(byte(rng));
+
+        std::uint16_t expected[16];
+        kernel::scalar::pq_scan(tables.data(), codes.data(), num_subspaces, expected);
+
+        for (auto set : kernel::all_instruction_sets) {
+            if (!kernel::is_supported(set)) continue;
+
+            std::uint16_t sums[16];
+            kernel::kernels(set).pq_scan(tables.data(), codes.data(), num_subspaces, sums);
+            CHECK(std::equal(sums, sums + 16, expected));
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#include "../img_sort/progress.h"
+#include "catch.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+TEST_CASE("progress counters", "[progress]") {
+    // Counters add up over the process, so only their changes are checked
+    const auto before = img_sort::progress::sample();
+
+    img_sort::progress::begin(img_sort::progress_stage::histograms, 10);
+    img_sort::progress::file_done(100);
+    img_sort::progress::file_done(0);
+    img_sort::progress::pairs_done(5);
+
+    auto s = img_sort::progress::sample();
+    CHECK(s.stage == img_sort::progress_stage::histograms);
+    CHECK(s.total == 10);
+    CHECK(s.files - before.files == 2);
+    CHECK(s.bytes - before.bytes == 100);
+    CHECK(s.done() == 2);
+
+    // A new stage counts from where the counters stood, and the counters keep adding up
+    img_sort::progress::begin(img_sort::progress_stage::pairs, 1000);
+    img_sort::progress::pairs_done(img_sort::progress::pair_batch);
+    s = img_sort::progress::sample();
+    CHECK(s.done() == img_sort::progress::pair_batch);
+    CHECK(s.pairs - before.pairs == 5 + img_sort::progress::pair_batch);
+    CHECK(s.files - before.files == 2);
+
+    img_sort::progress::end();
+    CHECK(img_sort::progress::sample().stage == img_sort::progress_stage::idle);
+}
+
+TEST_CASE("progress estimates", "[progress]") {
+    img_sort::progress::snapshot s;
+    s.stage = img_sort::progress_stage::pairs;
+    s.total = 1000;
+    s.pairs = 250;
+    const auto now = s.start + std::chrono::seconds{ 10 };
+
+    const auto e = img_sort::estimate_progress(s, now);
+    CHECK(e.percent == Approx(25.0));
+    CHECK(e.rate == Approx(25.0));
+    REQUIRE(e.remaining);
+    CHECK(e.remaining->count() == 30);
+    CHECK(img_sort::describe_progress(s, now) == "Pairs: 250 of 1000 (25.0%), 25 pairs/s, 30s left");
+
+    GIVEN("nothing done yet") {
+        s.pairs = 0;
+        CHECK_FALSE(img_sort::estimate_progress(s, now).remaining);
+        CHECK(img_sort::describe_progress(s, now) == "Pairs: 0 of 1000 (0.0%), 0 pairs/s, estimating");
+    }
+
+    GIVEN("idle") {
+        s.stage = img_sort::progress_stage::idle;
+        CHECK(img_sort::describe_progress(s, now).empty());
+    }
+
+    CHECK(img_sort::format_duration(std::chrono::seconds{ 17 }) == "17s");
+    CHECK(img_sort::format_duration(std::chrono::seconds{ 185 }) == "3m05s");
+    CHECK(img_sort::format_duration(std::chrono::seconds{ 7620 }) == "2h07m");
+}
+
+TEST_CASE("progress status file", "[progress]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_progress.txt";
+    std::filesystem::remove(path);
+
+    img_sort::progress::begin(img_sort::progress_stage::mst, 9);
+    img_sort::progress::edge_done();
+    { img_sort::progress_reporter reporter{ std::chrono::hours{ 1 }, false, path }; }
+    img_sort::progress::end();
+
+    // Written once more when the reporter stops, even before its first interval
+    std::ifstream file{ path };
+    std::stringstream ss;
+    ss << file.rdbuf();
+    CHECK(ss.str().find("stage=mst\ndone=1\ntotal=9\n") == 0);
+    CHECK_FALSE(std::filesystem::exists(path.string() + ".tmp"));
+
+    file.close();
+    std::filesystem::remove(path);
+}
@@ -0,0 +1,64 @@
+#include "../img_sort/projection.h"
+#include "catch.hpp"
+
+#include <random>
+
+TEST_CASE("blocked multiply", "[projection]") {
+    std::mt19937 rng{ 3 };
+    std::uniform_real_distribution<float> uniform{ -1.0f, 1.0f };
+
+    // Odd sizes to exercise partial row and dimension blocks, with plenty of zeros in A
+    const std::size_t num_rows = 37, dim = 300, cols = 5;
+    std::vector<std::vector<float>> a(num_rows, std::vector<float>(dim));
+    std::vector<float> b(dim * cols);
+    for (auto &row : a) {
+        for (auto &v : row) v = uniform(rng) < 0.0f ? 0.0f : uniform(rng);
+    }
+    for (auto &v : b) v = uniform(rng);
+
+    std::vector<const float *> rows;
+    for (const auto &row : a) rows.push_back(row.data());
+
+    std::vector<float> out(num_rows * cols);
+    img_sort::multiply(rows, dim, b.data(), cols, out.data());
+
+    for (std::size_t r = 0; r < num_rows; ++r) {
+        for (std::size_t j = 0; j < cols; ++j) {
+            double expected = 0.0;
+            for (std::size_t k = 0; k < dim; ++k) expected += a[r][k] * b[k * cols + j];
+            CHECK(out[r * cols + j] == Approx(expected).margin(1e-4));
+        }
+    }
+}
+
+TEST_CASE("random projection preserves distances", "[projection]") {
+    std::mt19937 rng{ 9 };
+    std::uniform_real_distribution<float> uniform{ 0.0f, 1.0f };
+
+    const std::size_t size = 40, dim = 4096, target_dim = 256;
+    std::vector<std::vector<float>> points(size, std::vector<float>(dim));
+    for (auto &p : points) {
+        for (auto &v : p) v = uniform(rng);
+    }
+
+    std::vector<const float *> rows;
+    for (const auto &p : points) rows.push_back(p.data());
+
+    const img_sort::random_projection projection{ dim, target_dim };
+    const auto reduced = projection.project(rows);
+    REQUIRE(reduced.size() == size * target_dim);
+
+    auto l2 = [](const float *a, const float *b, std::size_t n) {
+        double res = 0.0;
+        for (std::size_t i = 0; i < n; ++i) res += (a[i] - b[i]) * (a[i] - b[i]);
+        return std::sqrt(res);
+    };
+
+    const auto error = img_sort::measure_distortion(size,
+        [&](std::size_t x, std::size_t y) { return l2(rows[x], rows[y], dim); },
+        [&](std::size_t x, std::size_t y) { return l2(&reduced[x * target_dim], &reduced[y * target_dim], target_dim); });
+
+    CHECK(error.num_pairs == size * (size - 1) / 2);
+    CHECK(error.mean_relative_error < 0.1);
+    CHECK(error.max_absolute_error > 0.0);
+}
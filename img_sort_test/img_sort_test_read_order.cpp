@@ -0,0 +1,58 @@
+#include "../img_sort/read_order.h"
+#include "catch.hpp"
+
+#include <filesystem>
+#include <fstream>
+
+TEST_CASE("storage order", "[read_order]") {
+    using location = std::optional<img_sort::file_location>;
+
+    GIVEN("files on two devices, some without a location") {
+        const std::vector<location> locations = {
+            img_sort::file_location{ 2, 10 },
+            std::nullopt,
+            img_sort::file_location{ 1, 30 },
+            img_sort::file_location{ 1, 20 },
+            std::nullopt,
+            img_sort::file_location{ 2, 5 },
+        };
+
+        // By device, then position, then the files without a location as listed
+        CHECK(img_sort::storage_order(locations) == std::vector<std::size_t>{ 3, 2, 5, 0, 1, 4 });
+    }
+
+    GIVEN("no locations") {
+        CHECK(img_sort::storage_order(std::vector<location>(3)) == std::vector<std::size_t>{ 0, 1, 2 });
+    }
+}
+
+TEST_CASE("file locations", "[read_order]") {
+    const auto dir = std::filesystem::temp_directory_path() / "img_sort_test_read_order";
+    std::filesystem::create_directories(dir);
+    const auto a = dir / "a.bin", b = dir / "b.bin";
+    for (const auto &path : { a, b }) {
+        std::ofstream file{ path, std::ios::binary | std::ios::trunc };
+        file << std::string(64 * 1024, 'x');
+    }
+
+    CHECK_FALSE(img_sort::locate_file(a, img_sort::read_order::listed));
+    CHECK_FALSE(img_sort::locate_file(dir / "missing.bin", img_sort::read_order::inode));
+
+#if defined(__linux__) || defined(_WIN32)
+    GIVEN("two files in one directory") {
+        const auto la = img_sort::locate_file(a, img_sort::read_order::inode);
+        const auto lb = img_sort::locate_file(b, img_sort::read_order::inode);
+        REQUIRE(la);
+        REQUIRE(lb);
+        CHECK(la->device == lb->device);
+        CHECK(la->position != lb->position);
+    }
+#endif
+
+    // Extents depend on the file system, so only that asking is harmless
+    img_sort::locate_file(a, img_sort::read_order::extent);
+    img_sort::prefetch_file(a);
+    img_sort::prefetch_file(dir / "missing.bin");
+
+    std::filesystem::remove_all(dir);
+}
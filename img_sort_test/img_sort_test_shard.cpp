@@ -0,0 +1,64 @@
+#include "../img_sort/shard.h"
+#include "catch.hpp"
+
+#include <random>
+
+namespace {
+    double weight(const std::vector<img_sort::edge> &edges) {
+        double res = 0.0;
+        for (const auto &e : edges) res += e.cost;
+        return res;
+    }
+}
+
+TEST_CASE("merged shards give the exact MST", "[shard]") {
+    std::mt19937 rng{ 17 };
+    std::uniform_real_distribution<double> uniform{ 0.0, 1.0 };
+
+    const std::size_t size = 300;
+    std::vector<std::pair<double, double>> points(size);
+    for (auto &p : points) p = { uniform(rng), uniform(rng) };
+    auto dist = [&](std::size_t x, std::size_t y) { return std::hypot(points[x].first - points[y].first, points[x].second - points[y].second); };
+
+    std::vector<img_sort::edge> all_pairs;
+    for (std::size_t y = 1; y < size; ++y) {
+        for (std::size_t x = 0; x < y; ++x) all_pairs.push_back({ x, y, dist(x, y) });
+    }
+    const double expected = weight(img_sort::minimum_spanning_forest(size, all_pairs));
+
+    const auto dir = std::filesystem::temp_directory_path() / "img_sort_test_shard";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    for (std::size_t count : { 1, 2, 5 }) {
+        std::vector<img_sort::shard> shards;
+        for (std::size_t index = 0; index < count; ++index) {
+            img_sort::shard s;
+            s.fingerprint = 7;
+            s.index = index;
+            s.count = count;
+            for (std::size_t i = 0; i < size; ++i) s.nodes.push_back(i * 2);
+            s.forest = img_sort::compute_shard_forest(size, index, count, dist);
+            CHECK(s.forest.size() < size);
+
+            // Round trip through a file, as separate processes would
+            const auto path = dir / ("shard" + std::to_string(index) + ".bin");
+            img_sort::write_shard(path, s);
+            shards.push_back(img_sort::read_shard(path));
+
+            CHECK(shards.back().nodes == s.nodes);
+            CHECK(weight(shards.back().forest) == Approx(weight(s.forest)));
+        }
+
+        const auto merged = img_sort::merge_shards(shards);
+        CHECK(merged.size() == size - 1);
+        CHECK(weight(merged) == Approx(expected));
+
+        if (count > 1) {
+            shards.pop_back();
+            CHECK_THROWS(img_sort::merge_shards(shards));
+        }
+    }
+
+    std::filesystem::remove_all(dir);
+}
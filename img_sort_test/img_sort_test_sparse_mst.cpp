@@ -0,0 +1,74 @@
+#include "../img_sort/sparse_mst.h"
+#include "catch.hpp"
+
+#include <random>
+
+TEST_CASE("spanning forest", "[sparse_mst]") {
+    // Two triangles, with a duplicate and a self edge
+    std::vector<img_sort::edge> edges = {
+        { 0, 1, 1.0 }, { 1, 2, 2.0 }, { 0, 2, 3.0 },
+        { 3, 4, 1.0 }, { 4, 5, 1.5 }, { 3, 5, 0.5 },
+        { 1, 0, 1.0 }, { 2, 2, 0.0 }
+    };
+
+    const auto forest = img_sort::minimum_spanning_forest(6, edges);
+    REQUIRE(forest.size() == 4);
+
+    double weight = 0.0;
+    for (const auto &e : forest) weight += e.cost;
+    CHECK(weight == Approx(1.0 + 2.0 + 0.5 + 1.0));
+}
+
+TEST_CASE("connect components", "[sparse_mst]") {
+    std::mt19937 rng{ 5 };
+    std::uniform_real_distribution<double> uniform{ 0.0, 100.0 };
+
+    std::vector<double> points(50);
+    for (auto &p : points) p = uniform(rng);
+    auto dist = [&](std::size_t x, std::size_t y) { return std::abs(points[x] - points[y]); };
+
+    GIVEN("no edges") {
+        const auto edges = img_sort::connect_components(points.size(), {}, dist);
+        CHECK(edges.size() == points.size() - 1);
+
+        const auto t = img_sort::make_tree(points.size(), edges);
+        CHECK(t.num_edges() == points.size() - 1);
+    }
+
+    GIVEN("a partial forest") {
+        std::vector<img_sort::edge> forest;
+        for (std::size_t i = 1; i < 20; ++i) {
+            forest.push_back({ i - 1, i, dist(i - 1, i) });
+        }
+
+        const auto edges = img_sort::connect_components(points.size(), forest, dist);
+        CHECK(edges.size() == points.size() - 1);
+
+        img_sort::disjoint_sets sets{ points.size() };
+        for (const auto &e : edges) {
+            CHECK(sets.unite(e.x, e.y));
+        }
+    }
+
+    GIVEN("a spanning tree") {
+        std::vector<img_sort::edge> forest;
+        for (std::size_t i = 1; i < points.size(); ++i) {
+            forest.push_back({ 0, i, dist(0, i) });
+        }
+
+        CHECK(img_sort::connect_components(points.size(), forest, dist).size() == forest.size());
+    }
+}
+
+TEST_CASE("make tree", "[sparse_mst]") {
+    // A path 3 - 1 - 0 - 2 rooted at 0
+    const auto t = img_sort::make_tree(4, { { 1, 3, 1.0 }, { 0, 1, 1.0 }, { 2, 0, 1.0 } });
+
+    CHECK(t.num_edges() == 3);
+    CHECK(t.children(0).size() == 2);
+    CHECK(t.children(1).size() == 1);
+    CHECK(t.children(1)[0] == 3);
+    CHECK(t.children(2).empty());
+
+    CHECK_THROWS(img_sort::make_tree(4, { { 0, 1, 1.0 }, { 0, 2, 1.0 } }));
+}
@@ -0,0 +1,31 @@
+#include "../img_sort/system_resources.h"
+#include "catch.hpp"
+
+TEST_CASE("system resource parsing", "[system_resources]") {
+    GIVEN("/proc/meminfo") {
+        const auto available = img_sort::parse_meminfo_available("MemTotal:       32768000 kB\nMemFree:         1024000 kB\nMemAvailable:   16303284 kB\n");
+        REQUIRE(available);
+        CHECK(*available == 16303284ull * 1024);
+        CHECK_FALSE(img_sort::parse_meminfo_available("MemTotal:       32768000 kB\n"));
+    }
+
+    GIVEN("cgroup memory limits") {
+        CHECK(img_sort::parse_cgroup_memory_limit("4294967296\n") == 4294967296ull);
+        CHECK_FALSE(img_sort::parse_cgroup_memory_limit("max\n"));
+        CHECK_FALSE(img_sort::parse_cgroup_memory_limit("9223372036854771712\n"));  // cgroup v1 without a limit
+    }
+
+    GIVEN("cgroup CPU quotas") {
+        CHECK(img_sort::parse_cgroup_cpu_max("200000 100000\n") == 2u);
+        CHECK(img_sort::parse_cgroup_cpu_max("150000 100000\n") == 2u);
+        CHECK(img_sort::parse_cgroup_cpu_max("50000 100000\n") == 1u);
+        CHECK_FALSE(img_sort::parse_cgroup_cpu_max("max 100000\n"));
+        CHECK_FALSE(img_sort::parse_cgroup_cpu_max("-1 100000\n"));
+    }
+
+    GIVEN("this host") {
+        const auto resources = img_sort::detect_system_resources();
+        CHECK(resources.cores >= 1);
+        CHECK(resources.available_memory > 0);
+    }
+}
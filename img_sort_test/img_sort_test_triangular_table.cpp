@@ -1,4 +1,5 @@
 #include "../img_sort/img_sort.h"
+#include "../img_sort/huge_page_storage.h"
 #include "catch.hpp"
 
 TEST_CASE("size 0", "[triagular_table]") {
@@ -174,4 +175,50 @@ TEST_CASE("size 4", "[triagular_table]") {
             }
         }
     }
-}
\ No newline at end of file
+}
+
+TEST_CASE("row blocks", "[triagular_table]") {
+    for (std::size_t n : { 1, 2, 3, 10, 1000 }) {
+        for (std::size_t num_blocks : { 1, 3, 16 }) {
+            const img_sort::row_blocks blocks{ n, num_blocks };
+            REQUIRE(blocks.size() >= 1);
+            CHECK(blocks.size() <= std::max<std::size_t>(num_blocks, 1) + 1);
+
+            // Contiguous, non-empty and covering every row
+            std::size_t next = 0;
+            for (std::size_t b = 0; b < blocks.size(); ++b) {
+                const auto [first, last] = blocks.rows(b);
+                CHECK(first == next);
+                CHECK(last > first);
+                next = last;
+            }
+            CHECK(next == n);
+        }
+    }
+
+    // Blocks of a large table hold about the same number of entries
+    const img_sort::row_blocks blocks{ 1000, 8 };
+    for (std::size_t b = 0; b + 1 < blocks.size(); ++b) {
+        const auto [first, last] = blocks.rows(b);
+        const auto entries = (last * (last - 1) - first * (first - (first > 0 ? 1 : 0))) / 2;
+        CHECK(entries == Approx(1000 * 999 / 2 / 8).epsilon(0.02));
+    }
+}
+
+TEST_CASE("huge page storage", "[triagular_table]") {
+    // The largest table spans several huge pages
+    for (std::size_t n : { 1, 2, 50, 2000 }) {
+        img_sort::triangular_table<float, img_sort::huge_page_storage<float>> table{ n, 0.5f };
+        CHECK(table.storage().kind() != "none");
+        CHECK(std::all_of(table.begin(), table.end(), [](auto kvp) { return kvp.second == 0.5f; }));
+
+        for (std::size_t y = 1; y < n; ++y) {
+            float *row = table.row_data(y);
+            for (std::size_t x = 0; x < y; ++x) row[x] = static_cast<float>(y * n + x);
+        }
+        CHECK(std::all_of(table.begin(), table.end(), [n](auto kvp) {
+            auto [x, y] = kvp.first;
+            return kvp.second == static_cast<float>(y * n + x);
+        }));
+    }
+}
@@ -0,0 +1,43 @@
+#include "../img_sort/tuning.h"
+#include "catch.hpp"
+
+#include <filesystem>
+#include <set>
+
+TEST_CASE("tiled pair order", "[tuning]") {
+    constexpr std::size_t size = 37;
+
+    // Every pair of the row range exactly once, for whole rows and for tiles that do not divide the width
+    for (std::size_t tile : { 0, 1, 4, 10, 64 }) {
+        std::set<std::pair<std::size_t, std::size_t>> seen;
+        std::size_t count = 0;
+        img_sort::for_each_pair_tiled(5, size, tile, [&](std::size_t x, std::size_t y) {
+            CHECK(x < y);
+            CHECK(y >= 5);
+            seen.emplace(x, y);
+            ++count;
+        });
+
+        CHECK(count == size * (size - 1) / 2 - 5 * 4 / 2);
+        CHECK(seen.size() == count);
+    }
+}
+
+TEST_CASE("tuning cache", "[tuning]") {
+    const auto path = std::filesystem::temp_directory_path() / "img_sort_test_tuning.txt";
+    std::filesystem::remove(path);
+
+    {
+        img_sort::tuning_cache cache{ path };
+        CHECK_FALSE(cache.find("host/AVX2/l1/96/tile_columns"));
+        cache.store("host/AVX2/l1/96/tile_columns", 16);
+        cache.store("other/AVX-512/l1/96/tile_columns", 4);
+        cache.store("host/AVX2/l1/96/tile_columns", 64);
+    }
+
+    img_sort::tuning_cache cache{ path };
+    CHECK(cache.find("host/AVX2/l1/96/tile_columns") == 64u);
+    CHECK(cache.find("other/AVX-512/l1/96/tile_columns") == 4u);
+
+    std::filesystem::remove(path);
+}